@@ -0,0 +1,466 @@
+#include "AEAD.hpp"
+
+#include "SHA1.hpp"
+
+#include <cstring>
+#include <stdexcept>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define AEAD_X86 1
+#include <immintrin.h>
+#endif
+
+static inline uint32_t read_le32(uint8_t const *p) {
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void write_le32(uint8_t *p, uint32_t v) {
+	p[0] = uint8_t(v);
+	p[1] = uint8_t(v >> 8);
+	p[2] = uint8_t(v >> 16);
+	p[3] = uint8_t(v >> 24);
+}
+
+static inline uint64_t read_le64(uint8_t const *p) {
+	return uint64_t(read_le32(p)) | (uint64_t(read_le32(p + 4)) << 32);
+}
+
+static inline void write_le64(uint8_t *p, uint64_t v) {
+	write_le32(p, uint32_t(v));
+	write_le32(p + 4, uint32_t(v >> 32));
+}
+
+//compare tags without an early exit (so timing doesn't say how much of a forgery was right):
+static bool same_tag(uint8_t const *a, uint8_t const *b) {
+	uint8_t diff = 0;
+	for (size_t i = 0; i < AEADKey::TagSize; ++i) diff |= uint8_t(a[i] ^ b[i]);
+	return diff == 0;
+}
+
+//------ ChaCha20 (RFC 8439, 2.3) ------
+
+static inline uint32_t rotl(uint32_t v, int n) {
+	return (v << n) | (v >> (32 - n));
+}
+
+#define QUARTER_ROUND(a, b, c, d) \
+	a += b; d ^= a; d = rotl(d, 16); \
+	c += d; b ^= c; b = rotl(b, 12); \
+	a += b; d ^= a; d = rotl(d, 8); \
+	c += d; b ^= c; b = rotl(b, 7);
+
+static void chacha20_block(uint32_t const key[8], uint32_t counter, uint8_t const nonce[12], uint8_t out[64]) {
+	uint32_t const input[16] = {
+		0x61707865, 0x3320646e, 0x79622d32, 0x6b206574,
+		key[0], key[1], key[2], key[3], key[4], key[5], key[6], key[7],
+		counter, read_le32(nonce), read_le32(nonce + 4), read_le32(nonce + 8)
+	};
+	uint32_t x[16];
+	memcpy(x, input, sizeof(x));
+	for (uint32_t round = 0; round < 10; ++round) {
+		QUARTER_ROUND(x[0], x[4], x[8], x[12]);
+		QUARTER_ROUND(x[1], x[5], x[9], x[13]);
+		QUARTER_ROUND(x[2], x[6], x[10], x[14]);
+		QUARTER_ROUND(x[3], x[7], x[11], x[15]);
+		QUARTER_ROUND(x[0], x[5], x[10], x[15]);
+		QUARTER_ROUND(x[1], x[6], x[11], x[12]);
+		QUARTER_ROUND(x[2], x[7], x[8], x[13]);
+		QUARTER_ROUND(x[3], x[4], x[9], x[14]);
+	}
+	for (uint32_t i = 0; i < 16; ++i) write_le32(out + 4 * i, x[i] + input[i]);
+}
+
+#undef QUARTER_ROUND
+
+//xor the key stream (blocks 'counter', 'counter' + 1, ...) over 'size' bytes:
+static void chacha20_xor(uint32_t const key[8], uint32_t counter, uint8_t const nonce[12], uint8_t const *in, uint8_t *out, size_t size) {
+	uint8_t block[64];
+	while (size) {
+		chacha20_block(key, counter, nonce, block);
+		counter += 1;
+		size_t n = (size < 64 ? size : 64);
+		for (size_t i = 0; i < n; ++i) out[i] = in[i] ^ block[i];
+		in += n;
+		out += n;
+		size -= n;
+	}
+	memset(block, 0, sizeof(block));
+}
+
+//------ Poly1305 (RFC 8439, 2.5; 44/44/42-bit limbs, after poly1305-donna) ------
+
+struct Poly1305 {
+	uint64_t r[3], h[3] = {0, 0, 0}, pad[2];
+	explicit Poly1305(uint8_t const key[32]) {
+		uint64_t t0 = read_le64(key), t1 = read_le64(key + 8);
+		r[0] = t0 & 0xffc0fffffffULL;
+		r[1] = ((t0 >> 44) | (t1 << 20)) & 0xfffffc0ffffULL;
+		r[2] = (t1 >> 24) & 0x00ffffffc0fULL;
+		pad[0] = read_le64(key + 16);
+		pad[1] = read_le64(key + 24);
+	}
+	//whole 16-byte blocks only (the AEAD construction pads everything):
+	void blocks(uint8_t const *m, size_t size) {
+		typedef unsigned __int128 u128;
+		uint64_t const mask44 = 0xfffffffffffULL, mask42 = 0x3ffffffffffULL;
+		uint64_t const s1 = r[1] * (5 << 2), s2 = r[2] * (5 << 2);
+		uint64_t h0 = h[0], h1 = h[1], h2 = h[2];
+		for (; size >= 16; m += 16, size -= 16) {
+			uint64_t t0 = read_le64(m), t1 = read_le64(m + 8);
+			h0 += t0 & mask44;
+			h1 += ((t0 >> 44) | (t1 << 20)) & mask44;
+			h2 += ((t1 >> 24) & mask42) | (1ULL << 40);
+			u128 d0 = u128(h0) * r[0] + u128(h1) * s2 + u128(h2) * s1;
+			u128 d1 = u128(h0) * r[1] + u128(h1) * r[0] + u128(h2) * s2;
+			u128 d2 = u128(h0) * r[2] + u128(h1) * r[1] + u128(h2) * r[0];
+			uint64_t c = uint64_t(d0 >> 44); h0 = uint64_t(d0) & mask44;
+			d1 += c; c = uint64_t(d1 >> 44); h1 = uint64_t(d1) & mask44;
+			d2 += c; c = uint64_t(d2 >> 42); h2 = uint64_t(d2) & mask42;
+			h0 += c * 5; c = h0 >> 44; h0 &= mask44;
+			h1 += c;
+		}
+		h[0] = h0; h[1] = h1; h[2] = h2;
+	}
+	void finish(uint8_t mac[16]) {
+		uint64_t const mask44 = 0xfffffffffffULL, mask42 = 0x3ffffffffffULL;
+		uint64_t h0 = h[0], h1 = h[1], h2 = h[2], c;
+		//fully carry h:
+		c = h1 >> 44; h1 &= mask44; h2 += c;
+		c = h2 >> 42; h2 &= mask42; h0 += c * 5;
+		c = h0 >> 44; h0 &= mask44; h1 += c;
+		c = h1 >> 44; h1 &= mask44; h2 += c;
+		c = h2 >> 42; h2 &= mask42; h0 += c * 5;
+		c = h0 >> 44; h0 &= mask44; h1 += c;
+		//h - p, kept only if it didn't go negative (selected without branching):
+		uint64_t g0 = h0 + 5; c = g0 >> 44; g0 &= mask44;
+		uint64_t g1 = h1 + c; c = g1 >> 44; g1 &= mask44;
+		uint64_t g2 = h2 + c - (1ULL << 42);
+		c = (g2 >> 63) - 1;
+		g0 &= c; g1 &= c; g2 &= c;
+		c = ~c;
+		h0 = (h0 & c) | g0; h1 = (h1 & c) | g1; h2 = (h2 & c) | g2;
+		//+ pad, mod 2^128:
+		uint64_t t0 = pad[0], t1 = pad[1];
+		h0 += t0 & mask44; c = h0 >> 44; h0 &= mask44;
+		h1 += (((t0 >> 44) | (t1 << 20)) & mask44) + c; c = h1 >> 44; h1 &= mask44;
+		h2 += ((t1 >> 24) & mask42) + c; h2 &= mask42;
+		write_le64(mac, h0 | (h1 << 44));
+		write_le64(mac + 8, (h1 >> 20) | (h2 << 24));
+	}
+	void padded(uint8_t const *m, size_t size) {
+		size_t whole = size & ~size_t(15);
+		blocks(m, whole);
+		if (size > whole) {
+			uint8_t last[16] = {0};
+			memcpy(last, m + whole, size - whole);
+			blocks(last, 16);
+		}
+	}
+};
+
+static void chacha20_poly1305_tag(uint32_t const key[8], uint8_t const nonce[12], uint8_t const *aad, size_t aad_size, uint8_t const *ciphertext, size_t size, uint8_t tag[16]) {
+	uint8_t block[64];
+	chacha20_block(key, 0, nonce, block); //<-- (first 32 bytes are the one-time Poly1305 key)
+	Poly1305 poly(block);
+	memset(block, 0, sizeof(block));
+	poly.padded(aad, aad_size);
+	poly.padded(ciphertext, size);
+	uint8_t lengths[16];
+	write_le64(lengths, aad_size);
+	write_le64(lengths + 8, size);
+	poly.blocks(lengths, 16);
+	poly.finish(tag);
+}
+
+//------ AES-128-GCM (AES-NI + PCLMULQDQ) ------
+// (GHASH works on byte-reversed blocks, after Gueron + Kounavis, "Intel Carry-Less Multiplication Instruction and its
+//  Usage for Computing the GCM Mode", 2010; four blocks are multiplied by H^4..H^1 and share one reduction)
+
+#ifdef AEAD_X86
+
+#define AES_TARGET __attribute__((target("aes,pclmul,ssse3,sse4.1")))
+
+bool aead_has_aes_ni() {
+	static bool has = (__builtin_cpu_supports("aes") && __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("ssse3") && __builtin_cpu_supports("sse4.1"));
+	return has;
+}
+
+AES_TARGET static inline __m128i expand_step(__m128i key, __m128i assist) {
+	assist = _mm_shuffle_epi32(assist, 0xff);
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+	return _mm_xor_si128(key, assist);
+}
+
+AES_TARGET static void aes128_expand(uint8_t const key[16], __m128i *rk) {
+	rk[0] = _mm_loadu_si128(reinterpret_cast< __m128i const * >(key));
+	//(the round constant has to be an immediate)
+	rk[1] = expand_step(rk[0], _mm_aeskeygenassist_si128(rk[0], 0x01));
+	rk[2] = expand_step(rk[1], _mm_aeskeygenassist_si128(rk[1], 0x02));
+	rk[3] = expand_step(rk[2], _mm_aeskeygenassist_si128(rk[2], 0x04));
+	rk[4] = expand_step(rk[3], _mm_aeskeygenassist_si128(rk[3], 0x08));
+	rk[5] = expand_step(rk[4], _mm_aeskeygenassist_si128(rk[4], 0x10));
+	rk[6] = expand_step(rk[5], _mm_aeskeygenassist_si128(rk[5], 0x20));
+	rk[7] = expand_step(rk[6], _mm_aeskeygenassist_si128(rk[6], 0x40));
+	rk[8] = expand_step(rk[7], _mm_aeskeygenassist_si128(rk[7], 0x80));
+	rk[9] = expand_step(rk[8], _mm_aeskeygenassist_si128(rk[8], 0x1b));
+	rk[10] = expand_step(rk[9], _mm_aeskeygenassist_si128(rk[9], 0x36));
+}
+
+AES_TARGET static inline __m128i aes128_block(__m128i const *rk, __m128i block) {
+	block = _mm_xor_si128(block, rk[0]);
+	for (uint32_t i = 1; i < 10; ++i) block = _mm_aesenc_si128(block, rk[i]);
+	return _mm_aesenclast_si128(block, rk[10]);
+}
+
+AES_TARGET static inline __m128i byte_reverse(__m128i x) {
+	return _mm_shuffle_epi8(x, _mm_set_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15));
+}
+
+//256-bit carry-less product (unreduced):
+AES_TARGET static inline void clmul(__m128i a, __m128i b, __m128i &lo, __m128i &hi) {
+	__m128i mid = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x10), _mm_clmulepi64_si128(a, b, 0x01));
+	lo = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x00), _mm_slli_si128(mid, 8));
+	hi = _mm_xor_si128(_mm_clmulepi64_si128(a, b, 0x11), _mm_srli_si128(mid, 8));
+}
+
+//shift left by one (the bit-reflection fixup) and reduce mod x^128 + x^7 + x^2 + x + 1:
+AES_TARGET static inline __m128i reduce(__m128i lo, __m128i hi) {
+	__m128i carry_lo = _mm_srli_epi32(lo, 31);
+	__m128i carry_hi = _mm_srli_epi32(hi, 31);
+	lo = _mm_slli_epi32(lo, 1);
+	hi = _mm_slli_epi32(hi, 1);
+	__m128i across = _mm_srli_si128(carry_lo, 12);
+	lo = _mm_or_si128(lo, _mm_slli_si128(carry_lo, 4));
+	hi = _mm_or_si128(_mm_or_si128(hi, _mm_slli_si128(carry_hi, 4)), across);
+
+	__m128i a = _mm_xor_si128(_mm_xor_si128(_mm_slli_epi32(lo, 31), _mm_slli_epi32(lo, 30)), _mm_slli_epi32(lo, 25));
+	__m128i b = _mm_srli_si128(a, 4);
+	lo = _mm_xor_si128(lo, _mm_slli_si128(a, 12));
+	__m128i c = _mm_xor_si128(_mm_xor_si128(_mm_srli_epi32(lo, 1), _mm_srli_epi32(lo, 2)), _mm_srli_epi32(lo, 7));
+	lo = _mm_xor_si128(lo, _mm_xor_si128(c, b));
+	return _mm_xor_si128(hi, lo);
+}
+
+AES_TARGET static inline __m128i gf_mul(__m128i a, __m128i b) {
+	__m128i lo, hi;
+	clmul(a, b, lo, hi);
+	return reduce(lo, hi);
+}
+
+struct GHash {
+	__m128i const *h; //H, H^2, H^3, H^4 (byte-reversed)
+	__m128i x;
+	AES_TARGET explicit GHash(__m128i const *h_) : h(h_), x(_mm_setzero_si128()) {
+	}
+	AES_TARGET void blocks(uint8_t const *data, size_t size) {
+		for (; size >= 64; data += 64, size -= 64) {
+			__m128i b0 = _mm_xor_si128(x, byte_reverse(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data))));
+			__m128i b1 = byte_reverse(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 16)));
+			__m128i b2 = byte_reverse(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 32)));
+			__m128i b3 = byte_reverse(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 48)));
+			__m128i lo, hi, l, r;
+			clmul(b0, h[3], lo, hi);
+			clmul(b1, h[2], l, r); lo = _mm_xor_si128(lo, l); hi = _mm_xor_si128(hi, r);
+			clmul(b2, h[1], l, r); lo = _mm_xor_si128(lo, l); hi = _mm_xor_si128(hi, r);
+			clmul(b3, h[0], l, r); lo = _mm_xor_si128(lo, l); hi = _mm_xor_si128(hi, r);
+			x = reduce(lo, hi);
+		}
+		for (; size >= 16; data += 16, size -= 16) {
+			x = gf_mul(_mm_xor_si128(x, byte_reverse(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data)))), h[0]);
+		}
+		if (size) {
+			alignas(16) uint8_t last[16] = {0};
+			memcpy(last, data, size);
+			x = gf_mul(_mm_xor_si128(x, byte_reverse(_mm_load_si128(reinterpret_cast< __m128i const * >(last)))), h[0]);
+		}
+	}
+	AES_TARGET __m128i finish(size_t aad_size, size_t size) {
+		__m128i lengths = _mm_set_epi64x(int64_t(uint64_t(aad_size) * 8), int64_t(uint64_t(size) * 8)); //<-- (already "byte-reversed")
+		return byte_reverse(gf_mul(_mm_xor_si128(x, lengths), h[0]));
+	}
+};
+
+AES_TARGET static void gcm_setup(uint8_t const key[16], uint8_t *round_keys, uint8_t *h_powers) {
+	__m128i rk[11];
+	aes128_expand(key, rk);
+	for (uint32_t i = 0; i < 11; ++i) _mm_store_si128(reinterpret_cast< __m128i * >(round_keys + 16 * i), rk[i]);
+	__m128i h = byte_reverse(aes128_block(rk, _mm_setzero_si128()));
+	__m128i h2 = gf_mul(h, h), h3 = gf_mul(h2, h), h4 = gf_mul(h3, h);
+	_mm_store_si128(reinterpret_cast< __m128i * >(h_powers), h);
+	_mm_store_si128(reinterpret_cast< __m128i * >(h_powers + 16), h2);
+	_mm_store_si128(reinterpret_cast< __m128i * >(h_powers + 32), h3);
+	_mm_store_si128(reinterpret_cast< __m128i * >(h_powers + 48), h4);
+}
+
+//counter mode from block 2 on (block 1 -- J0 -- is for the tag); the counter is kept byte-reversed, so its
+// 32-bit big-endian tail is lane 0:
+AES_TARGET static void gcm_ctr(__m128i const *rk, uint8_t const nonce[12], uint8_t const *in, uint8_t *out, size_t size) {
+	alignas(16) uint8_t j0[16];
+	memcpy(j0, nonce, 12);
+	j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+	__m128i counter = byte_reverse(_mm_load_si128(reinterpret_cast< __m128i const * >(j0)));
+	__m128i const one = _mm_set_epi32(0, 0, 0, 1);
+	for (; size >= 64; in += 64, out += 64, size -= 64) {
+		__m128i c0 = _mm_add_epi32(counter, one);
+		__m128i c1 = _mm_add_epi32(c0, one);
+		__m128i c2 = _mm_add_epi32(c1, one);
+		__m128i c3 = _mm_add_epi32(c2, one);
+		counter = c3;
+		c0 = _mm_xor_si128(byte_reverse(c0), rk[0]);
+		c1 = _mm_xor_si128(byte_reverse(c1), rk[0]);
+		c2 = _mm_xor_si128(byte_reverse(c2), rk[0]);
+		c3 = _mm_xor_si128(byte_reverse(c3), rk[0]);
+		//(four independent blocks per round keep the AES unit busy)
+		for (uint32_t i = 1; i < 10; ++i) {
+			c0 = _mm_aesenc_si128(c0, rk[i]);
+			c1 = _mm_aesenc_si128(c1, rk[i]);
+			c2 = _mm_aesenc_si128(c2, rk[i]);
+			c3 = _mm_aesenc_si128(c3, rk[i]);
+		}
+		c0 = _mm_aesenclast_si128(c0, rk[10]);
+		c1 = _mm_aesenclast_si128(c1, rk[10]);
+		c2 = _mm_aesenclast_si128(c2, rk[10]);
+		c3 = _mm_aesenclast_si128(c3, rk[10]);
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(out), _mm_xor_si128(c0, _mm_loadu_si128(reinterpret_cast< __m128i const * >(in))));
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(out + 16), _mm_xor_si128(c1, _mm_loadu_si128(reinterpret_cast< __m128i const * >(in + 16))));
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(out + 32), _mm_xor_si128(c2, _mm_loadu_si128(reinterpret_cast< __m128i const * >(in + 32))));
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(out + 48), _mm_xor_si128(c3, _mm_loadu_si128(reinterpret_cast< __m128i const * >(in + 48))));
+	}
+	for (; size >= 16; in += 16, out += 16, size -= 16) {
+		counter = _mm_add_epi32(counter, one);
+		__m128i k = aes128_block(rk, byte_reverse(counter));
+		_mm_storeu_si128(reinterpret_cast< __m128i * >(out), _mm_xor_si128(k, _mm_loadu_si128(reinterpret_cast< __m128i const * >(in))));
+	}
+	if (size) {
+		counter = _mm_add_epi32(counter, one);
+		alignas(16) uint8_t k[16];
+		_mm_store_si128(reinterpret_cast< __m128i * >(k), aes128_block(rk, byte_reverse(counter)));
+		for (size_t i = 0; i < size; ++i) out[i] = in[i] ^ k[i];
+	}
+}
+
+AES_TARGET static void gcm_tag(__m128i const *rk, __m128i const *h, uint8_t const nonce[12], uint8_t const *aad, size_t aad_size, uint8_t const *ciphertext, size_t size, uint8_t tag[16]) {
+	GHash ghash(h);
+	ghash.blocks(aad, aad_size);
+	ghash.blocks(ciphertext, size);
+	__m128i s = ghash.finish(aad_size, size);
+	alignas(16) uint8_t j0[16];
+	memcpy(j0, nonce, 12);
+	j0[12] = 0; j0[13] = 0; j0[14] = 0; j0[15] = 1;
+	__m128i t = _mm_xor_si128(s, aes128_block(rk, _mm_load_si128(reinterpret_cast< __m128i const * >(j0))));
+	_mm_storeu_si128(reinterpret_cast< __m128i * >(tag), t);
+}
+
+AES_TARGET static void gcm_seal(AEADKey const &key, uint8_t const nonce[12], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t *tag) {
+	__m128i const *rk = reinterpret_cast< __m128i const * >(key.round_keys);
+	gcm_ctr(rk, nonce, in, out, size);
+	gcm_tag(rk, reinterpret_cast< __m128i const * >(key.h_powers), nonce, aad, aad_size, out, size, tag);
+}
+
+AES_TARGET static bool gcm_open(AEADKey const &key, uint8_t const nonce[12], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t const *tag) {
+	__m128i const *rk = reinterpret_cast< __m128i const * >(key.round_keys);
+	uint8_t expected[16];
+	gcm_tag(rk, reinterpret_cast< __m128i const * >(key.h_powers), nonce, aad, aad_size, in, size, expected);
+	if (!same_tag(expected, tag)) return false;
+	gcm_ctr(rk, nonce, in, out, size);
+	return true;
+}
+
+#else //!AEAD_X86
+
+bool aead_has_aes_ni() {
+	return false;
+}
+
+static void gcm_setup(uint8_t const *, uint8_t *, uint8_t *) {
+}
+
+static void gcm_seal(AEADKey const &, uint8_t const *, uint8_t const *, size_t, uint8_t const *, uint8_t *, size_t, uint8_t *) {
+}
+
+static bool gcm_open(AEADKey const &, uint8_t const *, uint8_t const *, size_t, uint8_t const *, uint8_t *, size_t, uint8_t const *) {
+	return false;
+}
+
+#endif
+
+//------ AEADKey ------
+
+AEADCipher aead_best_cipher() {
+	return (aead_has_aes_ni() ? AES128GCM : ChaCha20Poly1305);
+}
+
+char const *aead_cipher_name(AEADCipher cipher) {
+	return (cipher == AES128GCM ? "aes-128-gcm" : "chacha20-poly1305");
+}
+
+AEADKey::AEADKey(AEADCipher cipher_, uint8_t const *key, size_t key_size) : cipher(cipher_) {
+	memset(round_keys, 0, sizeof(round_keys));
+	memset(h_powers, 0, sizeof(h_powers));
+	memset(chacha_key, 0, sizeof(chacha_key));
+	if (cipher == AES128GCM) {
+		if (key_size != 16) throw std::runtime_error("AES-128-GCM needs a 16-byte key.");
+		if (!aead_has_aes_ni()) throw std::runtime_error("AES-128-GCM needs AES-NI + PCLMULQDQ, which this CPU doesn't have.");
+		gcm_setup(key, round_keys, h_powers);
+	} else {
+		if (key_size != 32) throw std::runtime_error("ChaCha20-Poly1305 needs a 32-byte key.");
+		for (uint32_t i = 0; i < 8; ++i) chacha_key[i] = read_le32(key + 4 * i);
+	}
+}
+
+AEADKey::~AEADKey() {
+	//(don't leave key material lying around in freed memory)
+	volatile uint8_t *p = round_keys;
+	for (size_t i = 0; i < sizeof(round_keys); ++i) p[i] = 0;
+	p = h_powers;
+	for (size_t i = 0; i < sizeof(h_powers); ++i) p[i] = 0;
+	volatile uint32_t *q = chacha_key;
+	for (size_t i = 0; i < 8; ++i) q[i] = 0;
+}
+
+void AEADKey::seal(uint8_t const nonce[NonceSize], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t *tag) const {
+	if (cipher == AES128GCM) {
+		gcm_seal(*this, nonce, aad, aad_size, in, out, size, tag);
+	} else {
+		chacha20_xor(chacha_key, 1, nonce, in, out, size);
+		chacha20_poly1305_tag(chacha_key, nonce, aad, aad_size, out, size, tag);
+	}
+}
+
+bool AEADKey::open(uint8_t const nonce[NonceSize], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t const *tag) const {
+	if (cipher == AES128GCM) return gcm_open(*this, nonce, aad, aad_size, in, out, size, tag);
+	uint8_t expected[TagSize];
+	chacha20_poly1305_tag(chacha_key, nonce, aad, aad_size, in, size, expected);
+	if (!same_tag(expected, tag)) return false;
+	chacha20_xor(chacha_key, 1, nonce, in, out, size);
+	return true;
+}
+
+//------ HKDF ------
+
+void hkdf_sha1(uint8_t const *secret, size_t secret_size, std::string const &salt, std::string const &info, uint8_t *out, size_t size) {
+	if (size > 255 * SHA1::DigestSize) throw std::runtime_error("HKDF can't make that many bytes.");
+	//extract:
+	uint8_t prk[SHA1::DigestSize];
+	HMACSHA1(reinterpret_cast< uint8_t const * >(salt.data()), salt.size()).compute(secret, secret_size, prk);
+	//expand:
+	HMACSHA1 mac(prk, sizeof(prk));
+	uint8_t t[SHA1::DigestSize];
+	size_t t_size = 0;
+	for (uint8_t i = 1; size; ++i) {
+		SHA1 ctx = mac.begin();
+		ctx.update(t, t_size);
+		ctx.update(reinterpret_cast< uint8_t const * >(info.data()), info.size());
+		ctx.update(&i, 1);
+		mac.finish(ctx, t);
+		t_size = sizeof(t);
+		size_t n = (size < t_size ? size : t_size);
+		memcpy(out, t, n);
+		out += n;
+		size -= n;
+	}
+	memset(prk, 0, sizeof(prk));
+	memset(t, 0, sizeof(t));
+}
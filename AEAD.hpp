@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Authenticated encryption (AEAD) for packet payloads:
+ *  - "aes-128-gcm": AES-128-GCM (NIST SP 800-38D), with AES-NI for the
+ *    cipher and PCLMULQDQ for GHASH, four blocks at a time;
+ *  - "chacha20-poly1305": ChaCha20-Poly1305 (RFC 8439), plain C++ -- for
+ *    CPUs without AES-NI (there is no table-based AES here: it is slow, and
+ *    leaks key bits through cache timing).
+ * aead_best_cipher() picks AES-128-GCM if the CPU has what it needs.
+ *
+ * Both encrypt / decrypt in place (or from one buffer into another), and
+ * open() checks the tag before decrypting anything, so a forged packet leaves
+ * the buffer as it was. Nonces are 12 bytes and tags 16, for both; a nonce
+ * must never be used twice with one key (see PacketCrypto.hpp for how
+ * channels pick them).
+ *
+ * hkdf_sha1() (RFC 5869, over HMACSHA1) turns a shared secret into keys.
+ */
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+enum AEADCipher : uint8_t { AES128GCM, ChaCha20Poly1305 };
+
+bool aead_has_aes_ni(); //AES-NI + PCLMULQDQ + SSSE3 (what AES-128-GCM needs)
+AEADCipher aead_best_cipher();
+char const *aead_cipher_name(AEADCipher cipher);
+
+struct AEADKey {
+	static constexpr size_t NonceSize = 12;
+	static constexpr size_t TagSize = 16;
+	//key is 16 bytes for AES128GCM, 32 for ChaCha20Poly1305; throws if the size is wrong or the CPU can't do AES128GCM:
+	AEADKey(AEADCipher cipher, uint8_t const *key, size_t key_size);
+	~AEADKey();
+
+	AEADCipher const cipher;
+
+	//encrypt 'size' bytes from 'in' to 'out' and write the TagSize-byte tag over ('aad' + ciphertext)
+	// ('out' may be 'in', or start before it -- both work front to back):
+	void seal(uint8_t const nonce[NonceSize], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t *tag) const;
+	//check 'tag'; if it matches, decrypt 'size' bytes from 'in' to 'out' (as above) and return true:
+	bool open(uint8_t const nonce[NonceSize], uint8_t const *aad, size_t aad_size, uint8_t const *in, uint8_t *out, size_t size, uint8_t const *tag) const;
+
+	//------ internals ------
+	alignas(16) uint8_t round_keys[11 * 16]; //AES-128 key schedule
+	alignas(16) uint8_t h_powers[4 * 16]; //GHASH key H, H^2, H^3, H^4 (byte-reversed)
+	uint32_t chacha_key[8];
+};
+
+//RFC 5869 HKDF with HMAC-SHA1; writes 'size' (at most 255 * 20) bytes to 'out':
+void hkdf_sha1(uint8_t const *secret, size_t secret_size, std::string const &salt, std::string const &info, uint8_t *out, size_t size);
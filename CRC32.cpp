@@ -0,0 +1,165 @@
+#include "CRC32.hpp"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CRC32_X86 1
+#include <immintrin.h>
+#endif
+
+//------ slicing-by-8 ------
+
+//table[k][b] is the CRC contribution of byte b followed by k zero bytes:
+static uint32_t const (*slice_tables())[256] {
+	static uint32_t tables[8][256];
+	static bool init = []() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (uint32_t k = 0; k < 8; ++k) {
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			}
+			tables[0][i] = c;
+		}
+		for (uint32_t i = 0; i < 256; ++i) {
+			for (uint32_t k = 1; k < 8; ++k) {
+				tables[k][i] = (tables[k-1][i] >> 8) ^ tables[0][tables[k-1][i] & 0xff];
+			}
+		}
+		return true;
+	}();
+	(void)init;
+	return tables;
+}
+
+static inline uint32_t read_le32(uint8_t const *p) {
+	return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+uint32_t crc32_slice8(uint8_t const *data, size_t size, uint32_t crc) {
+	uint32_t const (*t)[256] = slice_tables();
+	crc = ~crc;
+	while (size >= 8) {
+		uint32_t one = read_le32(data) ^ crc;
+		uint32_t two = read_le32(data + 4);
+		crc = t[7][one & 0xff] ^ t[6][(one >> 8) & 0xff] ^ t[5][(one >> 16) & 0xff] ^ t[4][one >> 24]
+		    ^ t[3][two & 0xff] ^ t[2][(two >> 8) & 0xff] ^ t[1][(two >> 16) & 0xff] ^ t[0][two >> 24];
+		data += 8;
+		size -= 8;
+	}
+	while (size) {
+		crc = t[0][(crc ^ *data) & 0xff] ^ (crc >> 8);
+		data += 1;
+		size -= 1;
+	}
+	return ~crc;
+}
+
+//------ carry-less multiply folding ------
+// (after Gopal et al., "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction", Intel, 2009;
+//  constants are x^k mod P(x), bit-reflected, for the k's needed to fold by 64 and 16 bytes)
+
+#ifdef CRC32_X86
+
+bool crc32_has_pclmul() {
+	static bool has = (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"));
+	return has;
+}
+
+__attribute__((target("pclmul,sse4.1")))
+uint32_t crc32_pclmul(uint8_t const *data, size_t size, uint32_t crc) {
+	if (size < 16) return crc32_slice8(data, size, crc);
+
+	__m128i const k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4); //fold by 64 bytes
+	__m128i const k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0); //fold by 16 bytes
+	__m128i const k5k0 = _mm_set_epi64x(0x0000000000, 0x0163cd6124); //128 -> 64 bits
+	__m128i const poly = _mm_set_epi64x(0x01f7011641, 0x01db710641); //Barrett reduction (mu, P)
+	__m128i const low32 = _mm_setr_epi32(~0, 0, ~0, 0);
+
+	__m128i x1 = _mm_xor_si128(_mm_loadu_si128(reinterpret_cast< __m128i const * >(data)), _mm_cvtsi32_si128(int(~crc)));
+	data += 16;
+	size -= 16;
+
+	if (size >= 48) {
+		//four lanes, each folded forward by 64 bytes per step:
+		__m128i x2 = _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x00));
+		__m128i x3 = _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x10));
+		__m128i x4 = _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x20));
+		data += 48;
+		size -= 48;
+		while (size >= 64) {
+			__m128i x5 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+			__m128i x6 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+			__m128i x7 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+			__m128i x8 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+			x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+			x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+			x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, x5), _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x00)));
+			x2 = _mm_xor_si128(_mm_xor_si128(x2, x6), _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x10)));
+			x3 = _mm_xor_si128(_mm_xor_si128(x3, x7), _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x20)));
+			x4 = _mm_xor_si128(_mm_xor_si128(x4, x8), _mm_loadu_si128(reinterpret_cast< __m128i const * >(data + 0x30)));
+			data += 64;
+			size -= 64;
+		}
+		//fold the four lanes into one:
+		__m128i const lanes[3] = {x2, x3, x4};
+		for (__m128i next : lanes) {
+			__m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+			x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+			x1 = _mm_xor_si128(_mm_xor_si128(x1, lo), next);
+		}
+	}
+
+	//one lane, folded forward by 16 bytes per step:
+	while (size >= 16) {
+		__m128i lo = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+		x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+		x1 = _mm_xor_si128(_mm_xor_si128(x1, lo), _mm_loadu_si128(reinterpret_cast< __m128i const * >(data)));
+		data += 16;
+		size -= 16;
+	}
+
+	//128 -> 64 bits:
+	__m128i x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+	x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+	x2 = _mm_srli_si128(x1, 4);
+	x1 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5k0, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+
+	//Barrett reduction, 64 -> 32 bits:
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+	x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32), poly, 0x00);
+	x1 = _mm_xor_si128(x1, x2);
+	uint32_t state = uint32_t(_mm_extract_epi32(x1, 1));
+
+	//(less than 16 bytes left)
+	return crc32_slice8(data, size, ~state);
+}
+
+#else //!CRC32_X86
+
+bool crc32_has_pclmul() {
+	return false;
+}
+
+uint32_t crc32_pclmul(uint8_t const *data, size_t size, uint32_t crc) {
+	return crc32_slice8(data, size, crc);
+}
+
+#endif
+
+//------ dispatch ------
+
+typedef uint32_t (*CRC32Kernel)(uint8_t const *, size_t, uint32_t);
+
+static CRC32Kernel kernel() {
+	static CRC32Kernel k = (crc32_has_pclmul() ? crc32_pclmul : crc32_slice8);
+	return k;
+}
+
+uint32_t crc32(uint8_t const *data, size_t size, uint32_t crc) {
+	return kernel()(data, size, crc);
+}
+
+char const *crc32_implementation() {
+	return (kernel() == crc32_pclmul ? "pclmul" : "slice8");
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+/*
+ * CRC-32 (ISO-HDLC / zlib polynomial, as used by STUN's FINGERPRINT).
+ *
+ * crc32() picks the fastest kernel the CPU supports, once, at startup:
+ *  - "pclmul": carry-less-multiply folding, 16 bytes per step (x86 with PCLMULQDQ + SSE4.1);
+ *  - "slice8": table-driven, 8 bytes per step (everywhere else).
+ * Both finish off any tail shorter than 16 bytes with the slicing tables.
+ *
+ * 'crc' continues a previous call, zlib-style:
+ *   crc32(ab, 2) == crc32(ab + 1, 1, crc32(ab, 1))
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+uint32_t crc32(uint8_t const *data, size_t size, uint32_t crc = 0);
+
+//name of the kernel crc32() dispatches to:
+char const *crc32_implementation();
+
+//individual kernels (for tests + benchmarks); crc32_pclmul() must only be called if crc32_has_pclmul():
+uint32_t crc32_slice8(uint8_t const *data, size_t size, uint32_t crc = 0);
+uint32_t crc32_pclmul(uint8_t const *data, size_t size, uint32_t crc = 0);
+bool crc32_has_pclmul();
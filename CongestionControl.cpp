@@ -0,0 +1,62 @@
+#include "CongestionControl.hpp"
+
+#include <algorithm>
+
+//------ NewReno ------
+
+NewReno::NewReno(uint32_t mss_) : CongestionControl(mss_), cwnd(10 * mss_) { //<-- RFC 6928 initial window
+}
+
+void NewReno::on_ack(uint32_t bytes, uint32_t, uint32_t) {
+	if (cwnd < ssthresh) {
+		cwnd += std::min(bytes, mss); //<-- RFC 3465 L=1
+		return;
+	}
+	acked += bytes;
+	if (acked >= cwnd) {
+		acked -= cwnd;
+		cwnd += mss;
+	}
+}
+
+void NewReno::on_loss() {
+	ssthresh = std::max(cwnd / 2, 2 * mss);
+	cwnd = ssthresh;
+	acked = 0;
+}
+
+void NewReno::on_timeout() {
+	ssthresh = std::max(cwnd / 2, 2 * mss);
+	cwnd = mss;
+	acked = 0;
+}
+
+//------ LEDBAT ------
+
+LEDBAT::LEDBAT(uint32_t mss_, uint32_t target_us_) : CongestionControl(mss_), target_us(target_us_), cwnd(2.0 * mss_) {
+}
+
+void LEDBAT::on_ack(uint32_t bytes, uint32_t rtt_us, uint32_t min_rtt_us) {
+	if (rtt_us == 0) return; //<-- no delay signal; hold steady
+	double queuing_us = double(rtt_us - std::min(rtt_us, min_rtt_us));
+	if (slow_start) {
+		if (queuing_us < 0.5 * target_us) {
+			cwnd += std::min(bytes, mss);
+			return;
+		}
+		slow_start = false;
+	}
+	double off_target = (double(target_us) - queuing_us) / double(target_us);
+	cwnd += gain * off_target * double(bytes) * double(mss) / cwnd;
+	cwnd = std::max(cwnd, double(2 * mss));
+}
+
+void LEDBAT::on_loss() {
+	slow_start = false;
+	cwnd = std::max(cwnd / 2.0, double(2 * mss));
+}
+
+void LEDBAT::on_timeout() {
+	slow_start = false;
+	cwnd = double(mss);
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+ * CongestionControl decides how many bytes a ReliableStream may have in
+ * flight. The stream reports what happens to its packets (acks with RTT
+ * samples, losses, retransmission timeouts) and sends no more than window().
+ *
+ * Two controllers are provided:
+ *  - NewReno (RFC 5681 / 6582): slow start, then +1 segment per round trip;
+ *    halve on loss, back to one segment on timeout. Fills any queue it is
+ *    given -- fine for bulk transfer, not for latency.
+ *  - LEDBAT (RFC 6817): grows only while the queuing delay it sees (RTT
+ *    minus the smallest RTT so far) is under 'target_us', and shrinks in
+ *    proportion as it goes over -- so it keeps bottleneck queues (and so
+ *    everyone's latency) short, and backs off in favor of loss-based flows.
+ *
+ * Other controllers just implement the interface and get handed to
+ * ReliableStream::congestion.
+ */
+
+#include <cstdint>
+
+struct CongestionControl {
+	CongestionControl(uint32_t mss_) : mss(mss_) { }
+	virtual ~CongestionControl() { }
+
+	uint32_t const mss; //bytes per full-sized segment
+
+	virtual char const *name() const = 0;
+
+	//'bytes' newly acknowledged (outside of loss recovery); rtt_us is a fresh sample, or 0 if there wasn't one
+	// (e.g., only retransmitted segments were acked); min_rtt_us is the smallest sample seen so far:
+	virtual void on_ack(uint32_t bytes, uint32_t rtt_us, uint32_t min_rtt_us) = 0;
+	//packets were lost (called at most once per round trip):
+	virtual void on_loss() = 0;
+	//the retransmission timer went off (everything in flight is presumed lost):
+	virtual void on_timeout() = 0;
+
+	//bytes allowed in flight:
+	virtual uint32_t window() const = 0;
+};
+
+struct NewReno : CongestionControl {
+	NewReno(uint32_t mss);
+
+	uint32_t cwnd;
+	uint32_t ssthresh = ~0U;
+	uint32_t acked = 0; //bytes acked toward the next +1 segment, in congestion avoidance
+
+	char const *name() const override { return "NewReno"; }
+	void on_ack(uint32_t bytes, uint32_t rtt_us, uint32_t min_rtt_us) override;
+	void on_loss() override;
+	void on_timeout() override;
+	uint32_t window() const override { return cwnd; }
+};
+
+struct LEDBAT : CongestionControl {
+	LEDBAT(uint32_t mss, uint32_t target_us = 25000);
+
+	uint32_t target_us; //queuing delay to aim for (RFC 6817 caps this at 100ms)
+	uint32_t gain = 1; //segments per round trip of growth at zero queuing delay
+	double cwnd; //(fractional, since growth per ack can be tiny)
+	bool slow_start = true; //until the first loss or half the target delay
+
+	char const *name() const override { return "LEDBAT"; }
+	void on_ack(uint32_t bytes, uint32_t rtt_us, uint32_t min_rtt_us) override;
+	void on_loss() override;
+	void on_timeout() override;
+	uint32_t window() const override { return uint32_t(cwnd); }
+};
@@ -0,0 +1,572 @@
+#include "DNSResolver.hpp"
+
+#include "SocketAddress.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+static constexpr uint16_t TypeA = 1;
+static constexpr uint16_t TypeCNAME = 5;
+static constexpr uint16_t TypeAAAA = 28;
+static constexpr uint16_t ClassIN = 1;
+
+static uint16_t read_u16(uint8_t const *at) {
+	return uint16_t((uint16_t(at[0]) << 8) | uint16_t(at[1]));
+}
+
+static uint32_t read_u32(uint8_t const *at) {
+	return (uint32_t(at[0]) << 24) | (uint32_t(at[1]) << 16) | (uint32_t(at[2]) << 8) | uint32_t(at[3]);
+}
+
+static void write_u16(uint8_t *at, uint16_t value) {
+	at[0] = uint8_t(value >> 8);
+	at[1] = uint8_t(value);
+}
+
+static std::string key_for(std::string const &name, uint16_t type) {
+	return (type == TypeA ? "A " : "AAAA ") + name;
+}
+
+static std::string normalize(std::string name) {
+	for (auto &c : name) c = char(std::tolower(static_cast< unsigned char >(c)));
+	if (!name.empty() && name.back() == '.') name.pop_back();
+	return name;
+}
+
+//a numeric address (no port)? returns false if 'name' isn't one:
+static bool parse_numeric(std::string const &name, struct sockaddr_storage *address) {
+	memset(address, '\0', sizeof(*address));
+	struct sockaddr_in &in = reinterpret_cast< struct sockaddr_in & >(*address);
+	if (inet_pton(AF_INET, name.c_str(), &in.sin_addr) == 1) {
+		in.sin_family = AF_INET;
+		return true;
+	}
+	struct sockaddr_in6 &in6 = reinterpret_cast< struct sockaddr_in6 & >(*address);
+	if (inet_pton(AF_INET6, name.c_str(), &in6.sin6_addr) == 1) {
+		in6.sin6_family = AF_INET6;
+		return true;
+	}
+	return false;
+}
+
+//dot-separated labels of 1-63 bytes, 253 bytes in all:
+static bool valid_name(std::string const &name) {
+	if (name.empty() || name.size() > 253) return false;
+	for (size_t start = 0; start <= name.size(); ) {
+		size_t dot = std::min(name.find('.', start), name.size());
+		if (dot == start || dot - start > 63) return false;
+		start = dot + 1;
+	}
+	return true;
+}
+
+//read a (possibly compressed) name starting at 'at' as "label.label" (lowercase);
+// returns the offset just past it, or 0 if it's malformed:
+static size_t read_name(uint8_t const *data, size_t size, size_t at, std::string *name) {
+	name->clear();
+	size_t end = 0; //(past the name where it started -- i.e., before the first pointer)
+	for (uint32_t jumps = 0; ; ) {
+		if (at >= size) return 0;
+		uint8_t length = data[at];
+		if ((length & 0xc0) == 0xc0) {
+			if (at + 1 >= size || ++jumps > 16) return 0; //<-- (pointer loops)
+			if (!end) end = at + 2;
+			at = (size_t(length & 0x3f) << 8) | data[at + 1];
+			continue;
+		}
+		if (length & 0xc0) return 0;
+		if (length == 0) return (end ? end : at + 1);
+		if (at + 1 + length > size || name->size() + length > 254) return 0;
+		if (!name->empty()) *name += '.';
+		for (size_t i = 0; i < length; ++i) *name += char(std::tolower(data[at + 1 + i]));
+		at += 1 + length;
+	}
+}
+
+//------------------------------------------------
+
+DNSResolver::DNSResolver(EventLoop &loop_) : loop(loop_), mt(std::random_device()()), buffer(4096) {
+	read_resolv_conf("/etc/resolv.conf");
+	read_hosts("/etc/hosts");
+	if (nameservers.empty()) {
+		//(same as the C library does)
+		struct sockaddr_storage local;
+		address_from_string("127.0.0.1:53", &local);
+		nameservers.emplace_back(local);
+	}
+}
+
+DNSResolver::~DNSResolver() {
+	for (auto &entry : queries_by_key) {
+		if (entry.second->timer) loop.cancel(entry.second->timer);
+	}
+	for (int sock : {sock4, sock6}) {
+		if (sock == -1) continue;
+		loop.unwatch(sock);
+		close(sock);
+	}
+}
+
+void DNSResolver::read_resolv_conf(std::string const &filename) {
+	std::ifstream in(filename);
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream str(line);
+		std::string keyword;
+		if (!(str >> keyword)) continue;
+		if (keyword == "nameserver") {
+			std::string host;
+			struct sockaddr_storage address;
+			if (!(str >> host) || !parse_numeric(host, &address)) continue; //<-- (e.g., scoped ipv6 addresses)
+			if (nameservers.size() >= 3) continue; //<-- (MAXNS; the C library ignores the rest, too)
+			if (address.ss_family == AF_INET) reinterpret_cast< struct sockaddr_in & >(address).sin_port = htons(53);
+			else reinterpret_cast< struct sockaddr_in6 & >(address).sin6_port = htons(53);
+			nameservers.emplace_back(address);
+		} else if (keyword == "options") {
+			std::string option;
+			while (str >> option) {
+				if (option.compare(0, 8, "timeout:") == 0) {
+					timeout_ms = uint32_t(std::max(1, std::min(30, std::atoi(option.c_str() + 8)))) * 1000;
+				} else if (option.compare(0, 9, "attempts:") == 0) {
+					attempts = uint32_t(std::max(1, std::min(5, std::atoi(option.c_str() + 9))));
+				}
+			}
+		}
+	}
+}
+
+void DNSResolver::read_hosts(std::string const &filename) {
+	std::ifstream in(filename);
+	std::string line;
+	while (std::getline(in, line)) {
+		line = line.substr(0, line.find('#'));
+		std::istringstream str(line);
+		std::string host, name;
+		struct sockaddr_storage address;
+		if (!(str >> host) || !parse_numeric(host, &address)) continue;
+		while (str >> name) {
+			auto &addresses = hosts[normalize(name)];
+			bool seen = false;
+			for (auto const &a : addresses) seen = seen || same_address(a, address);
+			if (!seen) addresses.emplace_back(address);
+		}
+	}
+}
+
+//------------------------------------------------
+
+void DNSResolver::resolve(std::string const &name_, int family, Callback const &callback) {
+	std::string name = normalize(name_);
+	Result result;
+	result.cached = true;
+
+	struct sockaddr_storage numeric;
+	if (parse_numeric(name, &numeric)) {
+		if (family == AF_UNSPEC || family == numeric.ss_family) {
+			result.ok = true;
+			result.ttl_s = max_ttl_s;
+			result.addresses.emplace_back(numeric);
+		} else {
+			result.error = "numeric address is of the wrong family.";
+		}
+		later(callback, result);
+		return;
+	}
+
+	auto h = hosts.find(name);
+	if (h != hosts.end()) {
+		for (auto const &address : h->second) {
+			if (family == AF_UNSPEC || family == address.ss_family) result.addresses.emplace_back(address);
+		}
+		if (!result.addresses.empty()) {
+			std::stable_sort(result.addresses.begin(), result.addresses.end(), [](struct sockaddr_storage const &a, struct sockaddr_storage const &b) {
+				return a.ss_family == AF_INET && b.ss_family != AF_INET;
+			});
+			result.ok = true;
+			result.ttl_s = max_ttl_s;
+			later(callback, result);
+			return;
+		}
+	}
+
+	if (!valid_name(name)) {
+		result.error = "not a valid host name.";
+		later(callback, result);
+		return;
+	}
+
+	if (family == AF_INET) {
+		lookup(name, TypeA, callback);
+	} else if (family == AF_INET6) {
+		lookup(name, TypeAAAA, callback);
+	} else {
+		//both, in parallel; merged once both are in:
+		struct Both {
+			Result a, aaaa;
+			uint32_t left = 2;
+		};
+		std::shared_ptr< Both > both = std::make_shared< Both >();
+		auto merge = [both, callback]() {
+			if (--both->left) return;
+			Result merged;
+			merged.ok = both->a.ok || both->aaaa.ok;
+			merged.error = (merged.ok ? nullptr : both->a.error);
+			merged.cached = both->a.cached && both->aaaa.cached;
+			merged.stale = both->a.stale || both->aaaa.stale;
+			merged.ttl_s = ~uint32_t(0);
+			for (Result const *part : {&both->a, &both->aaaa}) {
+				if (!part->ok) continue;
+				merged.addresses.insert(merged.addresses.end(), part->addresses.begin(), part->addresses.end());
+				merged.ttl_s = std::min(merged.ttl_s, part->ttl_s);
+			}
+			if (!merged.ok) merged.ttl_s = 0;
+			callback(merged);
+		};
+		lookup(name, TypeA, [both, merge](Result const &r) { both->a = r; merge(); });
+		lookup(name, TypeAAAA, [both, merge](Result const &r) { both->aaaa = r; merge(); });
+	}
+}
+
+void DNSResolver::resolve_all(std::vector< std::string > const &names, int family, ListCallback const &callback) {
+	struct All {
+		std::vector< Result > results;
+		size_t left;
+	};
+	std::shared_ptr< All > all = std::make_shared< All >();
+	all->results.resize(names.size());
+	all->left = names.size();
+	if (names.empty()) {
+		std::weak_ptr< bool > alive_(alive);
+		loop.defer([alive_, callback]() {
+			if (alive_.expired()) return;
+			callback(std::vector< Result >());
+		});
+		return;
+	}
+	for (size_t i = 0; i < names.size(); ++i) {
+		resolve(names[i], family, [all, i, callback](Result const &result) {
+			all->results[i] = result;
+			if (--all->left == 0) callback(all->results);
+		});
+	}
+}
+
+void DNSResolver::later(Callback const &callback, Result const &result) {
+	std::weak_ptr< bool > alive_(alive);
+	loop.defer([alive_, callback, result]() {
+		if (alive_.expired()) return;
+		callback(result);
+	});
+}
+
+void DNSResolver::lookup(std::string const &name, uint16_t type, Callback const &callback) {
+	std::string key = key_for(name, type);
+	uint64_t now = EventLoop::now();
+
+	auto c = cache.find(key);
+	if (c != cache.end()) {
+		Entry const &entry = c->second;
+		Result result;
+		result.cached = true;
+		if (now < entry.expires_ms) {
+			hits += 1;
+			result.ok = !entry.addresses.empty();
+			result.error = (result.ok ? nullptr : "no such host (cached).");
+			result.addresses = entry.addresses;
+			result.ttl_s = uint32_t((entry.expires_ms - now) / 1000);
+			later(callback, result);
+			return;
+		}
+		if (serve_stale && !entry.addresses.empty()) {
+			stale_hits += 1;
+			result.ok = true;
+			result.stale = true;
+			result.addresses = entry.addresses;
+			later(callback, result);
+			//...and refresh in the background (unless that's underway already):
+			if (queries_by_key.count(key)) return;
+			Query *query = new Query;
+			query->name = name;
+			query->type = type;
+			queries_by_key[key].reset(query);
+			send_query(*query);
+			return;
+		}
+	}
+
+	auto q = queries_by_key.find(key);
+	if (q != queries_by_key.end()) {
+		q->second->waiters.emplace_back(callback); //<-- (already asked)
+		return;
+	}
+	Query *query = new Query;
+	query->name = name;
+	query->type = type;
+	query->waiters.emplace_back(callback);
+	queries_by_key[key].reset(query);
+	send_query(*query);
+}
+
+//------------------------------------------------
+
+int DNSResolver::socket_for(int family) {
+	int &sock = (family == AF_INET ? sock4 : sock6);
+	if (sock != -1) return sock;
+	//(unbound: the first send picks a random source port -- which, with random ids, is what makes answers hard to spoof)
+	sock = socket(family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sock == -1) return -1;
+	int s = sock;
+	loop.watch(s, EPOLLIN, [this, s](uint32_t) {
+		handle_readable(s);
+	});
+	return sock;
+}
+
+void DNSResolver::send_query(Query &query) {
+	if (query.tries >= std::max(1U, attempts) * nameservers.size()) {
+		Result result;
+		result.error = "DNS lookup timed out.";
+		finish(query, result);
+		return;
+	}
+	if (query.tries == 0) {
+		//fresh id (not one in flight):
+		do {
+			query.id = uint16_t(mt());
+		} while (queries_by_id.count(query.id));
+		queries_by_id[query.id] = &query;
+	}
+	struct sockaddr_storage const &server = nameservers[query.tries % nameservers.size()];
+	query.tries += 1;
+
+	//header (id, recursion desired, one question) + question:
+	uint8_t packet[12 + 256 + 4];
+	memset(packet, '\0', 12);
+	write_u16(packet, query.id);
+	packet[2] = 0x01; //<-- RD
+	write_u16(packet + 4, 1);
+	size_t length = 12;
+	for (size_t start = 0; start <= query.name.size(); ) { //(labels were checked by valid_name())
+		size_t dot = std::min(query.name.find('.', start), query.name.size());
+		packet[length++] = uint8_t(dot - start);
+		memcpy(packet + length, query.name.data() + start, dot - start);
+		length += dot - start;
+		start = dot + 1;
+	}
+	packet[length++] = 0;
+	write_u16(packet + length, query.type);
+	write_u16(packet + length + 2, ClassIN);
+	length += 4;
+
+	int sock = socket_for(server.ss_family);
+	if (sock != -1) {
+		queries += 1;
+		//NOTE: a failed send is left to the timeout (which moves on to the next server)
+		sendto(sock, packet, length, 0, reinterpret_cast< struct sockaddr const * >(&server), address_length(server));
+	}
+	Query *q = &query;
+	query.timer = loop.after(timeout_ms, [this, q]() {
+		q->timer = 0;
+		on_timeout(*q);
+	});
+}
+
+void DNSResolver::on_timeout(Query &query) {
+	timeouts += 1;
+	send_query(query);
+}
+
+void DNSResolver::handle_readable(int sock) {
+	std::weak_ptr< bool > alive_(alive);
+	while (true) {
+		struct sockaddr_storage from;
+		socklen_t from_len = sizeof(from);
+		ssize_t got = recvfrom(sock, buffer.data(), buffer.size(), 0, reinterpret_cast< struct sockaddr * >(&from), &from_len);
+		if (got < 0) {
+			if (errno == EINTR) continue;
+			break; //<-- EAGAIN (or an ICMP error from some earlier send; the timeout deals with that)
+		}
+		handle_response(from, buffer.data(), size_t(got));
+		if (alive_.expired()) return; //<-- a callback destroyed the resolver (and closed 'sock')
+	}
+}
+
+void DNSResolver::handle_response(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	if (size < 12) return;
+	auto q = queries_by_id.find(read_u16(data));
+	if (q == queries_by_id.end()) return;
+	Query &query = *q->second;
+
+	//only from a server we asked, only a response, and only to our question:
+	bool known = false;
+	for (auto const &server : nameservers) known = known || same_address(server, from);
+	uint16_t flags = read_u16(data + 2);
+	if (!known || !(flags & 0x8000) || read_u16(data + 4) != 1) return;
+	std::string name;
+	size_t at = read_name(data, size, 12, &name);
+	if (!at || at + 4 > size || name != query.name || read_u16(data + at) != query.type || read_u16(data + at + 2) != ClassIN) return;
+	at += 4;
+
+	uint8_t rcode = uint8_t(flags & 0x0f);
+	if (rcode == 3) { //NXDOMAIN
+		Result result;
+		result.error = "no such host.";
+		finish(query, result, true);
+		return;
+	}
+	if (rcode != 0) {
+		//SERVFAIL, REFUSED, ...: this server is no help; try the next one now:
+		if (query.timer) loop.cancel(query.timer);
+		query.timer = 0;
+		send_query(query);
+		return;
+	}
+
+	//answers: addresses of the name -- or of what it is a CNAME for:
+	std::vector< std::string > names{query.name};
+	Result result;
+	uint32_t ttl = ~uint32_t(0);
+	uint16_t count = read_u16(data + 6);
+	for (uint16_t i = 0; i < count; ++i) {
+		std::string owner;
+		at = read_name(data, size, at, &owner);
+		if (!at || at + 10 > size) break;
+		uint16_t type = read_u16(data + at);
+		uint16_t klass = read_u16(data + at + 2);
+		uint32_t record_ttl = read_u32(data + at + 4);
+		uint16_t length = read_u16(data + at + 8);
+		at += 10;
+		if (at + length > size) break;
+		bool ours = (klass == ClassIN && std::find(names.begin(), names.end(), owner) != names.end());
+		if (ours && type == TypeCNAME) {
+			std::string target;
+			if (read_name(data, size, at, &target)) names.emplace_back(target);
+			ttl = std::min(ttl, record_ttl);
+		} else if (ours && type == query.type && length == (type == TypeA ? 4 : 16)) {
+			struct sockaddr_storage address;
+			memset(&address, '\0', sizeof(address));
+			if (type == TypeA) {
+				address.ss_family = AF_INET;
+				memcpy(&reinterpret_cast< struct sockaddr_in & >(address).sin_addr, data + at, 4);
+			} else {
+				address.ss_family = AF_INET6;
+				memcpy(&reinterpret_cast< struct sockaddr_in6 & >(address).sin6_addr, data + at, 16);
+			}
+			result.addresses.emplace_back(address);
+			ttl = std::min(ttl, record_ttl);
+		}
+		at += length;
+	}
+
+	if (result.addresses.empty()) {
+		if (flags & 0x0200) {
+			//truncated before any address (TCP fallback isn't worth it for this):
+			result.error = "DNS answer was truncated.";
+			finish(query, result);
+		} else {
+			result.error = "host has no address of that family.";
+			finish(query, result, true);
+		}
+		return;
+	}
+	result.ok = true;
+	result.ttl_s = std::max(min_ttl_s, std::min(max_ttl_s, ttl));
+	finish(query, result);
+}
+
+void DNSResolver::finish(Query &query, Result result, bool negative) {
+	std::string key = key_for(query.name, query.type);
+	uint64_t now = EventLoop::now();
+	if (result.ok) {
+		Entry &entry = cache[key];
+		entry.addresses = result.addresses;
+		entry.expires_ms = now + uint64_t(result.ttl_s) * 1000;
+	} else if (negative) {
+		Entry &entry = cache[key];
+		entry.addresses.clear();
+		entry.expires_ms = now + uint64_t(negative_ttl_s) * 1000;
+		result.ttl_s = negative_ttl_s;
+	} else {
+		//(didn't hear back: an old answer beats none)
+		auto c = cache.find(key);
+		if (c != cache.end() && !c->second.addresses.empty()) {
+			result.ok = true;
+			result.error = nullptr;
+			result.addresses = c->second.addresses;
+			result.cached = true;
+			result.stale = true;
+		}
+	}
+
+	std::vector< Callback > waiters = std::move(query.waiters);
+	if (query.timer) loop.cancel(query.timer);
+	if (query.tries) queries_by_id.erase(query.id);
+	queries_by_key.erase(key); //<-- deletes 'query'
+
+	for (auto const &waiter : waiters) waiter(result);
+}
+
+//------------------------------------------------
+
+void DNSResolver::load(std::string const &filename) {
+	std::ifstream in(filename);
+	std::string line;
+	int64_t unix_now = int64_t(std::time(nullptr));
+	uint64_t now = EventLoop::now();
+	while (std::getline(in, line)) {
+		std::istringstream str(line);
+		std::string name, type, address;
+		int64_t expires = 0;
+		if (!(str >> name >> type >> expires) || (type != "A" && type != "AAAA")) continue;
+		Entry entry;
+		struct sockaddr_storage parsed;
+		while (str >> address) {
+			if (address_from_string(address, &parsed)) entry.addresses.emplace_back(parsed);
+		}
+		if (entry.addresses.empty()) continue;
+		//(already expired entries are kept for serve_stale)
+		entry.expires_ms = (expires > unix_now ? now + uint64_t(expires - unix_now) * 1000 : 0);
+		std::string key = type + ' ' + normalize(name);
+		auto c = cache.find(key);
+		if (c != cache.end() && c->second.expires_ms >= entry.expires_ms) continue; //<-- (have a newer answer)
+		cache[key] = entry;
+	}
+}
+
+void DNSResolver::save(std::string const &filename) const {
+	int64_t unix_now = int64_t(std::time(nullptr));
+	uint64_t now = EventLoop::now();
+	//write to a temporary + rename, so a crash mid-write can't leave a truncated cache:
+	std::string temp = filename + ".tmp";
+	{
+		std::ofstream out(temp);
+		for (auto const &c : cache) {
+			if (c.second.addresses.empty()) continue; //<-- (failures aren't worth remembering across runs)
+			size_t space = c.first.find(' ');
+			int64_t expires = unix_now + (int64_t(c.second.expires_ms) - int64_t(now)) / 1000;
+			out << c.first.substr(space + 1) << ' ' << c.first.substr(0, space) << ' ' << expires;
+			for (auto const &address : c.second.addresses) out << ' ' << address_to_string(address);
+			out << '\n';
+		}
+		if (!out) {
+			throw std::runtime_error("Error writing DNS cache to '" + temp + "'.");
+		}
+	}
+	if (std::rename(temp.c_str(), filename.c_str()) != 0) {
+		throw std::runtime_error("Error renaming '" + temp + "' to '" + filename + "'.");
+	}
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+/*
+ * DNSResolver looks up host names (A / AAAA) without ever blocking: queries
+ * go out over its own non-blocking UDP socket to the nameservers from
+ * /etc/resolv.conf, and answers are read when the EventLoop says the socket
+ * is readable. (getaddrinfo() blocks for as long as the slowest resolver
+ * takes, and re-asks on every run.)
+ *
+ *  - answers are cached in memory for as long as their TTLs say (failures,
+ *    briefly, too); concurrent lookups of one name share one query;
+ *  - with serve_stale, an expired answer is handed out right away while a
+ *    fresh one is fetched in the background (RFC 8767) -- so a reconnect never
+ *    waits on DNS for a name it has seen before;
+ *  - the cache can be saved to / loaded from a file, so restarts begin warm;
+ *  - numeric addresses and /etc/hosts names are answered without a query;
+ *  - resolve_all() looks up a whole list of names in parallel.
+ *
+ * Names are taken as fully qualified (no search domains). Each query is sent
+ * to one nameserver at a time, moving on to the next after timeout_ms (or a
+ * SERVFAIL / REFUSED), for 'attempts' rounds. Callbacks always come from the
+ * loop, never from inside resolve().
+ */
+
+#include "EventLoop.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+struct DNSResolver {
+	//reads /etc/resolv.conf (nameservers, timeout, attempts) and /etc/hosts:
+	DNSResolver(EventLoop &loop);
+	~DNSResolver();
+	DNSResolver(DNSResolver const &) = delete;
+	DNSResolver &operator=(DNSResolver const &) = delete;
+
+	EventLoop &loop;
+	std::vector< struct sockaddr_storage > nameservers; //(port 53; 127.0.0.1 if resolv.conf names none)
+	uint32_t timeout_ms = 2000; //per try
+	uint32_t attempts = 2; //rounds through all the nameservers
+	uint32_t min_ttl_s = 10; //answers are kept at least this long...
+	uint32_t max_ttl_s = 24 * 60 * 60; //...and at most this long
+	uint32_t negative_ttl_s = 30; //"no such name" / "no such address" is remembered this long
+	bool serve_stale = true;
+
+	struct Result {
+		bool ok = false;
+		char const *error = nullptr; //if !ok, (static) description of what went wrong
+		std::vector< struct sockaddr_storage > addresses; //(port 0)
+		uint32_t ttl_s = 0; //how much longer the answer is good for
+		bool cached = false; //answered from the cache (or numeric / from /etc/hosts)
+		bool stale = false; //...from an expired cache entry (a refresh is underway)
+	};
+	typedef std::function< void(Result const &) > Callback;
+
+	//look up 'name' (AF_INET: A records, AF_INET6: AAAA, AF_UNSPEC: both, ipv4 first); 'callback' is called once, from the loop:
+	void resolve(std::string const &name, int family, Callback const &callback);
+
+	//look up every name in parallel; 'callback' gets one result per name (in the same order) once all are in:
+	typedef std::function< void(std::vector< Result > const &) > ListCallback;
+	void resolve_all(std::vector< std::string > const &names, int family, ListCallback const &callback);
+
+	//text file, one "name type expires addr..." line per cached answer (expires in unix time, seconds).
+	// load() silently ignores a missing file (and malformed lines); save() throws on error:
+	void load(std::string const &filename);
+	void save(std::string const &filename) const;
+
+	//------ stats ------
+	uint64_t hits = 0; //answered from the cache (fresh)
+	uint64_t stale_hits = 0;
+	uint64_t queries = 0; //sent (including retries)
+	uint64_t timeouts = 0;
+
+	//------ internals ------
+	struct Entry {
+		std::vector< struct sockaddr_storage > addresses; //(empty: a cached failure)
+		uint64_t expires_ms = 0; //EventLoop::now() time
+	};
+	std::unordered_map< std::string, Entry > cache; //keyed by type ("A" / "AAAA") + ' ' + name
+	std::unordered_map< std::string, std::vector< struct sockaddr_storage > > hosts; //from /etc/hosts
+
+	struct Query {
+		std::string name;
+		uint16_t type; //1 = A, 28 = AAAA
+		uint16_t id;
+		uint32_t tries = 0; //(the next try goes to nameservers[tries % nameservers.size()])
+		EventLoop::TimerID timer = 0;
+		std::vector< Callback > waiters;
+	};
+	std::unordered_map< std::string, std::unique_ptr< Query > > queries_by_key;
+	std::unordered_map< uint16_t, Query * > queries_by_id;
+	int sock4 = -1, sock6 = -1; //(opened on first use)
+	std::mt19937 mt;
+	std::vector< uint8_t > buffer;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- lets deferred callbacks (and handle_readable()) notice the resolver is gone
+
+	void read_resolv_conf(std::string const &filename);
+	void read_hosts(std::string const &filename);
+	//one record type; calls 'callback' from the loop:
+	void lookup(std::string const &name, uint16_t type, Callback const &callback);
+	void later(Callback const &callback, Result const &result);
+	void send_query(Query &query);
+	void on_timeout(Query &query);
+	void handle_readable(int sock);
+	void handle_response(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+	//answer the query's waiters (and cache: answers; failures if 'negative', i.e. the name / address type doesn't exist):
+	void finish(Query &query, Result result, bool negative = false);
+	int socket_for(int family);
+};
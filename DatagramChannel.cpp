@@ -0,0 +1,968 @@
+#include "DatagramChannel.hpp"
+
+#include "DNSResolver.hpp"
+#include "EventLoop.hpp"
+#include "FECCoder.hpp"
+#include "IOUring.hpp"
+#include "Keepalive.hpp"
+#include "LatencyTracker.hpp"
+#include "PacketCrypto.hpp"
+#include "PeerDemux.hpp"
+#include "MappedAddressCache.hpp"
+#include "MessagePacker.hpp"
+#include "Metrics.hpp"
+#include "NetworkSim.hpp"
+#include "PacketPool.hpp"
+#include "ReliableStream.hpp"
+#include "STUN.hpp"
+#include "STUNClient.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <random>
+#include <stdexcept>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103 //<-- (Linux 4.18+; older headers lack these)
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+//Kernel receive timestamps are CLOCK_REALTIME; this converts them to EventLoop::now_us() time
+// (read once per receive round -- the two clocks don't drift apart measurably within one):
+static int64_t realtime_offset_us() {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return int64_t(EventLoop::now_us()) - (int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000);
+}
+
+//SO_TIMESTAMPNS timestamp among 'hdr''s control messages, in EventLoop::now_us() time (0 if there isn't one):
+static uint64_t receive_timestamp(struct msghdr *hdr, int64_t offset_us) {
+	for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(hdr); cmsg; cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+			struct timespec ts;
+			memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+			return uint64_t(int64_t(ts.tv_sec) * 1000000 + ts.tv_nsec / 1000 + offset_us);
+		}
+	}
+	return 0;
+}
+
+//Preallocated buffers and message headers for batched I/O; the headers only ever point into these buffers,
+// so setting them up is done once and each syscall just resets the few fields the kernel writes:
+// (with GRO, receive buffers are 'rx_datagram' bytes, to take coalesced super-datagrams whole):
+struct DatagramChannel::Batch {
+	Batch(uint32_t size_, size_t max_datagram_, size_t rx_datagram_) : size(size_), max_datagram(max_datagram_), rx_datagram(rx_datagram_),
+		rx_buffers(size * rx_datagram), rx_addrs(size), rx_iovs(size), rx_msgs(size), rx_control(size * ControlSpace),
+		tx_buffers(size * max_datagram), tx_addrs(size), tx_iovs(size), tx_msgs(size),
+		gso_msgs(size), gso_first(size), gso_control(size * ControlSpace) {
+		for (uint32_t i = 0; i < size; ++i) {
+			rx_iovs[i].iov_base = &rx_buffers[i * rx_datagram];
+			rx_iovs[i].iov_len = rx_datagram;
+			memset(&rx_msgs[i], '\0', sizeof(rx_msgs[i]));
+			rx_msgs[i].msg_hdr.msg_name = &rx_addrs[i];
+			rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+			rx_msgs[i].msg_hdr.msg_iovlen = 1;
+
+			tx_iovs[i].iov_base = &tx_buffers[i * max_datagram];
+			memset(&tx_msgs[i], '\0', sizeof(tx_msgs[i]));
+			tx_msgs[i].msg_hdr.msg_name = &tx_addrs[i];
+			tx_msgs[i].msg_hdr.msg_iov = &tx_iovs[i];
+			tx_msgs[i].msg_hdr.msg_iovlen = 1;
+
+			memset(&gso_msgs[i], '\0', sizeof(gso_msgs[i]));
+		}
+	}
+	~Batch() {
+		for (PacketBuffer *packet : rx_packets) packet->release();
+	}
+	//receive into buffers from 'pool' instead of rx_buffers:
+	void use_pool(PacketPool &pool) {
+		rx_packets.reserve(size);
+		for (uint32_t i = 0; i < size; ++i) {
+			PacketBuffer *packet = pool.acquire();
+			if (!packet) {
+				throw std::runtime_error("DatagramChannel: packet pool too small for the receive batch.");
+			}
+			rx_packets.emplace_back(packet);
+			rx_iovs[i].iov_base = packet->data();
+			rx_iovs[i].iov_len = pool.mtu;
+		}
+		rx_buffers.clear();
+		rx_buffers.shrink_to_fit();
+	}
+	uint32_t size;
+	size_t max_datagram;
+	size_t rx_datagram;
+	static constexpr size_t ControlSpace = 64; //<-- (room for a few cmsgs per message)
+
+	std::vector< uint8_t > rx_buffers;
+	std::vector< struct sockaddr_storage > rx_addrs;
+	std::vector< struct iovec > rx_iovs;
+	std::vector< struct mmsghdr > rx_msgs;
+	std::vector< uint8_t > rx_control;
+	std::vector< PacketBuffer * > rx_packets; //with a pool, where rx_iovs point (else empty)
+
+	std::vector< uint8_t > tx_buffers;
+	std::vector< struct sockaddr_storage > tx_addrs;
+	std::vector< struct iovec > tx_iovs;
+	std::vector< struct mmsghdr > tx_msgs;
+	uint32_t tx_count = 0;
+
+	//with GSO, one message per run of queued datagrams (pointing at the run's tx_iovs), and where each run starts:
+	std::vector< struct mmsghdr > gso_msgs;
+	std::vector< uint32_t > gso_first;
+	std::vector< uint8_t > gso_control;
+};
+
+//io_uring backend state: the ring, a multishot recvmsg() picking buffers from its provided-buffer ring, and
+// send slots in one registered buffer (a slot is busy until the kernel is done with it):
+struct DatagramChannel::Ring {
+	static constexpr uint32_t Entries = 256; //submission queue (and send slots)
+	static constexpr uint32_t Completions = 4096;
+	static constexpr uint32_t Buffers = 1024; //receive buffers
+	static constexpr uint16_t BufferGroup = 0;
+	static constexpr size_t ControlSpace = 64; //<-- (room for a receive timestamp, once enabled)
+	static constexpr size_t BufferSize = sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) + ControlSpace + RingDatagram;
+	static constexpr uint64_t ReceiveTag = ~uint64_t(0); //user_data of the receive; sends use their slot index
+
+	Ring() : tx_buffers(size_t(Entries) * RingDatagram), tx_addrs(Entries), uring(Entries, Completions) {
+		for (uint32_t i = Entries; i > 0; --i) free_slots.emplace_back(i - 1);
+		memset(&receive_msg, '\0', sizeof(receive_msg));
+		receive_msg.msg_namelen = sizeof(struct sockaddr_storage);
+		receive_msg.msg_controllen = ControlSpace;
+	}
+	std::vector< uint8_t > tx_buffers;
+	std::vector< struct sockaddr_storage > tx_addrs;
+	std::vector< uint32_t > free_slots;
+	struct msghdr receive_msg; //(multishot receives read the sizes to reserve from this)
+	bool rearm_pending = false; //receive ended, but the submission queue had no room to re-arm it (reap() retries)
+	IOUring uring; //<-- (declared last, so it goes first: closing it finishes with the buffers above)
+};
+
+DatagramChannel::DatagramChannel(EventLoop &loop_, uint16_t port, Backend backend_, bool reuse_port) : loop(loop_), backend(backend_) {
+	//create socket, make it datagram-flavored (and non-blocking, since the loop drives it):
+	sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_UDP);
+	if (sockfd == -1) {
+		throw std::runtime_error(std::string("Error creating socket:\n") + strerror(errno));
+	}
+
+	if (reuse_port) {
+		int one = 1;
+		if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+			int err = errno;
+			close(sockfd);
+			throw std::runtime_error(std::string("Error setting SO_REUSEPORT:\n") + strerror(err));
+		}
+	}
+
+	{ //bind socket to local address:
+		struct sockaddr_in addr;
+		memset(&addr, '\0', sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = INADDR_ANY;
+
+		int ret = bind(sockfd, reinterpret_cast< const sockaddr * >(&addr), sizeof(addr));
+		if (ret != 0) {
+			int err = errno;
+			close(sockfd);
+			throw std::runtime_error(std::string("Error binding socket:\n") + strerror(err));
+		}
+	}
+
+	if (backend == IOUringBackend) {
+		try {
+			ring.reset(new Ring);
+			struct iovec iov;
+			iov.iov_base = ring->tx_buffers.data();
+			iov.iov_len = ring->tx_buffers.size();
+			if (!ring->uring.register_buffers(&iov, 1)) {
+				throw std::runtime_error(std::string("Error registering io_uring buffers:\n") + strerror(errno));
+			}
+			ring->uring.setup_buffer_ring(Ring::BufferGroup, Ring::Buffers, uint32_t(Ring::BufferSize));
+		} catch (...) {
+			close(sockfd);
+			throw;
+		}
+		arm_receive();
+		ring->uring.submit();
+	} else {
+		receive_buffer.resize(MaxDatagram);
+	}
+
+	stun.reset(new STUNClient(*this));
+
+	//(the ring's fd reads as ready when completions are waiting)
+	loop.watch(ring ? ring->uring.fd : sockfd, EPOLLIN, [this](uint32_t) {
+		if (ring) reap();
+		else if (batch) handle_readable_batched();
+		else handle_readable();
+	});
+}
+
+DatagramChannel::DatagramChannel(NetworkSim &network_, uint32_t network_host_, struct sockaddr_storage const &address) : loop(network_.loop()), backend(SyscallBackend),
+	network(&network_), network_host(network_host_), network_address(address) {
+	//(no socket and nothing to watch: the simulation calls dispatch() directly)
+	stun.reset(new STUNClient(*this));
+}
+
+DatagramChannel::~DatagramChannel() {
+	packer.reset(); //<-- (queues whatever it was holding)
+	fec.reset(); //<-- (queues its open blocks' parity)
+	//NOTE: a flush still deferred on the loop would outlive us -- so send now:
+	if (batch) flush();
+	keepalive.reset();
+	latency.reset();
+	demux.reset();
+	crypto.reset();
+	address_race.reset();
+	own_resolver.reset();
+	stun.reset(); //<-- cancels timers for outstanding transactions
+	if (rx_packet) rx_packet->release();
+	if (network) {
+		network->remove(*this);
+		return;
+	}
+	if (ring) {
+		loop.unwatch(ring->uring.fd);
+		ring->uring.submit(); //<-- (sends still queued)
+		ring.reset();
+	} else {
+		loop.unwatch(sockfd);
+	}
+	close(sockfd);
+}
+
+uint32_t DatagramChannel::random_seed() {
+	if (network) return network->random_seed();
+	return std::random_device()();
+}
+
+bool DatagramChannel::send_to(struct sockaddr const *to, socklen_t to_len, uint8_t const *data, size_t size) {
+	struct sockaddr_storage storage;
+	if (keepalive || ring || network || crypto) {
+		memset(&storage, '\0', sizeof(storage));
+		memcpy(&storage, to, std::min< size_t >(to_len, sizeof(storage)));
+	}
+	if (keepalive) keepalive->sent(storage);
+	PacketCrypto::Keys *keys = (crypto ? crypto->sealing(storage, data, size) : nullptr);
+	if (ring) {
+		if (!ring_send(storage, data, size, keys)) return false;
+		ring->uring.submit();
+		return true;
+	}
+	if (keys) {
+		//(sealed into a scratch buffer, in place of the copy sendto() makes anyway)
+		data = crypto->seal_to_scratch(*keys, data, size);
+		if (!size) {
+			errno = EKEYEXPIRED;
+			if (metrics) metrics->send_drops.add();
+			return false;
+		}
+	}
+	if (network) {
+		if (!network->send(*this, storage, data, size)) {
+			if (metrics) metrics->send_drops.add();
+			return false;
+		}
+		if (metrics) {
+			metrics->packets_out.add();
+			metrics->bytes_out.add(size);
+		}
+		return true;
+	}
+	ssize_t sent = sendto(sockfd, data, size, 0, to, to_len);
+	if (sent < 0) {
+		assert(sent == -1);
+		if (metrics) metrics->send_drops.add();
+		return false;
+	}
+	assert((size_t)sent == size);
+	if (metrics) {
+		metrics->packets_out.add();
+		metrics->bytes_out.add(size);
+	}
+	return true;
+}
+
+bool DatagramChannel::send_to(struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	return send_to(reinterpret_cast< struct sockaddr const * >(&to), address_length(to), data, size);
+}
+
+void DatagramChannel::enable_batching(uint32_t batch_size, size_t max_datagram) {
+	if (batch_size == 0 || max_datagram == 0) {
+		throw std::runtime_error("DatagramChannel: batch size and max datagram size must be positive.");
+	}
+	if (ring) {
+		throw std::runtime_error("DatagramChannel: the io_uring backend always batches; enable_batching() is for the syscall backend.");
+	}
+	if (network) {
+		throw std::runtime_error("DatagramChannel: simulated channels have no syscalls to batch.");
+	}
+	if (batch) flush();
+	batch.reset(new Batch(batch_size, max_datagram, gro ? MaxDatagram : max_datagram));
+	if (pool) batch->use_pool(*pool);
+}
+
+bool DatagramChannel::enable_offload() {
+	if (ring || network) return false; //<-- (not wired up for the io_uring backend; nothing to offload when simulated)
+	if (!batch) enable_batching();
+	//(setting the segment size to 0 changes nothing, but fails on kernels without UDP GSO)
+	int zero = 0, one = 1;
+	gso = (setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &zero, sizeof(zero)) == 0);
+	gro = (!pool && setsockopt(sockfd, SOL_UDP, UDP_GRO, &one, sizeof(one)) == 0); //<-- (a pool's buffers each take one datagram)
+	if (gro) enable_batching(batch->size, batch->max_datagram); //<-- (for bigger receive buffers)
+	return gso || gro;
+}
+
+bool DatagramChannel::queue_to(struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	PacketCrypto::Keys *keys = (crypto ? crypto->sealing(to, data, size) : nullptr);
+	if (ring) {
+		if (!ring_send(to, data, size, keys)) return false;
+		if (!flush_deferred) {
+			flush_deferred = true;
+			std::weak_ptr< bool > alive_(alive);
+			loop.defer([this, alive_]() {
+				if (alive_.expired()) return;
+				flush_deferred = false;
+				flush();
+			});
+		}
+		return true;
+	}
+	if (!batch) return send_to(to, data, size);
+	size_t wire = size + (keys ? PacketCrypto::Overhead : 0);
+	if (wire > batch->max_datagram) {
+		errno = EMSGSIZE;
+		if (metrics) metrics->send_drops.add();
+		return false;
+	}
+	//batch full? send it to make room (what became of the datagrams already in it isn't this one's business):
+	if (batch->tx_count == batch->size) flush();
+	if (batch->tx_count == batch->size) {
+		errno = ENOBUFS;
+		if (metrics) metrics->send_drops.add();
+		return false;
+	}
+
+	if (keepalive) keepalive->sent(to);
+
+	uint32_t i = batch->tx_count;
+	uint8_t *slot = reinterpret_cast< uint8_t * >(batch->tx_iovs[i].iov_base);
+	if (keys) {
+		//(sealed straight into the batch buffer -- the same one pass as copying it there)
+		size = crypto->seal(*keys, data, size, slot);
+		if (!size) {
+			errno = EKEYEXPIRED;
+			if (metrics) metrics->send_drops.add();
+			return false;
+		}
+	} else {
+		memcpy(slot, data, size);
+	}
+	batch->tx_count += 1;
+	batch->tx_iovs[i].iov_len = size;
+	batch->tx_addrs[i] = to;
+	batch->tx_msgs[i].msg_hdr.msg_namelen = address_length(to);
+	//(counted in packets_out / bytes_out by flush(), once it's known whether it went)
+
+	if (!flush_deferred) {
+		flush_deferred = true;
+		std::weak_ptr< bool > alive_(alive);
+		loop.defer([this, alive_]() {
+			if (alive_.expired()) return; //<-- channel was destroyed (and flushed) first
+			flush_deferred = false;
+			flush();
+		});
+	}
+	return true;
+}
+
+//sendmmsg() all of 'msgs'; returns how many could not be sent (they are dropped; errno is set by the last failure),
+// adding their size to 'dropped_bytes':
+static uint32_t send_all(int sockfd, struct mmsghdr *msgs, uint32_t count, size_t &dropped_bytes) {
+	uint32_t sent = 0;
+	uint32_t dropped = 0;
+	while (sent < count) {
+		int ret = sendmmsg(sockfd, msgs + sent, count - sent, 0);
+		if (ret < 0) {
+			assert(ret == -1);
+			//the failing datagram is the one at 'sent'; drop it (like a lost packet) and carry on with the rest:
+			if (errno == EINTR) continue;
+			dropped += 1;
+			dropped_bytes += msgs[sent].msg_hdr.msg_iov[0].iov_len;
+			ret = 1;
+		}
+		sent += ret;
+	}
+	return dropped;
+}
+
+bool DatagramChannel::flush() {
+	if (ring) {
+		int ret = ring->uring.submit();
+		if (ret < 0) {
+			errno = -ret;
+			return false;
+		}
+		return true;
+	}
+	if (!batch) return true;
+	Batch &b = *batch;
+	uint32_t dropped = 0;
+	size_t dropped_bytes = 0;
+	//what did go out is counted here, rather than when queued, so a drop is never also counted as sent:
+	auto count = [&]() {
+		if (metrics) {
+			size_t bytes = 0;
+			for (uint32_t i = 0; i < b.tx_count; ++i) bytes += b.tx_iovs[i].iov_len;
+			metrics->packets_out.add(b.tx_count - dropped);
+			metrics->bytes_out.add(bytes - dropped_bytes);
+			if (dropped) metrics->send_drops.add(dropped);
+		}
+		b.tx_count = 0;
+	};
+	if (!gso) {
+		dropped = send_all(sockfd, b.tx_msgs.data(), b.tx_count, dropped_bytes);
+		count();
+		return dropped == 0;
+	}
+
+	//runs of same-sized datagrams to one destination (the last may be shorter) go out as one message,
+	// which the kernel (or the NIC) cuts back up at the UDP_SEGMENT size:
+	uint32_t runs = 0;
+	for (uint32_t i = 0; i < b.tx_count; ) {
+		size_t segment = b.tx_iovs[i].iov_len;
+		size_t total = segment;
+		uint32_t n = 1;
+		while (i + n < b.tx_count && n < MaxSegments) {
+			size_t next = b.tx_iovs[i + n].iov_len;
+			if (next > segment || total + next > MaxSegmentedBytes || !same_address(b.tx_addrs[i + n], b.tx_addrs[i])) break;
+			total += next;
+			n += 1;
+			if (next < segment) break; //<-- a short one ends the run
+		}
+		struct msghdr &hdr = b.gso_msgs[runs].msg_hdr;
+		hdr.msg_name = &b.tx_addrs[i];
+		hdr.msg_namelen = b.tx_msgs[i].msg_hdr.msg_namelen;
+		hdr.msg_iov = &b.tx_iovs[i];
+		hdr.msg_iovlen = n;
+		if (n > 1) {
+			hdr.msg_control = &b.gso_control[runs * Batch::ControlSpace];
+			hdr.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+			struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+			cmsg->cmsg_level = SOL_UDP;
+			cmsg->cmsg_type = UDP_SEGMENT;
+			cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+			uint16_t size = uint16_t(segment);
+			memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+		} else {
+			hdr.msg_control = nullptr;
+			hdr.msg_controllen = 0;
+		}
+		b.gso_first[runs] = i;
+		runs += 1;
+		i += n;
+	}
+
+	uint32_t sent = 0;
+	while (sent < runs) {
+		int ret = sendmmsg(sockfd, &b.gso_msgs[sent], runs - sent, 0);
+		if (ret < 0) {
+			assert(ret == -1);
+			if (errno == EINTR) continue;
+			uint32_t n = uint32_t(b.gso_msgs[sent].msg_hdr.msg_iovlen);
+			if (n > 1) {
+				//segmentation refused -- EIO: the device can't (so stop asking); EMSGSIZE / EINVAL: e.g., segments
+				// bigger than the route's MTU -- so send the run datagram by datagram instead:
+				if (errno == EIO) gso = false;
+				gso_fallbacks += 1;
+				dropped += send_all(sockfd, &b.tx_msgs[b.gso_first[sent]], n, dropped_bytes);
+			} else {
+				dropped += 1; //<-- (as above)
+				dropped_bytes += b.tx_iovs[b.gso_first[sent]].iov_len;
+			}
+			ret = 1;
+		}
+		sent += ret;
+	}
+	count();
+	return dropped == 0;
+}
+
+void DatagramChannel::enable_packing(uint32_t flush_ms) {
+	packer.reset(new MessagePacker(*this, flush_ms));
+}
+
+void DatagramChannel::enable_fec(uint32_t block_size, uint32_t flush_ms) {
+	fec.reset(new FECCoder(*this, block_size, flush_ms));
+}
+
+void DatagramChannel::enable_packet_pool(PacketPool &pool_) {
+	if (ring) {
+		throw std::runtime_error("DatagramChannel: packet pools are for the syscall backend (io_uring receives into its own buffers).");
+	}
+	if (network) {
+		throw std::runtime_error("DatagramChannel: simulated channels have no socket to receive into packet pools from.");
+	}
+	if (gro) {
+		throw std::runtime_error("DatagramChannel: packet pools don't mix with GRO.");
+	}
+	if (pool) {
+		throw std::runtime_error("DatagramChannel: packet pool already set.");
+	}
+	rx_packet = pool_.acquire();
+	if (!rx_packet) {
+		throw std::runtime_error("DatagramChannel: packet pool is empty.");
+	}
+	pool = &pool_;
+	if (batch) batch->use_pool(*pool);
+}
+
+bool DatagramChannel::enable_timestamps() {
+	if (network) return false;
+	int one = 1;
+	if (!kernel_timestamps) kernel_timestamps = (setsockopt(sockfd, SOL_SOCKET, SO_TIMESTAMPNS, &one, sizeof(one)) == 0);
+	return kernel_timestamps;
+}
+
+void DatagramChannel::enable_latency_tracking(uint32_t interval_ms) {
+	enable_timestamps(); //<-- (without them, arrival times are when the loop read the datagram)
+	latency.reset(new LatencyTracker(*this, interval_ms));
+}
+
+void DatagramChannel::enable_encryption() {
+	if (!crypto) crypto.reset(new PacketCrypto(*this));
+}
+
+void DatagramChannel::enable_demux() {
+	if (!demux) demux.reset(new PeerDemux(*this));
+}
+
+void DatagramChannel::enable_metrics(Metrics &registry, std::string const &name) {
+	metrics = registry.add(name);
+}
+
+void DatagramChannel::enable_keepalive(uint32_t coalesce_ms) {
+	keepalive.reset(new KeepaliveScheduler(*this, coalesce_ms));
+}
+
+uint32_t DatagramChannel::queued() const {
+	if (ring) return ring->uring.pending();
+	return batch ? batch->tx_count : 0;
+}
+
+//------ io_uring backend ------
+
+void DatagramChannel::arm_receive() {
+	struct io_uring_sqe *sqe = ring->uring.get_sqe();
+	if (!sqe) {
+		ring->uring.submit();
+		sqe = ring->uring.get_sqe();
+	}
+	if (!sqe) {
+		//(the kernel didn't take the queue -- e.g., EBUSY with completions backed up -- so try again once they're reaped)
+		ring->rearm_pending = true;
+		return;
+	}
+	ring->rearm_pending = false;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = sockfd;
+	sqe->addr = reinterpret_cast< uint64_t >(&ring->receive_msg);
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = Ring::BufferGroup;
+	sqe->user_data = Ring::ReceiveTag;
+}
+
+bool DatagramChannel::ring_send(struct sockaddr_storage const &to, uint8_t const *data, size_t size, PacketCrypto::Keys *keys) {
+	if (size + (keys ? PacketCrypto::Overhead : 0) > RingDatagram) {
+		errno = EMSGSIZE;
+		if (metrics) metrics->send_drops.add();
+		return false;
+	}
+	if (keepalive) keepalive->sent(to);
+	//copy (or seal) into the next free slot, or -- with none free -- seal into scratch for a direct send:
+	uint8_t *buffer = nullptr;
+	if (!ring->free_slots.empty()) {
+		buffer = &ring->tx_buffers[size_t(ring->free_slots.back()) * RingDatagram];
+		if (keys) size = crypto->seal(*keys, data, size, buffer);
+		else memcpy(buffer, data, size);
+		data = buffer;
+	} else if (keys) {
+		data = crypto->seal_to_scratch(*keys, data, size);
+	}
+	if (keys && !size) {
+		errno = EKEYEXPIRED;
+		if (metrics) metrics->send_drops.add();
+		return false;
+	}
+	//(counted in packets_out / bytes_out once sent: below, or by reap() from the completion)
+	struct io_uring_sqe *sqe = nullptr;
+	if (buffer) {
+		sqe = ring->uring.get_sqe();
+		if (!sqe && ring->uring.submit() >= 0) sqe = ring->uring.get_sqe();
+	}
+	if (!sqe) {
+		//every slot still busy: rather than wait on completions (which would mean handling receives from
+		// inside whatever callback is sending), just send this one directly:
+		ring_direct_sends += 1;
+		ssize_t sent = sendto(sockfd, data, size, 0, reinterpret_cast< struct sockaddr const * >(&to), address_length(to));
+		if (metrics) {
+			if (sent < 0) {
+				metrics->send_drops.add();
+			} else {
+				metrics->packets_out.add();
+				metrics->bytes_out.add(size_t(sent));
+			}
+		}
+		return sent >= 0;
+	}
+	uint32_t slot = ring->free_slots.back();
+	ring->free_slots.pop_back();
+	ring->tx_addrs[slot] = to;
+
+	if (ring_zero_copy) {
+		//straight out of the registered buffer; the slot comes back with the kernel's notification:
+		sqe->opcode = IORING_OP_SEND_ZC;
+		sqe->ioprio = IORING_RECVSEND_FIXED_BUF;
+		sqe->buf_index = 0;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+	}
+	sqe->fd = sockfd;
+	sqe->addr = reinterpret_cast< uint64_t >(buffer);
+	sqe->len = uint32_t(size);
+	sqe->addr2 = reinterpret_cast< uint64_t >(&ring->tx_addrs[slot]);
+	sqe->addr_len = uint16_t(address_length(to));
+	sqe->user_data = slot;
+	return true;
+}
+
+void DatagramChannel::reap() {
+	Ring &r = *ring;
+	bool rearm = false;
+	int64_t offset_us = (kernel_timestamps ? realtime_offset_us() : 0);
+	//(the whole batch of completions is released at once, after this)
+	r.uring.reap([&](struct io_uring_cqe const &cqe) {
+		if (cqe.user_data != Ring::ReceiveTag) {
+			//a send: the first completion has the result; with IORING_CQE_F_MORE (zero-copy), a notification
+			// follows once the kernel is done with the buffer:
+			if (!(cqe.flags & IORING_CQE_F_NOTIF)) {
+				if (cqe.res < 0) {
+					ring_send_errors += 1;
+					if (metrics) metrics->send_drops.add();
+				} else if (metrics) {
+					metrics->packets_out.add();
+					metrics->bytes_out.add(size_t(cqe.res));
+				}
+			}
+			if (!(cqe.flags & IORING_CQE_F_MORE)) r.free_slots.emplace_back(uint32_t(cqe.user_data));
+			return;
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) rearm = true; //<-- (multishot ended: e.g., ran out of buffers)
+		if (!(cqe.flags & IORING_CQE_F_BUFFER)) return;
+		uint16_t id = uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		uint8_t *buffer = r.uring.buffer(id);
+		struct io_uring_recvmsg_out out;
+		memcpy(&out, buffer, sizeof(out));
+		if (cqe.res >= 0 && (out.flags & MSG_TRUNC)) {
+			truncated += 1;
+			if (metrics) metrics->truncated.add();
+		} else if (cqe.res >= 0) {
+			struct sockaddr_storage from;
+			memset(&from, '\0', sizeof(from));
+			memcpy(&from, buffer + sizeof(out), std::min< size_t >(out.namelen, sizeof(from)));
+			if (kernel_timestamps) {
+				//(the control messages sit between the name and the payload; a stand-in header lets CMSG_* walk them)
+				struct msghdr hdr;
+				memset(&hdr, '\0', sizeof(hdr));
+				hdr.msg_control = buffer + sizeof(out) + r.receive_msg.msg_namelen;
+				hdr.msg_controllen = out.controllen;
+				receive_us = receive_timestamp(&hdr, offset_us);
+			}
+			uint8_t const *data = buffer + sizeof(out) + r.receive_msg.msg_namelen + r.receive_msg.msg_controllen;
+			dispatch(from, data, out.payloadlen);
+			receive_us = 0;
+		}
+		r.uring.recycle(id);
+	});
+	r.uring.publish_buffers();
+	if (rearm || r.rearm_pending) arm_receive();
+	r.uring.submit(); //<-- (the re-arm, plus anything the callbacks sent)
+}
+
+struct sockaddr_storage DatagramChannel::local_address() const {
+	if (network) return network_address;
+	struct sockaddr_storage addr;
+	memset(&addr, '\0', sizeof(addr));
+	socklen_t addrlen = sizeof(addr);
+	if (getsockname(sockfd, reinterpret_cast< sockaddr * >(&addr), &addrlen) != 0) {
+		throw std::runtime_error(std::string("Error getting socket name:\n") + strerror(errno));
+	}
+	return addr;
+}
+
+std::string DatagramChannel::what_is_my_address() {
+	if (!have_mapped_address && address_cache) {
+		MappedAddressCache::Entry const *entry = address_cache->find(local_address());
+		uint64_t now = uint64_t(std::time(nullptr));
+		if (entry && entry->timestamp <= now && now - entry->timestamp <= address_cache_max_age_s) {
+			mapped_address = entry->mapped;
+			have_mapped_address = true;
+		}
+	}
+	//(if answering from the cache, this confirms it in the background -- server names resolve asynchronously, so nothing waits)
+	if (!mapped_address_confirmed) check_address();
+	return (have_mapped_address ? address_to_string(mapped_address) : std::string());
+}
+
+DNSResolver &DatagramChannel::dns() {
+	if (resolver) return *resolver;
+	if (!own_resolver) own_resolver.reset(new DNSResolver(loop));
+	return *own_resolver;
+}
+
+void DatagramChannel::check_address() {
+	if (!address_race) address_race.reset(new STUNServerRace(*this));
+	if (address_race->running()) return;
+	address_race->stats = stun_stats;
+	address_race->start(stun_servers, [this](STUNServerRace::Result const &result) {
+		on_address_result(result);
+	});
+}
+
+void DatagramChannel::on_address_result(STUNServerRace::Result const &result) {
+	bool changed = false;
+	if (result.ok) {
+		changed = !(have_mapped_address && same_address(mapped_address, result.mapped));
+		mapped_address = result.mapped;
+		have_mapped_address = true;
+		mapped_address_confirmed = true;
+
+		if (address_cache) {
+			MappedAddressCache::Entry entry;
+			entry.mapped = result.mapped;
+			entry.server = result.server;
+			entry.timestamp = uint64_t(std::time(nullptr));
+			address_cache->update(local_address(), entry);
+			if (!address_cache_file.empty()) {
+				try {
+					address_cache->save(address_cache_file);
+				} catch (std::exception &e) {
+					std::cerr << e.what() << std::endl; //<-- (the cache is just an optimization; carry on)
+				}
+			}
+		}
+	}
+	//(copy, so listeners can add / remove listeners)
+	std::vector< AddressListener > listeners(address_listeners.begin(), address_listeners.end());
+	for (auto const &listener : listeners) listener(result, changed);
+}
+
+void DatagramChannel::dispatch(struct sockaddr_storage const &from, uint8_t const *data, size_t size, PacketBuffer **packet) {
+	if (metrics) {
+		metrics->packets_in.add();
+		metrics->bytes_in.add(size);
+		metrics->datagram_bytes.record(size);
+	}
+	DatagramKind kind = classify_datagram(data, size);
+	if (crypto && kind != STUNDatagram) {
+		if (kind == SealedDatagram) {
+			//(receive buffers are all the channel's own, so the datagram is opened right where it landed)
+			if (!crypto->open(from, const_cast< uint8_t * >(data), size)) return;
+			kind = classify_datagram(data, size); //<-- (a payload that itself looks sealed just goes on as it is)
+		} else if (crypto->refuses_cleartext(from)) {
+			crypto->cleartext_drops += 1;
+			return;
+		}
+	}
+	switch (kind) {
+	case STUNDatagram:
+		if (stun->handle(from, data, size)) return;
+		if (stun_read_u16(data) == STUN_BINDING_INDICATION) return; //<-- a peer's keepalive
+		if (stun_read_u16(data) == STUN_BINDING_REQUEST && on_binding_request && on_binding_request(from, data, size)) return;
+		break;
+	case StreamDatagram:
+		if (!streams.empty() && ReliableStream::route(*this, from, data, size)) return;
+		break;
+	case LatencyDatagram:
+		if (latency && latency->handle(from, data, size)) return;
+		break;
+	case PackedDatagram:
+		if (packer && packer->handle(from, data, size)) return;
+		break;
+	case FECDatagram:
+		if (fec && fec->handle(from, data, size)) return;
+		break;
+	default:
+		break;
+	}
+	if (demux && demux->route(from, data, size)) return;
+	if (packet && on_packet) {
+		//hand the buffer over whole, and receive into a fresh one from now on -- if there is one:
+		PacketBuffer *replacement = pool->acquire();
+		if (!replacement) {
+			pool_drops += 1;
+			if (metrics) metrics->receive_drops.add();
+			return;
+		}
+		PacketBuffer *full = *packet;
+		*packet = replacement;
+		full->size = uint32_t(size);
+		full->from = from;
+		on_packet(full);
+		return;
+	}
+	if (on_receive) on_receive(from, data, size);
+	else if (metrics) metrics->receive_drops.add();
+}
+
+void DatagramChannel::deliver(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	if (demux && demux->route(from, data, size)) return;
+	if (on_receive) on_receive(from, data, size);
+}
+
+void DatagramChannel::handle_readable() {
+	int64_t offset_us = (kernel_timestamps ? realtime_offset_us() : 0);
+	//read a bounded number of datagrams per wakeup so other fds + timers get a turn:
+	for (uint32_t count = 0; count < 64; ++count) {
+		struct sockaddr_storage src_addr;
+
+		uint8_t *buffer = (rx_packet ? rx_packet->data() : receive_buffer.data());
+		size_t capacity = (rx_packet ? pool->mtu : receive_buffer.size());
+		struct iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = capacity;
+		alignas(struct cmsghdr) uint8_t control[64];
+		struct msghdr hdr;
+		memset(&hdr, '\0', sizeof(hdr));
+		hdr.msg_name = &src_addr;
+		hdr.msg_namelen = sizeof(src_addr);
+		hdr.msg_iov = &iov;
+		hdr.msg_iovlen = 1;
+		if (kernel_timestamps) {
+			hdr.msg_control = control;
+			hdr.msg_controllen = sizeof(control);
+		}
+		//(with MSG_TRUNC, the result is the datagram's real size, even if it didn't fit)
+		ssize_t got = recvmsg(sockfd, &hdr, MSG_TRUNC);
+
+		if (got < 0) {
+			assert(got == -1); //other negative results not specified behavior
+			//EAGAIN: drained; anything else (e.g., ICMP-induced ECONNREFUSED) is per-datagram, so also stop for now
+			return;
+		}
+		if (size_t(got) > capacity) {
+			truncated += 1;
+			if (metrics) metrics->truncated.add();
+			continue;
+		}
+
+		if (kernel_timestamps) receive_us = receive_timestamp(&hdr, offset_us);
+		dispatch(src_addr, buffer, size_t(got), rx_packet ? &rx_packet : nullptr);
+		receive_us = 0;
+	}
+}
+
+void DatagramChannel::handle_readable_batched() {
+	Batch &b = *batch;
+	int64_t offset_us = (kernel_timestamps ? realtime_offset_us() : 0);
+	//read a bounded number of batches per wakeup so other fds + timers get a turn:
+	for (uint32_t round = 0; round < 4; ++round) {
+		for (uint32_t i = 0; i < b.size; ++i) {
+			b.rx_msgs[i].msg_hdr.msg_namelen = sizeof(b.rx_addrs[i]);
+			b.rx_msgs[i].msg_hdr.msg_flags = 0;
+			if (gro || kernel_timestamps) {
+				b.rx_msgs[i].msg_hdr.msg_control = &b.rx_control[i * Batch::ControlSpace];
+				b.rx_msgs[i].msg_hdr.msg_controllen = Batch::ControlSpace;
+			}
+		}
+		int got = recvmmsg(sockfd, b.rx_msgs.data(), b.size, MSG_DONTWAIT, nullptr);
+		if (got <= 0) break; //drained (or a per-datagram error, as above)
+
+		for (int i = 0; i < got; ++i) {
+			struct msghdr &hdr = b.rx_msgs[i].msg_hdr;
+			if (hdr.msg_flags & MSG_TRUNC) {
+				truncated += 1;
+				if (metrics) metrics->truncated.add();
+				continue;
+			}
+			uint8_t const *data = reinterpret_cast< uint8_t const * >(b.rx_iovs[i].iov_base);
+			size_t size = b.rx_msgs[i].msg_len;
+			//GRO may have coalesced several same-sized datagrams from this sender; hand them over one by one, in place:
+			size_t segment = size;
+			if (gro) {
+				for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+					if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+						int value;
+						memcpy(&value, CMSG_DATA(cmsg), sizeof(value));
+						if (value > 0) segment = size_t(value);
+					}
+				}
+			}
+			//(coalesced segments share one timestamp: the last one's arrival)
+			if (kernel_timestamps) receive_us = receive_timestamp(&hdr, offset_us);
+			if (!b.rx_packets.empty()) {
+				dispatch(b.rx_addrs[i], data, size, &b.rx_packets[i]);
+				receive_us = 0;
+				if (batch.get() != &b) return; //<-- batching reconfigured from inside a callback
+				b.rx_iovs[i].iov_base = b.rx_packets[i]->data(); //<-- (in case it was handed over)
+				continue;
+			}
+			for (size_t at = 0; at < size; at += segment) {
+				dispatch(b.rx_addrs[i], data + at, std::min(segment, size - at));
+				if (batch.get() != &b) { receive_us = 0; return; } //<-- batching reconfigured from inside a callback
+			}
+			receive_us = 0;
+		}
+		if (uint32_t(got) < b.size) break;
+	}
+}
+
+//------ PendingFlush ------
+
+void PendingFlush::schedule(DatagramChannel &channel_, uint32_t delay_ms, std::function< void() > const &send) {
+	if (scheduled()) return;
+	channel = &channel_;
+	if (delay_ms != 0) {
+		timer = channel->loop.after(delay_ms, [this, send]() {
+			timer = 0;
+			send();
+		});
+		return;
+	}
+	deferred = std::make_shared< bool >(true);
+	std::weak_ptr< bool > alive_(deferred);
+	channel->loop.defer([this, alive_, send]() {
+		if (alive_.expired()) return; //<-- called off (or its owner is gone)
+		deferred.reset();
+		DatagramChannel &c = *channel;
+		send();
+		//(this runs with the loop's other end-of-turn work, so don't wait another turn for the channel's flush)
+		if (c.queued()) c.flush();
+	});
+}
+
+void PendingFlush::cancel() {
+	if (timer) {
+		channel->loop.cancel(timer);
+		timer = 0;
+	}
+	deferred.reset();
+}
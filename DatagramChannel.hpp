@@ -13,15 +13,295 @@
  *  (1) "reserve" an address (initiates STUN request, gets own info)
  *  (2) "connect" address to endpoint (gets others' info)
  *  (3) [alt] "listen" for connections from others
+ * (ICEAgent.hpp does (2) with candidate exchange + connectivity checks.)
+ *
+ * A channel owns one non-blocking UDP socket, driven by an EventLoop.
+ * The I/O backend is picked at construction: plain syscalls (epoll says the
+ * socket is readable, then recvmsg / recvmmsg), or io_uring (IOUring.hpp):
+ * one multishot recvmsg() fills buffers from a provided-buffer ring, sends
+ * are submitted from preallocated (registered) slots, and completions are
+ * reaped in batches whenever the ring's fd turns readable. Everything else (callbacks,
+ * queue_to() / flush(), STUN, streams, ...) behaves the same either way.
+ * Received STUN responses to our own requests are handled by 'stun';
+ * everything else is handed to on_receive.
+ *
+ * By default each datagram costs one recvmsg()/sendto(). enable_batching()
+ * switches to recvmmsg() into preallocated buffers (up to batch_size datagrams
+ * per syscall), and lets queue_to() gather outgoing datagrams for one
+ * sendmmsg() per loop turn. enable_offload() goes further, where the kernel
+ * supports it: runs of same-sized queued datagrams to one peer leave as one
+ * UDP GSO super-datagram, and GRO-coalesced ones are split back up in place on
+ * receive. (udp-bench compares all of these.)
+ *
+ * Incoming STUN Binding Indications (keepalives) are dropped silently, and
+ * packets for ReliableStreams are routed to them.
+ *
+ * enable_packing() sizes datagrams to the path MTU: packer->send() coalesces
+ * small messages and fragments big ones (see MessagePacker.hpp).
+ *
+ * enable_fec() adds parity to datagrams sent through fec->send(), so the
+ * peer can rebuild lost ones without waiting a round trip (see FECCoder.hpp).
+ *
+ * enable_packet_pool() receives straight into PacketPool buffers and hands
+ * the application's datagrams over whole (on_packet), e.g. to pass on to
+ * worker threads through SPSCRings without copying (see PacketPool.hpp).
+ *
+ * enable_demux() routes application datagrams to per-peer PeerChannels (by
+ * source address or connection ID), so one socket serves many peers (see
+ * PeerDemux.hpp).
+ *
+ * enable_encryption() seals everything but STUN to / from peers with a key
+ * (AES-128-GCM or ChaCha20-Poly1305, with a replay window; see
+ * PacketCrypto.hpp).
+ *
+ * enable_latency_tracking() keeps RTT / jitter numbers per peer from a
+ * timestamp echo, timed by the kernel's receive timestamps (see
+ * LatencyTracker.hpp).
+ *
+ * enable_metrics() counts traffic, drops, errors, and RTTs into a Metrics
+ * registry (see Metrics.hpp), which any thread can export.
+ *
+ * Channels can also be simulated, with no socket at all: NetworkSim::add_host()
+ * makes ones whose datagrams cross a simulated network (see NetworkSim.hpp).
  *
  */
 
+#include "EventLoop.hpp" //(for EventLoop::TimerID)
+#include "PacketCrypto.hpp" //(for PacketCrypto::Keys)
+#include "STUNServerRace.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct EventLoop;
+struct STUNClient;
+struct MappedAddressCache;
+struct KeepaliveScheduler;
+struct ReliableStream;
+struct MessagePacker;
+struct FECCoder;
+struct Metrics;
+struct ChannelMetrics;
+struct PacketPool;
+struct PacketBuffer;
+struct LatencyTracker;
+struct PeerDemux;
+struct NetworkSim;
+struct DNSResolver;
 
 struct DatagramChannel {
-	//Construct channel given remote address:
-	DatagramChannel(std::string address, uint16_t port = 0);
+	enum Backend : uint8_t { SyscallBackend, IOUringBackend };
+
+	//Construct channel with a socket bound to local port (0 = any port); throws on error
+	// (including if the io_uring backend was asked for but the kernel won't set up a ring).
+	// With reuse_port, the socket is bound with SO_REUSEPORT, to share the port (see ShardedListener.hpp):
+	DatagramChannel(EventLoop &loop, uint16_t port = 0, Backend backend = SyscallBackend, bool reuse_port = false);
+	//Simulated channel (no socket) for host 'network_host' of 'network', at 'address' -- see NetworkSim::add_host():
+	DatagramChannel(NetworkSim &network, uint32_t network_host, struct sockaddr_storage const &address);
+	~DatagramChannel();
+	DatagramChannel(DatagramChannel const &) = delete;
+	DatagramChannel &operator=(DatagramChannel const &) = delete;
+
+	EventLoop &loop;
+	Backend const backend;
+	int sockfd = -1; //(-1 if simulated)
+
+	//if simulated, the network carrying this channel's datagrams:
+	NetworkSim *network = nullptr;
+	uint32_t network_host = 0;
+	struct sockaddr_storage network_address;
+
+	//seed for this channel's (and its helpers') random number generators -- from the simulation's, if simulated, so runs replay:
+	uint32_t random_seed();
+
+	//STUN transactions (binding requests) on this channel's socket:
+	std::unique_ptr< STUNClient > stun;
+
+	//called for each received datagram that isn't a response to one of our STUN requests:
+	// (data is only valid during the call)
+	std::function< void(struct sockaddr_storage const &from, uint8_t const *data, size_t size) > on_receive;
+
+	//if set, called first for incoming STUN binding requests (e.g., ICE connectivity checks -- see ICEAgent.hpp);
+	// return true if the request was dealt with, false to hand it on to on_receive:
+	std::function< bool(struct sockaddr_storage const &from, uint8_t const *data, size_t size) > on_binding_request;
+
+	//send a datagram; returns false (with errno set) on failure:
+	bool send_to(struct sockaddr const *to, socklen_t to_len, uint8_t const *data, size_t size);
+	bool send_to(struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+
+	//------ io_uring backend ------
+	//datagrams bigger than this are dropped (counted in 'truncated') or refused (EMSGSIZE):
+	static constexpr size_t RingDatagram = 2048;
+	//send zero-copy from the registered slots (IORING_OP_SEND_ZC)? Only pays off for big datagrams on real NICs: each
+	// one pins a whole page, which (e.g., over loopback) also counts against the receiver's socket buffer:
+	bool ring_zero_copy = false;
+	uint64_t ring_send_errors = 0; //(send results only arrive later, so failures are just counted)
+	uint64_t ring_direct_sends = 0; //sent with plain sendto() because every send slot was busy
+
+	//------ batched I/O ------
+	//receive up to 'batch_size' datagrams per syscall; datagrams bigger than 'max_datagram' are dropped (and counted in 'truncated')
+	// (syscall backend only -- throws with io_uring, which always batches):
+	void enable_batching(uint32_t batch_size = 32, size_t max_datagram = 2048);
+
+	//queue a datagram for the next flush(); queued datagrams are flushed at the end of each loop turn,
+	// or right away once batch_size are waiting. (Without batching, same as send_to.)
+	bool queue_to(struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	//send everything queued now; returns false (with errno set) if some datagrams could not be sent (they are dropped):
+	bool flush();
+	uint32_t queued() const;
+
+	uint64_t truncated = 0;
+
+	//------ segmentation offload ------
+	//on top of batching (enabled first, if need be): use UDP GSO for sends and GRO for receives, as far as the
+	// kernel supports them; returns false if it supports neither (the channel then just stays batched), or with io_uring:
+	bool enable_offload();
+	bool gso = false; //(turned back off if the kernel later refuses to segment)
+	bool gro = false;
+	uint64_t gso_fallbacks = 0; //runs the kernel wouldn't segment, sent datagram by datagram instead
+
+	static constexpr uint32_t MaxSegments = 64; //<-- kernel's UDP_MAX_SEGMENTS
+	static constexpr size_t MaxSegmentedBytes = 65507; //<-- biggest IPv4 UDP payload
+
+	//reliable streams riding on this channel (see ReliableStream.hpp; streams add / remove themselves):
+	std::vector< ReliableStream * > streams;
+
+	//------ path MTU + message packing ------
+	//find each peer's path MTU and send messages through packer->send() to have them packed / fragmented to fit
+	// (the peer needs packing enabled too; unpacked messages arrive through on_receive):
+	void enable_packing(uint32_t flush_ms = 0);
+	std::unique_ptr< MessagePacker > packer;
+
+	//------ forward error correction ------
+	//send latency-critical datagrams through fec->send() to have blocks of them followed by parity, from which the peer
+	// rebuilds lost ones without a round trip (see FECCoder.hpp; the peer needs FEC enabled too):
+	void enable_fec(uint32_t block_size = 8, uint32_t flush_ms = 0);
+	std::unique_ptr< FECCoder > fec;
+
+	//------ packet pool ------
+	//receive straight into buffers from 'pool' (which must outlive the channel); datagrams for the application then go to
+	// on_packet, which owns the buffer from then on (release() it when done, from any thread) -- or, while on_packet
+	// isn't set, to on_receive as usual. If the pool runs dry, datagrams are dropped (counted in pool_drops).
+	// Syscall backend only, and not with GRO (it coalesces datagrams into one buffer); throws otherwise:
+	void enable_packet_pool(PacketPool &pool);
+	PacketPool *pool = nullptr;
+	std::function< void(PacketBuffer *packet) > on_packet;
+	uint64_t pool_drops = 0;
+
+	//------ per-peer channels ------
+	//route application datagrams to PeerChannels (see PeerDemux.hpp); everything unclaimed still goes to on_receive:
+	void enable_demux();
+	std::unique_ptr< PeerDemux > demux;
+
+	//------ encryption ------
+	//seal / open datagrams for peers given keys with crypto->set_secret() or crypto->add() (see PacketCrypto.hpp):
+	void enable_encryption();
+	std::unique_ptr< PacketCrypto > crypto;
+
+	//------ receive timestamps + latency ------
+	//have the kernel timestamp datagrams as they arrive (SO_TIMESTAMPNS); returns false if it won't (or if simulated,
+	// where arrival times are exact anyway):
+	bool enable_timestamps();
+	bool kernel_timestamps = false;
+	//arrival time of the datagram being dispatched, in EventLoop::now_us() time (the kernel's timestamp, if there is one):
+	uint64_t arrival_us() const { return receive_us ? receive_us : EventLoop::now_us(); }
+	//keep RTT / jitter numbers for peers added with latency->add() (see LatencyTracker.hpp; also enables timestamps):
+	void enable_latency_tracking(uint32_t interval_ms = 1000);
+	std::unique_ptr< LatencyTracker > latency;
+
+	//------ metrics ------
+	//count into 'registry', as channel 'name' (e.g., "shard3"); the registry may be shared with other channels / threads:
+	void enable_metrics(Metrics &registry, std::string const &name);
+	std::shared_ptr< ChannelMetrics > metrics;
+
+	//------ keepalives ------
+	//keep NAT bindings to peers open (see Keepalive.hpp); add peers with keepalive->add():
+	void enable_keepalive(uint32_t coalesce_ms = 1000);
+	std::unique_ptr< KeepaliveScheduler > keepalive;
+
+	//local address the socket is bound to:
+	struct sockaddr_storage local_address() const;
+
+	//------ public (mapped) address ------
+	//STUN servers to ask ("host[:port]"), plus optional stats for ordering them:
+	std::vector< std::string > stun_servers;
+	STUNServerStats *stun_stats = nullptr;
+	//optional cache of mapped addresses from earlier runs (saved to address_cache_file, if set, when it changes):
+	MappedAddressCache *address_cache = nullptr;
+	std::string address_cache_file;
+	uint32_t address_cache_max_age_s = 24 * 60 * 60; //<-- older entries are ignored
+	//looks up stun_servers' names (without blocking; see DNSResolver.hpp) -- may be shared between channels.
+	// If not set, the channel makes its own on first use:
+	DNSResolver *resolver = nullptr;
+	DNSResolver &dns();
+
+	//Our address as seen from outside ("ip:port"), or "" if not known yet.
+	// Answers right away, from this run's STUN results or (failing that) the cache; if the answer wasn't
+	// confirmed by STUN during this run, also starts a check in the background (see address_listeners):
+	std::string what_is_my_address();
+	//start a STUN check of the mapped address now (no-op if one is already running):
+	void check_address();
+
+	bool have_mapped_address = false;
+	bool mapped_address_confirmed = false; //by a STUN check during this run (rather than from the cache)
+	struct sockaddr_storage mapped_address;
+
+	//called whenever a check finishes (result.ok is false if it failed);
+	// 'changed' means the mapped address is different than what_is_my_address() said before.
+	// (a list, so a listener that is done can keep its iterator and erase itself)
+	typedef std::function< void(STUNServerRace::Result const &result, bool changed) > AddressListener;
+	std::list< AddressListener > address_listeners;
+
+	//------ internals ------
+	static constexpr size_t MaxDatagram = 65536;
+	std::vector< uint8_t > receive_buffer;
+	void handle_readable();
+	//STUN, streams, packer, demux, or on_receive -- or, if 'packet' (holding 'data') is given, on_packet, swapping in a fresh buffer:
+	void dispatch(struct sockaddr_storage const &from, uint8_t const *data, size_t size, PacketBuffer **packet = nullptr);
+	//an application message (e.g., unpacked by 'packer'): demux or on_receive:
+	void deliver(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+	PacketBuffer *rx_packet = nullptr; //(receive buffer for the unbatched path, with a pool)
+	uint64_t receive_us = 0; //kernel timestamp of the datagram being dispatched (0 = none)
+
+	std::unique_ptr< STUNServerRace > address_race;
+	std::unique_ptr< DNSResolver > own_resolver;
+	void on_address_result(STUNServerRace::Result const &result);
+
+	struct Batch; //buffers + mmsghdrs for recvmmsg / sendmmsg
+	std::unique_ptr< Batch > batch;
+	struct Ring; //io_uring + its buffers
+	std::unique_ptr< Ring > ring;
+	void arm_receive();
+	bool ring_send(struct sockaddr_storage const &to, uint8_t const *data, size_t size, PacketCrypto::Keys *keys = nullptr);
+	void reap();
+	bool flush_deferred = false;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- lets deferred flushes notice the channel is gone
+	void handle_readable_batched();
+};
+
+//A send held back to gather company -- MessagePacker's PACKED datagrams, FECCoder's parity -- that goes out
+// 'delay_ms' after schedule(), or, with delay_ms = 0, at the end of this loop turn (and then flushes the
+// channel's queue itself: end-of-turn work may run after the channel's own deferred flush).
+//cancel() (e.g., the datagrams went out early) or destroying it calls it off:
+struct PendingFlush {
+	PendingFlush() = default;
+	~PendingFlush() { cancel(); }
+	PendingFlush(PendingFlush const &) = delete;
+	PendingFlush &operator=(PendingFlush const &) = delete;
 
-	//Utility stuff:
-	static std::string what_is_my_address();
+	//call 'send' (which queues datagrams on 'channel') later, as above; does nothing if already scheduled:
+	void schedule(DatagramChannel &channel, uint32_t delay_ms, std::function< void() > const &send);
+	void cancel();
+	bool scheduled() const { return timer != 0 || deferred != nullptr; }
 
+	//------ internals ------
+	DatagramChannel *channel = nullptr;
+	EventLoop::TimerID timer = 0;
+	std::shared_ptr< bool > deferred; //<-- (the deferred call holds a weak_ptr, so cancel() just drops this)
 };
@@ -0,0 +1,131 @@
+#include "EventLoop.hpp"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+EventLoop::EventLoop() : timers(now()) {
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		throw std::runtime_error(std::string("Error creating epoll instance:\n") + strerror(errno));
+	}
+}
+
+EventLoop::~EventLoop() {
+	if (epoll_fd != -1) close(epoll_fd);
+}
+
+void EventLoop::watch(int fd, uint32_t events, std::function< void(uint32_t) > const &callback) {
+	std::unique_ptr< Watcher > watcher(new Watcher{fd, callback});
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = watcher.get();
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+		throw std::runtime_error(std::string("Error adding fd to epoll:\n") + strerror(errno));
+	}
+	watchers[fd] = std::move(watcher);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+	auto f = watchers.find(fd);
+	if (f == watchers.end()) {
+		throw std::runtime_error("Error modifying fd in epoll: fd is not watched.");
+	}
+	struct epoll_event ev;
+	memset(&ev, '\0', sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = f->second.get();
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) != 0) {
+		throw std::runtime_error(std::string("Error modifying fd in epoll:\n") + strerror(errno));
+	}
+}
+
+void EventLoop::unwatch(int fd) {
+	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr); //NOTE: fails harmlessly if fd already closed
+	auto f = watchers.find(fd);
+	if (f == watchers.end()) return;
+	//events for this fd may still be queued in the current batch, so keep the watcher alive until it's done:
+	f->second->fd = -1;
+	retired.emplace_back(std::move(f->second));
+	watchers.erase(f);
+}
+
+EventLoop::TimerID EventLoop::after(uint32_t ms, std::function< void() > const &callback) {
+	return timers.add(now() + ms, callback);
+}
+
+bool EventLoop::cancel(TimerID id) {
+	return timers.cancel(id);
+}
+
+uint64_t const *EventLoop::simulated_us = nullptr;
+
+uint64_t EventLoop::now() {
+	if (simulated_us) return *simulated_us / 1000;
+	return std::chrono::duration_cast< std::chrono::milliseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t EventLoop::now_us() {
+	if (simulated_us) return *simulated_us;
+	return std::chrono::duration_cast< std::chrono::microseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void EventLoop::defer(std::function< void() > const &callback) {
+	deferred.emplace_back(callback);
+}
+
+void EventLoop::run_deferred() {
+	//(callbacks may defer more work; that runs in the next round)
+	std::vector< std::function< void() > > batch;
+	batch.swap(deferred);
+	for (auto const &callback : batch) callback();
+	if (deferred.empty()) {
+		batch.clear();
+		deferred.swap(batch); //<-- keep the capacity
+	}
+}
+
+void EventLoop::run_once(int32_t max_wait_ms) {
+	bool ran = !deferred.empty();
+	if (ran) run_deferred(); //<-- deferred from outside the loop
+
+	int32_t wait_ms = timers.next_timeout(now());
+	if (ran || !deferred.empty()) wait_ms = 0; //<-- (that counts as this turn's work: don't block the caller past it)
+	if (max_wait_ms >= 0 && (wait_ms < 0 || wait_ms > max_wait_ms)) wait_ms = max_wait_ms;
+
+	constexpr int MaxEvents = 64;
+	struct epoll_event events[MaxEvents];
+	int got = epoll_wait(epoll_fd, events, MaxEvents, wait_ms);
+	if (got < 0) {
+		assert(got == -1);
+		if (errno != EINTR) {
+			throw std::runtime_error(std::string("Error in epoll_wait:\n") + strerror(errno));
+		}
+		got = 0;
+	}
+
+	for (int i = 0; i < got; ++i) {
+		Watcher *watcher = reinterpret_cast< Watcher * >(events[i].data.ptr);
+		if (watcher->fd == -1) continue; //unwatched by an earlier callback
+		watcher->callback(events[i].events);
+	}
+	retired.clear();
+
+	timers.advance(now());
+
+	if (!deferred.empty()) run_deferred();
+}
+
+void EventLoop::run() {
+	stopped = false;
+	while (!stopped) {
+		run_once();
+	}
+}
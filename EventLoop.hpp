@@ -0,0 +1,70 @@
+#pragma once
+
+/*
+ * EventLoop is a single-threaded reactor: epoll for (non-blocking) file
+ * descriptors, plus a TimerWheel for timeouts. All callbacks run on the
+ * thread that calls run() / run_once().
+ *
+ * Usage:
+ *   EventLoop loop;
+ *   loop.watch(fd, EPOLLIN, [&](uint32_t events){ ...read until EAGAIN... });
+ *   loop.after(500, [&](){ ...retransmit... });
+ *   loop.defer([&](){ ...flush queued sends... }); //once, at the end of this turn
+ *   loop.run(); //until loop.stop()
+ */
+
+#include "TimerWheel.hpp"
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct EventLoop {
+	EventLoop();
+	~EventLoop();
+	EventLoop(EventLoop const &) = delete;
+	EventLoop &operator=(EventLoop const &) = delete;
+
+	//------ file descriptors ------
+	//call 'callback' with epoll event flags whenever 'fd' is ready for 'events' (EPOLLIN, EPOLLOUT, ...):
+	void watch(int fd, uint32_t events, std::function< void(uint32_t) > const &callback);
+	//change the event mask of an already-watched fd:
+	void modify(int fd, uint32_t events);
+	void unwatch(int fd);
+
+	//------ timers ------
+	typedef TimerWheel::TimerID TimerID;
+	TimerID after(uint32_t ms, std::function< void() > const &callback);
+	bool cancel(TimerID id);
+
+	//monotonic clock, in milliseconds / microseconds -- or simulated time, while a NetworkSim has installed its clock:
+	static uint64_t now();
+	static uint64_t now_us();
+	static uint64_t const *simulated_us; //<-- (if set, read instead of the system clock)
+
+	//------ deferred work ------
+	//call 'callback' once, after the current dispatch round (i.e., before the loop next waits):
+	void defer(std::function< void() > const &callback);
+
+	//------ running ------
+	//wait (at most max_wait_ms, -1 for "until something happens") and dispatch ready fds + due timers:
+	void run_once(int32_t max_wait_ms = -1);
+	//run_once() until stop() is called:
+	void run();
+	void stop() { stopped = true; }
+	bool stopped = false;
+
+	//------ internals ------
+	int epoll_fd = -1;
+	TimerWheel timers;
+	struct Watcher {
+		int fd; //-1 once unwatched
+		std::function< void(uint32_t) > callback;
+	};
+	std::unordered_map< int, std::unique_ptr< Watcher > > watchers;
+	std::vector< std::unique_ptr< Watcher > > retired; //unwatched during dispatch; freed after
+	std::vector< std::function< void() > > deferred;
+	void run_deferred();
+};
@@ -0,0 +1,390 @@
+#include "FECCoder.hpp"
+
+#include "DatagramChannel.hpp"
+#include "Metrics.hpp"
+#include "ReedSolomon.hpp"
+#include "STUN.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+constexpr uint8_t FEC = 0xE9;
+constexpr uint8_t DATA = 0;
+constexpr uint8_t PARITY = 1;
+constexpr uint8_t REPORT = 2;
+
+FECCoder::FECCoder(DatagramChannel &channel_, uint32_t block_size_, uint32_t flush_ms_) : channel(channel_), block_size(block_size_), flush_ms(flush_ms_) {
+	if (block_size == 0 || block_size > MaxBlock) {
+		throw std::runtime_error("FECCoder: block size must be 1-" + std::to_string(MaxBlock) + ".");
+	}
+}
+
+FECCoder::~FECCoder() {
+	if (reap_timer) channel.loop.cancel(reap_timer);
+	for (auto &entry : peers) {
+		Peer &p = *entry.second;
+		close_block(p);
+	}
+}
+
+FECCoder::Peer &FECCoder::peer(struct sockaddr_storage const &address, bool sending) {
+	auto f = peers.find(address);
+	if (f != peers.end()) {
+		Peer &p = *f->second;
+		if (sending && !p.sending) {
+			p.sending = true;
+			receive_only_peers -= 1;
+		}
+		return p;
+	}
+	if (!sending) {
+		if (receive_only_peers >= max_receive_peers) forget_idlest();
+		receive_only_peers += 1;
+		if (!reap_timer) {
+			reap_timer = channel.loop.after(idle_ms, [this]() {
+				reap_timer = 0;
+				reap();
+			});
+		}
+	}
+	std::unique_ptr< Peer > &p = peers[address];
+	p.reset(new Peer);
+	p->address = address;
+	p->sending = sending;
+	return *p;
+}
+
+void FECCoder::remove(struct sockaddr_storage const &address) {
+	auto f = peers.find(address);
+	if (f == peers.end()) return;
+	close_block(*f->second);
+	if (!f->second->sending) receive_only_peers -= 1;
+	peers.erase(f);
+}
+
+void FECCoder::forget_idlest() {
+	auto idlest = peers.end();
+	for (auto f = peers.begin(); f != peers.end(); ++f) {
+		if (f->second->sending) continue;
+		if (idlest == peers.end() || f->second->last_receive_ms < idlest->second->last_receive_ms) idlest = f;
+	}
+	if (idlest == peers.end()) return;
+	receive_only_peers -= 1;
+	peers.erase(idlest);
+}
+
+void FECCoder::reap() {
+	uint64_t now = EventLoop::now();
+	uint64_t next_ms = 0; //earliest a remaining receive-only peer goes idle
+	for (auto f = peers.begin(); f != peers.end(); ) {
+		Peer &p = *f->second;
+		if (p.sending) {
+			++f;
+		} else if (p.last_receive_ms + idle_ms <= now) {
+			receive_only_peers -= 1;
+			f = peers.erase(f);
+		} else {
+			uint64_t idle_at = p.last_receive_ms + idle_ms;
+			if (next_ms == 0 || idle_at < next_ms) next_ms = idle_at;
+			++f;
+		}
+	}
+	if (next_ms != 0) {
+		reap_timer = channel.loop.after(uint32_t(next_ms - now), [this]() {
+			reap_timer = 0;
+			reap();
+		});
+	}
+}
+
+double FECCoder::loss(struct sockaddr_storage const &address) const {
+	auto f = peers.find(address);
+	return (f != peers.end() ? f->second->loss : -1.0);
+}
+
+uint32_t FECCoder::parity_for(double loss, uint32_t count) const {
+	uint32_t most = std::min(max_parity, MaxParity);
+	if (!adapt || loss < 0.0) {
+		return std::min(uint32_t(std::ceil(count * redundancy)), MaxParity);
+	}
+	if (loss >= 1.0) return most;
+	//fewest parities m for which P(more than m of the count + m datagrams are lost) <= target_failure:
+	for (uint32_t m = std::min(min_parity, most); m < most; ++m) {
+		uint32_t n = count + m;
+		double term = std::pow(1.0 - loss, double(n)); //P(X = 0)
+		double at_most_m = term;
+		for (uint32_t x = 0; x < m; ++x) {
+			term *= double(n - x) / double(x + 1) * loss / (1.0 - loss);
+			at_most_m += term;
+		}
+		if (1.0 - at_most_m <= target_failure) return m;
+	}
+	return most;
+}
+
+//------ sending ------
+
+bool FECCoder::send(struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	if (size + ParityHeader + LengthPrefix > mtu) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	Peer &p = peer(to, true);
+	if (p.count == 0) {
+		p.parities = parity_for(p.loss, (p.last_count ? p.last_count : block_size));
+		if (p.parity.size() < p.parities) p.parity.resize(p.parities);
+		for (uint32_t j = 0; j < p.parities; ++j) p.parity[j].assign(ParityHeader, 0);
+		Peer *pp = &p;
+		p.flush.schedule(channel, flush_ms, [this, pp]() {
+			close_block(*pp);
+		});
+	}
+	uint32_t index = p.count++;
+
+	scratch.resize(DataHeader + size);
+	scratch[0] = FEC;
+	scratch[1] = DATA;
+	stun_write_u16(&scratch[2], p.next_block);
+	scratch[4] = uint8_t(index);
+	scratch[5] = uint8_t(p.parities);
+	memcpy(&scratch[DataHeader], data, size);
+	data_sent += 1;
+	bool ok = channel.queue_to(p.address, scratch.data(), scratch.size());
+
+	//fold it into the block's parity now, so nothing needs keeping (and closing the block is just sending):
+	uint8_t length[LengthPrefix];
+	stun_write_u16(length, uint16_t(size));
+	for (uint32_t j = 0; j < p.parities; ++j) {
+		std::vector< uint8_t > &parity = p.parity[j];
+		if (parity.size() < ParityHeader + LengthPrefix + size) parity.resize(ParityHeader + LengthPrefix + size, 0);
+		uint8_t c = rs_coefficient(j, index);
+		parity[ParityHeader] ^= gf256_mul(c, length[0]);
+		parity[ParityHeader + 1] ^= gf256_mul(c, length[1]);
+		gf256_mul_add(&parity[ParityHeader + LengthPrefix], data, c, size);
+	}
+
+	if (p.count >= block_size) ok = close_block(p) && ok;
+	return ok;
+}
+
+bool FECCoder::close_block(Peer &p) {
+	p.flush.cancel();
+	if (p.count == 0) return true;
+	bool ok = true;
+	for (uint32_t j = 0; j < p.parities; ++j) {
+		std::vector< uint8_t > &parity = p.parity[j];
+		parity[0] = FEC;
+		parity[1] = PARITY;
+		stun_write_u16(&parity[2], p.next_block);
+		parity[4] = uint8_t(j);
+		parity[5] = uint8_t(p.parities);
+		parity[6] = uint8_t(p.count);
+		parity_sent += 1;
+		if (!channel.queue_to(p.address, parity.data(), parity.size())) ok = false;
+	}
+	p.next_block += 1;
+	p.last_count = p.count;
+	p.count = 0;
+	return ok;
+}
+
+void FECCoder::flush(struct sockaddr_storage const &to) {
+	auto f = peers.find(to);
+	if (f != peers.end()) close_block(*f->second);
+}
+
+void FECCoder::flush() {
+	for (auto &entry : peers) close_block(*entry.second);
+}
+
+//------ receiving ------
+
+FECCoder::Block *FECCoder::block(Peer &p, uint16_t id) {
+	if (!p.receiving) {
+		p.receiving = true;
+		p.newest = id;
+	} else if (int16_t(id - p.newest) > 0) {
+		p.newest = id;
+		//blocks far enough behind have had their chance at stragglers:
+		for (Block &b : p.blocks) {
+			if (b.used && !b.counted && int16_t(p.newest - b.id) >= int16_t(ReorderSlack)) count_losses(p, b);
+		}
+	}
+	if (int16_t(p.newest - id) >= int16_t(Window)) return nullptr;
+	Block &b = p.blocks[id % Window];
+	if (!b.used || b.id != id) {
+		if (b.used && !b.counted) count_losses(p, b);
+		b.id = id;
+		b.used = true;
+		b.done = false;
+		b.counted = false;
+		b.count = 0;
+		b.parities = 0;
+		b.highest = 0;
+		b.have_data = 0;
+		memset(b.present, 0, sizeof(b.present));
+		if (b.data.size() < MaxBlock) b.data.resize(MaxBlock);
+		b.parity_index.clear();
+	}
+	return &b;
+}
+
+void FECCoder::count_losses(Peer &p, Block &b) {
+	b.counted = true;
+	uint32_t count = (b.count ? b.count : b.highest); //<-- (no parity arrived to tell: at least this many)
+	uint32_t expected = count + b.parities;
+	uint32_t received = b.have_data + uint32_t(b.parity_index.size());
+	p.expected += expected;
+	p.lost += (received < expected ? expected - received : 0);
+	if (!b.done) {
+		for (uint32_t i = 0; i < count; ++i) {
+			if (!b.present[i]) unrecovered += 1;
+		}
+	}
+}
+
+void FECCoder::try_rebuild(Block &b, std::vector< std::vector< uint8_t > > &rebuilt) {
+	if (b.done || b.count == 0) return;
+	if (b.have_data >= b.count) {
+		b.done = true;
+		return;
+	}
+	uint32_t parities = uint32_t(b.parity_index.size());
+	if (b.have_data + parities < b.count) return;
+
+	//all parity of a block is the same size (the longest data, plus its length):
+	size_t size = b.parity[0].size();
+	for (uint32_t r = 1; r < parities; ++r) {
+		if (b.parity[r].size() != size) return; //<-- (garbled)
+	}
+	uint8_t *data[MaxBlock];
+	uint8_t const *parity[MaxParity];
+	bool present[MaxBlock];
+	for (uint32_t i = 0; i < b.count; ++i) {
+		if (b.present[i] && b.data[i].size() > size) return; //<-- (garbled)
+		b.data[i].resize(size, 0); //<-- (zero padding, as the sender's parity had it)
+		data[i] = b.data[i].data();
+		present[i] = b.present[i];
+	}
+	for (uint32_t r = 0; r < parities; ++r) parity[r] = b.parity[r].data();
+	if (!rs_decode(b.count, data, present, parities, parity, b.parity_index.data(), size)) return;
+	b.done = true;
+
+	for (uint32_t i = 0; i < b.count; ++i) {
+		if (present[i]) continue;
+		b.present[i] = true;
+		size_t length = stun_read_u16(data[i]);
+		if (LengthPrefix + length > size) { //<-- (garbled)
+			if (channel.metrics) channel.metrics->parse_errors.add();
+			continue;
+		}
+		recovered += 1;
+		rebuilt.emplace_back(data[i] + LengthPrefix, data[i] + LengthPrefix + length);
+	}
+}
+
+void FECCoder::maybe_report(Peer &p) {
+	uint64_t now = EventLoop::now();
+	if (p.expected == p.last_report_expected || now < p.last_report_ms + report_ms) return;
+	p.last_report_ms = now;
+	p.last_report_expected = p.expected;
+	uint8_t report[ReportSize];
+	report[0] = FEC;
+	report[1] = REPORT;
+	stun_write_u32(report + 2, p.expected);
+	stun_write_u32(report + 6, p.lost);
+	reports_sent += 1;
+	channel.queue_to(p.address, report, sizeof(report));
+}
+
+bool FECCoder::handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	if (size < 2) return false;
+	std::vector< std::vector< uint8_t > > rebuilt;
+	bool deliver = false;
+	if (data[1] == DATA) {
+		if (size < DataHeader) return false;
+		uint16_t id = stun_read_u16(data + 2);
+		uint32_t index = data[4];
+		uint32_t parities = data[5];
+		if (index >= MaxBlock || parities > MaxParity) return false;
+		data_received += 1;
+		Peer &p = peer(from, false);
+		p.last_receive_ms = EventLoop::now();
+		Block *b = block(p, id);
+		deliver = true; //<-- (even for a block too old to keep)
+		if (b) {
+			if (b->present[index] || (b->count && index >= b->count)) return true; //<-- (duplicate or rebuilt already, or garbled)
+			b->present[index] = true;
+			b->have_data += 1;
+			b->parities = parities;
+			b->highest = std::max(b->highest, index + 1);
+			if (!b->done) {
+				std::vector< uint8_t > &stored = b->data[index];
+				stored.resize(LengthPrefix + size - DataHeader);
+				stun_write_u16(stored.data(), uint16_t(size - DataHeader));
+				memcpy(stored.data() + LengthPrefix, data + DataHeader, size - DataHeader);
+				try_rebuild(*b, rebuilt);
+			}
+		}
+		maybe_report(p);
+	} else if (data[1] == PARITY) {
+		if (size < ParityHeader + LengthPrefix) return false;
+		uint16_t id = stun_read_u16(data + 2);
+		uint32_t index = data[4];
+		uint32_t parities = data[5];
+		uint32_t count = data[6];
+		if (index >= parities || parities > MaxParity || count == 0 || count > MaxBlock) return false;
+		parity_received += 1;
+		Peer &p = peer(from, false);
+		p.last_receive_ms = EventLoop::now();
+		Block *b = block(p, id);
+		if (b && (b->count == 0 || b->count == count) && b->highest <= count
+			&& std::find(b->parity_index.begin(), b->parity_index.end(), index) == b->parity_index.end()) {
+			b->count = count;
+			b->parities = parities;
+			b->parity_index.emplace_back(index);
+			if (!b->done) {
+				if (b->parity.size() < b->parity_index.size()) b->parity.resize(b->parity_index.size());
+				b->parity[b->parity_index.size() - 1].assign(data + ParityHeader, data + size);
+				try_rebuild(*b, rebuilt);
+			}
+		}
+		maybe_report(p);
+	} else if (data[1] == REPORT) {
+		if (size < ReportSize) return false;
+		auto f = peers.find(from);
+		if (f == peers.end()) return true;
+		Peer &p = *f->second;
+		uint32_t expected = stun_read_u32(data + 2);
+		uint32_t lost = stun_read_u32(data + 6);
+		int32_t new_expected = int32_t(expected - p.reported_expected);
+		uint32_t new_lost = lost - p.reported_lost;
+		if (new_expected <= 0 && new_expected > -(1 << 20)) return true; //<-- (old news: duplicated or reordered)
+		if (new_expected > 0 && new_lost <= uint32_t(new_expected)) {
+			//smoothed over reports, as RFC 6298 smooths RTT samples:
+			double sample = double(new_lost) / double(new_expected);
+			p.loss = (p.loss < 0.0 ? sample : 0.75 * p.loss + 0.25 * sample);
+		} //else the peer started counting over (restarted, say): just take the new baseline
+		p.reported_expected = expected;
+		p.reported_lost = lost;
+		return true;
+	} else {
+		return false;
+	}
+
+	//deliver last, as the callbacks may do anything (including destroying this coder):
+	std::weak_ptr< bool > alive_(alive);
+	if (deliver) {
+		channel.deliver(from, data + DataHeader, size - DataHeader);
+		if (alive_.expired()) return true;
+	}
+	for (auto const &payload : rebuilt) {
+		channel.deliver(from, payload.data(), payload.size());
+		if (alive_.expired()) return true;
+	}
+	return true;
+}
@@ -0,0 +1,161 @@
+#pragma once
+
+/*
+ * FECCoder adds forward error correction to a DatagramChannel: datagrams
+ * sent through fec->send() are grouped into blocks, and each block is
+ * followed by parity datagrams (Reed-Solomon; see ReedSolomon.hpp) from
+ * which the receiver rebuilds lost ones -- no round trip, so a loss costs
+ * at most the wait for the block's parity instead of a retransmission
+ * timeout. It is for latency-critical, loss-tolerant traffic (e.g., state
+ * updates); datagrams are still unreliable, just lost less often.
+ *
+ *  - Data datagrams go out right away; a block closes (and its parity goes
+ *    out) after 'block_size' of them, or 'flush_ms' after its first one
+ *    (0 = at the end of this loop turn). So 'flush_ms' bounds how late a
+ *    rebuilt datagram can be, and 'block_size' how much one block covers.
+ *  - Parity per block (sized for a block as full as the last one): with
+ *    'adapt', the fewest (within min_parity .. max_parity) that leave a
+ *    block unrecoverable at most 'target_failure' of the time at the loss
+ *    rate the peer reports (losses taken as independent); until a report
+ *    arrives -- or always, without 'adapt' -- 'redundancy' parity datagrams
+ *    per data datagram, rounded up. One parity datagram is plain XOR parity.
+ *  - Receivers count what each peer's blocks were missing (before repair)
+ *    and report it back, at most every 'report_ms', piggybacked on traffic
+ *    from that peer.
+ *
+ * Both ends need a coder (DatagramChannel::enable_fec()); datagrams it
+ * receives or rebuilds go to the channel's on_receive (or PeerChannel, with
+ * a demux), one call each, like any datagram -- rebuilt ones late and maybe
+ * out of order.
+ *
+ * On the wire (first byte from RFC 7983's unassigned range, next to PeerDemux's):
+ *   DATA:   0xE9 | 0 | block (2) | index (1) | parities (1) | payload
+ *   PARITY: 0xE9 | 1 | block (2) | parity index (1) | parities (1) | count (1) | parity
+ *   REPORT: 0xE9 | 2 | datagrams expected (4) | datagrams lost (4)   (running totals)
+ * Parity covers each data datagram's payload as length (2) | payload, zero-padded
+ * to the block's longest -- so a parity datagram is 3 bytes bigger than that.
+ */
+
+#include "DatagramChannel.hpp" //(for PendingFlush)
+#include "EventLoop.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+struct FECCoder {
+	FECCoder(DatagramChannel &channel, uint32_t block_size = 8, uint32_t flush_ms = 0); //throws if block_size is out of range
+	~FECCoder();
+	FECCoder(FECCoder const &) = delete;
+	FECCoder &operator=(FECCoder const &) = delete;
+
+	DatagramChannel &channel;
+	uint32_t block_size; //data datagrams per block (1 .. MaxBlock)
+	uint32_t flush_ms; //longest a block stays open
+
+	static constexpr uint32_t MaxBlock = 64;
+	static constexpr uint32_t MaxParity = 32;
+	static constexpr size_t DataHeader = 6;
+	static constexpr size_t ParityHeader = 7;
+	static constexpr size_t LengthPrefix = 2;
+	static constexpr size_t ReportSize = 10;
+
+	//parity per block:
+	double redundancy = 0.25; //parity datagrams per data datagram, when not adapting
+	bool adapt = true;
+	double target_failure = 0.01;
+	uint32_t min_parity = 1;
+	uint32_t max_parity = 8; //(at most MaxParity)
+	uint32_t report_ms = 250;
+
+	//peers we only receive from (never send to) are forgotten after 'idle_ms' without a datagram from them,
+	// and at most 'max_receive_peers' are kept (the longest idle is forgotten first), so stray or spoofed
+	// datagrams can't pile up state; peers we send to are kept until remove():
+	uint32_t idle_ms = 30000;
+	uint32_t max_receive_peers = 1024;
+
+	uint32_t mtu = 1472; //largest datagram to send; send() refuses payloads over mtu - ParityHeader - LengthPrefix
+
+	//send a datagram to 'to' with parity protection; returns false (with errno set) if it is too big or sending failed:
+	bool send(struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	//close the open block (sending its parity) to one peer, or to all:
+	void flush(struct sockaddr_storage const &to);
+	void flush();
+	//drop all state for 'peer' (closing its block first):
+	void remove(struct sockaddr_storage const &peer);
+
+	//loss rate 'peer' last reported (smoothed) for what we send it, or -1 if it hasn't:
+	double loss(struct sockaddr_storage const &peer) const;
+	//parity datagrams for a block of 'count' data datagrams at 'loss' (see above; loss < 0 = unknown):
+	uint32_t parity_for(double loss, uint32_t count) const;
+
+	//------ stats ------
+	uint64_t data_sent = 0;
+	uint64_t parity_sent = 0;
+	uint64_t data_received = 0;
+	uint64_t parity_received = 0;
+	uint64_t recovered = 0; //data datagrams rebuilt from parity
+	uint64_t unrecovered = 0; //data datagrams lost for good (as far as blocks told)
+	uint64_t reports_sent = 0;
+
+	//------ internals ------
+	static constexpr uint32_t Window = 16; //blocks per peer being received at once (older ones are closed)
+	static constexpr uint32_t ReorderSlack = 2; //blocks to wait for stragglers before counting a block's losses
+	struct Block {
+		uint16_t id = 0;
+		bool used = false;
+		bool done = false; //all data here (received or rebuilt)
+		bool counted = false; //losses counted
+		uint32_t count = 0; //data datagrams in the block (0 = no parity seen yet to tell)
+		uint32_t parities = 0;
+		uint32_t highest = 0; //highest data index seen + 1
+		uint32_t have_data = 0; //(received, not rebuilt)
+		bool present[MaxBlock]; //by data index (received or rebuilt)
+		std::vector< std::vector< uint8_t > > data; //length (2) | payload, by index
+		std::vector< uint32_t > parity_index; //parities received
+		std::vector< std::vector< uint8_t > > parity; //...and their contents (kept until done)
+	};
+	struct Peer {
+		struct sockaddr_storage address;
+		bool sending = false; //sent to at least once (else just received from)
+		uint64_t last_receive_ms = 0;
+		//sending:
+		uint16_t next_block = 0;
+		uint32_t count = 0; //data datagrams sent in the open block (0 = none open)
+		uint32_t parities = 0; //for the open block
+		uint32_t last_count = 0; //data datagrams in the last block (what the next one is taken to hold)
+		std::vector< std::vector< uint8_t > > parity; //being accumulated (after ParityHeader room)
+		PendingFlush flush; //closes the open block
+		double loss = -1.0;
+		uint32_t reported_expected = 0, reported_lost = 0; //totals in the last report
+		//receiving:
+		Block blocks[Window];
+		bool receiving = false;
+		uint16_t newest = 0; //newest block id seen
+		uint32_t expected = 0, lost = 0; //totals, for reports
+		uint32_t last_report_expected = 0;
+		uint64_t last_report_ms = 0;
+	};
+	std::unordered_map< struct sockaddr_storage, std::unique_ptr< Peer >, AddressHash, AddressEqual > peers;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- lets delivery notice the coder is gone
+	std::vector< uint8_t > scratch; //(reused for data datagrams)
+	uint32_t receive_only_peers = 0;
+	EventLoop::TimerID reap_timer = 0; //next look for idle receive-only peers (0 = there are none)
+
+	//called by the channel for datagrams that start with 0xE9; returns true if it was one of ours:
+	bool handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+
+	Peer &peer(struct sockaddr_storage const &address, bool sending);
+	bool close_block(Peer &peer);
+	Block *block(Peer &peer, uint16_t id); //(nullptr if too old to keep)
+	void count_losses(Peer &peer, Block &block);
+	//rebuild what parity allows, appending the payloads to 'rebuilt':
+	void try_rebuild(Block &block, std::vector< std::vector< uint8_t > > &rebuilt);
+	void maybe_report(Peer &peer);
+	void forget_idlest();
+	void reap();
+};
@@ -0,0 +1,131 @@
+#include "HierarchicalTimerWheel.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+HierarchicalTimerWheel::HierarchicalTimerWheel(uint64_t now_ms, uint32_t tick_ms_) : tick_ms(tick_ms_) {
+	assert(tick_ms > 0);
+	current_tick = now_ms / tick_ms;
+	for (uint32_t l = 0; l < Levels; ++l) {
+		for (uint32_t s = 0; s < Slots; ++s) heads[l][s] = Nil;
+		occupied[l] = 0;
+	}
+}
+
+void HierarchicalTimerWheel::schedule(uint32_t id, uint64_t deadline_ms) {
+	if (id >= nodes.size()) nodes.resize(id + 1);
+	if (nodes[id].where != Unscheduled) unlink(id);
+	else count += 1;
+	nodes[id].tick = std::max(current_tick, (deadline_ms + tick_ms - 1) / tick_ms);
+	link(id);
+}
+
+bool HierarchicalTimerWheel::unschedule(uint32_t id) {
+	if (!scheduled(id)) return false;
+	unlink(id);
+	count -= 1;
+	return true;
+}
+
+bool HierarchicalTimerWheel::scheduled(uint32_t id) const {
+	return id < nodes.size() && nodes[id].where != Unscheduled;
+}
+
+//put node in the coarsest level whose span (relative to now) holds it:
+void HierarchicalTimerWheel::link(uint32_t id) {
+	Node &node = nodes[id];
+	uint64_t delta = node.tick - current_tick;
+	uint32_t level = 0;
+	while (level + 1 < Levels && delta >= (uint64_t(1) << (SlotBits * (level + 1)))) ++level;
+	uint64_t tick = node.tick;
+	if (delta >= (uint64_t(1) << (SlotBits * Levels))) {
+		tick = current_tick + (uint64_t(1) << (SlotBits * Levels)) - 1; //<-- too far out: park at the far edge (re-linked when cascaded)
+	}
+	uint32_t slot = uint32_t(tick >> (SlotBits * level)) & (Slots - 1);
+
+	node.where = uint16_t(level * Slots + slot);
+	node.prev = Nil;
+	node.next = heads[level][slot];
+	if (node.next != Nil) nodes[node.next].prev = id;
+	heads[level][slot] = id;
+	occupied[level] |= (uint64_t(1) << slot);
+}
+
+void HierarchicalTimerWheel::unlink(uint32_t id) {
+	Node &node = nodes[id];
+	uint32_t level = node.where / Slots;
+	uint32_t slot = node.where % Slots;
+	if (node.prev != Nil) nodes[node.prev].next = node.next;
+	else heads[level][slot] = node.next;
+	if (node.next != Nil) nodes[node.next].prev = node.prev;
+	if (heads[level][slot] == Nil) occupied[level] &= ~(uint64_t(1) << slot);
+	node.where = Unscheduled;
+	node.prev = node.next = Nil;
+}
+
+//re-link everything in the current slot of 'level' (which now fits in a finer level):
+void HierarchicalTimerWheel::cascade(uint32_t level) {
+	uint32_t slot = uint32_t(current_tick >> (SlotBits * level)) & (Slots - 1);
+	uint32_t i = heads[level][slot];
+	heads[level][slot] = Nil;
+	occupied[level] &= ~(uint64_t(1) << slot);
+	while (i != Nil) {
+		uint32_t next = nodes[i].next;
+		link(i);
+		i = next;
+	}
+}
+
+uint64_t HierarchicalTimerWheel::next_wakeup_ms() const {
+	if (count == 0) return ~uint64_t(0);
+	uint64_t best = ~uint64_t(0);
+	for (uint32_t level = 0; level < Levels; ++level) {
+		if (!occupied[level]) continue;
+		uint32_t shift = SlotBits * level;
+		uint64_t block = current_tick >> shift;
+		uint32_t index = uint32_t(block) & (Slots - 1);
+		//slot 'index' at this level was already handled for this block unless we're exactly at its start:
+		uint32_t first = ((current_tick & ((uint64_t(1) << shift) - 1)) == 0 ? 0 : 1);
+		if (level == 0) first = 0;
+		uint64_t k = first;
+		for (; k < Slots + first; ++k) {
+			if (occupied[level] & (uint64_t(1) << ((index + k) & (Slots - 1)))) break;
+		}
+		uint64_t tick = (level == 0 ? current_tick + k : (block + k) << shift);
+		best = std::min(best, tick);
+	}
+	return best * tick_ms;
+}
+
+void HierarchicalTimerWheel::advance(uint64_t now_ms, std::vector< uint32_t > &expired) {
+	uint64_t now_tick = now_ms / tick_ms;
+	while (current_tick <= now_tick) {
+		if (count == 0) {
+			current_tick = now_tick + 1;
+			break;
+		}
+		//at a slot boundary of a level, pull that level's current slot down (coarsest that applies first):
+		if ((current_tick & (Slots - 1)) == 0) {
+			uint32_t top = 1;
+			while (top + 1 < Levels && (current_tick & ((uint64_t(1) << (SlotBits * (top + 1))) - 1)) == 0) ++top;
+			for (uint32_t level = top; level >= 1; --level) cascade(level);
+		}
+
+		uint32_t slot = uint32_t(current_tick) & (Slots - 1);
+		uint32_t i = heads[0][slot];
+		while (i != Nil) {
+			uint32_t next = nodes[i].next;
+			unlink(i);
+			count -= 1;
+			expired.emplace_back(i);
+			i = next;
+		}
+		current_tick += 1;
+
+		//nothing at level 0? skip ahead to the next boundary where a cascade could happen:
+		if (occupied[0] == 0) {
+			uint64_t boundary = (current_tick + Slots - 1) & ~uint64_t(Slots - 1);
+			current_tick = std::min(boundary, now_tick + 1);
+		}
+	}
+}
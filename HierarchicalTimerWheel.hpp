@@ -0,0 +1,61 @@
+#pragma once
+
+/*
+ * HierarchicalTimerWheel schedules many long, coarse timers (think: one
+ * keepalive per peer, tens of seconds out, for tens of thousands of peers).
+ *
+ * Four levels of 64 slots each; level L slots are 64^L ticks wide. A timer
+ * sits in the coarsest level that can hold it and is moved ("cascaded") one
+ * level down each time the wheel reaches its slot, so it is touched at most
+ * four times in its life no matter how far out it is -- unlike TimerWheel,
+ * which looks at a far-future timer on every rotation.
+ *
+ * Timers are identified by small integers chosen by the caller (e.g., an
+ * index into the caller's own array) and carry no callback: advance()
+ * just reports which ids came due. Not thread-safe.
+ */
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+struct HierarchicalTimerWheel {
+	HierarchicalTimerWheel(uint64_t now_ms, uint32_t tick_ms = 250);
+
+	static constexpr uint32_t Levels = 4;
+	static constexpr uint32_t SlotBits = 6;
+	static constexpr uint32_t Slots = 1 << SlotBits;
+
+	//(re)schedule 'id' to come due at 'deadline_ms' (rounded up to a tick):
+	void schedule(uint32_t id, uint64_t deadline_ms);
+	//returns false if 'id' wasn't scheduled:
+	bool unschedule(uint32_t id);
+	bool scheduled(uint32_t id) const;
+
+	//time (ms) at which advance() next has something to do -- fire or cascade -- or ~0 if nothing is scheduled:
+	uint64_t next_wakeup_ms() const;
+
+	//move time forward to 'now_ms', appending ids that came due to 'expired' (tick by tick; ids due in the same tick come in no particular order):
+	void advance(uint64_t now_ms, std::vector< uint32_t > &expired);
+
+	size_t size() const { return count; }
+
+	//------ internals ------
+	static constexpr uint32_t Nil = 0xffffffff;
+	static constexpr uint16_t Unscheduled = 0xffff;
+	struct Node {
+		uint64_t tick = 0;
+		uint32_t prev = Nil, next = Nil;
+		uint16_t where = Unscheduled; //level * Slots + slot
+	};
+	std::vector< Node > nodes; //indexed by id
+	uint32_t heads[Levels][Slots];
+	uint64_t occupied[Levels]; //bitmap of non-empty slots, per level
+	uint32_t tick_ms;
+	uint64_t current_tick; //every tick before this one has been processed
+	size_t count = 0;
+
+	void link(uint32_t id);
+	void unlink(uint32_t id);
+	void cascade(uint32_t level);
+};
@@ -0,0 +1,93 @@
+#pragma once
+
+/*
+ * Histogram is a fixed-size, log-linear ("HDR-style") histogram of integer
+ * values (e.g., microseconds of RTT, bytes per datagram).
+ *
+ * Values below 2^SubBits get exact buckets; above that, each power of two
+ * is split into 2^SubBits sub-buckets, so any recorded value is known to
+ * within ~3%. Values of 2^MaxBits or more land in the last bucket.
+ *
+ * record() is a count-leading-zeros plus an increment -- cheap enough for
+ * per-packet use.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+struct Histogram {
+	static constexpr uint32_t SubBits = 5;
+	static constexpr uint32_t MaxBits = 40;
+	static constexpr uint32_t Buckets = (MaxBits - SubBits + 1) << SubBits;
+
+	uint64_t counts[Buckets];
+	uint64_t total = 0;
+	uint64_t sum = 0;
+	uint64_t min = ~uint64_t(0);
+	uint64_t max = 0;
+
+	Histogram() { clear(); }
+
+	void clear() {
+		std::memset(counts, 0, sizeof(counts));
+		total = sum = max = 0;
+		min = ~uint64_t(0);
+	}
+
+	static uint32_t bucket(uint64_t value) {
+		if (value < (uint64_t(1) << SubBits)) return uint32_t(value);
+		uint32_t msb = 63 - __builtin_clzll(value);
+		if (msb >= MaxBits) return Buckets - 1;
+		uint32_t shift = msb - SubBits;
+		return ((msb - SubBits + 1) << SubBits) + uint32_t((value >> shift) & ((1U << SubBits) - 1));
+	}
+
+	//smallest value that lands in bucket 'b':
+	static uint64_t bucket_low(uint32_t b) {
+		if (b < (1U << SubBits)) return b;
+		uint32_t exponent = b >> SubBits;
+		uint64_t mantissa = b & ((1U << SubBits) - 1);
+		return ((uint64_t(1) << SubBits) + mantissa) << (exponent - 1);
+	}
+
+	//largest value that lands in bucket 'b':
+	static uint64_t bucket_high(uint32_t b) {
+		if (b + 1 >= Buckets) return ~uint64_t(0);
+		return bucket_low(b + 1) - 1;
+	}
+
+	void record(uint64_t value) {
+		counts[bucket(value)] += 1;
+		total += 1;
+		sum += value;
+		min = std::min(min, value);
+		max = std::max(max, value);
+	}
+
+	void merge(Histogram const &other) {
+		for (uint32_t b = 0; b < Buckets; ++b) counts[b] += other.counts[b];
+		total += other.total;
+		sum += other.sum;
+		min = std::min(min, other.min);
+		max = std::max(max, other.max);
+	}
+
+	double mean() const {
+		return total ? double(sum) / double(total) : 0.0;
+	}
+
+	//value at or below which fraction 'p' (0..1) of the recorded values fall (upper edge of the bucket, clamped to max):
+	uint64_t percentile(double p) const {
+		if (total == 0) return 0;
+		uint64_t rank = uint64_t(p * double(total) + 0.5);
+		if (rank < 1) rank = 1;
+		if (rank > total) rank = total;
+		uint64_t seen = 0;
+		for (uint32_t b = 0; b < Buckets; ++b) {
+			seen += counts[b];
+			if (seen >= rank) return std::min(bucket_high(b), max);
+		}
+		return max;
+	}
+};
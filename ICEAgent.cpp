@@ -0,0 +1,405 @@
+#include "ICEAgent.hpp"
+
+#include "DatagramChannel.hpp"
+#include "STUN.hpp"
+#include "SocketAddress.hpp"
+
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cstring>
+#include <random>
+#include <sstream>
+
+template< typename Generator >
+static std::string random_string(Generator &rd, size_t length) {
+	static char const alphabet[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789+/";
+	std::string ret(length, '\0');
+	for (auto &c : ret) c = alphabet[rd() % 64];
+	return ret;
+}
+
+template< typename Generator >
+static void make_credentials(Generator &rd, std::string *ufrag, std::string *password, uint64_t *tie_breaker) {
+	*ufrag = random_string(rd, 8);
+	*password = random_string(rd, 24); //<-- RFC 8445 asks for at least 128 bits
+	*tie_breaker = (uint64_t(rd()) << 32) | uint64_t(rd());
+}
+
+ICEAgent::ICEAgent(DatagramChannel &channel_) : channel(channel_) {
+	if (channel.network) {
+		//simulated: replayable credentials (and so tie-breaks) from the simulation's seed:
+		std::mt19937 mt(channel.random_seed());
+		make_credentials(mt, &ufrag, &password, &tie_breaker);
+	} else {
+		std::random_device rd;
+		make_credentials(rd, &ufrag, &password, &tie_breaker);
+	}
+	local_key.reset(new HMACSHA1(reinterpret_cast< uint8_t const * >(password.data()), password.size()));
+
+	channel.on_binding_request = [this](struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+		return handle_request(from, data, size);
+	};
+}
+
+ICEAgent::~ICEAgent() {
+	channel.on_binding_request = nullptr;
+	if (gather_timer) channel.loop.cancel(gather_timer);
+	if (have_gather_listener) channel.address_listeners.erase(gather_listener);
+	if (pace_timer) channel.loop.cancel(pace_timer);
+	if (timeout_timer) channel.loop.cancel(timeout_timer);
+	for (auto const &pair : pairs) {
+		channel.stun->cancel(pair.transaction); //<-- (returns false for ones that are already over)
+	}
+}
+
+uint32_t ICEAgent::priority(Candidate::Type type, uint16_t local_preference) {
+	uint32_t type_preference = (type == Candidate::Host ? 126 : type == Candidate::PeerReflexive ? 110 : 100);
+	return (type_preference << 24) | (uint32_t(local_preference) << 8) | (256 - 1); //<-- component 1
+}
+
+//------ gathering ------
+
+void ICEAgent::gather(std::function< void() > const &done) {
+	gather_done = done;
+	local.clear();
+
+	uint16_t port = 0;
+	{
+		struct sockaddr_storage bound = channel.local_address();
+		port = reinterpret_cast< struct sockaddr_in const & >(bound).sin_port;
+	}
+
+	//host candidates: every address of every interface that's up (but not loopback, as per RFC 8445 5.1.1.1)
+	// -- or, for a simulated channel, its one simulated address:
+	struct ifaddrs *ifs = nullptr;
+	if (channel.network) {
+		Candidate candidate;
+		candidate.type = Candidate::Host;
+		candidate.address = channel.local_address();
+		candidate.priority = priority(Candidate::Host, 65535);
+		local.emplace_back(candidate);
+	} else if (getifaddrs(&ifs) == 0) {
+		uint16_t local_preference = 65535;
+		for (struct ifaddrs *i = ifs; i; i = i->ifa_next) {
+			if (!i->ifa_addr || i->ifa_addr->sa_family != AF_INET) continue; //<-- (channel sockets are ipv4)
+			if (!(i->ifa_flags & IFF_UP) || (i->ifa_flags & IFF_LOOPBACK)) continue;
+			Candidate candidate;
+			candidate.type = Candidate::Host;
+			memset(&candidate.address, '\0', sizeof(candidate.address));
+			memcpy(&candidate.address, i->ifa_addr, sizeof(struct sockaddr_in));
+			reinterpret_cast< struct sockaddr_in & >(candidate.address).sin_port = port;
+			candidate.priority = priority(Candidate::Host, local_preference);
+			if (local_preference > 0) local_preference -= 1;
+			local.emplace_back(candidate);
+		}
+		freeifaddrs(ifs);
+	}
+
+	//server-reflexive candidate: the channel's mapped address (from this run or the cache), or wait for a check:
+	if (!channel.what_is_my_address().empty()) {
+		add_server_reflexive();
+		finish_gathering();
+		return;
+	}
+	if (!have_gather_listener) {
+		std::weak_ptr< bool > alive_(alive);
+		gather_listener = channel.address_listeners.emplace(channel.address_listeners.end(), [this, alive_](STUNServerRace::Result const &result, bool) {
+			if (alive_.expired() || !gather_done) return;
+			if (result.ok) add_server_reflexive();
+			finish_gathering();
+		});
+		have_gather_listener = true;
+	}
+	if (gather_timer) channel.loop.cancel(gather_timer); //<-- (from an earlier gather() still waiting)
+	gather_timer = channel.loop.after(gather_timeout_ms, [this]() {
+		gather_timer = 0;
+		finish_gathering();
+	});
+}
+
+void ICEAgent::add_server_reflexive() {
+	//(without a NAT, the mapped address is just one of the host candidates)
+	for (auto const &c : local) {
+		if (same_address(c.address, channel.mapped_address)) return;
+	}
+	Candidate candidate;
+	candidate.type = Candidate::ServerReflexive;
+	candidate.address = channel.mapped_address;
+	candidate.priority = priority(Candidate::ServerReflexive, 65535);
+	local.emplace_back(candidate);
+}
+
+void ICEAgent::finish_gathering() {
+	if (gather_timer) {
+		channel.loop.cancel(gather_timer);
+		gather_timer = 0;
+	}
+	if (have_gather_listener) {
+		//(safe from inside the listener itself: the channel calls a copy)
+		channel.address_listeners.erase(gather_listener);
+		have_gather_listener = false;
+	}
+	if (!gather_done) return;
+	std::function< void() > done = std::move(gather_done);
+	gather_done = nullptr;
+	done();
+}
+
+//------ description ------
+
+static char const *type_name(ICEAgent::Candidate::Type type) {
+	if (type == ICEAgent::Candidate::Host) return "host";
+	if (type == ICEAgent::Candidate::ServerReflexive) return "srflx";
+	return "prflx";
+}
+
+std::string ICEAgent::description() const {
+	std::ostringstream out;
+	out << "ice " << ufrag << ' ' << password << ' ' << tie_breaker;
+	for (auto const &c : local) {
+		out << ' ' << type_name(c.type) << '/' << address_to_string(c.address) << '/' << c.priority;
+	}
+	return out.str();
+}
+
+//------ checks ------
+
+char const *ICEAgent::connect(std::string const &remote_description, Callback const &callback_) {
+	std::istringstream in(remote_description);
+	std::string tag;
+	uint64_t remote_tie_breaker = 0;
+	if (!(in >> tag >> remote_ufrag >> remote_password >> remote_tie_breaker) || tag != "ice") {
+		return "not an ICE description.";
+	}
+	if (remote_tie_breaker == tie_breaker) return "ICE description has our own tie-breaker (talking to ourselves?).";
+
+	remote.clear();
+	std::string token;
+	while (in >> token) {
+		size_t first = token.find('/');
+		size_t last = token.rfind('/');
+		if (first == std::string::npos || first == last) return "malformed candidate in ICE description.";
+		std::string type = token.substr(0, first);
+		Candidate candidate;
+		if (type == "host") candidate.type = Candidate::Host;
+		else if (type == "srflx") candidate.type = Candidate::ServerReflexive;
+		else if (type == "prflx") candidate.type = Candidate::PeerReflexive;
+		else return "unknown candidate type in ICE description.";
+		if (!address_from_string(token.substr(first + 1, last - first - 1), &candidate.address)) {
+			return "bad candidate address in ICE description.";
+		}
+		char *end = nullptr;
+		candidate.priority = uint32_t(std::strtoul(token.c_str() + last + 1, &end, 10));
+		if (*end != '\0') return "bad candidate priority in ICE description.";
+		if (candidate.address.ss_family != AF_INET) continue; //<-- (channel sockets are ipv4)
+		remote.emplace_back(candidate);
+	}
+
+	controlling = (tie_breaker > remote_tie_breaker);
+	remote_key.reset(new HMACSHA1(reinterpret_cast< uint8_t const * >(remote_password.data()), remote_password.size()));
+	callback = callback_;
+	done = false;
+
+	pairs.clear();
+	for (size_t i = 0; i < remote.size(); ++i) add_pair(i);
+	if (pairs.empty()) return "no usable candidates in ICE description.";
+
+	timeout_timer = channel.loop.after(timeout_ms, [this]() {
+		timeout_timer = 0;
+		if (done) return;
+		Result failed;
+		failed.error = "no candidate pair worked.";
+		report(failed);
+	});
+
+	if (have_early_nomination && !controlling) {
+		for (size_t i = 0; i < pairs.size(); ++i) {
+			if (same_address(remote[pairs[i].remote_index].address, early_nomination)) {
+				select(i, 0);
+				return nullptr;
+			}
+		}
+	}
+	pace();
+	return nullptr;
+}
+
+uint64_t ICEAgent::pair_priority(Candidate const &remote_candidate) const {
+	//every local candidate shares the one socket, so pair with the best of them:
+	uint32_t local_priority = priority(Candidate::Host, 65535);
+	if (!local.empty()) {
+		local_priority = 0;
+		for (auto const &c : local) local_priority = std::max(local_priority, c.priority);
+	}
+	uint64_t G = (controlling ? local_priority : remote_candidate.priority);
+	uint64_t D = (controlling ? remote_candidate.priority : local_priority);
+	return (std::min(G, D) << 32) + 2 * std::max(G, D) + (G > D ? 1 : 0);
+}
+
+size_t ICEAgent::add_pair(size_t remote_index) {
+	Pair pair;
+	pair.remote_index = remote_index;
+	pair.priority = pair_priority(remote[remote_index]);
+	pairs.emplace_back(pair);
+	return pairs.size() - 1;
+}
+
+void ICEAgent::pace() {
+	pace_timer = 0;
+	if (done) return;
+	size_t best = pairs.size();
+	for (size_t i = 0; i < pairs.size(); ++i) {
+		if (pairs[i].state != Pair::Waiting) continue;
+		if (best == pairs.size() || pairs[i].priority > pairs[best].priority) best = i;
+	}
+	if (best == pairs.size()) return; //<-- everything started; new (peer-reflexive) pairs get checked as they show up
+	start_check(best);
+	pace_timer = channel.loop.after(pace_ms, [this]() {
+		pace();
+	});
+}
+
+void ICEAgent::start_check(size_t pair_index, bool nominate) {
+	Pair &pair = pairs[pair_index];
+	if (!nominate) pair.state = Pair::InProgress;
+	std::string username = remote_ufrag + ":" + ufrag;
+	pair.transaction = channel.stun->binding_request(remote[pair.remote_index].address, [this, pair_index](STUNClient::Result const &r) {
+		on_check(pair_index, r);
+	}, [&](STUNMessageBuilder &builder) {
+		builder.add_attribute(STUN_ATTR_USERNAME, username.data(), uint16_t(username.size()));
+		uint8_t *value = builder.add_attribute(STUN_ATTR_PRIORITY, nullptr, 4);
+		stun_write_u32(value, priority(Candidate::PeerReflexive, 65535)); //<-- what the peer should call us if it doesn't know this address
+		if (nominate) builder.add_attribute(STUN_ATTR_USE_CANDIDATE, nullptr, 0);
+		builder.add_message_integrity(*remote_key);
+		builder.add_fingerprint();
+		return builder.finish();
+	});
+}
+
+void ICEAgent::on_check(size_t pair_index, STUNClient::Result const &r) {
+	Pair &pair = pairs[pair_index];
+	if (pair.state == Pair::Succeeded) return; //<-- (outcome of a nomination; nothing more to learn)
+
+	//the response has to prove it came from the peer (and not, say, some other STUN server on that address):
+	if (!r.ok || STUNMessageView(r.response, r.response_size).verify_message_integrity(*remote_key)) {
+		pair.state = Pair::Failed;
+		return;
+	}
+	pair.state = Pair::Succeeded;
+	if (controlling && !done) {
+		select(pair_index, r.rtt_ms);
+		start_check(pair_index, true);
+	}
+}
+
+void ICEAgent::select(size_t pair_index, uint32_t rtt_ms) {
+	done = true;
+	Candidate const &c = remote[pairs[pair_index].remote_index];
+	Result selected;
+	selected.ok = true;
+	selected.remote = c.address;
+	selected.remote_type = c.type;
+	selected.rtt_ms = rtt_ms;
+
+	//stop everything else:
+	if (pace_timer) {
+		channel.loop.cancel(pace_timer);
+		pace_timer = 0;
+	}
+	for (size_t i = 0; i < pairs.size(); ++i) {
+		if (i != pair_index && pairs[i].state == Pair::InProgress) {
+			channel.stun->cancel(pairs[i].transaction);
+			pairs[i].state = Pair::Waiting;
+		}
+	}
+	report(selected);
+}
+
+void ICEAgent::report(Result const &result_) {
+	done = true;
+	result = result_;
+	if (timeout_timer) {
+		channel.loop.cancel(timeout_timer);
+		timeout_timer = 0;
+	}
+	Callback cb = std::move(callback);
+	callback = nullptr;
+	if (cb) cb(result);
+}
+
+//------ answering the peer's checks ------
+
+bool ICEAgent::handle_request(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	STUNMessageView request(data, size);
+	if (request.error) return false;
+
+	//only requests addressed to us ("<our ufrag>:<their ufrag>") are ours to answer:
+	STUNAttribute username;
+	if (!request.find(STUN_ATTR_USERNAME, &username)) return false;
+	if (username.length <= ufrag.size() || memcmp(username.value, ufrag.data(), ufrag.size()) != 0 || username.value[ufrag.size()] != ':') return false;
+	STUNAttribute attr;
+	if (request.find(STUN_ATTR_FINGERPRINT, &attr) && request.verify_fingerprint()) return false;
+	if (request.verify_message_integrity(*local_key)) return true; //<-- ours, but forged (or stale): drop
+
+	{ //answer:
+		uint8_t response[STUNClient::MaxMessage];
+		uint8_t id[12];
+		memcpy(id, request.transaction_id(), sizeof(id));
+		STUNMessageBuilder builder(response, sizeof(response), STUN_BINDING_RESPONSE, id);
+		builder.add_xor_mapped_address(from);
+		builder.add_message_integrity(*local_key);
+		builder.add_fingerprint();
+		channel.send_to(from, response, builder.finish());
+	}
+
+	bool use_candidate = request.find(STUN_ATTR_USE_CANDIDATE, &attr);
+	if (!remote_key) {
+		//connect() hasn't been called yet; remember a nomination for when it is:
+		if (use_candidate) {
+			have_early_nomination = true;
+			early_nomination = from;
+		}
+		return true;
+	}
+	if (done) return true;
+
+	size_t remote_index = remote.size();
+	for (size_t i = 0; i < remote.size(); ++i) {
+		if (same_address(remote[i].address, from)) {
+			remote_index = i;
+			break;
+		}
+	}
+	size_t pair_index = pairs.size();
+	if (remote_index == remote.size()) {
+		//a peer-reflexive candidate (e.g., the peer's address as a symmetric NAT maps it toward us):
+		Candidate candidate;
+		candidate.type = Candidate::PeerReflexive;
+		candidate.address = from;
+		candidate.priority = priority(Candidate::PeerReflexive, 65535);
+		if (request.find(STUN_ATTR_PRIORITY, &attr) && attr.length == 4) candidate.priority = stun_read_u32(attr.value);
+		remote.emplace_back(candidate);
+		pair_index = add_pair(remote_index);
+	} else {
+		for (size_t i = 0; i < pairs.size(); ++i) {
+			if (pairs[i].remote_index == remote_index) pair_index = i;
+		}
+	}
+
+	//the controlling side only nominates after its check came back, so the path works both ways:
+	if (use_candidate && !controlling) {
+		select(pair_index, 0);
+		return true;
+	}
+	//"triggered" check: the peer can evidently reach us from there, so try back right away
+	// -- resending one that's in progress, whose earlier requests may have hit the peer's NAT before this opened it (RFC 8445 7.3.1.4):
+	if (pairs[pair_index].state == Pair::Waiting || pairs[pair_index].state == Pair::Failed) {
+		start_check(pair_index);
+	} else if (pairs[pair_index].state == Pair::InProgress) {
+		channel.stun->retransmit(pairs[pair_index].transaction);
+	}
+	return true;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+/*
+ * ICEAgent connects a DatagramChannel to a peer the way ICE (RFC 8445) does,
+ * instead of sending to one out-of-band address and hoping:
+ *
+ *  (1) gather() collects our candidates: a "host" candidate per local
+ *      interface address, plus a "server-reflexive" one (our address as
+ *      the channel's STUN servers see it);
+ *  (2) description() goes to the peer out-of-band, and the peer's
+ *      description comes back to connect();
+ *  (3) connect() sends STUN connectivity checks (binding requests with
+ *      USERNAME + MESSAGE-INTEGRITY from the exchanged credentials) to every
+ *      remote candidate, highest pair priority first, one every pace_ms;
+ *      checks overlap, so a slow or dead candidate doesn't hold up the rest;
+ *  (4) the first check to succeed wins ("nominated"): the controlling side
+ *      reports it right away and tells the other side with USE-CANDIDATE.
+ *
+ * Host candidates outrank server-reflexive ones, so two peers behind the
+ * same NAT find the direct LAN path before trying the hairpin through the
+ * NAT's public address. Requests from an address that isn't among the
+ * remote candidates (a "peer-reflexive" candidate, e.g. from a symmetric
+ * NAT) are answered and immediately checked back.
+ *
+ * Since the channel has one (wildcard-bound) socket, every local candidate
+ * shares it, so "candidate pairs" come down to one check per remote
+ * candidate; local candidates only feed the pair priorities.
+ */
+
+#include "DatagramChannel.hpp" //(for DatagramChannel::AddressListener)
+#include "EventLoop.hpp"
+#include "SHA1.hpp"
+#include "STUNClient.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct ICEAgent {
+	//takes over channel.on_binding_request for as long as the agent exists:
+	ICEAgent(DatagramChannel &channel);
+	~ICEAgent();
+	ICEAgent(ICEAgent const &) = delete;
+	ICEAgent &operator=(ICEAgent const &) = delete;
+
+	DatagramChannel &channel;
+	uint32_t pace_ms = 50; //between starting checks ("Ta")
+	uint32_t gather_timeout_ms = 3000; //give up waiting for a server-reflexive candidate after this long
+	uint32_t timeout_ms = 10000; //give up on connect() after this long
+
+	struct Candidate {
+		enum Type : uint8_t { Host, ServerReflexive, PeerReflexive } type = Host;
+		struct sockaddr_storage address;
+		uint32_t priority = 0;
+	};
+	std::vector< Candidate > local;
+	std::vector< Candidate > remote;
+
+	//RFC 8445 candidate priority; 'local_preference' orders candidates of the same type (65535 = best):
+	static uint32_t priority(Candidate::Type type, uint16_t local_preference);
+
+	//collect local candidates, then call 'done' (once):
+	void gather(std::function< void() > const &done);
+
+	//our half of the out-of-band exchange, one line:
+	// "ice <ufrag> <password> <tie-breaker> <type>/<address>/<priority> ..."
+	std::string description() const;
+
+	struct Result {
+		bool ok = false;
+		char const *error = nullptr; //if !ok, (static) description of what went wrong
+		struct sockaddr_storage remote; //where to send to reach the peer
+		Candidate::Type remote_type = Candidate::Host;
+		uint32_t rtt_ms = 0; //of the winning check (0 if the peer nominated it)
+	};
+	typedef std::function< void(Result const &) > Callback;
+
+	//start checks against the peer's description(); 'callback' is called once, with the nominated address.
+	// returns nullptr if checks started, otherwise (static) description of what was wrong with 'remote_description':
+	char const *connect(std::string const &remote_description, Callback const &callback);
+
+	bool controlling = false; //decided by tie-breakers in connect(); only the controlling side nominates
+	bool done = false;
+	Result result;
+
+	//------ internals ------
+	std::string ufrag, password;
+	uint64_t tie_breaker = 0;
+	std::string remote_ufrag, remote_password;
+	std::unique_ptr< HMACSHA1 > local_key, remote_key; //keys for checks sent to us, and for checks we send
+
+	struct Pair {
+		size_t remote_index;
+		uint64_t priority;
+		enum : uint8_t { Waiting, InProgress, Succeeded, Failed } state = Waiting;
+		STUNClient::TransactionID transaction = {{0, 0, 0}};
+	};
+	std::vector< Pair > pairs; //in the order added (pace() picks the best waiting one)
+	Callback callback;
+
+	std::function< void() > gather_done;
+	EventLoop::TimerID gather_timer = 0;
+	bool have_gather_listener = false;
+	std::list< DatagramChannel::AddressListener >::iterator gather_listener; //<-- removed once gathering is over
+	EventLoop::TimerID pace_timer = 0;
+	EventLoop::TimerID timeout_timer = 0;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- for the channel's address listener
+	bool have_early_nomination = false; //USE-CANDIDATE arrived before connect() was called
+	struct sockaddr_storage early_nomination;
+
+	void add_server_reflexive();
+	void finish_gathering();
+	uint64_t pair_priority(Candidate const &remote_candidate) const;
+	size_t add_pair(size_t remote_index);
+	void pace();
+	void start_check(size_t pair_index, bool nominate = false);
+	void on_check(size_t pair_index, STUNClient::Result const &result);
+	void select(size_t pair_index, uint32_t rtt_ms);
+	void report(Result const &result);
+	bool handle_request(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+};
@@ -0,0 +1,138 @@
+#include "IOUring.hpp"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+IOUring::IOUring(uint32_t sq_entries_, uint32_t cq_entries) {
+	struct io_uring_params params;
+	memset(&params, '\0', sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE;
+	params.cq_entries = cq_entries;
+	fd = int(syscall(__NR_io_uring_setup, sq_entries_, &params));
+	if (fd < 0) {
+		throw std::runtime_error(std::string("Error setting up io_uring:\n") + strerror(errno));
+	}
+
+	//map the rings (one mapping for both, on kernels that allow it):
+	sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	bool single = (params.features & IORING_FEAT_SINGLE_MMAP);
+	if (single) sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+	sq_ring = mmap(nullptr, sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (sq_ring != MAP_FAILED) {
+		cq_ring = (single ? sq_ring : mmap(nullptr, cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING));
+	}
+	if (cq_ring != MAP_FAILED && cq_ring) {
+		sqes = reinterpret_cast< struct io_uring_sqe * >(mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES));
+	}
+	if (sq_ring == MAP_FAILED || cq_ring == MAP_FAILED || !cq_ring || sqes == MAP_FAILED || !sqes) {
+		int err = errno;
+		if (sq_ring != MAP_FAILED) munmap(sq_ring, sq_ring_size);
+		if (cq_ring && cq_ring != MAP_FAILED && cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+		close(fd);
+		throw std::runtime_error(std::string("Error mapping io_uring:\n") + strerror(err));
+	}
+
+	uint8_t *sq = reinterpret_cast< uint8_t * >(sq_ring);
+	sq_entries = params.sq_entries;
+	sq_head = reinterpret_cast< uint32_t * >(sq + params.sq_off.head);
+	sq_tail = reinterpret_cast< uint32_t * >(sq + params.sq_off.tail);
+	sq_mask = *reinterpret_cast< uint32_t * >(sq + params.sq_off.ring_mask);
+	sq_array = reinterpret_cast< uint32_t * >(sq + params.sq_off.array);
+	for (uint32_t i = 0; i < sq_entries; ++i) sq_array[i] = i; //<-- (entries are always submitted in order)
+	sqe_head = sqe_tail = *sq_tail;
+
+	uint8_t *cq = reinterpret_cast< uint8_t * >(cq_ring);
+	cq_head = reinterpret_cast< uint32_t * >(cq + params.cq_off.head);
+	cq_tail = reinterpret_cast< uint32_t * >(cq + params.cq_off.tail);
+	cq_mask = *reinterpret_cast< uint32_t * >(cq + params.cq_off.ring_mask);
+	cqes = reinterpret_cast< struct io_uring_cqe * >(cq + params.cq_off.cqes);
+}
+
+IOUring::~IOUring() {
+	close(fd); //<-- (cancels anything still in flight)
+	if (buf_ring) munmap(buf_ring, buf_ring_size);
+	munmap(sqes, sqes_size);
+	if (cq_ring != sq_ring) munmap(cq_ring, cq_ring_size);
+	munmap(sq_ring, sq_ring_size);
+}
+
+struct io_uring_sqe *IOUring::get_sqe() {
+	uint32_t head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+	if (sqe_tail - head >= sq_entries) return nullptr;
+	struct io_uring_sqe *sqe = &sqes[sqe_tail & sq_mask];
+	sqe_tail += 1;
+	memset(sqe, '\0', sizeof(*sqe));
+	return sqe;
+}
+
+int IOUring::submit(uint32_t wait_for) {
+	uint32_t count = sqe_tail - sqe_head;
+	if (count == 0 && wait_for == 0) return 0;
+	__atomic_store_n(sq_tail, sqe_tail, __ATOMIC_RELEASE);
+	sqe_head = sqe_tail;
+	int ret;
+	do {
+		ret = int(syscall(__NR_io_uring_enter, fd, count, wait_for, wait_for ? IORING_ENTER_GETEVENTS : 0, nullptr, 0));
+	} while (ret < 0 && errno == EINTR);
+	return (ret < 0 ? -errno : ret);
+}
+
+bool IOUring::register_buffers(struct iovec const *iovs, uint32_t count) {
+	return syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iovs, count) == 0;
+}
+
+void IOUring::setup_buffer_ring(uint16_t group, uint32_t count, uint32_t size) {
+	if (buf_ring) {
+		throw std::runtime_error("IOUring: buffer ring already set up.");
+	}
+	if (count == 0 || (count & (count - 1)) != 0 || count > 32768) {
+		throw std::runtime_error("IOUring: buffer count must be a power of two, at most 32768.");
+	}
+	//(the ring itself must be page-aligned, so it gets its own mapping)
+	buf_ring_size = count * sizeof(struct io_uring_buf);
+	void *ring = mmap(nullptr, buf_ring_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		throw std::runtime_error(std::string("Error allocating io_uring buffer ring:\n") + strerror(errno));
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, '\0', sizeof(reg));
+	reg.ring_addr = reinterpret_cast< uint64_t >(ring);
+	reg.ring_entries = count;
+	reg.bgid = group;
+	if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) != 0) {
+		int err = errno;
+		munmap(ring, buf_ring_size);
+		throw std::runtime_error(std::string("Error registering io_uring buffer ring:\n") + strerror(err));
+	}
+	buf_ring = reinterpret_cast< struct io_uring_buf_ring * >(ring);
+	buffer_group = group;
+	buf_count = count;
+	buffer_size = size;
+	buffers.assign(size_t(count) * size, 0);
+	buf_tail = 0;
+	for (uint32_t id = 0; id < count; ++id) recycle(uint16_t(id));
+	publish_buffers();
+}
+
+void IOUring::recycle(uint16_t id) {
+	//(not buf_ring->bufs: in C++, the header's flexible-array trick moves it 8 bytes off the ring's start)
+	struct io_uring_buf &buf = reinterpret_cast< struct io_uring_buf * >(buf_ring)[buf_tail & (buf_count - 1)];
+	buf.addr = reinterpret_cast< uint64_t >(buffer(id));
+	buf.len = buffer_size;
+	buf.bid = id;
+	buf_tail += 1;
+}
+
+void IOUring::publish_buffers() {
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
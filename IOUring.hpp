@@ -0,0 +1,85 @@
+#pragma once
+
+/*
+ * IOUring is a minimal io_uring wrapper, straight on the syscalls (no
+ * liburing): set up + map the rings, hand out submission entries, submit,
+ * and walk completions in batches. Plus the two registrations
+ * DatagramChannel's io_uring backend needs:
+ *  - fixed buffers (IORING_REGISTER_BUFFERS), which operations can then
+ *    use without the kernel pinning / mapping pages each time;
+ *  - a provided-buffer ring (IORING_REGISTER_PBUF_RING), which multishot
+ *    receives pick their buffers from; consumers give buffers back with
+ *    recycle() and make them visible again with publish_buffers().
+ *
+ * The ring fd is pollable: it reads as ready while completions are waiting,
+ * so an EventLoop can watch it like a socket.
+ *
+ * Single-threaded, and reap() must not be called from inside reap().
+ */
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <vector>
+
+struct IOUring {
+	//throws if io_uring is unavailable (old kernel, or disabled by sysctl / seccomp):
+	IOUring(uint32_t sq_entries, uint32_t cq_entries);
+	~IOUring();
+	IOUring(IOUring const &) = delete;
+	IOUring &operator=(IOUring const &) = delete;
+
+	int fd = -1;
+
+	//next submission entry (zeroed), or nullptr if the queue is full (submit() and try again):
+	struct io_uring_sqe *get_sqe();
+	//entries from get_sqe() not yet submitted:
+	uint32_t pending() const { return sqe_tail - sqe_head; }
+	//hand pending entries to the kernel (waiting for 'wait_for' completions); returns the count taken, or -errno:
+	int submit(uint32_t wait_for = 0);
+
+	//call 'f' with each waiting completion, oldest first, then release them all at once; returns how many:
+	template< typename F >
+	uint32_t reap(F const &f) {
+		uint32_t head = *cq_head;
+		uint32_t tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+		for (uint32_t at = head; at != tail; ++at) f(cqes[at & cq_mask]);
+		__atomic_store_n(cq_head, tail, __ATOMIC_RELEASE);
+		return tail - head;
+	}
+
+	//register 'count' fixed buffers; returns false (with errno set) on failure:
+	bool register_buffers(struct iovec const *iovs, uint32_t count);
+
+	//------ provided buffers ------
+	//register a ring of 'count' (a power of two, at most 32768) buffers of 'size' bytes each, as buffer group 'group';
+	// all start out available. Throws on failure:
+	void setup_buffer_ring(uint16_t group, uint32_t count, uint32_t size);
+	uint8_t *buffer(uint16_t id) { return &buffers[size_t(id) * buffer_size]; }
+	uint32_t buffer_size = 0;
+	//give buffer 'id' back (not seen by the kernel until publish_buffers()):
+	void recycle(uint16_t id);
+	void publish_buffers();
+
+	//------ internals ------
+	uint32_t sq_entries = 0;
+	uint32_t *sq_head = nullptr, *sq_tail = nullptr, *sq_array = nullptr;
+	uint32_t sq_mask = 0;
+	struct io_uring_sqe *sqes = nullptr;
+	uint32_t sqe_head = 0, sqe_tail = 0; //handed out by get_sqe(): [sqe_head, sqe_tail) not submitted yet
+
+	uint32_t *cq_head = nullptr, *cq_tail = nullptr;
+	uint32_t cq_mask = 0;
+	struct io_uring_cqe *cqes = nullptr;
+
+	void *sq_ring = nullptr, *cq_ring = nullptr;
+	size_t sq_ring_size = 0, cq_ring_size = 0, sqes_size = 0;
+
+	uint16_t buffer_group = 0;
+	struct io_uring_buf_ring *buf_ring = nullptr;
+	size_t buf_ring_size = 0;
+	uint32_t buf_count = 0;
+	uint16_t buf_tail = 0;
+	std::vector< uint8_t > buffers;
+};
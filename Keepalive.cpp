@@ -0,0 +1,231 @@
+#include "Keepalive.hpp"
+
+#include "NetworkSim.hpp"
+#include "STUN.hpp"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cassert>
+#include <stdexcept>
+
+//------ LifetimeSearch ------
+
+uint32_t LifetimeSearch::next_ms() const {
+	if (hi_ms == 0) return (lo_ms == 0 ? first_ms : std::min(cap_ms, lo_ms * 2));
+	return lo_ms + (hi_ms - lo_ms) / 2;
+}
+
+void LifetimeSearch::record(uint32_t idle_ms, bool survived) {
+	if (survived) lo_ms = std::max(lo_ms, idle_ms);
+	else hi_ms = (hi_ms == 0 ? idle_ms : std::min(hi_ms, idle_ms));
+}
+
+bool LifetimeSearch::done() const {
+	if (hi_ms == 0) return lo_ms >= cap_ms;
+	return hi_ms <= lo_ms || hi_ms - lo_ms <= std::max(2000U, lo_ms / 10);
+}
+
+//------ BindingLifetimeProbe ------
+
+BindingLifetimeProbe::BindingLifetimeProbe(DatagramChannel &beside, std::vector< std::string > const &servers_) : loop(beside.loop), servers(servers_) {
+	if (beside.network) channel = beside.network->add_socket(beside);
+	else channel.reset(new DatagramChannel(loop, 0));
+}
+
+BindingLifetimeProbe::~BindingLifetimeProbe() {
+	if (timer) loop.cancel(timer);
+	if (checking) channel->stun->cancel(transaction);
+}
+
+static uint16_t port_of(struct sockaddr_storage const &address) {
+	if (address.ss_family == AF_INET6) return ntohs(reinterpret_cast< struct sockaddr_in6 const & >(address).sin6_port);
+	return ntohs(reinterpret_cast< struct sockaddr_in const & >(address).sin_port);
+}
+
+void BindingLifetimeProbe::start(Callback const &callback_) {
+	if (state != Idle) {
+		throw std::runtime_error("BindingLifetimeProbe: already started.");
+	}
+	callback = callback_;
+	state = Resolving;
+
+	//race the servers once, to pick the one all probes go to and to get the first binding:
+	channel->stun_servers = servers;
+	channel->address_listeners.emplace_back([this](STUNServerRace::Result const &result, bool) {
+		if (state != Resolving) return;
+		if (!result.ok) {
+			fail(result.error);
+			return;
+		}
+		server = result.server_address;
+		mapped = result.mapped;
+		//a NAT that keeps the local port (or no NAT at all) would hand the same mapping back
+		// after an expiry, so "same mapping" wouldn't mean "binding survived":
+		if (port_of(mapped) == port_of(channel->local_address())) {
+			fail("Mapped port matches local port (no NAT, or a port-preserving one); can't measure binding lifetime.");
+			return;
+		}
+		wait();
+	});
+	channel->check_address();
+}
+
+void BindingLifetimeProbe::wait() {
+	state = Waiting;
+	waiting_ms = search.next_ms();
+	timer = loop.after(waiting_ms, [this]() {
+		timer = 0;
+		state = Checking;
+		checking = true;
+		transaction = channel->stun->binding_request(server, [this](STUNClient::Result const &result) {
+			checking = false;
+			on_check(result);
+		});
+	});
+}
+
+void BindingLifetimeProbe::on_check(STUNClient::Result const &result) {
+	if (!result.ok) {
+		fail(result.error);
+		return;
+	}
+	//(if the binding died, the request just made a new one -- which is what the next step watches)
+	search.record(waiting_ms, same_address(mapped, result.mapped));
+	mapped = result.mapped;
+
+	if (search.done()) state = Done;
+	else wait();
+	if (callback) callback(*this);
+}
+
+void BindingLifetimeProbe::fail(char const *error_) {
+	state = Failed;
+	error = error_;
+	if (callback) callback(*this);
+}
+
+//------ KeepaliveScheduler ------
+
+KeepaliveScheduler::KeepaliveScheduler(DatagramChannel &channel_, uint32_t coalesce_ms_) : channel(channel_), coalesce_ms(coalesce_ms_), wheel(EventLoop::now(), coalesce_ms_), mt(channel_.random_seed()) {
+	if (coalesce_ms == 0) {
+		throw std::runtime_error("KeepaliveScheduler: coalesce_ms must be positive.");
+	}
+}
+
+KeepaliveScheduler::~KeepaliveScheduler() {
+	if (timer) channel.loop.cancel(timer);
+}
+
+void KeepaliveScheduler::set_interval(uint32_t ms) {
+	ms = std::max(min_interval_ms, std::min(max_interval_ms, ms));
+	if (ms == interval_ms) return;
+	bool shorter = (ms < interval_ms);
+	interval_ms = ms;
+	//longer intervals are picked up lazily (timers that come due early just re-arm); shorter ones can't wait:
+	if (shorter) {
+		for (uint32_t id = 0; id < slots.size(); ++id) {
+			if (slots[id].used) schedule(id);
+		}
+		arm();
+	}
+}
+
+void KeepaliveScheduler::add(struct sockaddr_storage const &peer) {
+	if (index.count(peer)) return;
+	uint32_t id;
+	if (!free_slots.empty()) {
+		id = free_slots.back();
+		free_slots.pop_back();
+	} else {
+		id = uint32_t(slots.size());
+		slots.emplace_back();
+	}
+	Slot &slot = slots[id];
+	slot.peer = peer;
+	slot.last_send_ms = EventLoop::now(); //<-- assume a fresh peer was just talked to
+	slot.used = true;
+	index.emplace(peer, id);
+	schedule(id);
+	arm();
+}
+
+void KeepaliveScheduler::remove(struct sockaddr_storage const &peer) {
+	auto f = index.find(peer);
+	if (f == index.end()) return;
+	uint32_t id = f->second;
+	index.erase(f);
+	wheel.unschedule(id);
+	slots[id].used = false;
+	free_slots.emplace_back(id);
+	//(the loop timer is left alone; if nothing else is due it just finds nothing to do)
+}
+
+//due one tick early at most -- the wheel rounds up to a tick, so this never fires late:
+void KeepaliveScheduler::schedule(uint32_t id) {
+	uint64_t due = slots[id].last_send_ms + interval_ms;
+	wheel.schedule(id, due > coalesce_ms ? due - coalesce_ms : 0);
+}
+
+void KeepaliveScheduler::arm() {
+	uint64_t at = wheel.next_wakeup_ms();
+	if (at >= timer_at) return; //<-- already waking up sooner (and re-arming then)
+	if (timer) channel.loop.cancel(timer);
+	timer_at = at;
+	if (at == ~uint64_t(0)) {
+		timer = 0;
+		return;
+	}
+	uint64_t now = EventLoop::now();
+	timer = channel.loop.after(uint32_t(at > now ? std::min< uint64_t >(at - now, 0x7fffffff) : 0), [this]() {
+		timer = 0;
+		timer_at = ~uint64_t(0);
+		on_timer();
+	});
+}
+
+void KeepaliveScheduler::on_timer() {
+	wakeups += 1;
+	uint64_t now = EventLoop::now();
+	expired.clear();
+	wheel.advance(now, expired);
+	for (uint32_t id : expired) {
+		Slot &slot = slots[id];
+		assert(slot.used);
+		//idle long enough (give or take the coalescing window) to need a keepalive?
+		if (slot.last_send_ms + interval_ms <= now + coalesce_ms) send_keepalive(slot);
+		schedule(id);
+	}
+	arm();
+}
+
+void KeepaliveScheduler::send_keepalive(Slot &slot) {
+	uint32_t id[3] = {uint32_t(mt()), uint32_t(mt()), uint32_t(mt())};
+	uint8_t buffer[STUN_HEADER_SIZE + 8];
+	STUNMessageBuilder builder(buffer, sizeof(buffer), STUN_BINDING_INDICATION, reinterpret_cast< uint8_t const * >(id));
+	builder.add_fingerprint();
+	//(a failed send is treated like a lost packet; the next keepalive is an interval away either way)
+	channel.queue_to(slot.peer, buffer, builder.finish());
+	slot.last_send_ms = EventLoop::now();
+	keepalives_sent += 1;
+}
+
+void KeepaliveScheduler::probe_binding_lifetime(std::vector< std::string > const &servers) {
+	probe.reset(new BindingLifetimeProbe(channel, servers));
+	probe->channel->resolver = &channel.dns(); //<-- (names the channel looked up already are cached there)
+	probe->search.cap_ms = uint32_t(uint64_t(max_interval_ms) * 100 / (100 - std::min(margin_percent, 90U)));
+	probe->start([this](BindingLifetimeProbe const &p) {
+		on_probe_step(p);
+	});
+}
+
+void KeepaliveScheduler::on_probe_step(BindingLifetimeProbe const &p) {
+	uint32_t keep = 100 - std::min(margin_percent, 90U);
+	if (p.search.lo_ms != 0) {
+		set_interval(uint32_t(uint64_t(p.search.lo_ms) * keep / 100));
+	} else if (p.search.hi_ms != 0) {
+		//nothing has survived yet; at least stay clear of what is known to die:
+		set_interval(std::min(interval_ms, uint32_t(uint64_t(p.search.hi_ms) * keep / 100)));
+	}
+	if (on_probe) on_probe(p);
+}
@@ -0,0 +1,149 @@
+#pragma once
+
+/*
+ * KeepaliveScheduler keeps a channel's NAT bindings open by sending a STUN
+ * Binding Indication (header + FINGERPRINT, 28 bytes, never answered) to
+ * each peer the channel hasn't sent anything to for 'interval_ms'.
+ *
+ * Only *outgoing* traffic counts as activity: NATs must refresh a binding
+ * on outbound packets, but needn't on inbound ones (RFC 4787, REQ-6).
+ *
+ * Keeping the packet + wakeup count down:
+ *  - a send just stamps the peer's last-send time (no timer work); a peer's
+ *    timer only looks at the stamp when it comes due, and re-arms itself
+ *    if the peer turned out to be busy -- so busy peers never get keepalives;
+ *  - all peers' timers share one HierarchicalTimerWheel, behind a single
+ *    EventLoop timer;
+ *  - deadlines are rounded *down* to 'coalesce_ms', so peers that come due
+ *    close together share a wakeup (and, with batching, a sendmmsg()).
+ *
+ * BindingLifetimeProbe measures how long this NAT keeps an idle binding;
+ * probe_binding_lifetime() runs one and moves interval_ms toward the result.
+ */
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "HierarchicalTimerWheel.hpp"
+#include "STUNClient.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//Search over idle times for the longest one a binding survives:
+// double from first_ms until a binding dies (or cap_ms survives), then bisect until the gap is within 10% (or 2s).
+struct LifetimeSearch {
+	uint32_t first_ms = 30000;
+	uint32_t cap_ms = 300000;
+
+	uint32_t lo_ms = 0; //longest idle time a binding is known to survive
+	uint32_t hi_ms = 0; //shortest idle time a binding is known to die at (0 = none seen yet)
+
+	uint32_t next_ms() const;
+	void record(uint32_t idle_ms, bool survived);
+	bool done() const;
+};
+
+struct BindingLifetimeProbe {
+	//probes are sent from a fresh socket beside 'channel' (so its own traffic can't refresh the binding under test)
+	// -- a real one, or, if 'channel' is simulated, another simulated one on the same host:
+	BindingLifetimeProbe(DatagramChannel &beside, std::vector< std::string > const &servers);
+	~BindingLifetimeProbe();
+	BindingLifetimeProbe(BindingLifetimeProbe const &) = delete;
+	BindingLifetimeProbe &operator=(BindingLifetimeProbe const &) = delete;
+
+	EventLoop &loop;
+	std::vector< std::string > servers;
+	std::unique_ptr< DatagramChannel > channel;
+
+	LifetimeSearch search;
+
+	enum : uint8_t { Idle, Resolving, Waiting, Checking, Done, Failed } state = Idle;
+	char const *error = nullptr; //if Failed, (static) description of what went wrong
+
+	//called after every step (and once more when state becomes Done or Failed):
+	typedef std::function< void(BindingLifetimeProbe const &) > Callback;
+	void start(Callback const &callback);
+
+	struct sockaddr_storage server; //the server all probes go to (picked by racing 'servers')
+	struct sockaddr_storage mapped; //the binding currently being watched
+
+	//------ internals ------
+	Callback callback;
+	uint32_t waiting_ms = 0;
+	EventLoop::TimerID timer = 0;
+	STUNClient::TransactionID transaction;
+	bool checking = false;
+
+	void wait();
+	void on_check(STUNClient::Result const &result);
+	void fail(char const *error);
+};
+
+struct KeepaliveScheduler {
+	KeepaliveScheduler(DatagramChannel &channel, uint32_t coalesce_ms = 1000);
+	~KeepaliveScheduler();
+	KeepaliveScheduler(KeepaliveScheduler const &) = delete;
+	KeepaliveScheduler &operator=(KeepaliveScheduler const &) = delete;
+
+	DatagramChannel &channel;
+	uint32_t const coalesce_ms;
+
+	//keep a peer idle at most this long; set_interval() adjusts existing timers:
+	uint32_t interval_ms = 15000; //<-- RFC 5626 uses 15s for UDP too
+	uint32_t min_interval_ms = 10000;
+	uint32_t max_interval_ms = 120000;
+	void set_interval(uint32_t ms);
+
+	//start / stop keeping 'peer' alive (add() of a known peer, or remove() of an unknown one, does nothing):
+	void add(struct sockaddr_storage const &peer);
+	void remove(struct sockaddr_storage const &peer);
+	size_t peers() const { return index.size(); }
+
+	//called by the channel whenever it sends something:
+	void sent(struct sockaddr_storage const &to) {
+		if (index.empty()) return;
+		auto f = index.find(to);
+		if (f != index.end()) slots[f->second].last_send_ms = EventLoop::now();
+	}
+
+	uint64_t keepalives_sent = 0;
+	uint64_t wakeups = 0;
+
+	//------ binding lifetime ------
+	//measure this NAT's binding lifetime against 'servers' ("host[:port]"); interval_ms follows the
+	// measurement, staying 'margin_percent' under the longest idle time a binding was seen to survive:
+	void probe_binding_lifetime(std::vector< std::string > const &servers);
+	uint32_t margin_percent = 25;
+	std::unique_ptr< BindingLifetimeProbe > probe;
+	BindingLifetimeProbe::Callback on_probe; //called after each probe step (after interval_ms is updated)
+
+	//------ internals ------
+	struct Slot {
+		struct sockaddr_storage peer;
+		uint64_t last_send_ms = 0;
+		bool used = false;
+	};
+	std::vector< Slot > slots; //indexed by wheel id
+	std::vector< uint32_t > free_slots;
+	std::unordered_map< struct sockaddr_storage, uint32_t, AddressHash, AddressEqual > index;
+
+	HierarchicalTimerWheel wheel;
+	EventLoop::TimerID timer = 0;
+	uint64_t timer_at = ~uint64_t(0);
+	std::vector< uint32_t > expired; //(reused between wakeups)
+	std::mt19937 mt;
+
+	void schedule(uint32_t id);
+	void arm();
+	void on_timer();
+	void send_keepalive(Slot &slot);
+	void on_probe_step(BindingLifetimeProbe const &probe);
+};
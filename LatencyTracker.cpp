@@ -0,0 +1,151 @@
+#include "LatencyTracker.hpp"
+
+#include "DatagramChannel.hpp"
+#include "Metrics.hpp"
+#include "STUN.hpp"
+
+#include <algorithm>
+
+constexpr uint8_t LATENCY_PING = 0xE2;
+constexpr uint8_t LATENCY_PONG = 0xE3;
+constexpr size_t PingSize = 1 + 8;
+constexpr size_t PongSize = 1 + 8 + 4 + 8;
+
+static uint64_t read_u64(uint8_t const *p) {
+	return (uint64_t(stun_read_u32(p)) << 32) | stun_read_u32(p + 4);
+}
+
+static void write_u64(uint8_t *p, uint64_t v) {
+	stun_write_u32(p, uint32_t(v >> 32));
+	stun_write_u32(p + 4, uint32_t(v));
+}
+
+LatencyTracker::LatencyTracker(DatagramChannel &channel_, uint32_t interval_ms_) : channel(channel_), interval_ms(std::max(1U, interval_ms_)) {
+}
+
+LatencyTracker::~LatencyTracker() {
+	if (timer) channel.loop.cancel(timer);
+}
+
+void LatencyTracker::add(struct sockaddr_storage const &peer) {
+	if (!peers.emplace(peer, Peer()).second) return;
+	ping(peer); //<-- (a first number right away)
+	if (!timer) {
+		timer = channel.loop.after(interval_ms, [this]() {
+			timer = 0;
+			tick();
+		});
+	}
+}
+
+void LatencyTracker::remove(struct sockaddr_storage const &peer) {
+	peers.erase(peer);
+}
+
+void LatencyTracker::ping(struct sockaddr_storage const &peer) {
+	auto f = peers.find(peer);
+	if (f != peers.end()) send_ping(f->first, f->second);
+}
+
+LatencyTracker::Stats const *LatencyTracker::find(struct sockaddr_storage const &peer) const {
+	auto f = peers.find(peer);
+	return (f == peers.end() ? nullptr : &f->second.stats);
+}
+
+void LatencyTracker::tick() {
+	for (auto &entry : peers) send_ping(entry.first, entry.second);
+	if (peers.empty()) return; //<-- (add() starts things up again)
+	timer = channel.loop.after(interval_ms, [this]() {
+		timer = 0;
+		tick();
+	});
+}
+
+void LatencyTracker::send_ping(struct sockaddr_storage const &peer, Peer &p) {
+	uint8_t packet[PingSize];
+	packet[0] = LATENCY_PING;
+	uint64_t now = EventLoop::now_us();
+	write_u64(packet + 1, now);
+	//NOTE: a failed send is just a lost PING
+	channel.send_to(peer, packet, sizeof(packet));
+	p.outstanding[p.next_outstanding] = now;
+	p.next_outstanding = (p.next_outstanding + 1) % Outstanding;
+	p.stats.pings += 1;
+}
+
+void LatencyTracker::transit(Peer &p, uint64_t peer_sent_us, uint64_t arrival_us) {
+	//RFC 3550, 6.4.1 / A.8: J += (|D| - J) / 16, kept scaled by 16:
+	int64_t transit = int64_t(arrival_us - peer_sent_us);
+	if (p.have_transit) {
+		int64_t d = transit - p.last_transit_us;
+		uint64_t delta = uint64_t(d < 0 ? -d : d);
+		delta = std::min< uint64_t >(delta, 0x0fffffff); //<-- (a peer restart's clock jump shouldn't wrap it)
+		p.jitter_x16 = uint32_t(int64_t(p.jitter_x16) + int64_t(delta) - int64_t((p.jitter_x16 + 8) >> 4));
+		p.stats.jitter_us = p.jitter_x16 >> 4;
+	}
+	p.have_transit = true;
+	p.last_transit_us = transit;
+}
+
+bool LatencyTracker::handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	uint64_t arrival = channel.arrival_us();
+	if (data[0] == LATENCY_PING) {
+		if (size < PingSize) {
+			if (channel.metrics) channel.metrics->parse_errors.add();
+			return true;
+		}
+		uint64_t sent = read_u64(data + 1);
+		uint8_t packet[PongSize];
+		packet[0] = LATENCY_PONG;
+		write_u64(packet + 1, sent);
+		uint64_t now = EventLoop::now_us();
+		stun_write_u32(packet + 9, uint32_t(std::min< uint64_t >(now - std::min(now, arrival), 0xffffffff)));
+		write_u64(packet + 13, now);
+		channel.send_to(from, packet, sizeof(packet));
+
+		auto f = peers.find(from);
+		if (f != peers.end()) transit(f->second, sent, arrival);
+		return true;
+	}
+	if (data[0] == LATENCY_PONG) {
+		if (size < PongSize) {
+			if (channel.metrics) channel.metrics->parse_errors.add();
+			return true;
+		}
+		auto f = peers.find(from);
+		if (f == peers.end()) return true;
+		Peer &p = f->second;
+		//only an echo of a PING we sent (and haven't had answered yet) counts:
+		uint64_t echoed = read_u64(data + 1);
+		uint32_t slot = Outstanding;
+		for (uint32_t i = 0; i < Outstanding; ++i) {
+			if (echoed && p.outstanding[i] == echoed) slot = i;
+		}
+		if (slot == Outstanding || echoed > arrival) return true;
+		p.outstanding[slot] = 0;
+		transit(p, read_u64(data + 13), arrival);
+
+		uint64_t hold = stun_read_u32(data + 9);
+		uint64_t elapsed = arrival - echoed;
+		uint32_t rtt = uint32_t(std::max< uint64_t >(1, std::min< uint64_t >(elapsed > hold ? elapsed - hold : 1, 0xffffffff)));
+
+		//RFC 6298, in microseconds:
+		Stats &stats = p.stats;
+		if (stats.samples == 0) {
+			stats.srtt_us = rtt;
+			stats.rttvar_us = rtt / 2;
+			stats.min_rtt_us = rtt;
+		} else {
+			uint32_t delta = (stats.srtt_us > rtt ? stats.srtt_us - rtt : rtt - stats.srtt_us);
+			stats.rttvar_us = (3 * stats.rttvar_us + delta) / 4;
+			stats.srtt_us = (7 * stats.srtt_us + rtt) / 8;
+			stats.min_rtt_us = std::min(stats.min_rtt_us, rtt);
+		}
+		stats.last_rtt_us = rtt;
+		stats.samples += 1;
+		if (channel.metrics) channel.metrics->rtt_us.record(rtt);
+		if (on_sample) on_sample(from, stats);
+		return true;
+	}
+	return false;
+}
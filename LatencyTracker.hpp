@@ -0,0 +1,90 @@
+#pragma once
+
+/*
+ * LatencyTracker keeps round-trip time and jitter numbers for each peer of a
+ * DatagramChannel, from a lightweight timestamp echo:
+ *  - every 'interval_ms', each tracked peer gets a PING with our send time;
+ *  - the peer's tracker answers right away with a PONG that echoes it, says
+ *    how long the PING was held (arrival to reply), and carries its own
+ *    send time;
+ *  - RTT = PONG arrival - PING send - hold, smoothed as per RFC 6298
+ *    (srtt, rttvar), plus the minimum and the latest sample;
+ *  - one-way jitter (peer -> us) is RFC 3550's interarrival jitter, from the
+ *    send times in the peer's PINGs and PONGs and our arrival times -- the
+ *    two clocks' offset cancels out.
+ *
+ * Arrival times are the channel's kernel receive timestamps
+ * (DatagramChannel::enable_timestamps(), turned on by enable_latency_tracking()),
+ * i.e., when the datagram reached the socket rather than when the loop got
+ * around to reading it; so a busy loop doesn't show up as network latency.
+ * Updating a peer's numbers is a handful of integer operations per PONG;
+ * reading them (find()) is one hash lookup.
+ *
+ * Both ends need a tracker (DatagramChannel::enable_latency_tracking()) to
+ * answer PINGs; numbers are only kept for peers added with add().
+ *
+ * On the wire (first bytes from RFC 7983's unassigned range, next to ReliableStream's):
+ *   PING: 0xE2 | sent_us (8)
+ *   PONG: 0xE3 | echoed sent_us (8) | hold_us (4) | sent_us (8)
+ */
+
+#include "EventLoop.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+
+struct DatagramChannel;
+
+struct LatencyTracker {
+	LatencyTracker(DatagramChannel &channel, uint32_t interval_ms = 1000);
+	~LatencyTracker();
+	LatencyTracker(LatencyTracker const &) = delete;
+	LatencyTracker &operator=(LatencyTracker const &) = delete;
+
+	DatagramChannel &channel;
+	uint32_t const interval_ms;
+
+	//start / stop pinging 'peer' (and keeping its numbers):
+	void add(struct sockaddr_storage const &peer);
+	void remove(struct sockaddr_storage const &peer);
+	//ping a tracked peer now (e.g., for a fresh number before picking a route):
+	void ping(struct sockaddr_storage const &peer);
+
+	struct Stats {
+		uint32_t srtt_us = 0; //(all 0 until the first sample)
+		uint32_t rttvar_us = 0;
+		uint32_t min_rtt_us = 0;
+		uint32_t last_rtt_us = 0;
+		uint32_t jitter_us = 0; //peer -> us
+		uint64_t samples = 0; //RTT samples
+		uint64_t pings = 0; //sent
+	};
+	//numbers for 'peer', or nullptr if it isn't tracked:
+	Stats const *find(struct sockaddr_storage const &peer) const;
+
+	//called after each RTT sample:
+	std::function< void(struct sockaddr_storage const &peer, Stats const &stats) > on_sample;
+
+	//------ internals ------
+	static constexpr uint32_t Outstanding = 4; //PINGs a PONG may still answer
+	struct Peer {
+		Stats stats;
+		uint64_t outstanding[Outstanding] = {0, 0, 0, 0}; //send times of recent PINGs (0 = answered)
+		uint32_t next_outstanding = 0;
+		bool have_transit = false;
+		int64_t last_transit_us = 0; //arrival - peer's send time, of the last timestamp from the peer
+		uint32_t jitter_x16 = 0; //(RFC 3550's scaled integer form)
+	};
+	std::unordered_map< struct sockaddr_storage, Peer, AddressHash, AddressEqual > peers;
+	EventLoop::TimerID timer = 0;
+
+	void tick();
+	void send_ping(struct sockaddr_storage const &peer, Peer &p);
+	void transit(Peer &p, uint64_t peer_sent_us, uint64_t arrival_us);
+	//called by the channel for datagrams that start with 0xE2 / 0xE3; returns true if it was one of ours:
+	bool handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+};
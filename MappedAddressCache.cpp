@@ -0,0 +1,48 @@
+#include "MappedAddressCache.hpp"
+
+#include "SocketAddress.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+MappedAddressCache::Entry const *MappedAddressCache::find(struct sockaddr_storage const &local) const {
+	auto f = entries.find(address_to_string(local));
+	if (f == entries.end()) return nullptr;
+	return &f->second;
+}
+
+void MappedAddressCache::update(struct sockaddr_storage const &local, Entry const &entry) {
+	entries[address_to_string(local)] = entry;
+}
+
+void MappedAddressCache::load(std::string const &filename) {
+	std::ifstream in(filename);
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream str(line);
+		std::string local, mapped;
+		Entry entry;
+		if (!(str >> local >> mapped >> entry.server >> entry.timestamp)) continue;
+		if (!address_from_string(mapped, &entry.mapped)) continue;
+		entries[local] = entry;
+	}
+}
+
+void MappedAddressCache::save(std::string const &filename) const {
+	//write to a temporary + rename, so a crash mid-write can't leave a truncated cache:
+	std::string temp = filename + ".tmp";
+	{
+		std::ofstream out(temp);
+		for (auto const &e : entries) {
+			out << e.first << ' ' << address_to_string(e.second.mapped) << ' ' << e.second.server << ' ' << e.second.timestamp << '\n';
+		}
+		if (!out) {
+			throw std::runtime_error("Error writing mapped address cache to '" + temp + "'.");
+		}
+	}
+	if (std::rename(temp.c_str(), filename.c_str()) != 0) {
+		throw std::runtime_error("Error renaming '" + temp + "' to '" + filename + "'.");
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+
+/*
+ * MappedAddressCache remembers, across runs, the public (mapped) address
+ * STUN last reported for each local bind address -- so that a restarted
+ * process can hand out its address right away and confirm it in the
+ * background, instead of waiting on DNS + a STUN round trip.
+ *
+ * (see DatagramChannel::what_is_my_address())
+ */
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <map>
+#include <string>
+
+struct MappedAddressCache {
+	struct Entry {
+		struct sockaddr_storage mapped;
+		std::string server; //STUN server that reported it
+		uint64_t timestamp = 0; //when it was reported (unix time, seconds)
+	};
+	std::map< std::string, Entry > entries; //keyed by local bind address, as address_to_string()
+
+	//entry for 'local', or nullptr if none:
+	Entry const *find(struct sockaddr_storage const &local) const;
+	void update(struct sockaddr_storage const &local, Entry const &entry);
+
+	//text file, one "local mapped server timestamp" line per bind address.
+	// load() silently ignores a missing file (and malformed lines); save() throws on error.
+	void load(std::string const &filename);
+	void save(std::string const &filename) const;
+};
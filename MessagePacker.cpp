@@ -0,0 +1,379 @@
+#include "MessagePacker.hpp"
+
+#include "DatagramChannel.hpp"
+#include "Metrics.hpp"
+#include "STUN.hpp"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+constexpr uint8_t PACKED = 0xE4;
+constexpr uint8_t FRAGMENT = 0xE5;
+constexpr uint8_t PROBE = 0xE6;
+constexpr uint8_t PROBE_ACK = 0xE7;
+
+//------ PathMTUSearch ------
+
+uint32_t PathMTUSearch::next() const {
+	if (mtu >= max) return 0;
+	if (too_big == 0) return max;
+	if (too_big <= mtu + step) return 0;
+	return mtu + (too_big - mtu) / 2;
+}
+
+void PathMTUSearch::record(uint32_t size, bool got_through) {
+	if (got_through) {
+		mtu = std::max(mtu, size);
+		if (too_big != 0 && too_big <= mtu) too_big = 0; //<-- (the path got better)
+	} else {
+		if (size <= mtu) mtu = base; //<-- (the path got worse)
+		too_big = (too_big == 0 ? size : std::min(too_big, size));
+	}
+}
+
+//------ MessagePacker ------
+
+MessagePacker::MessagePacker(DatagramChannel &channel_, uint32_t flush_ms_) : channel(channel_), flush_ms(flush_ms_), mt(channel_.random_seed()) {
+	//set DF and keep the kernel from fragmenting (or from capping sizes at its own idea of the path MTU):
+	// (simulated networks never fragment, and refuse what's over a link's MTU anyway)
+	int value = IP_PMTUDISC_PROBE;
+	if (!channel.network && setsockopt(channel.sockfd, IPPROTO_IP, IP_MTU_DISCOVER, &value, sizeof(value)) != 0) {
+		throw std::runtime_error(std::string("Error setting IP_MTU_DISCOVER:\n") + strerror(errno));
+	}
+}
+
+MessagePacker::~MessagePacker() {
+	if (reap_timer) channel.loop.cancel(reap_timer);
+	for (auto &entry : peers) {
+		Peer &p = *entry.second;
+		send_packed(p);
+		if (p.probe_timer) channel.loop.cancel(p.probe_timer);
+	}
+}
+
+MessagePacker::Peer &MessagePacker::peer(struct sockaddr_storage const &address, bool sending) {
+	auto f = peers.find(address);
+	if (f != peers.end()) {
+		if (sending && receive_only(*f->second)) receive_only_peers -= 1; //<-- (send() is about to start searching)
+		return *f->second;
+	}
+	if (!sending) {
+		if (receive_only_peers >= max_receive_peers) forget_idlest();
+		receive_only_peers += 1;
+	}
+	std::unique_ptr< Peer > &p = peers[address];
+	p.reset(new Peer);
+	p->address = address;
+	p->search.base = base_mtu;
+	p->search.max = max_mtu;
+	p->search.mtu = base_mtu;
+	return *p;
+}
+
+uint32_t MessagePacker::mtu(struct sockaddr_storage const &address) const {
+	auto f = peers.find(address);
+	return (f != peers.end() ? f->second->search.mtu : base_mtu);
+}
+
+void MessagePacker::remove(struct sockaddr_storage const &address) {
+	auto f = peers.find(address);
+	if (f == peers.end()) return;
+	Peer &p = *f->second;
+	send_packed(p);
+	if (p.probe_timer) channel.loop.cancel(p.probe_timer);
+	if (receive_only(p)) receive_only_peers -= 1;
+	peers.erase(f);
+}
+
+//------ sending ------
+
+bool MessagePacker::send(struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	if (size > MaxMessage) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	Peer &p = peer(to, true);
+	if (!p.searching) {
+		p.searching = true;
+		next_probe(p);
+	}
+	messages_sent += 1;
+
+	uint32_t mtu = p.search.mtu;
+	bool ok = true;
+	if (PackedHeader + LengthPrefix + size > mtu) {
+		ok = send_packed(p); //<-- (so messages still leave in order)
+		return send_fragments(p, data, size) && ok;
+	}
+	if (!p.packed.empty() && p.packed.size() + LengthPrefix + size > mtu) ok = send_packed(p);
+	if (p.packed.empty()) {
+		p.packed.reserve(mtu);
+		p.packed.push_back(PACKED);
+		Peer *pp = &p;
+		p.flush.schedule(channel, flush_ms, [this, pp]() {
+			send_packed(*pp);
+		});
+	}
+	size_t at = p.packed.size();
+	p.packed.resize(at + LengthPrefix + size);
+	stun_write_u16(&p.packed[at], uint16_t(size));
+	memcpy(&p.packed[at + LengthPrefix], data, size);
+	//no room left for another message? don't wait for one:
+	if (p.packed.size() + LengthPrefix >= mtu) ok = send_packed(p) && ok;
+	return ok;
+}
+
+bool MessagePacker::send_packed(Peer &p) {
+	p.flush.cancel();
+	if (p.packed.empty()) return true;
+	datagrams_sent += 1;
+	bool ok = channel.queue_to(p.address, p.packed.data(), p.packed.size());
+	p.packed.clear();
+	return ok;
+}
+
+bool MessagePacker::send_fragments(Peer &p, uint8_t const *data, size_t size) {
+	size_t room = p.search.mtu - FragmentHeader;
+	size_t count = (size + room - 1) / room;
+	if (count > MaxFragments) {
+		errno = EMSGSIZE;
+		return false;
+	}
+	size_t piece = (size + count - 1) / count; //<-- (even pieces, rather than a runt at the end)
+	uint16_t id = p.next_id++;
+	bool ok = true;
+	for (size_t i = 0; i < count; ++i) {
+		size_t begin = i * piece;
+		size_t length = std::min(piece, size - begin);
+		scratch.resize(FragmentHeader + length);
+		scratch[0] = FRAGMENT;
+		stun_write_u16(&scratch[1], id);
+		scratch[3] = uint8_t(i);
+		scratch[4] = uint8_t(count);
+		memcpy(&scratch[FragmentHeader], data + begin, length);
+		datagrams_sent += 1;
+		if (!channel.queue_to(p.address, scratch.data(), scratch.size())) ok = false;
+	}
+	return ok;
+}
+
+void MessagePacker::flush(struct sockaddr_storage const &to) {
+	auto f = peers.find(to);
+	if (f != peers.end()) send_packed(*f->second);
+}
+
+void MessagePacker::flush() {
+	for (auto &entry : peers) send_packed(*entry.second);
+}
+
+//------ path MTU ------
+
+void MessagePacker::next_probe(Peer &p) {
+	uint32_t size = p.search.next();
+	if (size != 0) {
+		start_probe(p, size);
+		return;
+	}
+	//search complete; come back later to make sure the MTU still holds, and to see if bigger ones work now:
+	p.probe_size = 0;
+	Peer *pp = &p;
+	p.probe_timer = channel.loop.after(recheck_ms, [this, pp]() {
+		pp->probe_timer = 0;
+		if (pp->search.mtu > pp->search.base) {
+			pp->confirming = true;
+			start_probe(*pp, pp->search.mtu);
+		} else {
+			pp->search.too_big = 0;
+			next_probe(*pp);
+		}
+	});
+}
+
+void MessagePacker::start_probe(Peer &p, uint32_t size) {
+	p.probe_size = size;
+	p.probe_tries = 0;
+	send_probe(p);
+}
+
+void MessagePacker::send_probe(Peer &p) {
+	p.probe_nonce = uint32_t(mt());
+	scratch.assign(p.probe_size, 0);
+	scratch[0] = PROBE;
+	stun_write_u32(&scratch[1], p.probe_nonce);
+	p.probe_tries += 1;
+	probes_sent += 1;
+	if (!channel.send_to(p.address, scratch.data(), scratch.size()) && errno == EMSGSIZE) {
+		//too big for the local interface -- no need to wait to find that out:
+		p.probe_tries = MaxProbes;
+		probe_failed(p);
+		return;
+	}
+	Peer *pp = &p;
+	p.probe_timer = channel.loop.after(probe_timeout_ms, [this, pp]() {
+		pp->probe_timer = 0;
+		if (pp->probe_tries < MaxProbes) send_probe(*pp);
+		else probe_failed(*pp);
+	});
+}
+
+void MessagePacker::probe_failed(Peer &p) {
+	if (p.confirming) {
+		//black hole: what used to get through doesn't anymore, so start over from the bottom:
+		p.confirming = false;
+		p.search.reset();
+	} else {
+		p.search.record(p.probe_size, false);
+	}
+	next_probe(p);
+}
+
+void MessagePacker::probe_acked(Peer &p) {
+	if (p.probe_timer) {
+		channel.loop.cancel(p.probe_timer);
+		p.probe_timer = 0;
+	}
+	if (p.confirming) {
+		p.confirming = false;
+		p.search.too_big = 0; //<-- (try bigger sizes again)
+	} else {
+		p.search.record(p.probe_size, true);
+	}
+	next_probe(p);
+}
+
+//------ receiving ------
+
+bool MessagePacker::handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	if (data[0] == PACKED) {
+		std::weak_ptr< bool > alive_(alive);
+		size_t at = PackedHeader;
+		while (at + LengthPrefix <= size) {
+			size_t length = stun_read_u16(data + at);
+			at += LengthPrefix;
+			if (at + length > size) { //<-- (malformed; keep what was good)
+				if (channel.metrics) channel.metrics->parse_errors.add();
+				break;
+			}
+			messages_received += 1;
+			channel.deliver(from, data + at, length);
+			if (alive_.expired()) return true; //<-- packer was replaced from inside the callback
+			at += length;
+		}
+		return true;
+	} else if (data[0] == FRAGMENT) {
+		if (size <= FragmentHeader) return false;
+		handle_fragment(from, data, size);
+		return true;
+	} else if (data[0] == PROBE) {
+		if (size < 5) return false;
+		//(no state needed to answer, so peers we've never sent to get answers too)
+		uint8_t ack[7];
+		ack[0] = PROBE_ACK;
+		memcpy(ack + 1, data + 1, 4);
+		stun_write_u16(ack + 5, uint16_t(std::min< size_t >(size, 0xffff)));
+		channel.queue_to(from, ack, sizeof(ack));
+		return true;
+	} else if (data[0] == PROBE_ACK) {
+		if (size < 7) return false;
+		auto f = peers.find(from);
+		if (f == peers.end()) return true;
+		Peer &p = *f->second;
+		if (p.probe_size != 0 && stun_read_u32(data + 1) == p.probe_nonce && stun_read_u16(data + 5) == p.probe_size) probe_acked(p);
+		return true;
+	}
+	return false;
+}
+
+void MessagePacker::handle_fragment(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	uint16_t id = stun_read_u16(data + 1);
+	uint8_t index = data[3];
+	uint8_t count = data[4];
+	if (count == 0 || index >= count) return;
+
+	Peer &p = peer(from, false);
+	p.last_receive_ms = EventLoop::now();
+	auto partial = std::find_if(p.partials.begin(), p.partials.end(), [id](Partial const &q) { return q.id == id; });
+	if (partial == p.partials.end()) {
+		if (p.partials.size() >= max_partial) {
+			fragments_dropped += p.partials.front().have;
+			p.partials.erase(p.partials.begin());
+		}
+		p.partials.emplace_back();
+		partial = p.partials.end() - 1;
+		partial->id = id;
+		partial->started_ms = EventLoop::now();
+		partial->count = count;
+		if (!reap_timer) {
+			reap_timer = channel.loop.after(reassembly_ms, [this]() {
+				reap_timer = 0;
+				reap();
+			});
+		}
+		partial->pieces.resize(count);
+	}
+	if (partial->count != count || !partial->pieces[index].empty()) return; //<-- (duplicate, or garbled)
+	partial->pieces[index].assign(data + FragmentHeader, data + size);
+	partial->have += 1;
+	if (partial->have < partial->count) return;
+
+	std::vector< uint8_t > message;
+	for (auto const &piece : partial->pieces) message.insert(message.end(), piece.begin(), piece.end());
+	p.partials.erase(partial);
+	if (p.partials.empty() && receive_only(p)) {
+		receive_only_peers -= 1;
+		peers.erase(from);
+	}
+	messages_received += 1;
+	channel.deliver(from, message.data(), message.size());
+}
+
+bool MessagePacker::receive_only(Peer const &p) {
+	return !p.searching && p.packed.empty() && !p.flush.scheduled() && !p.probe_timer;
+}
+
+void MessagePacker::forget_idlest() {
+	auto idlest = peers.end();
+	for (auto f = peers.begin(); f != peers.end(); ++f) {
+		if (!receive_only(*f->second)) continue;
+		if (idlest == peers.end() || f->second->last_receive_ms < idlest->second->last_receive_ms) idlest = f;
+	}
+	if (idlest == peers.end()) return;
+	for (auto const &partial : idlest->second->partials) fragments_dropped += partial.have;
+	receive_only_peers -= 1;
+	peers.erase(idlest);
+}
+
+void MessagePacker::reap() {
+	uint64_t now = EventLoop::now();
+	uint64_t next_ms = 0; //earliest a remaining partial goes stale
+	for (auto f = peers.begin(); f != peers.end(); ) {
+		Peer &p = *f->second;
+		for (auto partial = p.partials.begin(); partial != p.partials.end(); ) {
+			if (partial->started_ms + reassembly_ms <= now) {
+				fragments_dropped += partial->have;
+				partial = p.partials.erase(partial);
+			} else {
+				uint64_t stale_ms = partial->started_ms + reassembly_ms;
+				if (next_ms == 0 || stale_ms < next_ms) next_ms = stale_ms;
+				++partial;
+			}
+		}
+		if (p.partials.empty() && receive_only(p)) {
+			receive_only_peers -= 1;
+			f = peers.erase(f);
+		} else {
+			++f;
+		}
+	}
+	if (next_ms != 0) {
+		reap_timer = channel.loop.after(uint32_t(next_ms - now), [this]() {
+			reap_timer = 0;
+			reap();
+		});
+	}
+}
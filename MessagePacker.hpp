@@ -0,0 +1,162 @@
+#pragma once
+
+/*
+ * MessagePacker sends application messages of any size (up to MaxMessage)
+ * over a DatagramChannel in datagrams that fit the path MTU to each peer:
+ *  - small messages to the same peer are coalesced into one datagram, which
+ *    goes out once the next message wouldn't fit, or 'flush_ms' after its
+ *    first message went in (0 = at the end of this loop turn);
+ *  - a message too big for one datagram is split into fragments, and put
+ *    back together on the other side (if any fragment is lost, so is the
+ *    message, 'reassembly_ms' later -- but no IP fragmentation, which many
+ *    paths drop outright);
+ *  - each peer's path MTU is found by PLPMTUD (RFC 8899): start out at
+ *    'base' (which any sane path carries), then send padded probes of bigger
+ *    sizes that the peer's packer echoes; sizes whose probes go unanswered
+ *    'MaxProbes' times are taken as too big. A found MTU is re-checked (and
+ *    bigger sizes tried again) every 'recheck_ms'; if it stops getting
+ *    through, the peer drops back to 'base' and searches again.
+ *
+ * Enabling sets DF on the channel's socket (IP_PMTUDISC_PROBE), so the
+ * kernel never fragments -- probes measure the path, and raw send_to()s
+ * bigger than the interface MTU fail with EMSGSIZE.
+ *
+ * Both ends need a packer (DatagramChannel::enable_packing()); messages it
+ * unpacks go to the channel's on_receive (or PeerChannel, with a demux), one
+ * call each, like any datagram.
+ *
+ * On the wire (first bytes from RFC 7983's unassigned range, next to ReliableStream's):
+ *   PACKED:    0xE4 | count x (length (2) | message)
+ *   FRAGMENT:  0xE5 | message id (2) | index (1) | count (1) | piece
+ *   PROBE:     0xE6 | nonce (4) | padding up to the size being probed
+ *   PROBE_ACK: 0xE7 | nonce (4) | size (2)
+ */
+
+#include "DatagramChannel.hpp" //(for PendingFlush)
+#include "EventLoop.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+//Search over datagram (UDP payload) sizes for the largest one the path carries:
+// try 'max' first (most paths are Ethernet all the way), then bisect down to within 'step'.
+struct PathMTUSearch {
+	uint32_t base = 1200; //<-- RFC 8899 BASE_PLPMTU; assumed to always get through
+	uint32_t max = 1472; //<-- 1500-byte Ethernet MTU, less IPv4 + UDP headers
+	uint32_t step = 16;
+
+	uint32_t mtu = 1200; //largest size known to get through
+	uint32_t too_big = 0; //smallest size known not to (0 = none seen yet)
+
+	//size to probe next, or 0 if done:
+	uint32_t next() const;
+	void record(uint32_t size, bool got_through);
+	bool done() const { return next() == 0; }
+	//forget everything above 'base' (e.g., the path changed):
+	void reset() { mtu = base; too_big = 0; }
+};
+
+struct MessagePacker {
+	//sets DF on 'channel's socket (which must outlive the packer); throws on error:
+	MessagePacker(DatagramChannel &channel, uint32_t flush_ms = 0);
+	~MessagePacker();
+	MessagePacker(MessagePacker const &) = delete;
+	MessagePacker &operator=(MessagePacker const &) = delete;
+
+	DatagramChannel &channel;
+	uint32_t flush_ms; //longest a message waits for company
+
+	static constexpr size_t PackedHeader = 1;
+	static constexpr size_t LengthPrefix = 2;
+	static constexpr size_t FragmentHeader = 5;
+	static constexpr uint32_t MaxFragments = 255;
+	static constexpr size_t MaxMessage = MaxFragments * (1200 - FragmentHeader); //<-- (fits in fragments at any MTU)
+
+	//path MTU search settings (for peers added after a change):
+	uint32_t base_mtu = 1200;
+	uint32_t max_mtu = 1472;
+	uint32_t probe_timeout_ms = 1000;
+	static constexpr uint32_t MaxProbes = 3; //<-- RFC 8899 MAX_PROBES
+	uint32_t recheck_ms = 600000; //<-- RFC 8899 PMTU_RAISE_TIMER
+
+	//queue a message for 'to'; returns false (with errno set) if it is too big or sending failed:
+	bool send(struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	//send whatever is waiting (for one peer, or for all):
+	void flush(struct sockaddr_storage const &to);
+	void flush();
+
+	//current path MTU to 'peer' (base_mtu if unknown):
+	uint32_t mtu(struct sockaddr_storage const &peer) const;
+	//drop all state for 'peer' (sending anything waiting first):
+	void remove(struct sockaddr_storage const &peer);
+
+	uint32_t max_partial = 4; //fragmented messages being put back together at once, per peer (oldest dropped)
+	uint32_t reassembly_ms = 3000; //a message still missing fragments this long after its first one arrived is dropped
+	//peers we only receive fragments from (never send to) are kept while they have partial messages, but at most
+	// 'max_receive_peers' of them (the longest since its last fragment is forgotten first, partials and all):
+	uint32_t max_receive_peers = 1024;
+
+	//------ stats ------
+	uint64_t messages_sent = 0;
+	uint64_t datagrams_sent = 0;
+	uint64_t messages_received = 0;
+	uint64_t probes_sent = 0;
+	uint64_t fragments_dropped = 0; //of messages that never completed
+
+	//------ internals ------
+	struct Partial {
+		uint16_t id = 0;
+		uint64_t started_ms = 0;
+		uint8_t count = 0;
+		uint8_t have = 0;
+		std::vector< std::vector< uint8_t > > pieces;
+	};
+	struct Peer {
+		struct sockaddr_storage address;
+		PathMTUSearch search;
+		bool searching = false; //<-- (only peers we send to get probed)
+		bool confirming = false; //re-checking search.mtu, rather than searching
+		uint32_t probe_size = 0; //size of the outstanding probe (0 = none)
+		uint32_t probe_nonce = 0;
+		uint32_t probe_tries = 0;
+		EventLoop::TimerID probe_timer = 0; //probe timeout, or (when done) the next re-check
+
+		std::vector< uint8_t > packed; //PACKED datagram being filled
+		PendingFlush flush; //of 'packed'
+		uint16_t next_id = 0;
+
+		std::vector< Partial > partials; //oldest first
+		uint64_t last_receive_ms = 0; //(of a fragment)
+	};
+	//NOTE: peers we only receive fragments from (never send to) are dropped once they have nothing partial,
+	// so stray or spoofed fragments don't leave state behind for good:
+	std::unordered_map< struct sockaddr_storage, std::unique_ptr< Peer >, AddressHash, AddressEqual > peers;
+	uint32_t receive_only_peers = 0;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- lets delivery notice the packer is gone
+	EventLoop::TimerID reap_timer = 0; //next look for stale partial messages (0 = none anywhere)
+	std::mt19937 mt;
+	std::vector< uint8_t > scratch; //(reused for fragments and probes)
+
+	//called by the channel for datagrams that start with 0xE4 - 0xE7; returns true if it was one of ours:
+	bool handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+
+	//find or add; 'sending' peers don't count against max_receive_peers:
+	Peer &peer(struct sockaddr_storage const &address, bool sending);
+	bool send_packed(Peer &peer);
+	bool send_fragments(Peer &peer, uint8_t const *data, size_t size);
+	void next_probe(Peer &peer);
+	void start_probe(Peer &peer, uint32_t size);
+	void send_probe(Peer &peer);
+	void probe_failed(Peer &peer);
+	void probe_acked(Peer &peer);
+	void handle_fragment(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+	static bool receive_only(Peer const &peer);
+	void forget_idlest();
+	void reap();
+};
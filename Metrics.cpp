@@ -0,0 +1,121 @@
+#include "Metrics.hpp"
+
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+SharedHistogram::SharedHistogram() {
+	for (auto &c : counts) c.store(0, std::memory_order_relaxed);
+}
+
+void SharedHistogram::snapshot(Histogram *into) const {
+	into->clear();
+	for (uint32_t b = 0; b < Histogram::Buckets; ++b) {
+		uint64_t count = counts[b].load(std::memory_order_relaxed);
+		into->counts[b] = count;
+		into->total += count;
+	}
+	into->sum = sum.load(std::memory_order_relaxed);
+	into->min = min.load(std::memory_order_relaxed);
+	into->max = max.load(std::memory_order_relaxed);
+}
+
+std::shared_ptr< ChannelMetrics > Metrics::add(std::string const &name) {
+	std::shared_ptr< ChannelMetrics > metrics = std::make_shared< ChannelMetrics >();
+	std::lock_guard< std::mutex > lock(mutex);
+	channels.emplace_back(name, metrics);
+	return metrics;
+}
+
+//(label values may not hold raw quotes, backslashes, or newlines)
+static std::string escape_label(std::string const &value) {
+	std::string out;
+	for (char c : value) {
+		if (c == '\\' || c == '"') out += '\\';
+		if (c == '\n') out += "\\n";
+		else out += c;
+	}
+	return out;
+}
+
+std::string Metrics::export_text() {
+	//hold on to the live channels (and forget the dead ones) under the lock; read them after:
+	std::vector< std::pair< std::string, std::shared_ptr< ChannelMetrics > > > live;
+	{
+		std::lock_guard< std::mutex > lock(mutex);
+		std::vector< std::pair< std::string, std::weak_ptr< ChannelMetrics > > > kept;
+		for (auto const &c : channels) {
+			if (std::shared_ptr< ChannelMetrics > metrics = c.second.lock()) {
+				live.emplace_back(escape_label(c.first), metrics);
+				kept.emplace_back(c);
+			}
+		}
+		channels.swap(kept);
+	}
+
+	static struct {
+		char const *name;
+		char const *help;
+		Counter ChannelMetrics::*counter;
+	} const counters[] = {
+		{"packets_in_total", "Datagrams received.", &ChannelMetrics::packets_in},
+		{"bytes_in_total", "Payload bytes received.", &ChannelMetrics::bytes_in},
+		{"packets_out_total", "Datagrams sent.", &ChannelMetrics::packets_out},
+		{"bytes_out_total", "Payload bytes sent.", &ChannelMetrics::bytes_out},
+		{"receive_drops_total", "Received datagrams nobody took.", &ChannelMetrics::receive_drops},
+		{"send_drops_total", "Datagrams that failed to send.", &ChannelMetrics::send_drops},
+		{"truncated_total", "Received datagrams too big for the receive buffers.", &ChannelMetrics::truncated},
+		{"parse_errors_total", "Malformed datagrams.", &ChannelMetrics::parse_errors},
+		{"retransmits_total", "STUN request retransmits and stream resends.", &ChannelMetrics::retransmits},
+		{"stun_timeouts_total", "STUN transactions that timed out.", &ChannelMetrics::stun_timeouts},
+	};
+	static struct {
+		char const *name;
+		char const *help;
+		SharedHistogram ChannelMetrics::*histogram;
+	} const histograms[] = {
+		{"rtt_us", "Round-trip times (STUN transactions and stream samples), in microseconds.", &ChannelMetrics::rtt_us},
+		{"datagram_bytes", "Sizes of received datagrams.", &ChannelMetrics::datagram_bytes},
+	};
+	static double const quantiles[] = {0.5, 0.9, 0.99, 0.999};
+
+	std::ostringstream out;
+	for (auto const &c : counters) {
+		out << "# HELP " << prefix << c.name << ' ' << c.help << '\n';
+		out << "# TYPE " << prefix << c.name << " counter\n";
+		for (auto const &l : live) {
+			out << prefix << c.name << "{channel=\"" << l.first << "\"} " << ((*l.second).*(c.counter)).get() << '\n';
+		}
+	}
+	Histogram snapshot;
+	for (auto const &h : histograms) {
+		out << "# HELP " << prefix << h.name << ' ' << h.help << '\n';
+		out << "# TYPE " << prefix << h.name << " summary\n";
+		for (auto const &l : live) {
+			((*l.second).*(h.histogram)).snapshot(&snapshot);
+			for (double q : quantiles) {
+				out << prefix << h.name << "{channel=\"" << l.first << "\",quantile=\"" << q << "\"} " << snapshot.percentile(q) << '\n';
+			}
+			out << prefix << h.name << "_sum{channel=\"" << l.first << "\"} " << snapshot.sum << '\n';
+			out << prefix << h.name << "_count{channel=\"" << l.first << "\"} " << snapshot.total << '\n';
+		}
+	}
+	return out.str();
+}
+
+void Metrics::export_to(std::string const &filename) {
+	std::string text = export_text();
+	//write to a temporary + rename, so a scraper never reads a half-written file:
+	std::string temp = filename + ".tmp";
+	{
+		std::ofstream out(temp);
+		out << text;
+		if (!out) {
+			throw std::runtime_error("Error writing metrics to '" + temp + "'.");
+		}
+	}
+	if (std::rename(temp.c_str(), filename.c_str()) != 0) {
+		throw std::runtime_error("Error renaming '" + temp + "' to '" + filename + "'.");
+	}
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+/*
+ * Metrics are counters and histograms cheap enough for the hot path, and
+ * readable from any thread without stopping the one that updates them.
+ *
+ * Each ChannelMetrics has exactly one writer (the thread running the
+ * channel's EventLoop -- so one per shard with ShardedListener), which means
+ * an update is a relaxed load + store: no locked instructions, no sharing of
+ * cache lines between writers. Readers (a scraper, a status line) see every
+ * value whole, and at most a few updates stale.
+ *
+ * A Metrics registry hands out named ChannelMetrics (see
+ * DatagramChannel::enable_metrics()) and exports all of them as text, in the
+ * Prometheus exposition format:
+ *   natt_packets_in_total{channel="shard0"} 12345
+ *   natt_rtt_us{channel="shard0",quantile="0.99"} 20479
+ *   ...
+ * Channels that have gone away drop out of the export.
+ */
+
+#include "Histogram.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+//Counter with a single writer:
+struct Counter {
+	std::atomic< uint64_t > value{0};
+	void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+//Histogram (same buckets as Histogram.hpp) with a single writer; snapshot() from anywhere:
+struct SharedHistogram {
+	SharedHistogram();
+	void record(uint64_t value) {
+		bump(counts[Histogram::bucket(value)], 1);
+		bump(sum, value);
+		if (value < min.load(std::memory_order_relaxed)) min.store(value, std::memory_order_relaxed);
+		if (value > max.load(std::memory_order_relaxed)) max.store(value, std::memory_order_relaxed);
+	}
+	//copy into 'into' (its total is the sum of the copied buckets, so percentiles stay consistent):
+	void snapshot(Histogram *into) const;
+
+	std::atomic< uint64_t > counts[Histogram::Buckets];
+	std::atomic< uint64_t > sum{0};
+	std::atomic< uint64_t > min{~uint64_t(0)};
+	std::atomic< uint64_t > max{0};
+	static void bump(std::atomic< uint64_t > &a, uint64_t n) { a.store(a.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+};
+
+struct ChannelMetrics {
+	Counter packets_in;
+	Counter bytes_in;
+	Counter packets_out; //handed to the kernel (or queued for it)
+	Counter bytes_out;
+	Counter receive_drops; //received with nobody to take them (no on_receive)
+	Counter send_drops; //sends that failed
+	Counter truncated; //received datagrams too big for the receive buffers
+	Counter parse_errors; //malformed STUN responses, stream acks, packed datagrams
+	Counter retransmits; //STUN request retransmits + ReliableStream resends
+	Counter stun_timeouts; //STUN transactions that never got an answer
+
+	SharedHistogram rtt_us; //STUN transactions + ReliableStream samples
+	SharedHistogram datagram_bytes; //received datagrams
+};
+
+struct Metrics {
+	//new metrics for a channel called 'name' (names needn't be unique, but then their series clash):
+	std::shared_ptr< ChannelMetrics > add(std::string const &name);
+
+	//everything, in Prometheus text format:
+	std::string export_text();
+	//write export_text() to 'filename' (via a temporary file + rename, so a scraper never sees half of it); throws on error:
+	void export_to(std::string const &filename);
+
+	std::string prefix = "natt_";
+
+	//------ internals ------
+	std::mutex mutex;
+	std::vector< std::pair< std::string, std::weak_ptr< ChannelMetrics > > > channels;
+};
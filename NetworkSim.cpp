@@ -0,0 +1,415 @@
+#include "NetworkSim.hpp"
+
+#include "STUN.hpp"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+
+static struct sockaddr_storage make_address(uint32_t ip, uint16_t port) {
+	struct sockaddr_storage address;
+	memset(&address, '\0', sizeof(address));
+	struct sockaddr_in &in = reinterpret_cast< struct sockaddr_in & >(address);
+	in.sin_family = AF_INET;
+	in.sin_addr.s_addr = htonl(ip);
+	in.sin_port = htons(port);
+	return address;
+}
+
+static uint32_t ip_of(struct sockaddr_storage const &address) {
+	return ntohl(reinterpret_cast< struct sockaddr_in const & >(address).sin_addr.s_addr);
+}
+
+static uint16_t port_of(struct sockaddr_storage const &address) {
+	return ntohs(reinterpret_cast< struct sockaddr_in const & >(address).sin_port);
+}
+
+//address + port, packed (6 bytes), for NAT mapping keys:
+static void append_key(std::string &key, struct sockaddr_storage const &address) {
+	struct sockaddr_in const &in = reinterpret_cast< struct sockaddr_in const & >(address);
+	key.append(reinterpret_cast< char const * >(&in.sin_addr.s_addr), 4);
+	key.append(reinterpret_cast< char const * >(&in.sin_port), 2);
+}
+
+NetworkSim::NetworkSim(uint64_t seed_) : seed(seed_), mt(seed_) {
+	if (EventLoop::simulated_us) {
+		throw std::runtime_error("NetworkSim: another simulation is already running.");
+	}
+	EventLoop::simulated_us = &now_us;
+	loop_.reset(new EventLoop); //<-- (after the clock is installed, so its timers start in simulated time)
+}
+
+NetworkSim::~NetworkSim() {
+	while (!events.empty()) {
+		delete events.top();
+		events.pop();
+	}
+	for (Event *event : spare) delete event;
+	loop_.reset();
+	EventLoop::simulated_us = nullptr;
+}
+
+struct sockaddr_storage NetworkSim::next_public_address() {
+	uint32_t n = next_public++;
+	if (n >= 254 * 256) {
+		throw std::runtime_error("NetworkSim: out of public addresses.");
+	}
+	//198.51.100.1, ..., 198.51.100.254, 198.51.101.1, ...
+	return make_address((198U << 24) | (51U << 16) | ((100U + n / 254) << 8) | (1 + n % 254), 0);
+}
+
+uint32_t NetworkSim::add(Host const &host) {
+	uint32_t index = uint32_t(hosts.size());
+	hosts.emplace_back(host);
+	host_by_address[host.address] = index;
+	return index;
+}
+
+NetworkSim::NAT *NetworkSim::add_nat(NAT::Type type, uint32_t binding_timeout_ms) {
+	if (nats.size() >= 4096) {
+		throw std::runtime_error("NetworkSim: out of private address space for NATs.");
+	}
+	std::unique_ptr< NAT > nat(new NAT);
+	nat->type = type;
+	nat->binding_timeout_ms = binding_timeout_ms;
+	nat->public_address = next_public_address();
+	nat->index = uint32_t(nats.size());
+	nat->next_port = uint16_t(1024 + mt() % 64512); //<-- (NATs start allocating wherever)
+	nat_by_ip[ip_of(nat->public_address)] = nat.get();
+	nats.emplace_back(std::move(nat));
+	return nats.back().get();
+}
+
+std::unique_ptr< DatagramChannel > NetworkSim::add_host(NAT *nat, Link const &link, uint16_t port) {
+	if (port == 0) port = uint16_t(32768 + mt() % 28232); //<-- (Linux's ephemeral range)
+	Host host;
+	if (nat) {
+		if (nat->next_host >= 4094) {
+			throw std::runtime_error("NetworkSim: too many hosts behind one NAT.");
+		}
+		uint32_t h = ++nat->next_host;
+		host.address = make_address((10U << 24) | (nat->index << 12) | h, port);
+	} else {
+		host.address = next_public_address();
+		reinterpret_cast< struct sockaddr_in & >(host.address).sin_port = htons(port);
+	}
+	host.nat = nat;
+	host.link = link;
+	uint32_t index = add(host);
+	std::unique_ptr< DatagramChannel > channel(new DatagramChannel(*this, index, hosts[index].address));
+	hosts[index].channel = channel.get();
+	return channel;
+}
+
+std::unique_ptr< DatagramChannel > NetworkSim::add_socket(DatagramChannel const &beside, uint16_t port) {
+	if (beside.network != this || beside.network_host >= hosts.size()) {
+		throw std::runtime_error("NetworkSim: add_socket() next to a channel not on this network.");
+	}
+	Host host;
+	host.address = hosts[beside.network_host].address;
+	host.nat = hosts[beside.network_host].nat;
+	host.link = hosts[beside.network_host].link;
+	if (port != 0) {
+		reinterpret_cast< struct sockaddr_in & >(host.address).sin_port = htons(port);
+		if (host_by_address.count(host.address)) {
+			throw std::runtime_error("NetworkSim: port " + std::to_string(port) + " is already in use on that host.");
+		}
+	} else {
+		do {
+			reinterpret_cast< struct sockaddr_in & >(host.address).sin_port = htons(uint16_t(32768 + mt() % 28232));
+		} while (host_by_address.count(host.address));
+	}
+	uint32_t index = add(host);
+	std::unique_ptr< DatagramChannel > channel(new DatagramChannel(*this, index, hosts[index].address));
+	hosts[index].channel = channel.get();
+	return channel;
+}
+
+std::string NetworkSim::add_stun_server(Link const &link) {
+	Host host;
+	host.address = next_public_address();
+	reinterpret_cast< struct sockaddr_in & >(host.address).sin_port = htons(3478);
+	host.link = link;
+	uint32_t index = add(host);
+	hosts[index].handler = [this, index](struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+		uint8_t buffer[2048];
+		if (size > sizeof(buffer)) return;
+		memcpy(buffer, data, size);
+		size_t response = stun_binding_response_in_place(buffer, size, sizeof(buffer), from);
+		if (response) transmit(index, from, buffer, response);
+	};
+	return address_to_string(host.address);
+}
+
+//------ sending ------
+
+bool NetworkSim::send(DatagramChannel &channel, struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	return transmit(channel.network_host, to, data, size);
+}
+
+void NetworkSim::remove(DatagramChannel &channel) {
+	if (channel.network_host < hosts.size() && hosts[channel.network_host].channel == &channel) {
+		hosts[channel.network_host].channel = nullptr;
+	}
+}
+
+bool NetworkSim::transmit(uint32_t from_host, struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	Host &host = hosts[from_host];
+	if (size > host.link.mtu) {
+		//(like a local interface refusing a DF datagram over its MTU)
+		too_big += 1;
+		errno = EMSGSIZE;
+		return false;
+	}
+	if (to.ss_family != AF_INET) {
+		unroutable += 1;
+		return true;
+	}
+	uint64_t at_us;
+	if (cross(host.link, host.up_free_us, size, &at_us)) {
+		schedule(at_us, from_host, false, host.address, to, data, size);
+	}
+	return true; //<-- (lost or not, it was sent)
+}
+
+bool NetworkSim::cross(Link const &link, uint64_t &free_us, size_t size, uint64_t *at_us) {
+	if (size > link.mtu) {
+		too_big += 1;
+		return false;
+	}
+	if (link.loss > 0.0 && uniform() < link.loss) {
+		lost += 1;
+		return false;
+	}
+	uint64_t at = now_us;
+	if (link.rate_bytes_per_s) {
+		uint64_t start = std::max(now_us, free_us);
+		if (start - now_us > link.queue_us) {
+			queue_drops += 1;
+			return false;
+		}
+		free_us = start + (uint64_t(size) + 28) * 1000000 / link.rate_bytes_per_s; //<-- (+ IP / UDP headers)
+		at = free_us;
+	}
+	at += link.latency_us;
+	if (link.jitter_us) at += mt() % (uint64_t(link.jitter_us) + 1);
+	if (link.reorder > 0.0 && uniform() < link.reorder) at += link.reorder_us;
+	*at_us = at;
+	return true;
+}
+
+void NetworkSim::schedule(uint64_t at_us, uint32_t host, bool arrived, struct sockaddr_storage const &from, struct sockaddr_storage const &to, uint8_t const *data, size_t size) {
+	Event *event;
+	if (spare.empty()) {
+		event = new Event;
+	} else {
+		event = spare.back();
+		spare.pop_back();
+	}
+	event->at_us = at_us;
+	event->order = next_order++;
+	event->host = host;
+	event->arrived = arrived;
+	event->from = from;
+	event->to = to;
+	event->data.assign(data, data + size);
+	events.push(event);
+}
+
+//------ routing ------
+
+void NetworkSim::route(Event &event) {
+	NAT *source_nat = hosts[event.host].nat;
+	struct sockaddr_storage from = event.from;
+	uint32_t to_ip = ip_of(event.to);
+
+	//straight to a host? (a private one only from behind the same NAT)
+	uint32_t target = NoHost;
+	auto found = host_by_address.find(event.to);
+	if (found != host_by_address.end() && hosts[found->second].nat == source_nat) target = found->second;
+
+	if (target == NoHost) {
+		//leaving the LAN: out through the sender's NAT...
+		if (source_nat && !translate_out(*source_nat, event.from, event.to, &from)) {
+			unroutable += 1;
+			return;
+		}
+		//...and in through the receiver's (or to a public host):
+		auto nat = nat_by_ip.find(to_ip);
+		if (nat != nat_by_ip.end()) {
+			target = translate_in(*nat->second, from, event.to, nullptr);
+		} else if (found != host_by_address.end() && !hosts[found->second].nat) {
+			target = found->second;
+		}
+		if (target == NoHost) {
+			unroutable += 1;
+			return;
+		}
+	}
+
+	Host &host = hosts[target];
+	uint64_t at_us;
+	if (cross(host.link, host.down_free_us, event.data.size(), &at_us)) {
+		schedule(at_us, target, true, from, host.address, event.data.data(), event.data.size());
+	}
+}
+
+void NetworkSim::deliver(Event &event) {
+	Host &host = hosts[event.host];
+	if (host.channel) {
+		delivered += 1;
+		host.channel->dispatch(event.from, event.data.data(), event.data.size());
+	} else if (host.handler) {
+		delivered += 1;
+		host.handler(event.from, event.data.data(), event.data.size());
+	} else {
+		unroutable += 1; //<-- (host gone)
+	}
+}
+
+bool NetworkSim::translate_out(NAT &nat, struct sockaddr_storage const &internal, struct sockaddr_storage const &to, struct sockaddr_storage *external) {
+	uint64_t now = now_us / 1000;
+	std::string key;
+	append_key(key, internal);
+	if (nat.type == NAT::Symmetric) append_key(key, to);
+
+	NAT::Mapping *mapping = nullptr;
+	auto k = nat.by_key.find(key);
+	if (k != nat.by_key.end()) {
+		mapping = &nat.by_port[k->second];
+		if (now - mapping->last_active_ms > nat.binding_timeout_ms) {
+			//expired: forget it (the next datagram gets a new mapping -- most likely on a new port):
+			nat.expired += 1;
+			nat.by_port.erase(k->second);
+			nat.by_key.erase(k);
+			mapping = nullptr;
+		}
+	}
+	if (!mapping) {
+		//next free port, wrapping around above the well-known ones:
+		uint16_t port = 0;
+		for (uint32_t tries = 0; tries < 64512; ++tries) {
+			uint16_t candidate = nat.next_port;
+			nat.next_port = (nat.next_port == 65535 ? 1024 : nat.next_port + 1);
+			auto taken = nat.by_port.find(candidate);
+			if (taken != nat.by_port.end() && now - taken->second.last_active_ms > nat.binding_timeout_ms) {
+				//(an expired mapping nobody came back for)
+				std::string old_key;
+				append_key(old_key, taken->second.internal);
+				if (nat.type == NAT::Symmetric && !taken->second.permitted.empty()) append_key(old_key, taken->second.permitted[0]);
+				nat.by_key.erase(old_key);
+				nat.by_port.erase(taken);
+				taken = nat.by_port.end();
+			}
+			if (taken == nat.by_port.end()) {
+				port = candidate;
+				break;
+			}
+		}
+		if (port == 0) return false;
+		mapping = &nat.by_port[port];
+		mapping->internal = internal;
+		mapping->port = port;
+		nat.by_key[key] = port;
+	}
+
+	mapping->last_active_ms = now;
+	bool known = false;
+	for (auto const &p : mapping->permitted) {
+		if (same_address(p, to)) {
+			known = true;
+			break;
+		}
+	}
+	if (!known) mapping->permitted.emplace_back(to);
+
+	*external = nat.public_address;
+	reinterpret_cast< struct sockaddr_in & >(*external).sin_port = htons(mapping->port);
+	return true;
+}
+
+uint32_t NetworkSim::translate_in(NAT &nat, struct sockaddr_storage const &from, struct sockaddr_storage const &to, struct sockaddr_storage *internal) {
+	uint64_t now = now_us / 1000;
+	auto m = nat.by_port.find(port_of(to));
+	if (m == nat.by_port.end()) {
+		nat.filtered += 1;
+		return NoHost;
+	}
+	NAT::Mapping &mapping = m->second;
+	if (now - mapping.last_active_ms > nat.binding_timeout_ms) {
+		nat.expired += 1;
+		return NoHost;
+	}
+	bool allowed = (nat.type == NAT::FullCone);
+	for (auto const &p : mapping.permitted) {
+		if (allowed) break;
+		if (nat.type == NAT::Restricted) allowed = (ip_of(p) == ip_of(from));
+		else allowed = same_address(p, from);
+	}
+	if (!allowed) {
+		nat.filtered += 1;
+		return NoHost;
+	}
+	if (nat.inbound_refresh) mapping.last_active_ms = now;
+	if (internal) *internal = mapping.internal;
+	auto host = host_by_address.find(mapping.internal);
+	return (host == host_by_address.end() ? NoHost : host->second);
+}
+
+//------ running ------
+
+uint64_t NetworkSim::next_due_us() {
+	if (!loop_->deferred.empty()) return now_us;
+	uint64_t due = ~uint64_t(0);
+	if (!events.empty()) due = events.top()->at_us;
+	int32_t timeout_ms = loop_->timers.next_timeout(EventLoop::now());
+	if (timeout_ms >= 0) due = std::min(due, (EventLoop::now() + uint64_t(timeout_ms)) * 1000);
+	return std::max(due, now_us);
+}
+
+bool NetworkSim::step() {
+	bool any = false;
+	if (!loop_->deferred.empty()) {
+		loop_->run_deferred();
+		any = true;
+	}
+	while (!events.empty() && events.top()->at_us <= now_us) {
+		Event *event = events.top();
+		events.pop();
+		if (event->arrived) deliver(*event);
+		else route(*event);
+		spare.emplace_back(event);
+		any = true;
+	}
+	size_t pending = loop_->timers.pending();
+	loop_->timers.advance(EventLoop::now());
+	if (loop_->timers.pending() != pending) any = true;
+	if (!loop_->deferred.empty()) {
+		loop_->run_deferred();
+		any = true;
+	}
+	return any;
+}
+
+void NetworkSim::run_for(uint64_t ms) {
+	run_until([]() { return false; }, ms);
+}
+
+bool NetworkSim::run_until(std::function< bool() > const &done, uint64_t limit_ms) {
+	uint64_t end_us = now_us + limit_ms * 1000;
+	while (!done()) {
+		uint64_t due = next_due_us();
+		if (due > end_us) {
+			now_us = end_us;
+			step(); //<-- (timers due at exactly the end)
+			return done();
+		}
+		bool advanced = (due > now_us);
+		now_us = due;
+		if (!step() && !advanced) now_us += 1000; //<-- (nothing was actually due after all; don't spin)
+	}
+	return true;
+}
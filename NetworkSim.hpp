@@ -0,0 +1,185 @@
+#pragma once
+
+/*
+ * NetworkSim is an in-process, deterministic stand-in for the internet:
+ * DatagramChannels made by add_host() have no socket; what they send goes
+ * through simulated links and NATs and comes out at other simulated
+ * channels (or simulated STUN servers), in simulated time.
+ *
+ *  - Time is virtual: while a NetworkSim exists, EventLoop::now() /
+ *    now_us() read its clock, and run_for() jumps straight from one event
+ *    (a delivery, a timer) to the next. An hour of keepalives takes
+ *    milliseconds; nothing depends on how fast the machine is.
+ *  - Everything random (loss, jitter, NAT port choice, STUN transaction ids,
+ *    ICE credentials, ...) comes from generators seeded from 'seed', so the
+ *    same seed replays the same run, packet for packet.
+ *  - Each host sits on a Link: one-way latency plus uniform jitter, random
+ *    loss, occasional reordering (a packet held back by an extra delay), a
+ *    bandwidth cap with a drop-tail queue, and a largest datagram (MTU).
+ *    A datagram crosses the sender's link, then the receiver's.
+ *  - Hosts can sit behind a NAT (several hosts can share one), which maps
+ *    (private address, port) to ports on its public address and filters
+ *    what comes back, as per RFC 4787's behaviors:
+ *      FullCone:       one mapping per private address; anyone may send to it;
+ *      Restricted:     ...only hosts (addresses) it has sent to may answer;
+ *      PortRestricted: ...only address + port pairs it has sent to may answer;
+ *      Symmetric:      a new mapping per destination, which only that
+ *                      destination may answer.
+ *    Mappings expire 'binding_timeout_ms' after the last outbound datagram
+ *    (and inbound ones too, with 'inbound_refresh'). Hosts behind the same NAT
+ *    reach each other directly at their private addresses; hairpinning
+ *    (sending to a mapping on one's own NAT) works.
+ *  - add_stun_server() adds a binding responder at a public address, for
+ *    channels' stun_servers ("ip:port").
+ *
+ * Addresses: public hosts / servers / NATs get 198.51.100.x, 198.51.101.x,
+ * ... (TEST-NET-2 and beyond); hosts behind NAT n get 10.0.0.0 + n * 4096 + 1,
+ * + 2, ... (so up to 4096 NATs of up to 4094 hosts each).
+ *
+ * Only one NetworkSim may exist at a time (it owns the process-wide clock),
+ * and simulated channels must use loop() and be destroyed before the sim.
+ * Single-threaded.
+ */
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//one host's connection to the network (NetworkSim::Link), same both ways:
+struct SimLink {
+	uint32_t latency_us = 5000; //one way
+	uint32_t jitter_us = 0; //extra delay, uniform in [0, jitter_us]
+	double loss = 0.0; //probability
+	double reorder = 0.0; //probability a packet is held back by another reorder_us
+	uint32_t reorder_us = 5000;
+	uint64_t rate_bytes_per_s = 0; //0 = unlimited
+	uint32_t queue_us = 50000; //drop-tail once this much is waiting for the rate limit
+	uint32_t mtu = 1472; //largest datagram (UDP payload) that fits; bigger ones are dropped
+};
+
+struct NetworkSim {
+	typedef SimLink Link;
+
+	struct NAT {
+		enum Type : uint8_t { FullCone, Restricted, PortRestricted, Symmetric } type = PortRestricted;
+		uint32_t binding_timeout_ms = 30000;
+		bool inbound_refresh = false;
+
+		struct sockaddr_storage public_address; //(port unused)
+		uint32_t index = 0; //(picks its hosts' private block)
+
+		//------ internals ------
+		struct Mapping {
+			struct sockaddr_storage internal;
+			uint16_t port;
+			uint64_t last_active_ms;
+			std::vector< struct sockaddr_storage > permitted; //destinations sent to (Restricted: port ignored)
+		};
+		std::unordered_map< uint16_t, Mapping > by_port;
+		std::unordered_map< std::string, uint16_t > by_key; //internal address + port (+ destination's, if Symmetric), packed
+		uint16_t next_port = 0;
+		uint32_t next_host = 0;
+		uint64_t expired = 0, filtered = 0; //(stats)
+	};
+
+	NetworkSim(uint64_t seed = 1);
+	~NetworkSim();
+	NetworkSim(NetworkSim const &) = delete;
+	NetworkSim &operator=(NetworkSim const &) = delete;
+
+	uint64_t const seed;
+	EventLoop &loop() { return *loop_; }
+	uint64_t now_us = 1000000; //<-- simulated time (starts at 1 s, so nothing mistakes it for "never")
+
+	//a NAT, for add_host() to put hosts behind:
+	NAT *add_nat(NAT::Type type, uint32_t binding_timeout_ms = 30000);
+	//a channel on a new host (behind 'nat', or with a public address if nullptr), bound to 'port' (0 = any):
+	std::unique_ptr< DatagramChannel > add_host(NAT *nat = nullptr, Link const &link = Link(), uint16_t port = 0);
+	//another channel on the same host as 'beside' (same address, NAT, and link settings), bound to 'port' (0 = any)
+	// -- i.e., a second socket; it queues for the link's rate cap separately, though:
+	std::unique_ptr< DatagramChannel > add_socket(DatagramChannel const &beside, uint16_t port = 0);
+	//a STUN binding responder (public); returns its "ip:port":
+	std::string add_stun_server(Link const &link = Link());
+
+	//advance simulated time by 'ms', handling everything that comes due:
+	void run_for(uint64_t ms);
+	//...or until 'done' returns true (checked after each event); returns false on hitting the limit:
+	bool run_until(std::function< bool() > const &done, uint64_t limit_ms);
+
+	//------ stats ------
+	uint64_t delivered = 0;
+	uint64_t lost = 0; //random loss
+	uint64_t queue_drops = 0; //rate-limited link's queue was full
+	uint64_t too_big = 0; //over a link's mtu
+	uint64_t unroutable = 0; //no such address (or a NAT refused it -- see NAT::expired / filtered)
+
+	//------ internals ------
+	struct Host {
+		struct sockaddr_storage address;
+		NAT *nat = nullptr;
+		Link link;
+		uint64_t up_free_us = 0, down_free_us = 0; //when each direction's rate limit is next free
+		DatagramChannel *channel = nullptr; //(nullptr once gone)
+		std::function< void(struct sockaddr_storage const &from, uint8_t const *data, size_t size) > handler; //(servers)
+	};
+	std::vector< Host > hosts;
+	std::unordered_map< struct sockaddr_storage, uint32_t, AddressHash, AddressEqual > host_by_address;
+	std::unordered_map< uint32_t, NAT * > nat_by_ip; //(public ip, host order)
+	std::vector< std::unique_ptr< NAT > > nats;
+	uint32_t next_public = 0;
+
+	struct Event {
+		uint64_t at_us;
+		uint64_t order; //<-- (ties go in send order, so runs replay exactly)
+		uint32_t host; //receiving host -- or, if !arrived, the sending host (the datagram is just off its link)
+		bool arrived;
+		struct sockaddr_storage from;
+		struct sockaddr_storage to;
+		std::vector< uint8_t > data;
+	};
+	static constexpr uint32_t NoHost = 0xffffffff;
+	double uniform() { return double(mt() >> 11) * 0x1.0p-53; }
+	struct Later {
+		bool operator()(Event const *a, Event const *b) const { return a->at_us > b->at_us || (a->at_us == b->at_us && a->order > b->order); }
+	};
+	std::priority_queue< Event *, std::vector< Event * >, Later > events;
+	std::vector< Event * > spare; //(recycled, so data buffers are reused)
+	uint64_t next_order = 0;
+	std::mt19937_64 mt;
+
+	std::unique_ptr< EventLoop > loop_;
+
+	struct sockaddr_storage next_public_address();
+	uint32_t add(Host const &host);
+
+	//called by simulated channels:
+	bool send(DatagramChannel &channel, struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	void remove(DatagramChannel &channel);
+	uint32_t random_seed() { return uint32_t(mt()); }
+
+	//send from host 'from_host' onto its link; returns false (with errno set) if too big for it:
+	bool transmit(uint32_t from_host, struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	//delay through a link (in one direction); returns false if the packet is dropped:
+	bool cross(Link const &link, uint64_t &free_us, size_t size, uint64_t *at_us);
+	void schedule(uint64_t at_us, uint32_t host, bool arrived, struct sockaddr_storage const &from, struct sockaddr_storage const &to, uint8_t const *data, size_t size);
+	void route(Event &event); //<-- (datagram off the sender's link: through NATs, onto the receiver's link)
+	void deliver(Event &event);
+	//NAT translation: outbound (returns false if no port is left), inbound (returns the host, or NoHost if refused):
+	bool translate_out(NAT &nat, struct sockaddr_storage const &internal, struct sockaddr_storage const &to, struct sockaddr_storage *external);
+	uint32_t translate_in(NAT &nat, struct sockaddr_storage const &from, struct sockaddr_storage const &to, struct sockaddr_storage *internal);
+	//handle everything due by now_us; returns true if anything was:
+	bool step();
+	//when the next thing is due (or ~0):
+	uint64_t next_due_us();
+};
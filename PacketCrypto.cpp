@@ -0,0 +1,143 @@
+#include "PacketCrypto.hpp"
+
+#include "DatagramChannel.hpp"
+#include "STUN.hpp"
+
+#include <cstring>
+
+static constexpr uint64_t MaxSeq = (uint64_t(1) << 48) - 1;
+
+//------ replay window ------
+
+bool PacketCrypto::Window::fresh(uint64_t seq) const {
+	if (seq > top) return true;
+	if (top - seq >= Span) return false; //<-- (too old to tell, so refused)
+	return !((bits[(seq / 64) % Words] >> (seq % 64)) & 1);
+}
+
+void PacketCrypto::Window::mark(uint64_t seq) {
+	if (seq > top) {
+		//clear the words the window slides over (the bits past 'top' in its own word are clear already):
+		uint64_t from = top / 64 + 1, to = seq / 64;
+		if (to >= from + Words) {
+			for (uint32_t i = 0; i < Words; ++i) bits[i] = 0;
+		} else {
+			for (uint64_t w = from; w <= to; ++w) bits[w % Words] = 0;
+		}
+		top = seq;
+	}
+	bits[(seq / 64) % Words] |= uint64_t(1) << (seq % 64);
+}
+
+//------ keys ------
+
+PacketCrypto::PacketCrypto(DatagramChannel &channel_) : channel(channel_), mt(channel_.random_seed()) {
+}
+
+PacketCrypto::~PacketCrypto() {
+}
+
+std::shared_ptr< PacketCrypto::Keys > PacketCrypto::derive(uint8_t const *secret, size_t secret_size) {
+	//one HKDF run for both ciphers' keys and the IV:
+	uint8_t okm[16 + 32 + AEADKey::NonceSize];
+	hkdf_sha1(secret, secret_size, "nat-traversal PacketCrypto", "aes-128-gcm key | chacha20-poly1305 key | iv", okm, sizeof(okm));
+	std::shared_ptr< Keys > keys = std::make_shared< Keys >();
+	if (aead_has_aes_ni()) keys->aes.reset(new AEADKey(AES128GCM, okm, 16));
+	keys->chacha.reset(new AEADKey(ChaCha20Poly1305, okm + 16, 32));
+	memcpy(keys->iv, okm + 48, AEADKey::NonceSize);
+	memset(okm, 0, sizeof(okm));
+	keys->sender_id = mt();
+	return keys;
+}
+
+void PacketCrypto::set_secret(uint8_t const *secret, size_t secret_size) {
+	any_peer = derive(secret, secret_size);
+}
+
+void PacketCrypto::add(struct sockaddr_storage const &peer, uint8_t const *secret, size_t secret_size) {
+	peers[peer] = derive(secret, secret_size);
+}
+
+void PacketCrypto::remove(struct sockaddr_storage const &peer) {
+	peers.erase(peer);
+}
+
+PacketCrypto::Keys *PacketCrypto::keys_for(struct sockaddr_storage const &peer) const {
+	if (!peers.empty()) {
+		auto f = peers.find(peer);
+		if (f != peers.end()) return f->second.get();
+	}
+	return any_peer.get();
+}
+
+PacketCrypto::Keys *PacketCrypto::sealing(struct sockaddr_storage const &to, uint8_t const *data, size_t size) const {
+	if (looks_like_stun(data, size)) return nullptr;
+	return keys_for(to);
+}
+
+//------ sealing + opening ------
+
+static void make_nonce(PacketCrypto::Keys const &keys, uint8_t const *header, uint8_t nonce[AEADKey::NonceSize]) {
+	//sender_id (4) | 0 0 | seq (6), straight from the header, xor the IV:
+	memcpy(nonce, header + 1, 4);
+	nonce[4] = 0;
+	nonce[5] = 0;
+	memcpy(nonce + 6, header + 5, 6);
+	for (size_t i = 0; i < AEADKey::NonceSize; ++i) nonce[i] ^= keys.iv[i];
+}
+
+size_t PacketCrypto::seal(Keys &keys, uint8_t const *data, size_t size, uint8_t *out) {
+	if (keys.next_seq > MaxSeq) return 0; //<-- (at a billion datagrams a second, some three days' worth)
+	bool aes = (cipher == AES128GCM && keys.aes);
+	uint64_t seq = keys.next_seq++;
+	out[0] = (aes ? SealedAES : SealedChaCha);
+	stun_write_u32(out + 1, keys.sender_id);
+	stun_write_u16(out + 5, uint16_t(seq >> 32));
+	stun_write_u32(out + 7, uint32_t(seq));
+	uint8_t nonce[AEADKey::NonceSize];
+	make_nonce(keys, out, nonce);
+	(aes ? keys.aes : keys.chacha)->seal(nonce, out, HeaderSize, data, out + HeaderSize, size, out + HeaderSize + size);
+	sealed += 1;
+	return size + Overhead;
+}
+
+uint8_t const *PacketCrypto::seal_to_scratch(Keys &keys, uint8_t const *data, size_t &size) {
+	if (scratch.size() < size + Overhead) scratch.resize(size + Overhead);
+	size = seal(keys, data, size, scratch.data());
+	return scratch.data();
+}
+
+bool PacketCrypto::open(struct sockaddr_storage const &from, uint8_t *data, size_t &size) {
+	Keys *keys = keys_for(from);
+	if (!keys || size < Overhead || (data[0] == SealedAES && !keys->aes)) {
+		forged += 1;
+		return false;
+	}
+	uint32_t sender_id = stun_read_u32(data + 1);
+	uint64_t seq = (uint64_t(stun_read_u16(data + 5)) << 32) | stun_read_u32(data + 7);
+	auto w = keys->windows.find(sender_id);
+	if (w != keys->windows.end() && !w->second.fresh(seq)) {
+		replayed += 1;
+		return false;
+	}
+	uint8_t nonce[AEADKey::NonceSize];
+	make_nonce(*keys, data, nonce);
+	size_t payload = size - Overhead;
+	AEADKey const &key = (data[0] == SealedAES ? *keys->aes : *keys->chacha);
+	//(decrypts over the header: the payload ends up at the start of the buffer)
+	if (!key.open(nonce, data, HeaderSize, data + HeaderSize, data, payload, data + HeaderSize + payload)) {
+		forged += 1;
+		return false;
+	}
+	if (sender_id == keys->sender_id) {
+		//one of ours, bounced back -- or the peer happened to pick our id; either way, stop using it:
+		reflected += 1;
+		uint32_t old = keys->sender_id;
+		while (keys->sender_id == old) keys->sender_id = mt();
+		return false;
+	}
+	keys->windows[sender_id].mark(seq); //<-- (only authentic datagrams move the window)
+	opened += 1;
+	size = payload;
+	return true;
+}
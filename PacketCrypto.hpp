@@ -0,0 +1,118 @@
+#pragma once
+
+/*
+ * PacketCrypto encrypts a DatagramChannel's traffic with an AEAD (see
+ * AEAD.hpp): once a peer has a key -- every peer, with set_secret(), or
+ * one at a time, with add() -- everything sent to it (streams, packed
+ * messages, latency pings, PeerChannels, plain send_to()s) is sealed on its
+ * way out, and everything from it is opened in place in the receive buffer
+ * and handed on as if it had arrived in the clear. STUN stays in the clear
+ * (servers and ICE checks need to read it); cleartext anything-else from a
+ * peer with a key is dropped (unless !require).
+ *
+ * Sealing is fused with the copy the send path makes anyway (into the
+ * batch / io_uring slot, or in place of the application's buffer for a plain
+ * sendto()), and opening decrypts over the datagram where it landed -- so
+ * encryption costs the cipher's own pass over the bytes and nothing more.
+ *
+ * On the wire (first bytes from RFC 7983's unassigned range, next to PeerDemux's):
+ *   0xEA (AES-128-GCM) or 0xEB (ChaCha20-Poly1305) | sender_id (4) | seq (6) | ciphertext | tag (16)
+ * The 11-byte header is authenticated (as associated data); the nonce is
+ * sender_id | 0 0 | seq, xored with a per-secret IV. Each end picks a random
+ * sender_id per secret and numbers its datagrams from 0, so nonces never
+ * repeat under one key -- as long as two ends sharing a secret don't pick the
+ * same sender_id (like SRTP's SSRCs: a 1-in-2^32 chance per pair). A
+ * datagram carrying our own sender_id is taken as a reflection of one of
+ * ours and dropped (and we pick a new id, in case it was a real collision).
+ *
+ * Replays are caught per sender_id with a 960-datagram sliding window (after
+ * RFC 6479); windows are kept per secret rather than per address, so a
+ * datagram replayed from some other address is refused too. A restarted peer
+ * shows up with a fresh sender_id, and so a fresh window.
+ *
+ * Both ends derive all keys from the same secret (HKDF-SHA1); each sends
+ * with 'cipher' and opens either (AES-128-GCM only given AES-NI -- so
+ * for a mix of CPUs, pin cipher to ChaCha20Poly1305 everywhere). There is
+ * no handshake: a secret is a pre-shared key (or one exchanged some other
+ * way, e.g., alongside ICE candidates), and there is no forward secrecy.
+ */
+
+#include "AEAD.hpp"
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <memory>
+#include <random>
+#include <unordered_map>
+#include <vector>
+
+struct DatagramChannel;
+
+struct PacketCrypto {
+	PacketCrypto(DatagramChannel &channel);
+	~PacketCrypto();
+	PacketCrypto(PacketCrypto const &) = delete;
+	PacketCrypto &operator=(PacketCrypto const &) = delete;
+
+	DatagramChannel &channel;
+
+	static constexpr uint8_t SealedAES = 0xEA;
+	static constexpr uint8_t SealedChaCha = 0xEB;
+	static constexpr size_t HeaderSize = 11;
+	static constexpr size_t Overhead = HeaderSize + AEADKey::TagSize; //bytes sealing adds to a datagram
+
+	AEADCipher cipher = aead_best_cipher(); //what we seal with (see above)
+	bool require = true; //drop cleartext (non-STUN) datagrams from peers with a key
+
+	//encrypt to + require encryption from every peer, with keys from 'secret':
+	void set_secret(uint8_t const *secret, size_t secret_size);
+	//...or just 'peer', with keys from its own secret (overriding set_secret()'s for it); remove() forgets it:
+	void add(struct sockaddr_storage const &peer, uint8_t const *secret, size_t secret_size);
+	void remove(struct sockaddr_storage const &peer);
+
+	//------ stats ------
+	uint64_t sealed = 0;
+	uint64_t opened = 0;
+	uint64_t forged = 0; //failed authentication (or no key to try)
+	uint64_t replayed = 0; //authentic, but seen before (or too old to tell)
+	uint64_t reflected = 0; //carried our own sender_id
+	uint64_t cleartext_drops = 0;
+
+	//------ internals ------
+	struct Window { //RFC 6479-style: 16 words of 64 bits, the newest word partly ahead of 'top'
+		static constexpr uint32_t Words = 16;
+		static constexpr uint64_t Span = 64 * (Words - 1); //sequence numbers this far behind 'top' still get checked
+		uint64_t bits[Words] = {0};
+		uint64_t top = 0;
+		bool fresh(uint64_t seq) const;
+		void mark(uint64_t seq);
+	};
+	struct Keys {
+		std::unique_ptr< AEADKey > aes; //(only with AES-NI)
+		std::unique_ptr< AEADKey > chacha;
+		uint8_t iv[AEADKey::NonceSize];
+		uint32_t sender_id = 0; //ours
+		uint64_t next_seq = 0;
+		std::unordered_map< uint32_t, Window > windows; //by the peer's sender_id
+	};
+	std::shared_ptr< Keys > any_peer; //from set_secret()
+	std::unordered_map< struct sockaddr_storage, std::shared_ptr< Keys >, AddressHash, AddressEqual > peers; //from add()
+	std::mt19937 mt;
+	std::vector< uint8_t > scratch; //(sealed copies for sendto(), which doesn't need one of its own)
+
+	std::shared_ptr< Keys > derive(uint8_t const *secret, size_t secret_size);
+	Keys *keys_for(struct sockaddr_storage const &peer) const;
+	//keys to seal 'data' for 'to' with (nullptr: it goes as it is -- no key for 'to', or STUN):
+	Keys *sealing(struct sockaddr_storage const &to, uint8_t const *data, size_t size) const;
+	//seal 'data' into 'out' (room for size + Overhead); returns the sealed size (0 if the sequence numbers ran out):
+	size_t seal(Keys &keys, uint8_t const *data, size_t size, uint8_t *out);
+	//...into 'scratch':
+	uint8_t const *seal_to_scratch(Keys &keys, uint8_t const *data, size_t &size);
+	//open a sealed datagram in place -- the payload moves to the start of 'data' -- and set 'size' to its size;
+	// false if it isn't to be believed (counted above):
+	bool open(struct sockaddr_storage const &from, uint8_t *data, size_t &size);
+	//should a cleartext (non-STUN) datagram from 'from' be dropped?
+	bool refuses_cleartext(struct sockaddr_storage const &from) const { return require && keys_for(from); }
+};
@@ -0,0 +1,59 @@
+#include "PacketPool.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <stdexcept>
+
+static constexpr uint32_t CacheLine = 64;
+
+PacketPool::PacketPool(uint32_t count_, uint32_t mtu_) : count(count_), mtu(mtu_),
+	stride(uint32_t((sizeof(PacketBuffer) + mtu_ + CacheLine - 1) / CacheLine * CacheLine)) {
+	if (count == 0 || mtu == 0) {
+		throw std::runtime_error("PacketPool: buffer count and mtu must be positive.");
+	}
+	memory = reinterpret_cast< uint8_t * >(std::aligned_alloc(CacheLine, size_t(count) * stride));
+	if (!memory) {
+		throw std::runtime_error("PacketPool: out of memory.");
+	}
+	//all buffers start out free, lowest index on top:
+	for (uint32_t i = 0; i < count; ++i) {
+		PacketBuffer *buffer = new (at(i)) PacketBuffer;
+		buffer->pool = this;
+		buffer->index = i;
+		buffer->next_free.store(i + 1 < count ? i + 2 : 0, std::memory_order_relaxed);
+	}
+	free_head.store(1, std::memory_order_release);
+}
+
+PacketPool::~PacketPool() {
+	//NOTE: buffers still out dangle after this; release them first.
+	for (uint32_t i = 0; i < count; ++i) at(i)->~PacketBuffer();
+	std::free(memory);
+}
+
+PacketBuffer *PacketPool::acquire() {
+	uint64_t head = free_head.load(std::memory_order_acquire);
+	while (true) {
+		uint32_t top = uint32_t(head);
+		if (top == 0) {
+			exhausted.fetch_add(1, std::memory_order_relaxed);
+			return nullptr;
+		}
+		PacketBuffer *buffer = at(top - 1);
+		//(if 'buffer' is taken and returned meanwhile, the tag will have moved on and the swap fails)
+		uint64_t next = ((head >> 32) + 1) << 32 | buffer->next_free.load(std::memory_order_relaxed);
+		if (free_head.compare_exchange_weak(head, next, std::memory_order_acquire, std::memory_order_acquire)) {
+			buffer->size = 0;
+			return buffer;
+		}
+	}
+}
+
+void PacketPool::release(PacketBuffer *buffer) {
+	uint64_t head = free_head.load(std::memory_order_relaxed);
+	while (true) {
+		buffer->next_free.store(uint32_t(head), std::memory_order_relaxed);
+		uint64_t next = ((head >> 32) + 1) << 32 | (buffer->index + 1);
+		if (free_head.compare_exchange_weak(head, next, std::memory_order_release, std::memory_order_relaxed)) return;
+	}
+}
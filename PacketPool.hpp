@@ -0,0 +1,65 @@
+#pragma once
+
+/*
+ * PacketPool is a fixed set of packet buffers, each sized for one datagram
+ * of up to 'mtu' bytes (not 64 KiB), allocated once up front in one
+ * cache-line-aligned block.
+ *
+ * Free buffers sit on a lock-free stack (tagged head, so no ABA), so any
+ * thread can acquire() or release(): typically a channel's I/O thread
+ * receives into buffers (DatagramChannel::enable_packet_pool()) and hands
+ * them to workers -- through SPSCRings (SPSCRing.hpp), no copying -- and each
+ * worker releases them when done, back to whichever pool they came from.
+ *
+ * Nothing is allocated per packet; when every buffer is out, acquire()
+ * returns nullptr (and the receiver drops instead of waiting).
+ */
+
+#include <sys/socket.h>
+
+#include <atomic>
+#include <cstdint>
+
+struct PacketPool;
+
+struct alignas(64) PacketBuffer {
+	PacketPool *pool; //<-- home
+	uint32_t index;
+	uint32_t size = 0; //bytes of data()
+	struct sockaddr_storage from; //(for received datagrams)
+	std::atomic< uint32_t > next_free{0}; //(free stack link, as index + 1)
+
+	//'mtu' bytes of payload space follow the header:
+	uint8_t *data() { return reinterpret_cast< uint8_t * >(this + 1); }
+	uint8_t const *data() const { return reinterpret_cast< uint8_t const * >(this + 1); }
+
+	//give the buffer back to its pool (from any thread):
+	void release();
+};
+
+struct PacketPool {
+	//'count' buffers of 'mtu' bytes each; throws on error:
+	PacketPool(uint32_t count, uint32_t mtu = 1500);
+	~PacketPool();
+	PacketPool(PacketPool const &) = delete;
+	PacketPool &operator=(PacketPool const &) = delete;
+
+	uint32_t const count;
+	uint32_t const mtu;
+	uint32_t const stride; //bytes from one buffer to the next (header + mtu, rounded up to a cache line)
+
+	//a free buffer (size 0), or nullptr if all are out:
+	PacketBuffer *acquire();
+	void release(PacketBuffer *buffer);
+
+	std::atomic< uint64_t > exhausted{0}; //acquire()s that came back empty
+
+	//------ internals ------
+	uint8_t *memory = nullptr;
+	PacketBuffer *at(uint32_t index) { return reinterpret_cast< PacketBuffer * >(memory + size_t(index) * stride); }
+	alignas(64) std::atomic< uint64_t > free_head{0}; //(tag << 32) | (index + 1) of the top free buffer; 0 = none
+};
+
+inline void PacketBuffer::release() {
+	pool->release(this);
+}
@@ -0,0 +1,199 @@
+#include "PeerDemux.hpp"
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "STUN.hpp"
+
+#include <cassert>
+#include <cstring>
+#include <stdexcept>
+
+DatagramKind classify_datagram(uint8_t const *data, size_t size) {
+	if (size == 0) return OtherDatagram;
+	uint8_t b = data[0];
+	if (b <= 3) return (looks_like_stun(data, size) ? STUNDatagram : OtherDatagram);
+	if (b >= 16 && b <= 19) return ZRTPDatagram;
+	if (b >= 20 && b <= 63) return DTLSDatagram;
+	if (b >= 64 && b <= 79) return TURNChannelDatagram;
+	if (b >= 128 && b <= 191) return RTPDatagram;
+	if ((b & 0xfe) == 0xe0) return StreamDatagram;
+	if ((b & 0xfe) == 0xe2) return LatencyDatagram;
+	if ((b & 0xfc) == 0xe4) return PackedDatagram;
+	if (b == PeerDemux::PeerFrame) return PeerDatagram;
+	if (b == 0xe9) return FECDatagram;
+	if ((b & 0xfe) == 0xea) return SealedDatagram;
+	return OtherDatagram;
+}
+
+//------ table ------
+
+template< typename Match >
+PeerChannel *PeerDemux::Table::find(uint64_t hash, Match const &match) const {
+	if (count == 0) return nullptr;
+	size_t mask = slots.size() - 1;
+	for (size_t i = home(hash); slots[i].peer; i = (i + 1) & mask) {
+		if (slots[i].hash == hash && match(*slots[i].peer)) return slots[i].peer;
+	}
+	return nullptr;
+}
+
+void PeerDemux::Table::insert(uint64_t hash, PeerChannel *peer) {
+	if ((count + 1) * 2 > slots.size()) resize(slots.empty() ? 16 : slots.size() * 2); //<-- (at most half full keeps probes short)
+	size_t mask = slots.size() - 1;
+	size_t i = home(hash);
+	while (slots[i].peer) i = (i + 1) & mask;
+	slots[i].hash = hash;
+	slots[i].peer = peer;
+	count += 1;
+}
+
+void PeerDemux::Table::erase(uint64_t hash, PeerChannel *peer) {
+	if (count == 0) return;
+	size_t mask = slots.size() - 1;
+	size_t i = home(hash);
+	while (slots[i].peer && slots[i].peer != peer) i = (i + 1) & mask;
+	if (!slots[i].peer) return;
+	//pull later members of the probe run back over the hole, unless that would put them before their home slot:
+	for (size_t j = (i + 1) & mask; slots[j].peer; j = (j + 1) & mask) {
+		size_t k = home(slots[j].hash);
+		if (((j - k) & mask) >= ((j - i) & mask)) {
+			slots[i] = slots[j];
+			i = j;
+		}
+	}
+	slots[i] = Slot();
+	count -= 1;
+}
+
+void PeerDemux::Table::resize(size_t size) {
+	std::vector< Slot > old;
+	old.swap(slots);
+	slots.resize(size);
+	shift = 64;
+	for (size_t s = size; s > 1; s >>= 1) shift -= 1;
+	count = 0;
+	for (auto const &slot : old) {
+		if (slot.peer) insert(slot.hash, slot.peer);
+	}
+}
+
+//------ demux ------
+
+PeerDemux::PeerDemux(DatagramChannel &channel_) : channel(channel_), mt(channel_.random_seed()) {
+}
+
+PeerDemux::~PeerDemux() {
+	assert(peers() == 0 && "PeerChannels must be destroyed before their PeerDemux");
+}
+
+uint32_t PeerDemux::new_connection_id() {
+	while (true) {
+		uint32_t id = mt();
+		if (id != 0 && !find(id)) return id;
+	}
+}
+
+PeerChannel *PeerDemux::find(struct sockaddr_storage const &address) const {
+	return by_address.find(hash(address), [&address](PeerChannel const &peer) { return same_address(peer.address, address); });
+}
+
+PeerChannel *PeerDemux::find(uint32_t connection_id) const {
+	return by_id.find(hash(connection_id), [connection_id](PeerChannel const &peer) { return peer.connection_id == connection_id; });
+}
+
+void PeerDemux::add(PeerChannel *peer) {
+	if (peer->connection_id) {
+		if (find(peer->connection_id)) throw std::runtime_error("Connection ID " + std::to_string(peer->connection_id) + " is already in use.");
+		by_id.insert(hash(peer->connection_id), peer);
+	} else {
+		if (find(peer->address)) throw std::runtime_error("Already have a peer channel for " + address_to_string(peer->address) + ".");
+		by_address.insert(hash(peer->address), peer);
+	}
+}
+
+void PeerDemux::remove(PeerChannel *peer) {
+	if (peer->connection_id) by_id.erase(hash(peer->connection_id), peer);
+	else by_address.erase(hash(peer->address), peer);
+}
+
+bool PeerDemux::route(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	uint32_t connection_id = 0;
+	PeerChannel *peer;
+	if (size >= FrameHeader && data[0] == PeerFrame) {
+		connection_id = stun_read_u32(data + 1);
+		data += FrameHeader;
+		size -= FrameHeader;
+		peer = find(connection_id);
+		if (peer && !same_address(peer->address, from)) {
+			if (!follow_migration) {
+				unclaimed += 1;
+				return false;
+			}
+			struct sockaddr_storage old = peer->address;
+			peer->address = from;
+			migrations += 1;
+			if (peer->on_migrate) {
+				peer->on_migrate(old);
+				peer = find(connection_id); //<-- (the callback may have dropped it)
+			}
+		}
+	} else {
+		peer = find(from);
+	}
+	if (peer) return deliver(peer, data, size);
+
+	unclaimed += 1;
+	if (!on_new_peer) return false;
+	on_new_peer(from, connection_id, data, size);
+	//taken?
+	peer = (connection_id ? find(connection_id) : find(from));
+	if (!peer) return true; //<-- (on_new_peer saw it; turning the peer away is its call)
+	unclaimed -= 1;
+	return deliver(peer, data, size);
+}
+
+bool PeerDemux::deliver(PeerChannel *peer, uint8_t const *data, size_t size) {
+	routed += 1;
+	peer->packets_in += 1;
+	peer->bytes_in += size;
+	peer->last_receive_ms = EventLoop::now();
+	if (peer->on_receive) peer->on_receive(data, size); //<-- (may destroy 'peer'; nothing touches it after)
+	return true;
+}
+
+//------ peer channel ------
+
+PeerChannel::PeerChannel(PeerDemux &demux_, struct sockaddr_storage const &address_, uint32_t connection_id_) : demux(demux_), address(address_), connection_id(connection_id_) {
+	demux.add(this);
+}
+
+PeerChannel::~PeerChannel() {
+	demux.remove(this);
+}
+
+uint8_t const *PeerChannel::framed(uint8_t const *data, size_t &size) {
+	if (!connection_id) return data;
+	std::vector< uint8_t > &frame = demux.frame;
+	frame.resize(PeerDemux::FrameHeader + size);
+	frame[0] = PeerDemux::PeerFrame;
+	stun_write_u32(frame.data() + 1, connection_id);
+	if (size) memcpy(frame.data() + PeerDemux::FrameHeader, data, size);
+	size += PeerDemux::FrameHeader;
+	return frame.data();
+}
+
+bool PeerChannel::send(uint8_t const *data, size_t size) {
+	uint8_t const *packet = framed(data, size);
+	if (!demux.channel.send_to(address, packet, size)) return false;
+	packets_out += 1;
+	bytes_out += size;
+	return true;
+}
+
+bool PeerChannel::queue(uint8_t const *data, size_t size) {
+	uint8_t const *packet = framed(data, size);
+	if (!demux.channel.queue_to(address, packet, size)) return false;
+	packets_out += 1;
+	bytes_out += size;
+	return true;
+}
@@ -0,0 +1,155 @@
+#pragma once
+
+/*
+ * PeerDemux lets one DatagramChannel -- one bound port, one NAT mapping, one
+ * STUN check -- carry many logical peer channels, instead of a socket (and a
+ * STUN round trip) per peer.
+ *
+ * Each datagram is classified by its first byte (and, for STUN, the magic
+ * cookie), as per RFC 7983 -- see classify_datagram(). STUN, stream, latency,
+ * packed, and FEC datagrams go where they always did; application datagrams are
+ * routed to PeerChannels:
+ *  - a PeerChannel without a connection ID gets the datagrams from its
+ *    address (plain payload on the wire);
+ *  - one with a connection ID gets the datagrams carrying that ID, from
+ *    wherever they come -- so several logical channels can share one peer
+ *    address, and (with follow_migration) a peer whose NAT rebinds it to a new
+ *    port is followed instead of lost:
+ *      0xE8 | connection_id (4) | payload
+ * Lookups go through flat (open-addressing, linear-probing) hash tables:
+ * one probe, usually, and no allocation per datagram.
+ *
+ * Datagrams for no known peer go to on_new_peer, which may accept the peer
+ * by constructing a PeerChannel for it (the datagram is then delivered to
+ * it), or ignore it; without an on_new_peer, they are handed on to the
+ * channel's on_receive.
+ *
+ * Application payloads without a connection ID shouldn't start with a byte
+ * RFC 7983 assigns to someone else (0-3, 16-79, 128-191) or with 0xE0-0xEF.
+ *
+ * Connection IDs are just routing labels -- anyone who sees one can send as
+ * that peer (and, with follow_migration, move it); authenticate payloads if
+ * that matters.
+ */
+
+#include "SocketAddress.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+struct DatagramChannel;
+struct PeerChannel;
+
+//RFC 7983 first-byte ranges, plus the ones this library uses from the unassigned range:
+enum DatagramKind : uint8_t {
+	STUNDatagram, //0-3 (with the magic cookie)
+	ZRTPDatagram, //16-19
+	DTLSDatagram, //20-63
+	TURNChannelDatagram, //64-79
+	RTPDatagram, //128-191 (RTP / RTCP)
+	StreamDatagram, //0xE0-0xE1 (ReliableStream.hpp)
+	LatencyDatagram, //0xE2-0xE3 (LatencyTracker.hpp)
+	PackedDatagram, //0xE4-0xE7 (MessagePacker.hpp)
+	PeerDatagram, //0xE8 (connection ID + payload)
+	FECDatagram, //0xE9 (FECCoder.hpp)
+	SealedDatagram, //0xEA-0xEB (PacketCrypto.hpp)
+	OtherDatagram, //anything else (incl. empty)
+};
+DatagramKind classify_datagram(uint8_t const *data, size_t size);
+
+struct PeerDemux {
+	PeerDemux(DatagramChannel &channel);
+	~PeerDemux();
+	PeerDemux(PeerDemux const &) = delete;
+	PeerDemux &operator=(PeerDemux const &) = delete;
+
+	DatagramChannel &channel;
+
+	//called for an application datagram no PeerChannel claims (connection_id is 0 if it didn't carry one);
+	// construct a PeerChannel for 'from' (or for 'connection_id') from inside to take it, else it is dropped:
+	std::function< void(struct sockaddr_storage const &from, uint32_t connection_id, uint8_t const *data, size_t size) > on_new_peer;
+
+	//move a PeerChannel with a connection ID to the address its datagrams come from:
+	bool follow_migration = true;
+
+	//a random connection ID that isn't in use (never 0):
+	uint32_t new_connection_id();
+
+	PeerChannel *find(struct sockaddr_storage const &address) const; //(PeerChannels without a connection ID)
+	PeerChannel *find(uint32_t connection_id) const;
+	size_t peers() const { return by_address.count + by_id.count; }
+
+	static constexpr uint8_t PeerFrame = 0xE8;
+	static constexpr size_t FrameHeader = 5;
+
+	//------ stats ------
+	uint64_t routed = 0; //datagrams delivered to a PeerChannel
+	uint64_t unclaimed = 0; //handed to on_new_peer / on_receive instead
+	uint64_t migrations = 0;
+
+	//------ internals ------
+	//open-addressing table of PeerChannels by 64-bit key hash (linear probing; backward-shift erase, so no tombstones):
+	struct Table {
+		struct Slot {
+			uint64_t hash = 0;
+			PeerChannel *peer = nullptr; //(nullptr = empty)
+		};
+		std::vector< Slot > slots; //(power-of-two size)
+		size_t count = 0;
+		uint32_t shift = 64;
+		size_t home(uint64_t hash) const { return size_t((hash * 0x9e3779b97f4a7c15ULL) >> shift); }
+		template< typename Match >
+		PeerChannel *find(uint64_t hash, Match const &match) const;
+		void insert(uint64_t hash, PeerChannel *peer);
+		void erase(uint64_t hash, PeerChannel *peer);
+		void resize(size_t size);
+	};
+	Table by_address;
+	Table by_id;
+	std::mt19937 mt;
+	std::vector< uint8_t > frame; //(scratch for framing sends)
+
+	static uint64_t hash(struct sockaddr_storage const &address) { return AddressHash()(address); }
+	static uint64_t hash(uint32_t connection_id) { return connection_id; }
+	void add(PeerChannel *peer); //throws if the address / connection ID is taken
+	void remove(PeerChannel *peer);
+	//called by the channel for application datagrams; returns true if a PeerChannel took it:
+	bool route(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+	bool deliver(PeerChannel *peer, uint8_t const *data, size_t size);
+};
+
+//One logical channel to one peer over a PeerDemux; registers itself on construction (the demux must outlive it):
+struct PeerChannel {
+	//connection_id 0: routed by address (and sent as plain datagrams); throws if another PeerChannel has the address / ID:
+	PeerChannel(PeerDemux &demux, struct sockaddr_storage const &address, uint32_t connection_id = 0);
+	~PeerChannel();
+	PeerChannel(PeerChannel const &) = delete;
+	PeerChannel &operator=(PeerChannel const &) = delete;
+
+	PeerDemux &demux;
+	struct sockaddr_storage address; //where sends go (updated on migration)
+	uint32_t const connection_id;
+
+	//send a datagram to the peer now / via the channel's queue_to(); false (with errno set) on failure:
+	bool send(uint8_t const *data, size_t size);
+	bool queue(uint8_t const *data, size_t size);
+
+	//called with each payload from the peer (data is only valid during the call; the callback may destroy this PeerChannel):
+	std::function< void(uint8_t const *data, size_t size) > on_receive;
+	//called after the peer's datagrams started coming from a new address (connection ID channels only):
+	std::function< void(struct sockaddr_storage const &old_address) > on_migrate;
+
+	//------ stats ------
+	uint64_t packets_in = 0;
+	uint64_t bytes_in = 0;
+	uint64_t packets_out = 0;
+	uint64_t bytes_out = 0;
+	uint64_t last_receive_ms = 0; //EventLoop::now() (0 = nothing yet)
+
+	//------ internals ------
+	uint8_t const *framed(uint8_t const *data, size_t &size);
+};
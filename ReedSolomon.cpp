@@ -0,0 +1,250 @@
+#include "ReedSolomon.hpp"
+
+#include <cstring>
+#include <utility>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define GF256_X86 1
+#include <immintrin.h>
+#endif
+
+//------ field arithmetic ------
+
+struct GF256Tables {
+	uint8_t exp[512]; //(doubled, so exp[log a + log b] needs no reduction)
+	uint8_t log[256];
+	uint8_t coefficients[RSMaxParity][RSMaxData];
+	GF256Tables() {
+		uint32_t x = 1;
+		for (uint32_t i = 0; i < 255; ++i) {
+			exp[i] = exp[i + 255] = uint8_t(x);
+			log[x] = uint8_t(i);
+			x <<= 1;
+			if (x & 0x100) x ^= 0x11d;
+		}
+		exp[510] = exp[511] = 0;
+		log[0] = 0;
+		//Cauchy: 1 / (x_j + y_i), x_j = j, y_i = 128 + i; columns scaled by (x_0 + y_i) so parity 0 is all ones:
+		for (uint32_t j = 0; j < RSMaxParity; ++j) {
+			for (uint32_t i = 0; i < RSMaxData; ++i) {
+				uint32_t y = 128 + i;
+				coefficients[j][i] = exp[log[y] + 255 - log[j ^ y]];
+			}
+		}
+	}
+};
+
+static GF256Tables const &tables() {
+	static GF256Tables t;
+	return t;
+}
+
+uint8_t gf256_mul(uint8_t a, uint8_t b) {
+	if (a == 0 || b == 0) return 0;
+	GF256Tables const &t = tables();
+	return t.exp[t.log[a] + t.log[b]];
+}
+
+uint8_t gf256_inv(uint8_t a) {
+	GF256Tables const &t = tables();
+	return t.exp[255 - t.log[a]];
+}
+
+uint8_t rs_coefficient(uint32_t parity, uint32_t index) {
+	return tables().coefficients[parity][index];
+}
+
+//c * x for every x = 0..15 (lo) and for every x = 0x00, 0x10, ..., 0xf0 (hi); c * b = lo[b & 0xf] ^ hi[b >> 4]:
+static void nibble_tables(uint8_t c, uint8_t lo[16], uint8_t hi[16]) {
+	for (uint32_t x = 0; x < 16; ++x) {
+		lo[x] = gf256_mul(c, uint8_t(x));
+		hi[x] = gf256_mul(c, uint8_t(x << 4));
+	}
+}
+
+//------ portable ------
+
+void gf256_mul_add_portable(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	if (c == 0) return;
+	if (c == 1) {
+		for (size_t i = 0; i < size; ++i) dst[i] ^= src[i];
+		return;
+	}
+	uint8_t lo[16], hi[16];
+	nibble_tables(c, lo, hi);
+	for (size_t i = 0; i < size; ++i) {
+		dst[i] ^= lo[src[i] & 0xf] ^ hi[src[i] >> 4];
+	}
+}
+
+//------ PSHUFB / VPSHUFB ------
+// (each nibble looked up sixteen / thirty-two at a time -- after Plank, Greenan & Miller,
+//  "Screaming Fast Galois Field Arithmetic Using Intel SIMD Instructions", FAST 2013)
+
+#ifdef GF256_X86
+
+bool gf256_has_ssse3() {
+	static bool has = __builtin_cpu_supports("ssse3");
+	return has;
+}
+
+bool gf256_has_avx2() {
+	static bool has = __builtin_cpu_supports("avx2");
+	return has;
+}
+
+__attribute__((target("ssse3")))
+void gf256_mul_add_ssse3(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	if (c == 0) return;
+	size_t i = 0;
+	if (c == 1) {
+		for (; i + 16 <= size; i += 16) {
+			__m128i d = _mm_loadu_si128(reinterpret_cast< __m128i const * >(dst + i));
+			__m128i s = _mm_loadu_si128(reinterpret_cast< __m128i const * >(src + i));
+			_mm_storeu_si128(reinterpret_cast< __m128i * >(dst + i), _mm_xor_si128(d, s));
+		}
+	} else {
+		uint8_t lo[16], hi[16];
+		nibble_tables(c, lo, hi);
+		__m128i const table_lo = _mm_loadu_si128(reinterpret_cast< __m128i const * >(lo));
+		__m128i const table_hi = _mm_loadu_si128(reinterpret_cast< __m128i const * >(hi));
+		__m128i const mask = _mm_set1_epi8(0x0f);
+		for (; i + 16 <= size; i += 16) {
+			__m128i s = _mm_loadu_si128(reinterpret_cast< __m128i const * >(src + i));
+			__m128i product = _mm_xor_si128(
+				_mm_shuffle_epi8(table_lo, _mm_and_si128(s, mask)),
+				_mm_shuffle_epi8(table_hi, _mm_and_si128(_mm_srli_epi64(s, 4), mask)));
+			__m128i d = _mm_loadu_si128(reinterpret_cast< __m128i const * >(dst + i));
+			_mm_storeu_si128(reinterpret_cast< __m128i * >(dst + i), _mm_xor_si128(d, product));
+		}
+	}
+	gf256_mul_add_portable(dst + i, src + i, c, size - i);
+}
+
+__attribute__((target("avx2")))
+void gf256_mul_add_avx2(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	if (c == 0) return;
+	size_t i = 0;
+	if (c == 1) {
+		for (; i + 32 <= size; i += 32) {
+			__m256i d = _mm256_loadu_si256(reinterpret_cast< __m256i const * >(dst + i));
+			__m256i s = _mm256_loadu_si256(reinterpret_cast< __m256i const * >(src + i));
+			_mm256_storeu_si256(reinterpret_cast< __m256i * >(dst + i), _mm256_xor_si256(d, s));
+		}
+	} else {
+		uint8_t lo[16], hi[16];
+		nibble_tables(c, lo, hi);
+		//(VPSHUFB looks up within each 128-bit lane, so both lanes get the table)
+		__m256i const table_lo = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast< __m128i const * >(lo)));
+		__m256i const table_hi = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast< __m128i const * >(hi)));
+		__m256i const mask = _mm256_set1_epi8(0x0f);
+		for (; i + 32 <= size; i += 32) {
+			__m256i s = _mm256_loadu_si256(reinterpret_cast< __m256i const * >(src + i));
+			__m256i product = _mm256_xor_si256(
+				_mm256_shuffle_epi8(table_lo, _mm256_and_si256(s, mask)),
+				_mm256_shuffle_epi8(table_hi, _mm256_and_si256(_mm256_srli_epi64(s, 4), mask)));
+			__m256i d = _mm256_loadu_si256(reinterpret_cast< __m256i const * >(dst + i));
+			_mm256_storeu_si256(reinterpret_cast< __m256i * >(dst + i), _mm256_xor_si256(d, product));
+		}
+	}
+	gf256_mul_add_portable(dst + i, src + i, c, size - i);
+}
+
+#else //!GF256_X86
+
+bool gf256_has_ssse3() {
+	return false;
+}
+
+bool gf256_has_avx2() {
+	return false;
+}
+
+void gf256_mul_add_ssse3(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	gf256_mul_add_portable(dst, src, c, size);
+}
+
+void gf256_mul_add_avx2(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	gf256_mul_add_portable(dst, src, c, size);
+}
+
+#endif
+
+//------ dispatch ------
+
+typedef void (*GF256Kernel)(uint8_t *, uint8_t const *, uint8_t, size_t);
+
+static GF256Kernel kernel() {
+	static GF256Kernel k = (gf256_has_avx2() ? gf256_mul_add_avx2 : gf256_has_ssse3() ? gf256_mul_add_ssse3 : gf256_mul_add_portable);
+	return k;
+}
+
+void gf256_mul_add(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size) {
+	kernel()(dst, src, c, size);
+}
+
+char const *gf256_implementation() {
+	GF256Kernel k = kernel();
+	return (k == gf256_mul_add_avx2 ? "avx2" : k == gf256_mul_add_ssse3 ? "ssse3" : "portable");
+}
+
+//------ decoding ------
+
+bool rs_decode(uint32_t count, uint8_t *const *data, bool const *present, uint32_t parity_count, uint8_t const *const *parity, uint32_t const *parity_index, size_t size) {
+	std::vector< uint32_t > missing;
+	for (uint32_t i = 0; i < count; ++i) {
+		if (!present[i]) missing.emplace_back(i);
+	}
+	uint32_t e = uint32_t(missing.size());
+	if (e == 0) return true;
+	if (e > parity_count) return false;
+
+	//the first e parities, restricted to the missing columns, make an e x e system; invert it (Gauss-Jordan):
+	std::vector< uint8_t > a(e * e), inverse(e * e, 0);
+	for (uint32_t r = 0; r < e; ++r) {
+		for (uint32_t c = 0; c < e; ++c) a[r * e + c] = rs_coefficient(parity_index[r], missing[c]);
+		inverse[r * e + r] = 1;
+	}
+	for (uint32_t c = 0; c < e; ++c) {
+		uint32_t pivot = c;
+		while (pivot < e && a[pivot * e + c] == 0) ++pivot;
+		if (pivot == e) return false; //<-- (can't happen for distinct parity indices; Cauchy submatrices are invertible)
+		if (pivot != c) {
+			for (uint32_t k = 0; k < e; ++k) {
+				std::swap(a[c * e + k], a[pivot * e + k]);
+				std::swap(inverse[c * e + k], inverse[pivot * e + k]);
+			}
+		}
+		uint8_t scale = gf256_inv(a[c * e + c]);
+		for (uint32_t k = 0; k < e; ++k) {
+			a[c * e + k] = gf256_mul(a[c * e + k], scale);
+			inverse[c * e + k] = gf256_mul(inverse[c * e + k], scale);
+		}
+		for (uint32_t r = 0; r < e; ++r) {
+			uint8_t factor = a[r * e + c];
+			if (r == c || factor == 0) continue;
+			for (uint32_t k = 0; k < e; ++k) {
+				a[r * e + k] ^= gf256_mul(factor, a[c * e + k]);
+				inverse[r * e + k] ^= gf256_mul(factor, inverse[c * e + k]);
+			}
+		}
+	}
+
+	//missing[c] = sum_r inverse[c][r] * (parity_r + sum_{i present} coefficient(r, i) * data_i)
+	// -- so fold the inverse into the present symbols' coefficients and go straight to the output:
+	for (uint32_t c = 0; c < e; ++c) {
+		uint8_t *out = data[missing[c]];
+		memset(out, 0, size);
+		for (uint32_t r = 0; r < e; ++r) {
+			gf256_mul_add(out, parity[r], inverse[c * e + r], size);
+		}
+		for (uint32_t i = 0; i < count; ++i) {
+			if (!present[i]) continue;
+			uint8_t coefficient = 0;
+			for (uint32_t r = 0; r < e; ++r) coefficient ^= gf256_mul(inverse[c * e + r], rs_coefficient(parity_index[r], i));
+			gf256_mul_add(out, data[i], coefficient, size);
+		}
+	}
+	return true;
+}
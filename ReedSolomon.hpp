@@ -0,0 +1,59 @@
+#pragma once
+
+/*
+ * Reed-Solomon erasure coding over GF(2^8) (polynomial 0x11d), for
+ * FECCoder's parity datagrams.
+ *
+ * The code is systematic -- data symbols go out as they are -- with parity
+ * symbol j the sum over data symbols i of rs_coefficient(j, i) * data_i.
+ * Coefficients come from a Cauchy matrix (rows x_j = j, columns
+ * y_i = 128 + i), each column scaled so that parity 0 is plain XOR; every
+ * square submatrix of a Cauchy matrix is invertible, so any 'count' of the
+ * count + parities symbols get all the data back. Parity j doesn't depend
+ * on how many other parities there are, or on how many data symbols follow,
+ * so parity can be accumulated as data goes out and the number of parities
+ * picked per block.
+ *
+ * gf256_mul_add() (dst ^= c * src, the only bulk operation the codec needs)
+ * picks the fastest kernel the CPU supports, once, at startup:
+ *  - "avx2":  split-nibble table lookups with VPSHUFB, 32 bytes per step;
+ *  - "ssse3": the same with PSHUFB, 16 bytes per step;
+ *  - "portable": the same nibble tables, a byte at a time.
+ * (c = 1, i.e. XOR parity, skips the tables.)
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+static constexpr uint32_t RSMaxData = 128; //data symbols per block
+static constexpr uint32_t RSMaxParity = 128; //parity symbols per block
+
+uint8_t gf256_mul(uint8_t a, uint8_t b);
+uint8_t gf256_inv(uint8_t a); //(a != 0)
+
+//dst[0..size) ^= c * src[0..size):
+void gf256_mul_add(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size);
+
+//name of the kernel gf256_mul_add() dispatches to:
+char const *gf256_implementation();
+
+//individual kernels (for tests + benchmarks); _ssse3 / _avx2 must only be called if the CPU has them:
+void gf256_mul_add_portable(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size);
+void gf256_mul_add_ssse3(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size);
+void gf256_mul_add_avx2(uint8_t *dst, uint8_t const *src, uint8_t c, size_t size);
+bool gf256_has_ssse3();
+bool gf256_has_avx2();
+
+//coefficient of data symbol 'index' in parity symbol 'parity' (1 for every index of parity 0):
+uint8_t rs_coefficient(uint32_t parity, uint32_t index);
+
+//add data symbol 'index' into parity symbol 'parity' (start from zeros; symbols shorter than the parity count as zero-padded):
+inline void rs_encode_add(uint8_t *parity_symbol, uint32_t parity, uint32_t index, uint8_t const *data, size_t size) {
+	gf256_mul_add(parity_symbol, data, rs_coefficient(parity, index), size);
+}
+
+//Rebuild missing data symbols from parity, all 'size' bytes:
+// 'data' has 'count' buffers, holding the symbols where present[i] (the others get written);
+// 'parity' has 'parity_count' symbols, parity[r] being parity number parity_index[r] (all different).
+//Returns false (writing nothing) if there are fewer parities than missing symbols:
+bool rs_decode(uint32_t count, uint8_t *const *data, bool const *present, uint32_t parity_count, uint8_t const *const *parity, uint32_t const *parity_index, size_t size);
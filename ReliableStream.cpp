@@ -0,0 +1,299 @@
+#include "ReliableStream.hpp"
+
+#include "DatagramChannel.hpp"
+#include "Metrics.hpp"
+#include "STUN.hpp"
+#include "SocketAddress.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+constexpr uint8_t STREAM_DATA = 0xE0;
+constexpr uint8_t STREAM_ACK = 0xE1;
+
+static uint64_t now_us() {
+	return EventLoop::now_us(); //<-- (so streams follow simulated time, too)
+}
+
+//sequence numbers wrap, so compare by difference:
+static bool seq_before(uint32_t a, uint32_t b) {
+	return int32_t(a - b) < 0;
+}
+
+ReliableStream::ReliableStream(DatagramChannel &channel_, struct sockaddr_storage const &peer_, uint32_t stream_id_, uint32_t window_)
+	: channel(channel_), peer(peer_), stream_id(stream_id_), window(window_),
+	  congestion(new NewReno(uint32_t(MaxPacket))),
+	  segments(window_), send_data(size_t(window_) * MaxMessage), peer_window(window_),
+	  recv_data(size_t(window_) * MaxMessage), recv_size(window_), recv_have(window_) {
+	if (window == 0 || (window & (window - 1)) != 0 || window > 0x8000) {
+		throw std::runtime_error("ReliableStream: window must be a power of two, at most 32768.");
+	}
+	channel.streams.emplace_back(this);
+}
+
+ReliableStream::~ReliableStream() {
+	if (rto_timer) channel.loop.cancel(rto_timer);
+	channel.streams.erase(std::remove(channel.streams.begin(), channel.streams.end(), this), channel.streams.end());
+}
+
+bool ReliableStream::route(DatagramChannel &channel, struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	if (size < 5) return false;
+	uint32_t id = stun_read_u32(data + 1);
+	for (ReliableStream *stream : channel.streams) {
+		if (stream->stream_id != id || !same_address(stream->peer, from)) continue;
+		if (data[0] == STREAM_DATA && size >= DataHeader) {
+			stream->handle_data(stun_read_u32(data + 5), data + DataHeader, size - DataHeader);
+			return true;
+		} else if (data[0] == STREAM_ACK) {
+			stream->handle_ack(data, size);
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+//------ sending ------
+
+bool ReliableStream::send(uint8_t const *data, size_t size) {
+	if (size > MaxMessage || send_space() == 0) {
+		blocked = true;
+		return false;
+	}
+	uint32_t slot = snd_end & (window - 1);
+	Segment &segment = segments[slot];
+	segment = Segment();
+	segment.size = uint16_t(size);
+	memcpy(&send_data[size_t(slot) * MaxMessage], data, size);
+	snd_end += 1;
+	pump();
+	return true;
+}
+
+void ReliableStream::transmit(uint32_t seq) {
+	uint32_t slot = seq & (window - 1);
+	Segment &segment = segments[slot];
+	uint8_t packet[MaxPacket];
+	packet[0] = STREAM_DATA;
+	stun_write_u32(packet + 1, stream_id);
+	stun_write_u32(packet + 5, seq);
+	memcpy(packet + DataHeader, &send_data[size_t(slot) * MaxMessage], segment.size);
+	//NOTE: a failed send is treated like a lost packet -- loss detection / the RTO take care of it.
+	channel.queue_to(peer, packet, DataHeader + segment.size);
+
+	if (segment.transmissions) {
+		retransmits += 1;
+		if (channel.metrics) channel.metrics->retransmits.add();
+	}
+	segment.transmissions += 1;
+	segment.lost = false;
+	segment.sent_us = now_us();
+	bytes_in_flight += segment.size + DataHeader;
+	packets_sent += 1;
+}
+
+void ReliableStream::pump() {
+	uint32_t cwnd = std::max(congestion->window(), uint32_t(MaxPacket));
+	//resends first (oldest first), then new messages:
+	for (uint32_t seq = snd_una; seq_before(seq, snd_nxt) && bytes_in_flight < cwnd; ++seq) {
+		Segment const &segment = segments[seq & (window - 1)];
+		if (segment.lost && !segment.acked) transmit(seq);
+	}
+	while (seq_before(snd_nxt, snd_end) && bytes_in_flight < cwnd && snd_nxt - snd_una < peer_window) {
+		transmit(snd_nxt);
+		snd_nxt += 1;
+	}
+	arm_rto();
+}
+
+void ReliableStream::arm_rto() {
+	if (rto_timer || bytes_in_flight == 0) return;
+	rto_timer = channel.loop.after(rto_ms, [this]() {
+		rto_timer = 0;
+		on_rto();
+	});
+}
+
+void ReliableStream::on_rto() {
+	if (snd_una == snd_nxt) return;
+	timeouts += 1;
+	//presume everything in flight lost; resend from the oldest, one segment at a time (per the controller):
+	for (uint32_t seq = snd_una; seq_before(seq, snd_nxt); ++seq) {
+		Segment &segment = segments[seq & (window - 1)];
+		if (!segment.acked) segment.lost = true;
+	}
+	bytes_in_flight = 0;
+	congestion->on_timeout();
+	recovery_start_us = now_us();
+	rto_ms = std::min(max_rto_ms, rto_ms * 2);
+	pump();
+}
+
+void ReliableStream::handle_ack(uint8_t const *data, size_t size) {
+	if (size < 12 || size < 12 + size_t(data[11]) * 8) {
+		if (channel.metrics) channel.metrics->parse_errors.add();
+		return;
+	}
+	uint32_t cumulative = stun_read_u32(data + 5);
+	uint32_t peer_window_ = stun_read_u16(data + 9);
+	uint32_t count = data[11];
+	//ignore acks for things never sent (corrupt or confused):
+	if (seq_before(snd_nxt, cumulative)) return;
+	peer_window = std::min(window, std::max(1U, peer_window_));
+
+	uint64_t now = now_us();
+	uint32_t cwnd = congestion->window();
+	bool cwnd_limited = (2 * bytes_in_flight >= cwnd); //<-- no growing the window while the application doesn't fill it (RFC 7661)
+	uint32_t growth_bytes = 0; //newly acked, sent since the last congestion response
+	bool newly_acked = false;
+
+	auto ack = [&](uint32_t seq) {
+		Segment &segment = segments[seq & (window - 1)];
+		if (segment.acked) return;
+		segment.acked = true;
+		if (!segment.lost) bytes_in_flight -= segment.size + DataHeader;
+		segment.lost = false;
+		newly_acked = true;
+		if (segment.sent_us > recovery_start_us) growth_bytes += segment.size + DataHeader;
+		if (segment.transmissions == 1 || (min_rtt_us != ~0U && now - segment.sent_us >= min_rtt_us)) {
+			rack_sent_us = std::max(rack_sent_us, segment.sent_us); //<-- (a resend acked too quickly was an earlier copy arriving)
+		}
+	};
+
+	//RTT sample only from the newest segment this ACK covers, and only if it was sent once (Karn's rule);
+	// older ones may have waited out a hole before being reported:
+	uint32_t newest = (count ? stun_read_u32(data + 12 + 4) - 1 : cumulative - 1);
+	uint64_t sample_sent_us = 0;
+	if (seq_before(newest, snd_nxt) && !seq_before(newest, snd_una)) {
+		Segment const &segment = segments[newest & (window - 1)];
+		if (!segment.acked && segment.transmissions == 1) sample_sent_us = segment.sent_us;
+	}
+
+	for (uint32_t seq = snd_una; seq_before(seq, cumulative); ++seq) ack(seq);
+	for (uint32_t r = 0; r < count; ++r) {
+		uint32_t start = stun_read_u32(data + 12 + 8 * r);
+		uint32_t end = stun_read_u32(data + 12 + 8 * r + 4);
+		start = (seq_before(start, snd_una) ? snd_una : start);
+		end = (seq_before(snd_nxt, end) ? snd_nxt : end);
+		for (uint32_t seq = start; seq_before(seq, end); ++seq) ack(seq);
+	}
+
+	bool advanced = seq_before(snd_una, cumulative);
+	if (advanced) snd_una = cumulative;
+
+	//RTT estimate (RFC 6298, in microseconds):
+	uint32_t rtt_us = 0;
+	if (sample_sent_us) {
+		rtt_us = uint32_t(std::max< uint64_t >(1, now - sample_sent_us));
+		min_rtt_us = std::min(min_rtt_us, rtt_us);
+		if (channel.metrics) channel.metrics->rtt_us.record(rtt_us);
+		if (srtt_us == 0) {
+			srtt_us = rtt_us;
+			rttvar_us = rtt_us / 2;
+		} else {
+			uint32_t delta = (srtt_us > rtt_us ? srtt_us - rtt_us : rtt_us - srtt_us);
+			rttvar_us = (3 * rttvar_us + delta) / 4;
+			srtt_us = (7 * srtt_us + rtt_us) / 8;
+		}
+		uint32_t rto = (srtt_us + std::max(1000U, 4 * rttvar_us) + 999) / 1000;
+		rto_ms = std::max(min_rto_ms, std::min(max_rto_ms, rto));
+	}
+
+	//loss detection (RACK): anything sent a reordering window before a segment that made it isn't coming:
+	bool congestion_event = false;
+	if (newly_acked && min_rtt_us != ~0U) {
+		uint64_t reordering_us = min_rtt_us / 4;
+		//(if the ranges ran out, what's below the last one may well have arrived -- wait for a later ACK to say)
+		uint32_t known = (count == MaxRanges ? stun_read_u32(data + 12 + 8 * (count - 1)) : snd_una);
+		for (uint32_t seq = (seq_before(known, snd_una) ? snd_una : known); seq_before(seq, snd_nxt); ++seq) {
+			Segment &segment = segments[seq & (window - 1)];
+			if (segment.acked || segment.lost) continue;
+			if (segment.sent_us + reordering_us >= rack_sent_us) continue;
+			segment.lost = true;
+			bytes_in_flight -= segment.size + DataHeader;
+			if (segment.sent_us > recovery_start_us) congestion_event = true;
+		}
+	}
+	if (congestion_event) {
+		congestion->on_loss();
+		recovery_start_us = now;
+	} else if (growth_bytes && cwnd_limited) {
+		congestion->on_ack(growth_bytes, rtt_us, min_rtt_us);
+	}
+
+	if (advanced) {
+		//restart the timer for what's still outstanding:
+		if (rto_timer) {
+			channel.loop.cancel(rto_timer);
+			rto_timer = 0;
+		}
+	}
+	pump();
+
+	if (blocked && send_space() > 0) {
+		blocked = false;
+		if (on_writable) on_writable();
+	}
+}
+
+//------ receiving ------
+
+void ReliableStream::handle_data(uint32_t seq, uint8_t const *data, size_t size) {
+	schedule_ack(); //<-- (duplicates get acked too, in case the last ACK was lost)
+	if (seq_before(seq, rcv_nxt) || seq - rcv_nxt >= window || size > MaxMessage) return;
+	if (seq_before(rcv_max, seq + 1)) rcv_max = seq + 1;
+
+	if (seq == rcv_nxt) {
+		//in order: hand it over without copying, then whatever it unblocked:
+		rcv_nxt += 1;
+		if (on_message) on_message(data, size);
+		while (recv_have[rcv_nxt & (window - 1)]) {
+			uint32_t slot = rcv_nxt & (window - 1);
+			recv_have[slot] = 0;
+			rcv_nxt += 1;
+			if (on_message) on_message(&recv_data[size_t(slot) * MaxMessage], recv_size[slot]);
+		}
+		return;
+	}
+	uint32_t slot = seq & (window - 1);
+	if (recv_have[slot]) return; //duplicate
+	recv_have[slot] = 1;
+	recv_size[slot] = uint16_t(size);
+	memcpy(&recv_data[size_t(slot) * MaxMessage], data, size);
+}
+
+void ReliableStream::schedule_ack() {
+	if (ack_deferred) return;
+	ack_deferred = true;
+	std::weak_ptr< bool > alive_(alive);
+	channel.loop.defer([this, alive_]() {
+		if (alive_.expired()) return;
+		ack_deferred = false;
+		send_ack();
+	});
+}
+
+void ReliableStream::send_ack() {
+	uint8_t packet[12 + MaxRanges * 8];
+	packet[0] = STREAM_ACK;
+	stun_write_u32(packet + 1, stream_id);
+	stun_write_u32(packet + 5, rcv_nxt);
+	uint32_t held = rcv_max - rcv_nxt; //<-- (slots in use for out-of-order messages, at most)
+	stun_write_u16(packet + 9, uint16_t(std::min< uint32_t >(0xffff, window - std::min(window, held))));
+
+	//ranges of what arrived past the first hole, newest first (so the sender always hears about the latest):
+	uint32_t count = 0;
+	uint32_t seq = rcv_max;
+	while (seq_before(rcv_nxt, seq) && count < MaxRanges) {
+		while (seq_before(rcv_nxt, seq) && !recv_have[(seq - 1) & (window - 1)]) --seq;
+		if (!seq_before(rcv_nxt, seq)) break;
+		uint32_t end = seq;
+		while (seq_before(rcv_nxt, seq) && recv_have[(seq - 1) & (window - 1)]) --seq;
+		stun_write_u32(packet + 12 + 8 * count, seq);
+		stun_write_u32(packet + 12 + 8 * count + 4, end);
+		count += 1;
+	}
+	packet[11] = uint8_t(count);
+	channel.queue_to(peer, packet, 12 + 8 * count);
+}
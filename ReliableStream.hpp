@@ -0,0 +1,125 @@
+#pragma once
+
+/*
+ * ReliableStream is an opt-in, reliable, in-order message stream to one peer,
+ * layered over a DatagramChannel -- unreliable datagrams (and STUN) keep
+ * flowing on the same socket around it.
+ *
+ * Both sides construct a stream with the same stream_id, pointed at each
+ * other (e.g., at the address ICEAgent found); there is no handshake.
+ *
+ * On the wire (first byte tells stream packets apart from everything else,
+ * per RFC 7983's unassigned range, and the stream id has to match too):
+ *   DATA: 0xE0 | stream_id (4) | seq (4) | message
+ *   ACK:  0xE1 | stream_id (4) | next expected seq (4) | window (2) | count (1) | count x [start, end) (4 + 4)
+ * Each message is one DATA packet, numbered by seq. ACKs carry up to
+ * MaxRanges selective-ack ranges of what arrived past a hole, newest first;
+ * the receiver sends at most one per loop turn (so a recvmmsg() batch gets
+ * one ACK).
+ *
+ * Sending:
+ *  - messages wait in a ring-buffer window ('window' messages) until acked;
+ *  - a message is declared lost once one sent a quarter-RTT or more after
+ *    it has been acked (RACK, RFC 8985 -- which also catches lost resends),
+ *    and is resent right away; the retransmission timer (RFC 6298 RTO from
+ *    RTT samples, Karn's rule) catches the rest;
+ *  - how much is in flight is up to 'congestion' (see CongestionControl.hpp).
+ *
+ * Callbacks must not destroy the stream.
+ */
+
+#include "CongestionControl.hpp"
+#include "EventLoop.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+struct DatagramChannel;
+
+struct ReliableStream {
+	//registers with 'channel' (which must outlive the stream); throws if window isn't a power of two:
+	ReliableStream(DatagramChannel &channel, struct sockaddr_storage const &peer, uint32_t stream_id = 0, uint32_t window = 512);
+	~ReliableStream();
+	ReliableStream(ReliableStream const &) = delete;
+	ReliableStream &operator=(ReliableStream const &) = delete;
+
+	DatagramChannel &channel;
+	struct sockaddr_storage const peer;
+	uint32_t const stream_id;
+	uint32_t const window; //messages, each way
+
+	static constexpr size_t MaxPacket = 1200;
+	static constexpr size_t DataHeader = 9;
+	static constexpr size_t MaxMessage = MaxPacket - DataHeader;
+	static constexpr uint32_t MaxRanges = 128; //<-- (fills an ACK to about MaxPacket)
+
+	//queue a message (at most MaxMessage bytes); returns false if it is too big or the send window is full:
+	bool send(uint8_t const *data, size_t size);
+	//messages send() will still take:
+	uint32_t send_space() const { return window - (snd_end - snd_una); }
+	//messages sent but not acknowledged yet:
+	uint32_t unacked() const { return snd_end - snd_una; }
+
+	//called with each message, in order (data is only valid during the call):
+	std::function< void(uint8_t const *data, size_t size) > on_message;
+	//called when send() has room again after returning false:
+	std::function< void() > on_writable;
+
+	std::unique_ptr< CongestionControl > congestion; //NewReno unless replaced
+
+	uint32_t min_rto_ms = 200;
+	uint32_t max_rto_ms = 60000;
+
+	//------ stats ------
+	uint64_t packets_sent = 0;
+	uint64_t retransmits = 0;
+	uint64_t timeouts = 0;
+	uint32_t srtt_us = 0, rttvar_us = 0, min_rtt_us = ~0U;
+	uint32_t rto_ms = 1000; //<-- RFC 6298 initial value
+
+	//------ internals ------
+	//send side, ring-indexed by seq & (window - 1):
+	struct Segment {
+		uint16_t size = 0;
+		uint8_t transmissions = 0;
+		bool acked = false;
+		bool lost = false; //declared lost and not yet resent
+		uint64_t sent_us = 0;
+	};
+	std::vector< Segment > segments;
+	std::vector< uint8_t > send_data; //window x MaxMessage
+	uint32_t snd_una = 0; //oldest unacknowledged
+	uint32_t snd_nxt = 0; //next never-sent
+	uint32_t snd_end = 0; //next to be queued
+	uint64_t rack_sent_us = 0; //send time of the most recently sent segment known to have arrived
+	uint64_t recovery_start_us = 0; //last congestion response; losses of segments sent before it don't count again
+	uint32_t bytes_in_flight = 0;
+	uint32_t peer_window; //what the peer's last ACK said it will take
+	bool blocked = false; //send() has returned false since the last on_writable
+	EventLoop::TimerID rto_timer = 0;
+
+	//receive side:
+	std::vector< uint8_t > recv_data; //window x MaxMessage
+	std::vector< uint16_t > recv_size;
+	std::vector< uint8_t > recv_have;
+	uint32_t rcv_nxt = 0; //next seq to deliver
+	uint32_t rcv_max = 0; //one past the highest seq received
+	bool ack_deferred = false;
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- lets deferred ACKs notice the stream is gone
+
+	//called by the channel for datagrams that start with 0xE0 / 0xE1; returns true if some stream took it:
+	static bool route(DatagramChannel &channel, struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+
+	void handle_data(uint32_t seq, uint8_t const *data, size_t size);
+	void handle_ack(uint8_t const *data, size_t size);
+	void transmit(uint32_t seq);
+	void pump(); //send whatever the windows allow
+	void arm_rto();
+	void on_rto();
+	void schedule_ack();
+	void send_ack();
+};
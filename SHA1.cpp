@@ -0,0 +1,231 @@
+#include "SHA1.hpp"
+
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA1_X86 1
+#include <immintrin.h>
+#endif
+
+//------ portable ------
+
+static inline uint32_t rol(uint32_t x, uint32_t n) {
+	return (x << n) | (x >> (32 - n));
+}
+
+static inline uint32_t read_be32(uint8_t const *p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+void sha1_blocks_portable(uint32_t state[5], uint8_t const *blocks, size_t count) {
+	for (; count; --count, blocks += 64) {
+		uint32_t w[80];
+		for (uint32_t i = 0; i < 16; ++i) w[i] = read_be32(blocks + 4 * i);
+		for (uint32_t i = 16; i < 80; ++i) w[i] = rol(w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1);
+
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (uint32_t i = 0; i < 80; ++i) {
+			uint32_t f, k;
+			if (i < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5a827999;
+			} else if (i < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ed9eba1;
+			} else if (i < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8f1bbcdc;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xca62c1d6;
+			}
+			uint32_t t = rol(a, 5) + f + e + k + w[i];
+			e = d;
+			d = c;
+			c = rol(b, 30);
+			b = a;
+			a = t;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+	}
+}
+
+//------ x86 SHA extensions ------
+// Each group of four rounds consumes one 16-byte message block and (from the
+// fourth group on) finishes scheduling the next few with SHA1MSG1/SHA1MSG2.
+
+#ifdef SHA1_X86
+
+bool sha1_has_sha_ni() {
+	static bool has = (__builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1"));
+	return has;
+}
+
+struct SHANIState {
+	__m128i abcd, e0, e1;
+	__m128i m[4];
+};
+
+//rounds 4*I .. 4*I+3:
+template< int I >
+__attribute__((target("sha,ssse3,sse4.1"), always_inline))
+static inline void sha_ni_group(SHANIState &s, uint8_t const *block, __m128i const &byteswap) {
+	__m128i &cur = s.m[I % 4];
+	__m128i &ea = (I % 2 == 0 ? s.e0 : s.e1); //the E (+ message) for these rounds
+	__m128i &eb = (I % 2 == 0 ? s.e1 : s.e0); //saves ABCD, to become next group's E
+	if (I < 4) cur = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast< __m128i const * >(block + 16 * I)), byteswap);
+	if (I == 0) ea = _mm_add_epi32(ea, cur);
+	else ea = _mm_sha1nexte_epu32(ea, cur);
+	eb = s.abcd;
+	if (I >= 3 && I <= 18) s.m[(I + 1) % 4] = _mm_sha1msg2_epu32(s.m[(I + 1) % 4], cur);
+	s.abcd = _mm_sha1rnds4_epu32(s.abcd, ea, I / 5);
+	if (I >= 1 && I <= 16) s.m[(I + 3) % 4] = _mm_sha1msg1_epu32(s.m[(I + 3) % 4], cur);
+	if (I >= 2 && I <= 17) s.m[(I + 2) % 4] = _mm_xor_si128(s.m[(I + 2) % 4], cur);
+}
+
+template< int... I >
+__attribute__((target("sha,ssse3,sse4.1"), always_inline))
+static inline void sha_ni_groups(SHANIState &s, uint8_t const *block, __m128i const &byteswap) {
+	(sha_ni_group< I >(s, block, byteswap), ...);
+}
+
+__attribute__((target("sha,ssse3,sse4.1")))
+void sha1_blocks_sha_ni(uint32_t state[5], uint8_t const *blocks, size_t count) {
+	__m128i const byteswap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+
+	SHANIState s;
+	s.abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast< __m128i const * >(state)), 0x1b);
+	s.e0 = _mm_set_epi32(int(state[4]), 0, 0, 0);
+
+	for (; count; --count, blocks += 64) {
+		__m128i abcd_save = s.abcd;
+		__m128i e0_save = s.e0;
+		sha_ni_groups< 0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19 >(s, blocks, byteswap);
+		s.e0 = _mm_sha1nexte_epu32(s.e0, e0_save);
+		s.abcd = _mm_add_epi32(s.abcd, abcd_save);
+	}
+
+	_mm_storeu_si128(reinterpret_cast< __m128i * >(state), _mm_shuffle_epi32(s.abcd, 0x1b));
+	state[4] = uint32_t(_mm_extract_epi32(s.e0, 3));
+}
+
+#else //!SHA1_X86
+
+bool sha1_has_sha_ni() {
+	return false;
+}
+
+void sha1_blocks_sha_ni(uint32_t state[5], uint8_t const *blocks, size_t count) {
+	sha1_blocks_portable(state, blocks, count);
+}
+
+#endif
+
+SHA1Blocks sha1_best_blocks() {
+	static SHA1Blocks best = (sha1_has_sha_ni() ? sha1_blocks_sha_ni : sha1_blocks_portable);
+	return best;
+}
+
+char const *sha1_implementation() {
+	return (sha1_best_blocks() == sha1_blocks_sha_ni ? "sha-ni" : "portable");
+}
+
+//------ SHA1 ------
+
+SHA1::SHA1(SHA1Blocks blocks_) : blocks(blocks_) {
+	state[0] = 0x67452301;
+	state[1] = 0xefcdab89;
+	state[2] = 0x98badcfe;
+	state[3] = 0x10325476;
+	state[4] = 0xc3d2e1f0;
+}
+
+void SHA1::update(uint8_t const *data, size_t size) {
+	total += size;
+	if (buffered) {
+		size_t take = BlockSize - buffered;
+		if (take > size) take = size;
+		std::memcpy(buffer + buffered, data, take);
+		buffered += take;
+		data += take;
+		size -= take;
+		if (buffered < BlockSize) return;
+		blocks(state, buffer, 1);
+		buffered = 0;
+	}
+	if (size >= BlockSize) {
+		blocks(state, data, size / BlockSize);
+		data += size & ~(BlockSize - 1);
+		size &= (BlockSize - 1);
+	}
+	std::memcpy(buffer, data, size);
+	buffered = size;
+}
+
+void SHA1::finish(uint8_t *digest) {
+	uint64_t bits = total * 8;
+	//pad with 0x80, zeros, then 64-bit big-endian length, to a block boundary:
+	buffer[buffered++] = 0x80;
+	if (buffered > BlockSize - 8) {
+		std::memset(buffer + buffered, 0, BlockSize - buffered);
+		blocks(state, buffer, 1);
+		buffered = 0;
+	}
+	std::memset(buffer + buffered, 0, BlockSize - 8 - buffered);
+	for (uint32_t i = 0; i < 8; ++i) {
+		buffer[BlockSize - 1 - i] = uint8_t(bits >> (8 * i));
+	}
+	blocks(state, buffer, 1);
+	buffered = 0;
+
+	for (uint32_t i = 0; i < 5; ++i) {
+		digest[4*i+0] = uint8_t(state[i] >> 24);
+		digest[4*i+1] = uint8_t(state[i] >> 16);
+		digest[4*i+2] = uint8_t(state[i] >> 8);
+		digest[4*i+3] = uint8_t(state[i]);
+	}
+}
+
+void sha1(uint8_t const *data, size_t size, uint8_t *digest) {
+	SHA1 ctx;
+	ctx.update(data, size);
+	ctx.finish(digest);
+}
+
+//------ HMAC (RFC 2104) ------
+
+HMACSHA1::HMACSHA1(uint8_t const *key, size_t key_size, SHA1Blocks blocks) : inner(blocks), outer(blocks) {
+	uint8_t padded[SHA1::BlockSize];
+	std::memset(padded, 0, sizeof(padded));
+	if (key_size > SHA1::BlockSize) {
+		SHA1 ctx(blocks);
+		ctx.update(key, key_size);
+		ctx.finish(padded);
+	} else {
+		std::memcpy(padded, key, key_size);
+	}
+
+	uint8_t pad[SHA1::BlockSize];
+	for (uint32_t i = 0; i < SHA1::BlockSize; ++i) pad[i] = padded[i] ^ 0x36;
+	inner.update(pad, sizeof(pad));
+	for (uint32_t i = 0; i < SHA1::BlockSize; ++i) pad[i] = padded[i] ^ 0x5c;
+	outer.update(pad, sizeof(pad));
+}
+
+void HMACSHA1::finish(SHA1 &ctx, uint8_t *mac) const {
+	uint8_t inner_digest[SHA1::DigestSize];
+	ctx.finish(inner_digest);
+	SHA1 o = outer;
+	o.update(inner_digest, sizeof(inner_digest));
+	o.finish(mac);
+}
+
+void HMACSHA1::compute(uint8_t const *data, size_t size, uint8_t *mac) const {
+	SHA1 ctx = begin();
+	ctx.update(data, size);
+	finish(ctx, mac);
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+/*
+ * SHA-1 and HMAC-SHA1 (for STUN's MESSAGE-INTEGRITY).
+ *
+ * The compression function is picked once, at startup:
+ *  - "sha-ni": x86 SHA extensions (SHA1RNDS4 and friends);
+ *  - "portable": plain C++, everywhere else.
+ *
+ * HMACSHA1 pre-hashes the padded key, so once a key is set up each message
+ * costs only the compressions its own bytes need (plus one for the outer hash)
+ * -- for a typical 20-100 byte STUN message that's three or four in all.
+ */
+
+#include <cstdint>
+#include <cstddef>
+
+//compress 'count' 64-byte blocks into 'state':
+typedef void (*SHA1Blocks)(uint32_t state[5], uint8_t const *blocks, size_t count);
+
+void sha1_blocks_portable(uint32_t state[5], uint8_t const *blocks, size_t count);
+void sha1_blocks_sha_ni(uint32_t state[5], uint8_t const *blocks, size_t count); //only call if sha1_has_sha_ni()
+bool sha1_has_sha_ni();
+
+//fastest kernel this CPU supports (and its name):
+SHA1Blocks sha1_best_blocks();
+char const *sha1_implementation();
+
+struct SHA1 {
+	static constexpr size_t DigestSize = 20;
+	static constexpr size_t BlockSize = 64;
+
+	SHA1(SHA1Blocks blocks = sha1_best_blocks());
+
+	void update(uint8_t const *data, size_t size);
+	void finish(uint8_t *digest); //writes DigestSize bytes
+
+	SHA1Blocks blocks;
+	uint32_t state[5];
+	uint8_t buffer[BlockSize];
+	size_t buffered = 0;
+	uint64_t total = 0; //bytes hashed so far
+};
+
+void sha1(uint8_t const *data, size_t size, uint8_t *digest);
+
+struct HMACSHA1 {
+	HMACSHA1(uint8_t const *key, size_t key_size, SHA1Blocks blocks = sha1_best_blocks());
+
+	//start a new MAC (keeps the key):
+	SHA1 begin() const { return inner; }
+	//finish a MAC started with begin(); writes SHA1::DigestSize bytes:
+	void finish(SHA1 &ctx, uint8_t *mac) const;
+
+	//one-shot:
+	void compute(uint8_t const *data, size_t size, uint8_t *mac) const;
+
+	SHA1 inner; //state after hashing key ^ ipad
+	SHA1 outer; //state after hashing key ^ opad
+};
@@ -0,0 +1,67 @@
+#pragma once
+
+/*
+ * SPSCRing is a bounded, lock-free queue between exactly one producer
+ * thread and one consumer thread -- e.g., a channel's I/O thread handing
+ * PacketBuffers (PacketPool.hpp) to a worker, which owns them from then on.
+ *
+ * The producer only writes 'tail', the consumer only writes 'head'; each
+ * sits on its own cache line next to the producer's / consumer's cached copy
+ * of the other index, so in the steady state a push or pop touches no line
+ * the other side is writing (the other index is re-read only when the ring
+ * looks full / empty).
+ *
+ * Capacity must be a power of two.
+ */
+
+#include <atomic>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+template< typename T >
+struct SPSCRing {
+	explicit SPSCRing(uint32_t capacity) : slots(capacity), mask(capacity - 1) {
+		if (capacity == 0 || (capacity & (capacity - 1)) != 0) {
+			throw std::runtime_error("SPSCRing: capacity must be a power of two.");
+		}
+	}
+	SPSCRing(SPSCRing const &) = delete;
+	SPSCRing &operator=(SPSCRing const &) = delete;
+
+	//producer side; returns false if full:
+	bool push(T const &value) {
+		uint32_t t = tail.load(std::memory_order_relaxed);
+		if (t - cached_head > mask) {
+			cached_head = head.load(std::memory_order_acquire);
+			if (t - cached_head > mask) return false;
+		}
+		slots[t & mask] = value;
+		tail.store(t + 1, std::memory_order_release);
+		return true;
+	}
+
+	//consumer side; returns false if empty:
+	bool pop(T *value) {
+		uint32_t h = head.load(std::memory_order_relaxed);
+		if (h == cached_tail) {
+			cached_tail = tail.load(std::memory_order_acquire);
+			if (h == cached_tail) return false;
+		}
+		*value = slots[h & mask];
+		head.store(h + 1, std::memory_order_release);
+		return true;
+	}
+
+	//(a snapshot; exact only on a quiet ring)
+	uint32_t size() const { return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire); }
+	uint32_t capacity() const { return mask + 1; }
+
+	//------ internals ------
+	std::vector< T > slots;
+	uint32_t const mask;
+	alignas(64) std::atomic< uint32_t > head{0}; //next to pop (written by the consumer)
+	uint32_t cached_tail = 0; //consumer's last look at 'tail'
+	alignas(64) std::atomic< uint32_t > tail{0}; //next to push (written by the producer)
+	uint32_t cached_head = 0; //producer's last look at 'head'
+};
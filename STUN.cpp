@@ -0,0 +1,453 @@
+#include "STUN.hpp"
+
+#include "CRC32.hpp"
+
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <stdexcept>
+#include <string>
+
+template< typename T >
+static std::string binary(T val, uint32_t bits) {
+	std::string ret;
+	ret.reserve(bits);
+	assert(bits >= 8*sizeof(val) || (val >> bits) == 0);
+	while (bits != 0) {
+		bits -= 1;
+		if (val & (1 << bits)) ret += '1';
+		else ret += '0';
+	}
+	return ret;
+}
+
+template< typename T >
+static std::string hex(T val, uint32_t digits) {
+	std::string ret;
+	ret.reserve(digits);
+	assert(digits >= 2*sizeof(val) || (val >> (4*digits)) == 0);
+	while (digits != 0) {
+		digits -= 1;
+		ret += "0123456789abcdef"[(val >> (4*digits)) & 0xf];
+	}
+	return ret;
+}
+
+STUNMessageView::STUNMessageView(uint8_t const *data_, size_t size_) : data(data_), size(size_) {
+	attributes_begin = attributes_end = data;
+
+	if (size < STUN_HEADER_SIZE) {
+		error = "header is too small.";
+		return;
+	}
+	attributes_begin = attributes_end = data + STUN_HEADER_SIZE;
+
+	if (data[0] & 0xc0) {
+		error = "leading bits of message type are not zero.";
+	} else if (length() + STUN_HEADER_SIZE != size) {
+		error = "length doesn't match message length.";
+	} else if (length() % 4) {
+		error = "length is not a multiple of four.";
+	} else if (cookie() != STUN_COOKIE) {
+		error = "cookie is not 0x2112A442.";
+	}
+
+	//walk attributes (bounded by the actual datagram, so even a bad length field can't overrun):
+	uint8_t const *end = data + size;
+	uint8_t const *at = attributes_begin;
+	while (end - at >= 4) {
+		size_t padded = (stun_read_u16(at + 2) + 3U) & ~3U;
+		if (size_t(end - at) - 4 < padded) {
+			if (!error) error = "attribute runs past end of message.";
+			break;
+		}
+		at += 4 + padded;
+	}
+	attributes_end = at;
+	if (at != end && !error) error = "trailing bytes after last attribute.";
+}
+
+bool STUNMessageView::has_transaction_id(uint32_t const (&id)[3]) const {
+	static_assert(sizeof(id) == 12, "transaction id is 96 bits");
+	return std::memcmp(transaction_id(), id, sizeof(id)) == 0;
+}
+
+bool STUNMessageView::find(uint16_t type, STUNAttribute *attr) const {
+	for (STUNAttribute const &a : *this) {
+		if (a.type == type) {
+			*attr = a;
+			return true;
+		}
+	}
+	return false;
+}
+
+char const *STUNMessageView::verify_fingerprint() const {
+	if (error) return error;
+	//FINGERPRINT must be the last attribute:
+	uint8_t const *last = nullptr;
+	for (iterator it = begin(); it != end(); ++it) last = it.at;
+	if (!last || stun_read_u16(last) != STUN_ATTR_FINGERPRINT) return "no FINGERPRINT attribute (or not last).";
+	if (stun_read_u16(last + 2) != 4) return "FINGERPRINT of invalid length.";
+	//(header length already covers the fingerprint, as it must when the CRC is computed)
+	uint32_t expected = crc32(data, last - data) ^ STUN_FINGERPRINT_XOR;
+	if (stun_read_u32(last + 4) != expected) return "FINGERPRINT does not match.";
+	return nullptr;
+}
+
+char const *STUNMessageView::verify_message_integrity(HMACSHA1 const &key) const {
+	if (error) return error;
+	//everything up to the first MESSAGE-INTEGRITY is covered (later attributes, e.g., FINGERPRINT, are not):
+	STUNAttribute attr;
+	if (!find(STUN_ATTR_MESSAGE_INTEGRITY, &attr)) return "no MESSAGE-INTEGRITY attribute.";
+	if (attr.length != SHA1::DigestSize) return "MESSAGE-INTEGRITY of invalid length.";
+	uint8_t const *start = attr.value - 4;
+
+	//...hashed with the header length as if MESSAGE-INTEGRITY were the last attribute:
+	uint8_t header[STUN_HEADER_SIZE];
+	std::memcpy(header, data, STUN_HEADER_SIZE);
+	stun_write_u16(header + 2, uint16_t(start + 4 + SHA1::DigestSize - data - STUN_HEADER_SIZE));
+
+	SHA1 ctx = key.begin();
+	ctx.update(header, STUN_HEADER_SIZE);
+	ctx.update(data + STUN_HEADER_SIZE, start - data - STUN_HEADER_SIZE);
+	uint8_t mac[SHA1::DigestSize];
+	key.finish(ctx, mac);
+
+	//(compare without early exit, so timing doesn't say how much of a forgery was right)
+	uint8_t diff = 0;
+	for (uint32_t i = 0; i < SHA1::DigestSize; ++i) diff |= uint8_t(mac[i] ^ attr.value[i]);
+	if (diff) return "MESSAGE-INTEGRITY does not match.";
+	return nullptr;
+}
+
+char const *decode_xor_mapped_address(STUNAttribute const &attr, uint8_t const *transaction_id, struct sockaddr_storage *out) {
+	assert(out);
+	if (attr.length < 4) return "XOR-MAPPED-ADDRESS of invalid length.";
+	if (attr.value[0] != 0) return "XOR-MAPPED-ADDRESS has non-zero reserved byte.";
+	uint8_t family = attr.value[1];
+	uint16_t port = stun_read_u16(attr.value + 2) ^ uint16_t(STUN_COOKIE >> 16);
+
+	std::memset(out, '\0', sizeof(*out));
+	if (family == 0x01) {
+		if (attr.length != 8) return "XOR-MAPPED-ADDRESS (ipv4) of invalid length.";
+		struct sockaddr_in &ret = *reinterpret_cast< struct sockaddr_in * >(out);
+		ret.sin_family = AF_INET;
+		ret.sin_port = htons(port);
+		ret.sin_addr.s_addr = htonl(stun_read_u32(attr.value + 4) ^ STUN_COOKIE);
+	} else if (family == 0x02) {
+		if (attr.length != 20) return "XOR-MAPPED-ADDRESS (ipv6) of invalid length.";
+		//ipv6 address is xor'd with cookie + transaction id:
+		uint8_t mask[16];
+		mask[0] = uint8_t(STUN_COOKIE >> 24);
+		mask[1] = uint8_t(STUN_COOKIE >> 16);
+		mask[2] = uint8_t(STUN_COOKIE >> 8);
+		mask[3] = uint8_t(STUN_COOKIE);
+		std::memcpy(mask + 4, transaction_id, 12);
+		struct sockaddr_in6 &ret = *reinterpret_cast< struct sockaddr_in6 * >(out);
+		ret.sin6_family = AF_INET6;
+		ret.sin6_port = htons(port);
+		for (uint32_t i = 0; i < 16; ++i) {
+			ret.sin6_addr.s6_addr[i] = attr.value[4 + i] ^ mask[i];
+		}
+	} else {
+		return "XOR-MAPPED-ADDRESS has unknown address family.";
+	}
+	return nullptr;
+}
+
+static char const *attribute_name(uint16_t type) {
+	switch (type) {
+		case 0x0000: return "(Reserved)";
+		case 0x0001: return "MAPPED_ADDRESS";
+		case 0x0002: return "(Reserved; was RESPONSE-ADDRESS)";
+		case 0x0003: return "(Reserved; was CHANGE-ADDRESS)";
+		case 0x0004: return "(Reserved; was SOURCE-ADDRESS)";
+		case 0x0005: return "(Reserved; was CHANGED-ADDRESS)";
+		case 0x0006: return "USERNAME";
+		case 0x0007: return "(Reserved; was PASSWORD)";
+		case 0x0008: return "MESSAGE-INTEGRITY";
+		case 0x0009: return "ERROR-CODE";
+		case 0x000a: return "UNKNOWN-ATTRIBUTES";
+		case 0x000b: return "(Reserved; was REFLECTED-FROM)";
+		case 0x0014: return "REALM";
+		case 0x0015: return "NONCE";
+		case 0x0020: return "XOR-MAPPED-ADDRESS";
+		case 0x0024: return "PRIORITY";
+		case 0x0025: return "USE-CANDIDATE";
+		case 0x8022: return "SOFTWARE";
+		case 0x8023: return "ALTERNATE-SERVER";
+		case 0x8028: return "FINGERPRINT";
+	}
+	if (type <= 0x7FFF) return "(Unknown; Comprehension-required)";
+	else return "(Unknown; Comprehension-optional)";
+}
+
+void dump_stun_message(uint8_t const *data, size_t size) {
+	STUNMessageView msg(data, size);
+	if (!msg.has_header()) {
+		std::cout << "(INVALID message: header is too small.)" << std::endl;
+		return;
+	}
+
+	{ //-------- header: type ------
+		uint16_t type = msg.type();
+		std::cout << "Should be 00: 0b" << ((type >> 15) & 0x1) << ((type >> 14) & 0x1) << std::endl;
+		// 8 gets shifted right by 7
+		// 4 gets shifted right by 4
+		uint8_t cls = ((type & 0x0100) >> 7) | ((type & 0x0010) >> 4);
+		// 13-9 get shifted right by 2 -->0x3e00
+		// 7-5 get shifted right by 1 --> 0x00e0
+		// 3-0 aren't shifted --> 0x000f
+		uint16_t method = ((type & 0x3e00) >> 2) | ((type & 0x00e0) >> 1) | (type & 0x000f);
+
+		std::cout << "Class: 0b" << binary(cls, 2) << "\n";
+		std::cout << "Method: 0b" << binary(method, 12) << "\n";
+	}
+
+	{ //-------- header: length ------
+		uint16_t length = msg.length();
+		std::cout << "Length: " << length;
+		if (length + 20U != size) std::cout << " (INVALID! Length should be " << int32_t(size) - 20 << ")";
+		std::cout << "\n";
+	}
+
+	{ //-------- header: cookie ------
+		uint32_t cookie = msg.cookie();
+		std::cout << "Cookie: 0x" << hex(cookie, 8);
+		if (cookie != STUN_COOKIE) std::cout << " (INVALID! must be 0x2112A442)";
+		std::cout << "\n";
+	}
+
+	{ //-------- header: ID ------
+		uint8_t const *id = msg.transaction_id();
+		std::cout << "Transaction ID: 0x" << hex(stun_read_u32(id), 8) << " " << hex(stun_read_u32(id + 4), 8) << " " << hex(stun_read_u32(id + 8), 8) << "\n";
+	}
+
+	//------ attributes ------
+	for (STUNAttribute const &attr : msg) {
+		std::cout << "Type: 0x" << hex(attr.type, 4) << " " << attribute_name(attr.type) << "\n";
+		std::cout << "Length: " << attr.length << "\n";
+		std::cout << "Value: '";
+		std::cout.write(reinterpret_cast< char const * >(attr.value), attr.length);
+		std::cout << "'\n";
+		std::cout << "Padding: " << ((4 - attr.length % 4) % 4) << " bytes\n";
+
+		if (attr.type == STUN_ATTR_XOR_MAPPED_ADDRESS) {
+			struct sockaddr_storage addr;
+			if (char const *err = decode_xor_mapped_address(attr, msg.transaction_id(), &addr)) {
+				std::cout << "XOR-MAPPED-ADDRESS INVALID: " << err << "\n";
+			} else if (addr.ss_family == AF_INET) {
+				struct sockaddr_in const &in = *reinterpret_cast< struct sockaddr_in const * >(&addr);
+				std::cout << "XOR-MAPPED-ADDRESS (ipv4):\n";
+				std::cout << " port: " << ntohs(in.sin_port) << "\n";
+				std::cout << " addr: 0x" << hex(ntohl(in.sin_addr.s_addr), 8) << " == " << inet_ntoa(in.sin_addr) << "\n";
+			} else { assert(addr.ss_family == AF_INET6);
+				struct sockaddr_in6 const &in6 = *reinterpret_cast< struct sockaddr_in6 const * >(&addr);
+				char str[INET6_ADDRSTRLEN];
+				inet_ntop(AF_INET6, &in6.sin6_addr, str, sizeof(str));
+				std::cout << "XOR-MAPPED-ADDRESS (ipv6):\n";
+				std::cout << " port: " << ntohs(in6.sin6_port) << "\n";
+				std::cout << " addr: " << str << "\n";
+			}
+		}
+		if (attr.type == STUN_ATTR_FINGERPRINT) {
+			char const *err = msg.verify_fingerprint();
+			std::cout << "Check: " << (err ? err : "FINGERPRINT matches.") << "\n";
+		}
+	}
+
+	if (msg.error) std::cout << "(INVALID message: " << msg.error << ")\n";
+	std::cout.flush();
+}
+
+struct sockaddr_in get_mapped_address(uint8_t const *data, size_t size, uint32_t const (&id)[3]) {
+	STUNMessageView msg(data, size);
+	if (msg.error) {
+		throw std::runtime_error(std::string("Error: ") + msg.error);
+	}
+	if (msg.type() != STUN_BINDING_RESPONSE) {
+		throw std::runtime_error("Error: message type was 0x" + hex(msg.type(), 4) + ", expecting 0x0101.");
+	}
+	if (!msg.has_transaction_id(id)) {
+		throw std::runtime_error("Error: transaction id mis-match.");
+	}
+
+	STUNAttribute attr;
+	if (!msg.find(STUN_ATTR_XOR_MAPPED_ADDRESS, &attr)) {
+		throw std::runtime_error("Error: no XOR-MAPPED-ADDRESS attribute.");
+	}
+
+	struct sockaddr_storage addr;
+	if (char const *err = decode_xor_mapped_address(attr, msg.transaction_id(), &addr)) {
+		throw std::runtime_error(std::string("Error: ") + err);
+	}
+	if (addr.ss_family != AF_INET) {
+		throw std::runtime_error("Error: XOR-MAPPED-ADDRESS for ipv6 (wanted ipv4).");
+	}
+	return *reinterpret_cast< struct sockaddr_in * >(&addr);
+}
+
+STUNMessageBuilder::STUNMessageBuilder(uint8_t *buffer_, size_t capacity_, uint16_t type, uint8_t const *transaction_id) : buffer(buffer_), capacity(capacity_) {
+	if (capacity < STUN_HEADER_SIZE) {
+		throw std::runtime_error("STUNMessageBuilder: buffer too small for header.");
+	}
+	stun_write_u16(buffer, type);
+	stun_write_u16(buffer + 2, 0);
+	stun_write_u32(buffer + 4, STUN_COOKIE);
+	std::memcpy(buffer + 8, transaction_id, 12);
+	size = STUN_HEADER_SIZE;
+}
+
+uint8_t *STUNMessageBuilder::add_attribute(uint16_t type, void const *value, uint16_t length) {
+	size_t padded = (length + 3U) & ~3U;
+	if (capacity - size < 4 + padded) {
+		throw std::runtime_error("STUNMessageBuilder: out of space adding attribute 0x" + hex(type, 4) + ".");
+	}
+	uint8_t *at = buffer + size;
+	stun_write_u16(at, type);
+	stun_write_u16(at + 2, length);
+	if (value) std::memcpy(at + 4, value, length);
+	std::memset(at + 4 + length, '\0', padded - length);
+	size += 4 + padded;
+	return at + 4;
+}
+
+void STUNMessageBuilder::add_xor_mapped_address(struct sockaddr_storage const &address) {
+	if (address.ss_family == AF_INET) {
+		struct sockaddr_in const &in = reinterpret_cast< struct sockaddr_in const & >(address);
+		uint8_t *value = add_attribute(STUN_ATTR_XOR_MAPPED_ADDRESS, nullptr, 8);
+		value[0] = 0;
+		value[1] = 0x01;
+		stun_write_u16(value + 2, ntohs(in.sin_port) ^ uint16_t(STUN_COOKIE >> 16));
+		stun_write_u32(value + 4, ntohl(in.sin_addr.s_addr) ^ STUN_COOKIE);
+	} else if (address.ss_family == AF_INET6) {
+		struct sockaddr_in6 const &in6 = reinterpret_cast< struct sockaddr_in6 const & >(address);
+		uint8_t *value = add_attribute(STUN_ATTR_XOR_MAPPED_ADDRESS, nullptr, 20);
+		value[0] = 0;
+		value[1] = 0x02;
+		stun_write_u16(value + 2, ntohs(in6.sin6_port) ^ uint16_t(STUN_COOKIE >> 16));
+		//xor with cookie + transaction id:
+		uint8_t mask[16];
+		stun_write_u32(mask, STUN_COOKIE);
+		std::memcpy(mask + 4, buffer + 8, 12);
+		for (uint32_t i = 0; i < 16; ++i) {
+			value[4 + i] = in6.sin6_addr.s6_addr[i] ^ mask[i];
+		}
+	} else {
+		throw std::runtime_error("STUNMessageBuilder: XOR-MAPPED-ADDRESS of unknown address family.");
+	}
+}
+
+void STUNMessageBuilder::add_error_code(uint16_t code, char const *reason) {
+	size_t reason_length = std::strlen(reason);
+	uint8_t *value = add_attribute(STUN_ATTR_ERROR_CODE, nullptr, uint16_t(4 + reason_length));
+	value[0] = 0;
+	value[1] = 0;
+	value[2] = uint8_t(code / 100);
+	value[3] = uint8_t(code % 100);
+	std::memcpy(value + 4, reason, reason_length);
+}
+
+void STUNMessageBuilder::add_message_integrity(HMACSHA1 const &key) {
+	if (capacity - size < 4 + SHA1::DigestSize) {
+		throw std::runtime_error("STUNMessageBuilder: out of space adding MESSAGE-INTEGRITY.");
+	}
+	//length must already cover the attribute when the HMAC is computed:
+	stun_write_u16(buffer + 2, uint16_t(size + 4 + SHA1::DigestSize - STUN_HEADER_SIZE));
+	uint8_t *at = buffer + size;
+	key.compute(buffer, size, at + 4);
+	stun_write_u16(at, STUN_ATTR_MESSAGE_INTEGRITY);
+	stun_write_u16(at + 2, uint16_t(SHA1::DigestSize));
+	size += 4 + SHA1::DigestSize;
+}
+
+void STUNMessageBuilder::add_fingerprint() {
+	if (capacity - size < 8) {
+		throw std::runtime_error("STUNMessageBuilder: out of space adding FINGERPRINT.");
+	}
+	//length must already cover the fingerprint when the CRC is computed:
+	stun_write_u16(buffer + 2, uint16_t(size + 8 - STUN_HEADER_SIZE));
+	uint32_t crc = crc32(buffer, size) ^ STUN_FINGERPRINT_XOR;
+	uint8_t *at = buffer + size;
+	stun_write_u16(at, STUN_ATTR_FINGERPRINT);
+	stun_write_u16(at + 2, 4);
+	stun_write_u32(at + 4, crc);
+	size += 8;
+}
+
+size_t STUNMessageBuilder::finish() {
+	stun_write_u16(buffer + 2, uint16_t(size - STUN_HEADER_SIZE));
+	return size;
+}
+
+STUNBindingRequestTemplate::STUNBindingRequestTemplate(std::string const &software, bool fingerprint_) : fingerprint(fingerprint_) {
+	if (software.size() > MaxSoftware) {
+		throw std::runtime_error("STUNBindingRequestTemplate: SOFTWARE value longer than " + std::to_string(MaxSoftware) + " bytes.");
+	}
+	uint8_t zero_id[12] = {0};
+	STUNMessageBuilder builder(bytes, sizeof(bytes), STUN_BINDING_REQUEST, zero_id);
+	if (!software.empty()) {
+		builder.add_attribute(STUN_ATTR_SOFTWARE, software.data(), uint16_t(software.size()));
+	}
+	if (fingerprint) {
+		builder.add_fingerprint(); //<-- value recomputed by stamp()
+	}
+	size = builder.finish();
+}
+
+size_t STUNBindingRequestTemplate::stamp(uint8_t *out, uint32_t const (&id)[3]) const {
+	std::memcpy(out, bytes, size);
+	std::memcpy(out + 8, id, sizeof(id));
+	if (fingerprint) {
+		stun_write_u32(out + size - 4, crc32(out, size - 8) ^ STUN_FINGERPRINT_XOR);
+	}
+	return size;
+}
+
+//attributes this code knows what to do with (or can safely ignore) in a binding request:
+static bool understood(uint16_t type) {
+	return type >= 0x8000
+		|| type == STUN_ATTR_USERNAME
+		|| type == STUN_ATTR_MESSAGE_INTEGRITY
+		|| type == STUN_ATTR_REALM
+		|| type == STUN_ATTR_NONCE
+		|| type == STUN_ATTR_PRIORITY //<-- (ICE connectivity checks; ICE-CONTROLLED / -CONTROLLING are >= 0x8000)
+		|| type == STUN_ATTR_USE_CANDIDATE;
+}
+
+size_t stun_binding_response_in_place(uint8_t *buffer, size_t size, size_t capacity, struct sockaddr_storage const &from, bool fingerprint) {
+	STUNMessageView request(buffer, size);
+	if (request.error || request.type() != STUN_BINDING_REQUEST) return 0;
+
+	//a bad FINGERPRINT means this isn't really STUN (e.g., application data that happens to look like it):
+	STUNAttribute fingerprint_attr;
+	if (request.find(STUN_ATTR_FINGERPRINT, &fingerprint_attr) && request.verify_fingerprint()) return 0;
+
+	//collect (up to a few) unknown comprehension-required attributes:
+	uint16_t unknown[8];
+	uint32_t unknown_count = 0;
+	for (STUNAttribute const &attr : request) {
+		if (!understood(attr.type) && unknown_count < 8) {
+			unknown[unknown_count++] = attr.type;
+		}
+	}
+
+	uint8_t id[12];
+	std::memcpy(id, request.transaction_id(), sizeof(id));
+
+	STUNMessageBuilder builder(buffer, capacity, unknown_count ? STUN_BINDING_ERROR_RESPONSE : STUN_BINDING_RESPONSE, id);
+	if (unknown_count) {
+		builder.add_error_code(420, "Unknown Attribute");
+		uint8_t *value = builder.add_attribute(STUN_ATTR_UNKNOWN_ATTRIBUTES, nullptr, uint16_t(2 * unknown_count));
+		for (uint32_t i = 0; i < unknown_count; ++i) {
+			stun_write_u16(value + 2 * i, unknown[i]);
+		}
+	} else {
+		builder.add_xor_mapped_address(from);
+	}
+	if (fingerprint) builder.add_fingerprint();
+	return builder.finish();
+}
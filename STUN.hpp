@@ -0,0 +1,194 @@
+#pragma once
+
+/*
+ * STUN (RFC 5389) message helpers.
+ *
+ * STUNMessageView looks at a received datagram in place -- no copies, no allocation.
+ * The header, length, cookie, and attribute bounds are all checked once, at construction;
+ * after that the attributes can be walked without any further checking:
+ *
+ *   STUNMessageView msg(buf, got);
+ *   if (msg.error) { ...msg.error is a static string describing the problem... }
+ *   for (STUNAttribute const &attr : msg) { ... }
+ *
+ * STUNMessageBuilder goes the other way, writing a message directly into a
+ * caller-supplied buffer. STUNBindingRequestTemplate keeps a pre-built binding
+ * request around so that making a new one is a copy + transaction id stamp.
+ *
+ * FINGERPRINT (CRC-32) and MESSAGE-INTEGRITY (HMAC-SHA1) can be added by the
+ * builder and checked on the view; see CRC32.hpp and SHA1.hpp for the kernels.
+ *
+ */
+
+#include "SHA1.hpp"
+
+#include <netinet/in.h>
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+constexpr uint32_t STUN_COOKIE = 0x2112A442;
+constexpr size_t STUN_HEADER_SIZE = 20;
+
+//message types (class + method, already interleaved):
+constexpr uint16_t STUN_BINDING_REQUEST = 0x0001;
+constexpr uint16_t STUN_BINDING_INDICATION = 0x0011;
+constexpr uint16_t STUN_BINDING_RESPONSE = 0x0101;
+constexpr uint16_t STUN_BINDING_ERROR_RESPONSE = 0x0111;
+
+//attribute types:
+constexpr uint16_t STUN_ATTR_MAPPED_ADDRESS = 0x0001;
+constexpr uint16_t STUN_ATTR_USERNAME = 0x0006;
+constexpr uint16_t STUN_ATTR_MESSAGE_INTEGRITY = 0x0008;
+constexpr uint16_t STUN_ATTR_ERROR_CODE = 0x0009;
+constexpr uint16_t STUN_ATTR_UNKNOWN_ATTRIBUTES = 0x000a;
+constexpr uint16_t STUN_ATTR_REALM = 0x0014;
+constexpr uint16_t STUN_ATTR_NONCE = 0x0015;
+constexpr uint16_t STUN_ATTR_XOR_MAPPED_ADDRESS = 0x0020;
+constexpr uint16_t STUN_ATTR_PRIORITY = 0x0024; //(ICE, RFC 8445)
+constexpr uint16_t STUN_ATTR_USE_CANDIDATE = 0x0025; //(ICE)
+constexpr uint16_t STUN_ATTR_SOFTWARE = 0x8022;
+constexpr uint16_t STUN_ATTR_ALTERNATE_SERVER = 0x8023;
+constexpr uint16_t STUN_ATTR_FINGERPRINT = 0x8028;
+
+constexpr uint32_t STUN_FINGERPRINT_XOR = 0x5354554e;
+
+inline uint16_t stun_read_u16(uint8_t const *p) {
+	return uint16_t((uint16_t(p[0]) << 8) | uint16_t(p[1]));
+}
+
+inline uint32_t stun_read_u32(uint8_t const *p) {
+	return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) | (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+inline void stun_write_u16(uint8_t *p, uint16_t v) {
+	p[0] = uint8_t(v >> 8);
+	p[1] = uint8_t(v);
+}
+
+inline void stun_write_u32(uint8_t *p, uint32_t v) {
+	p[0] = uint8_t(v >> 24);
+	p[1] = uint8_t(v >> 16);
+	p[2] = uint8_t(v >> 8);
+	p[3] = uint8_t(v);
+}
+
+//Cheap check for "is this datagram (probably) STUN?" -- leading zero bits + magic cookie:
+inline bool looks_like_stun(uint8_t const *data, size_t size) {
+	return size >= STUN_HEADER_SIZE && (data[0] & 0xc0) == 0 && stun_read_u32(data + 4) == STUN_COOKIE;
+}
+
+struct STUNAttribute {
+	uint16_t type;
+	uint16_t length; //length of value (padding not included)
+	uint8_t const *value;
+};
+
+struct STUNMessageView {
+	STUNMessageView(uint8_t const *data, size_t size);
+
+	uint8_t const *data;
+	size_t size;
+
+	//nullptr if message is well-formed, otherwise (static) description of first problem found:
+	char const *error = nullptr;
+
+	//header fields -- can be read whenever size >= STUN_HEADER_SIZE, even if error is set:
+	bool has_header() const { return size >= STUN_HEADER_SIZE; }
+	uint16_t type() const { return stun_read_u16(data); }
+	uint16_t length() const { return stun_read_u16(data + 2); }
+	uint32_t cookie() const { return stun_read_u32(data + 4); }
+	uint8_t const *transaction_id() const { return data + 8; }
+	bool has_transaction_id(uint32_t const (&id)[3]) const;
+
+	//attributes -- if error is set, only the well-formed prefix is walked:
+	struct iterator {
+		uint8_t const *at;
+		STUNAttribute operator*() const {
+			return STUNAttribute{ stun_read_u16(at), stun_read_u16(at + 2), at + 4 };
+		}
+		iterator &operator++() {
+			at += 4 + ((stun_read_u16(at + 2) + 3U) & ~3U);
+			return *this;
+		}
+		bool operator==(iterator const &o) const { return at == o.at; }
+		bool operator!=(iterator const &o) const { return at != o.at; }
+	};
+	iterator begin() const { return iterator{attributes_begin}; }
+	iterator end() const { return iterator{attributes_end}; }
+
+	//find first attribute of given type; returns false if not present:
+	bool find(uint16_t type, STUNAttribute *attr) const;
+
+	//check FINGERPRINT (must be present, last, and match); returns nullptr if ok, else (static) description:
+	char const *verify_fingerprint() const;
+	//check MESSAGE-INTEGRITY against 'key' (see STUNMessageBuilder::add_message_integrity); same return as above:
+	char const *verify_message_integrity(HMACSHA1 const &key) const;
+
+	uint8_t const *attributes_begin;
+	uint8_t const *attributes_end;
+};
+
+//Decode an XOR-MAPPED-ADDRESS value (ipv4 or ipv6) into 'out'.
+// returns nullptr on success, or (static) description of the problem:
+char const *decode_xor_mapped_address(STUNAttribute const &attr, uint8_t const *transaction_id, struct sockaddr_storage *out);
+
+//Print a human-readable description of a STUN message (for debugging):
+void dump_stun_message(uint8_t const *data, size_t size);
+
+//Parse a STUN server response to find mapped host+port:
+// fills in ipv4 address info + returns
+// throws on error / invalid message / wrong transaction
+struct sockaddr_in get_mapped_address(uint8_t const *data, size_t size, uint32_t const (&id)[3]);
+
+//Write a message (header + attributes) directly into a fixed buffer.
+// The length field is back-patched by finish() (or add_fingerprint()).
+// Running out of space is a usage error and throws.
+struct STUNMessageBuilder {
+	STUNMessageBuilder(uint8_t *buffer, size_t capacity, uint16_t type, uint8_t const *transaction_id);
+
+	uint8_t *buffer;
+	size_t capacity;
+	size_t size = 0;
+
+	//append an attribute (padded to four bytes); returns pointer to the value in the buffer:
+	uint8_t *add_attribute(uint16_t type, void const *value, uint16_t length);
+
+	//append XOR-MAPPED-ADDRESS for an ipv4 or ipv6 address:
+	void add_xor_mapped_address(struct sockaddr_storage const &address);
+
+	//append ERROR-CODE (e.g., 420 "Unknown Attribute"):
+	void add_error_code(uint16_t code, char const *reason);
+
+	//append MESSAGE-INTEGRITY (HMAC-SHA1 of everything before it); only FINGERPRINT may follow.
+	// 'key' is the password for short-term credentials, or MD5(username ":" realm ":" password) for long-term ones:
+	void add_message_integrity(HMACSHA1 const &key);
+
+	//append FINGERPRINT (CRC-32 of everything before it); must be the last attribute:
+	void add_fingerprint();
+
+	//patch header length; returns total message size:
+	size_t finish();
+};
+
+//A binding request with everything but the transaction id filled in.
+struct STUNBindingRequestTemplate {
+	STUNBindingRequestTemplate(std::string const &software = "", bool fingerprint = false);
+
+	static constexpr size_t MaxSoftware = 128;
+	static constexpr size_t Capacity = STUN_HEADER_SIZE + 4 + MaxSoftware + 8;
+
+	uint8_t bytes[Capacity];
+	size_t size = 0;
+	bool fingerprint = false;
+
+	//write a request with the given transaction id to 'out' (room for at least 'size' bytes); returns size:
+	size_t stamp(uint8_t *out, uint32_t const (&id)[3]) const;
+};
+
+//Answer a binding request from 'from' by rewriting it into the response, in place.
+// 'buffer' holds the request ('size' bytes) and has room for 'capacity' bytes.
+// Requests with unknown comprehension-required attributes get a 420 error response.
+// returns size of the response, or 0 if the datagram should just be dropped.
+size_t stun_binding_response_in_place(uint8_t *buffer, size_t size, size_t capacity, struct sockaddr_storage const &from, bool fingerprint = true);
@@ -0,0 +1,154 @@
+#include "STUNClient.hpp"
+
+#include "DatagramChannel.hpp"
+#include "Metrics.hpp"
+#include "SocketAddress.hpp"
+
+#include <netinet/in.h>
+
+#include <cassert>
+#include <cstring>
+
+STUNClient::STUNClient(DatagramChannel &channel_) : channel(channel_), request_template("TCHOW STUN Test", true) {
+	mt.seed(channel.random_seed()); //NOTE: only a seed; ids are not cryptographically strong
+}
+
+STUNClient::~STUNClient() {
+	pending.for_each([this](Transaction &t) {
+		if (t.timer) channel.loop.cancel(t.timer);
+	});
+}
+
+STUNClient::TransactionID STUNClient::binding_request(struct sockaddr_storage const &server, Callback const &callback) {
+	return binding_request(server, callback, Attributes());
+}
+
+STUNClient::TransactionID STUNClient::binding_request(struct sockaddr_storage const &server, Callback const &callback, Attributes const &attributes) {
+	TransactionID transaction;
+	Transaction *t = nullptr;
+	do { //(a collision with an outstanding id is astronomically unlikely, but cheap to rule out)
+		transaction.id[0] = mt();
+		transaction.id[1] = mt();
+		transaction.id[2] = mt();
+		t = pending.insert(reinterpret_cast< uint8_t const * >(transaction.id));
+	} while (!t);
+	t->transaction = transaction;
+	t->server = server;
+	t->callback = callback;
+	if (attributes) {
+		t->message.resize(MaxMessage);
+		STUNMessageBuilder builder(t->message.data(), t->message.size(), STUN_BINDING_REQUEST, reinterpret_cast< uint8_t const * >(transaction.id));
+		t->message.resize(attributes(builder));
+	}
+	send(*t);
+	return transaction;
+}
+
+bool STUNClient::cancel(TransactionID const &transaction) {
+	uint8_t const *id = reinterpret_cast< uint8_t const * >(transaction.id);
+	Transaction *t = pending.find(id);
+	if (!t) return false;
+	if (t->timer) channel.loop.cancel(t->timer);
+	pending.erase(id);
+	return true;
+}
+
+bool STUNClient::retransmit(TransactionID const &transaction) {
+	Transaction *t = pending.find(reinterpret_cast< uint8_t const * >(transaction.id));
+	if (!t) return false;
+	if (t->timer) {
+		channel.loop.cancel(t->timer);
+		t->timer = 0;
+	}
+	if (channel.metrics) channel.metrics->retransmits.add();
+	t->sends = 0; //<-- (so send() starts the schedule over, and this counts as the first send of Rc)
+	send(*t);
+	return true;
+}
+
+void STUNClient::send(Transaction &t) {
+	//NOTE: a failed send is treated like a lost packet -- the retransmit timer takes care of it.
+	if (!t.message.empty()) {
+		channel.send_to(t.server, t.message.data(), t.message.size());
+	} else {
+		uint8_t message[STUNBindingRequestTemplate::Capacity];
+		size_t size = request_template.stamp(message, t.transaction.id);
+		channel.send_to(t.server, message, size);
+	}
+
+	if (t.sends && channel.metrics) channel.metrics->retransmits.add();
+	t.sends += 1;
+	t.last_send_ms = EventLoop::now();
+	t.interval_ms = (t.sends == 1 ? rto_ms : 2 * t.interval_ms);
+	uint32_t wait_ms = (t.sends < Rc ? t.interval_ms : Rm * rto_ms);
+
+	TransactionID transaction = t.transaction;
+	t.timer = channel.loop.after(wait_ms, [this, transaction]() {
+		on_timer(transaction);
+	});
+}
+
+void STUNClient::on_timer(TransactionID const &transaction) {
+	Transaction *t = pending.find(reinterpret_cast< uint8_t const * >(transaction.id));
+	if (!t) return;
+	t->timer = 0;
+	if (t->sends < Rc) {
+		send(*t);
+	} else {
+		if (channel.metrics) channel.metrics->stun_timeouts.add();
+		Result result;
+		result.error = "timed out.";
+		finish(*t, result);
+	}
+}
+
+void STUNClient::finish(Transaction &entry, Result &result) {
+	Transaction t = std::move(entry);
+	pending.erase(reinterpret_cast< uint8_t const * >(t.transaction.id));
+
+	if (t.timer) channel.loop.cancel(t.timer);
+	result.transaction = t.transaction;
+	result.server = t.server;
+	if (t.callback) t.callback(result);
+}
+
+bool STUNClient::handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size) {
+	//look up the transaction before parsing anything, so strays and late duplicates are cheap to drop:
+	if (size < STUN_HEADER_SIZE) return false;
+	Transaction *t = pending.find(data + 8);
+	if (!t) return false; //not ours (or a late duplicate)
+	if (!same_address(from, t->server)) return false;
+
+	//malformed responses are dropped; retransmission continues as if the packet were lost:
+	STUNMessageView msg(data, size);
+	if (msg.error) {
+		if (channel.metrics) channel.metrics->parse_errors.add();
+		return true;
+	}
+
+	//a response carrying a bad FINGERPRINT isn't STUN after all -- let the channel hand it to the application:
+	STUNAttribute fingerprint;
+	if (msg.find(STUN_ATTR_FINGERPRINT, &fingerprint) && msg.verify_fingerprint()) return false;
+
+	Result result;
+	if (msg.type() == STUN_BINDING_ERROR_RESPONSE) {
+		result.error = "server sent error response.";
+	} else if (msg.type() != STUN_BINDING_RESPONSE) {
+		return true;
+	} else {
+		STUNAttribute attr;
+		if (!msg.find(STUN_ATTR_XOR_MAPPED_ADDRESS, &attr)) {
+			result.error = "no XOR-MAPPED-ADDRESS attribute.";
+		} else if (char const *err = decode_xor_mapped_address(attr, msg.transaction_id(), &result.mapped)) {
+			result.error = err;
+		} else {
+			result.ok = true;
+			result.rtt_ms = uint32_t(EventLoop::now() - t->last_send_ms);
+			if (channel.metrics) channel.metrics->rtt_us.record(uint64_t(result.rtt_ms) * 1000);
+			result.response = data;
+			result.response_size = size;
+		}
+	}
+	finish(*t, result);
+	return true;
+}
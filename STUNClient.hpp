@@ -0,0 +1,102 @@
+#pragma once
+
+/*
+ * STUNClient runs binding-request transactions over a DatagramChannel's
+ * socket, retransmitting on the channel's EventLoop timers as per
+ * RFC 5389 section 7.2.1:
+ *
+ *  - first retransmit after rto_ms, doubling each time;
+ *  - at most Rc requests in total;
+ *  - after the last request, wait Rm * rto_ms before giving up.
+ *
+ * (With the defaults that's sends at 0, 500, 1500, 3500, 7500, 15500,
+ *  31500 ms and a timeout at 39500 ms.)
+ *
+ * Any number of transactions can be outstanding at once; responses are
+ * matched back to requests by transaction id via a flat hash table (see
+ * STUNTransactionTable.hpp), so routing a response -- or dropping a late or
+ * duplicate one -- costs the same with ten or ten thousand in flight.
+ */
+
+#include "EventLoop.hpp"
+#include "STUN.hpp"
+#include "STUNTransactionTable.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <vector>
+
+struct DatagramChannel;
+
+struct STUNClient {
+	STUNClient(DatagramChannel &channel);
+	~STUNClient();
+	STUNClient(STUNClient const &) = delete;
+	STUNClient &operator=(STUNClient const &) = delete;
+
+	DatagramChannel &channel;
+
+	//retransmission parameters (RFC 5389 defaults):
+	uint32_t rto_ms = 500;
+	uint32_t Rc = 7;
+	uint32_t Rm = 16;
+
+	//largest request built with custom attributes (RFC 5389's limit when the path MTU is unknown):
+	static constexpr size_t MaxMessage = 548;
+
+	//SOFTWARE + FINGERPRINT binding request that all requests are stamped from:
+	STUNBindingRequestTemplate request_template;
+
+	struct TransactionID {
+		uint32_t id[3];
+	};
+
+	struct Result {
+		TransactionID transaction;
+		struct sockaddr_storage server; //who the request was sent to
+		bool ok = false;
+		char const *error = nullptr; //if !ok, (static) description of what went wrong
+		struct sockaddr_storage mapped; //if ok, the XOR-MAPPED-ADDRESS
+		uint32_t rtt_ms = 0; //if ok, time since the most recent (re)transmission
+		uint8_t const *response = nullptr; //if ok, the raw response (only valid during callback)
+		size_t response_size = 0;
+	};
+	typedef std::function< void(Result const &) > Callback;
+
+	//start a binding request to 'server'; 'callback' is called exactly once, unless the transaction is cancel()'d:
+	TransactionID binding_request(struct sockaddr_storage const &server, Callback const &callback);
+	//same, but with attributes of the caller's choosing (e.g., ICE's USERNAME / PRIORITY / MESSAGE-INTEGRITY) instead of
+	// request_template's; 'attributes' is called once, with a builder holding just the header (and must finish() it):
+	typedef std::function< size_t(STUNMessageBuilder &builder) > Attributes;
+	TransactionID binding_request(struct sockaddr_storage const &server, Callback const &callback, Attributes const &attributes);
+	//stop retransmitting; callback will not be called:
+	bool cancel(TransactionID const &transaction);
+	//send the request again now, and restart the retransmit schedule from rto_ms (e.g., an ICE triggered check):
+	bool retransmit(TransactionID const &transaction);
+
+	size_t outstanding() const { return pending.size(); }
+
+	//called by the channel for STUN-looking datagrams; returns true if it answered an outstanding transaction:
+	bool handle(struct sockaddr_storage const &from, uint8_t const *data, size_t size);
+
+	//------ internals ------
+	struct Transaction {
+		TransactionID transaction;
+		struct sockaddr_storage server;
+		uint32_t sends = 0;
+		uint64_t last_send_ms = 0;
+		uint32_t interval_ms = 0;
+		EventLoop::TimerID timer = 0;
+		Callback callback;
+		std::vector< uint8_t > message; //if not empty, sent instead of a request stamped from request_template
+	};
+	STUNTransactionTable< Transaction > pending;
+	std::mt19937 mt;
+
+	void send(Transaction &t);
+	void on_timer(TransactionID const &transaction);
+	void finish(Transaction &t, Result &result); //NOTE: removes 't' from pending
+};
@@ -0,0 +1,212 @@
+#include "STUNServerRace.hpp"
+
+#include "DatagramChannel.hpp"
+
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+
+//------------------------------------------------
+
+void STUNServerStats::record_success(std::string const &server, uint32_t rtt_ms) {
+	Entry &entry = servers[server];
+	if (entry.successes == 0) entry.srtt_ms = rtt_ms;
+	else entry.srtt_ms = (7 * entry.srtt_ms + rtt_ms) / 8; //same smoothing as TCP's SRTT
+	entry.successes += 1;
+}
+
+void STUNServerStats::record_failure(std::string const &server) {
+	servers[server].failures += 1;
+}
+
+void STUNServerStats::order(std::vector< std::string > &names) const {
+	auto rank = [this](std::string const &name) -> std::pair< uint32_t, uint32_t > {
+		auto f = servers.find(name);
+		if (f == servers.end()) return std::make_pair(1, 0); //unknown
+		Entry const &entry = f->second;
+		if (entry.successes == 0 || entry.failures > entry.successes) return std::make_pair(2, entry.failures); //known-bad
+		return std::make_pair(0, entry.srtt_ms); //known-good
+	};
+	std::stable_sort(names.begin(), names.end(), [&rank](std::string const &a, std::string const &b) {
+		return rank(a) < rank(b);
+	});
+}
+
+void STUNServerStats::load(std::string const &filename) {
+	std::ifstream in(filename);
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream str(line);
+		std::string name;
+		Entry entry;
+		if (!(str >> name >> entry.srtt_ms >> entry.successes >> entry.failures)) continue;
+		servers[name] = entry;
+	}
+}
+
+void STUNServerStats::save(std::string const &filename) const {
+	std::ofstream out(filename);
+	for (auto const &s : servers) {
+		out << s.first << ' ' << s.second.srtt_ms << ' ' << s.second.successes << ' ' << s.second.failures << '\n';
+	}
+	if (!out) {
+		throw std::runtime_error("Error writing STUN server stats to '" + filename + "'.");
+	}
+}
+
+//------------------------------------------------
+
+//split "host", "host:port", or "[v6 host]:port" (default port 3478):
+static void split_host_port(std::string const &server, std::string *host, std::string *port) {
+	*port = "3478";
+	if (!server.empty() && server[0] == '[') {
+		size_t close = server.find(']');
+		*host = server.substr(1, close - 1);
+		if (close != std::string::npos && close + 1 < server.size() && server[close + 1] == ':') *port = server.substr(close + 2);
+		return;
+	}
+	size_t colon = server.rfind(':');
+	if (colon == std::string::npos || server.find(':') != colon) { //<-- no port (or bare ipv6 literal)
+		*host = server;
+	} else {
+		*host = server.substr(0, colon);
+		*port = server.substr(colon + 1);
+	}
+}
+
+STUNServerRace::STUNServerRace(DatagramChannel &channel_) : channel(channel_) {
+}
+
+STUNServerRace::~STUNServerRace() {
+	cancel();
+}
+
+void STUNServerRace::start(std::vector< std::string > const &servers, Callback const &callback_) {
+	assert(!running());
+	callback = callback_;
+	candidates.clear();
+
+	std::vector< std::string > names = servers;
+	if (stats) stats->order(names);
+
+	//look up every server (in the family our socket speaks), all at once:
+	std::vector< std::string > hosts(names.size()), ports(names.size());
+	for (size_t n = 0; n < names.size(); ++n) split_host_port(names[n], &hosts[n], &ports[n]);
+	uint64_t started = ++generation;
+	std::weak_ptr< bool > alive_(alive);
+	channel.dns().resolve_all(hosts, channel.local_address().ss_family, [this, alive_, started, names, ports](std::vector< DNSResolver::Result > const &resolved) {
+		if (alive_.expired() || generation != started) return; //<-- (cancelled meanwhile)
+		begin(names, ports, resolved);
+	});
+}
+
+void STUNServerRace::begin(std::vector< std::string > const &names, std::vector< std::string > const &ports, std::vector< DNSResolver::Result > const &resolved) {
+	std::vector< std::vector< struct sockaddr_storage > > addresses(names.size());
+	for (size_t n = 0; n < names.size(); ++n) {
+		char *end = nullptr;
+		unsigned long port = std::strtoul(ports[n].c_str(), &end, 10);
+		if (!resolved[n].ok || *end != '\0' || port == 0 || port > 65535) {
+			if (stats) stats->record_failure(names[n]);
+			continue;
+		}
+		for (struct sockaddr_storage addr : resolved[n].addresses) {
+			if (addr.ss_family == AF_INET) reinterpret_cast< struct sockaddr_in & >(addr).sin_port = htons(uint16_t(port));
+			else reinterpret_cast< struct sockaddr_in6 & >(addr).sin6_port = htons(uint16_t(port));
+			addresses[n].emplace_back(addr);
+		}
+	}
+
+	//interleave: first address of each server (in order), then second addresses, ...
+	for (size_t round = 0; ; ++round) {
+		bool any = false;
+		for (size_t n = 0; n < names.size(); ++n) {
+			if (round >= addresses[n].size()) continue;
+			any = true;
+			candidates.emplace_back();
+			candidates.back().server = names[n];
+			candidates.back().address = addresses[n][round];
+		}
+		if (!any) break;
+	}
+
+	if (candidates.empty()) {
+		Result result;
+		result.error = "no STUN server addresses could be resolved.";
+		finish(result);
+		return;
+	}
+
+	launch(0);
+	for (size_t i = 1; i < candidates.size(); ++i) {
+		candidates[i].start_timer = channel.loop.after(uint32_t(i) * stagger_ms, [this, i]() {
+			candidates[i].start_timer = 0;
+			launch(i);
+		});
+	}
+}
+
+void STUNServerRace::launch(size_t index) {
+	Candidate &candidate = candidates[index];
+	if (candidate.state != Candidate::Waiting) return;
+	candidate.state = Candidate::Sent;
+	candidate.transaction = channel.stun->binding_request(candidate.address, [this, index](STUNClient::Result const &result) {
+		on_result(index, result);
+	});
+}
+
+void STUNServerRace::on_result(size_t index, STUNClient::Result const &result) {
+	Candidate &candidate = candidates[index];
+	if (result.ok) {
+		if (stats) stats->record_success(candidate.server, result.rtt_ms);
+		Result won;
+		won.ok = true;
+		won.server = candidate.server;
+		won.server_address = candidate.address;
+		won.mapped = result.mapped;
+		won.rtt_ms = result.rtt_ms;
+		finish(won);
+		return;
+	}
+
+	candidate.state = Candidate::Failed;
+	if (stats) stats->record_failure(candidate.server);
+
+	//don't wait out the stagger -- start the next waiting candidate now:
+	for (Candidate &next : candidates) {
+		if (next.state == Candidate::Waiting) {
+			channel.loop.cancel(next.start_timer);
+			next.start_timer = 0;
+			launch(&next - &candidates[0]);
+			return;
+		}
+	}
+
+	for (Candidate const &c : candidates) {
+		if (c.state != Candidate::Failed) return; //still something in flight
+	}
+	Result lost;
+	lost.error = "all STUN servers failed.";
+	finish(lost);
+}
+
+void STUNServerRace::cancel() {
+	generation += 1;
+	for (Candidate &candidate : candidates) {
+		if (candidate.start_timer) channel.loop.cancel(candidate.start_timer);
+		if (candidate.state == Candidate::Sent) channel.stun->cancel(candidate.transaction);
+	}
+	candidates.clear();
+	callback = nullptr;
+}
+
+void STUNServerRace::finish(Result const &result) {
+	Callback done = std::move(callback);
+	cancel();
+	if (done) done(result);
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+/*
+ * STUNServerRace asks a whole list of STUN servers for our mapped address,
+ * "happy eyeballs" style:
+ *  - server names are looked up in parallel, without blocking (the
+ *    channel's DNSResolver), and every address of every server is a candidate;
+ *  - candidates start 'stagger_ms' apart, fastest-known server first
+ *    (a candidate that fails early pulls the next one forward);
+ *  - the first valid XOR-MAPPED-ADDRESS wins, and everything else is cancelled.
+ *
+ * STUNServerStats remembers per-server round-trip times (and can be saved to
+ * / loaded from a file) so that later races try the fastest server first.
+ */
+
+#include "DNSResolver.hpp"
+#include "EventLoop.hpp"
+#include "STUNClient.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct DatagramChannel;
+
+struct STUNServerStats {
+	struct Entry {
+		uint32_t srtt_ms = 0; //smoothed round-trip time (valid if successes > 0)
+		uint32_t successes = 0;
+		uint32_t failures = 0;
+	};
+	std::map< std::string, Entry > servers; //keyed by server name, as given to the race
+
+	void record_success(std::string const &server, uint32_t rtt_ms);
+	void record_failure(std::string const &server);
+
+	//stable-sort 'names' best-first: known-good by srtt, then unknown, then known-bad:
+	void order(std::vector< std::string > &names) const;
+
+	//text file, one "name srtt_ms successes failures" line per server.
+	// load() silently ignores a missing file; save() throws on error.
+	void load(std::string const &filename);
+	void save(std::string const &filename) const;
+};
+
+struct STUNServerRace {
+	STUNServerRace(DatagramChannel &channel);
+	~STUNServerRace();
+	STUNServerRace(STUNServerRace const &) = delete;
+	STUNServerRace &operator=(STUNServerRace const &) = delete;
+
+	DatagramChannel &channel;
+	STUNServerStats *stats = nullptr; //if set, used for ordering and updated with results
+	uint32_t stagger_ms = 50;
+
+	struct Result {
+		bool ok = false;
+		char const *error = nullptr; //if !ok, (static) description of what went wrong
+		std::string server; //name of the server that answered
+		struct sockaddr_storage server_address;
+		struct sockaddr_storage mapped;
+		uint32_t rtt_ms = 0;
+	};
+	typedef std::function< void(Result const &) > Callback;
+
+	//race 'servers' ("host" or "host:port"; port defaults to 3478); callback is called once, unless cancel()'d:
+	void start(std::vector< std::string > const &servers, Callback const &callback);
+	void cancel();
+	bool running() const { return bool(callback); }
+
+	//------ internals ------
+	struct Candidate {
+		std::string server;
+		struct sockaddr_storage address;
+		enum : uint8_t { Waiting, Sent, Failed } state = Waiting;
+		STUNClient::TransactionID transaction;
+		EventLoop::TimerID start_timer = 0;
+	};
+	std::vector< Candidate > candidates;
+	Callback callback;
+	uint64_t generation = 0; //<-- bumped by start() / cancel(), so name lookups finishing late for an old race are ignored
+	std::shared_ptr< bool > alive = std::make_shared< bool >(true); //<-- ...or for a race that's gone
+
+	//(once the names are looked up:)
+	void begin(std::vector< std::string > const &names, std::vector< std::string > const &ports, std::vector< DNSResolver::Result > const &resolved);
+
+	void launch(size_t index);
+	void on_result(size_t index, STUNClient::Result const &result);
+	void finish(Result const &result);
+};
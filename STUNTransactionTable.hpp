@@ -0,0 +1,129 @@
+#pragma once
+
+/*
+ * STUNTransactionTable maps 96-bit STUN transaction ids to per-transaction
+ * state (e.g., retransmit timers), for routing responses in O(1) with many
+ * thousands of requests in flight on one socket.
+ *
+ * Layout is flat open addressing with linear probing: probing only touches
+ * a dense array of 16-byte keys; values live in a parallel array at the same
+ * index. Deletion shifts later entries back (no tombstones), so probe
+ * sequences stay short no matter how much churn there is. Load is kept at
+ * or below 1/2.
+ *
+ * NOTE: insert() and erase() may move values, so don't hold value pointers
+ *  across them.
+ */
+
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+
+template< typename T >
+struct STUNTransactionTable {
+	STUNTransactionTable(size_t initial_capacity = 64) {
+		size_t capacity = 16;
+		while (capacity < 2 * initial_capacity) capacity *= 2;
+		keys.assign(capacity, Key());
+		values.resize(capacity);
+	}
+
+	//returns value for transaction 'id' (12 bytes, as in the message), or nullptr:
+	T *find(uint8_t const *id) {
+		size_t i = locate(id);
+		return (i == Missing ? nullptr : &values[i]);
+	}
+
+	//add (default-constructed) value for 'id'; returns nullptr if 'id' is already present:
+	T *insert(uint8_t const *id) {
+		if (2 * (count + 1) > keys.size()) grow();
+		size_t mask = keys.size() - 1;
+		for (size_t i = hash(id) & mask; ; i = (i + 1) & mask) {
+			if (!keys[i].used) {
+				std::memcpy(keys[i].id, id, 12);
+				keys[i].used = 1;
+				values[i] = T();
+				count += 1;
+				return &values[i];
+			}
+			if (std::memcmp(keys[i].id, id, 12) == 0) return nullptr;
+		}
+	}
+
+	bool erase(uint8_t const *id) {
+		size_t i = locate(id);
+		if (i == Missing) return false;
+		size_t mask = keys.size() - 1;
+		//backward-shift deletion: pull later members of the probe run into the hole:
+		size_t hole = i;
+		for (size_t j = (i + 1) & mask; keys[j].used; j = (j + 1) & mask) {
+			size_t home = hash(reinterpret_cast< uint8_t const * >(keys[j].id)) & mask;
+			//can entry j move to 'hole'? (only if its home isn't cyclically in (hole, j])
+			bool movable = (hole <= j ? (home <= hole || home > j) : (home <= hole && home > j));
+			if (movable) {
+				keys[hole] = keys[j];
+				values[hole] = std::move(values[j]);
+				hole = j;
+			}
+		}
+		keys[hole].used = 0;
+		values[hole] = T();
+		count -= 1;
+		return true;
+	}
+
+	size_t size() const { return count; }
+
+	template< typename F >
+	void for_each(F const &f) {
+		for (size_t i = 0; i < keys.size(); ++i) {
+			if (keys[i].used) f(values[i]);
+		}
+	}
+
+	//------ internals ------
+	struct Key {
+		uint32_t id[3] = {0, 0, 0};
+		uint32_t used = 0;
+	};
+	static_assert(sizeof(Key) == 16, "keys are packed four-to-a-cache-line");
+	static constexpr size_t Missing = ~size_t(0);
+
+	std::vector< Key > keys;
+	std::vector< T > values;
+	size_t count = 0;
+
+	//ids are usually random, but don't count on it -- mix all 96 bits:
+	static size_t hash(uint8_t const *id) {
+		uint32_t w[3];
+		std::memcpy(w, id, 12);
+		uint64_t h = uint64_t(w[0]) * 0x9E3779B97F4A7C15ULL;
+		h ^= uint64_t(w[1]) * 0xC2B2AE3D27D4EB4FULL;
+		h ^= uint64_t(w[2]) * 0x165667B19E3779F9ULL;
+		return size_t(h ^ (h >> 29));
+	}
+
+	size_t locate(uint8_t const *id) const {
+		size_t mask = keys.size() - 1;
+		for (size_t i = hash(id) & mask; keys[i].used; i = (i + 1) & mask) {
+			if (std::memcmp(keys[i].id, id, 12) == 0) return i;
+		}
+		return Missing;
+	}
+
+	void grow() {
+		std::vector< Key > old_keys(keys.size() * 2, Key());
+		std::vector< T > old_values(keys.size() * 2);
+		old_keys.swap(keys);
+		old_values.swap(values);
+		size_t mask = keys.size() - 1;
+		for (size_t o = 0; o < old_keys.size(); ++o) {
+			if (!old_keys[o].used) continue;
+			size_t i = hash(reinterpret_cast< uint8_t const * >(old_keys[o].id)) & mask;
+			while (keys[i].used) i = (i + 1) & mask;
+			keys[i] = old_keys[o];
+			values[i] = std::move(old_values[o]);
+		}
+	}
+};
@@ -0,0 +1,143 @@
+#include "ShardedListener.hpp"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <linux/filter.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+#ifndef SO_ATTACH_REUSEPORT_CBPF
+#define SO_ATTACH_REUSEPORT_CBPF 51 //<-- (Linux 4.5+)
+#endif
+
+//Steering hash of a peer's (host-order) address and port; the BPF program in attach_steering() computes exactly this:
+static constexpr uint32_t SteeringMultiplier = 0x9e3779b1; //<-- (2^32 / golden ratio: spreads nearby addresses / ports)
+static uint32_t steering_hash(uint32_t address, uint16_t port, uint32_t shards) {
+	return ((address ^ port) * SteeringMultiplier >> 16) % shards;
+}
+
+ShardedListener::Shard::Shard(uint32_t index_, uint16_t port, DatagramChannel::Backend backend) : index(index_) {
+	channel.reset(new DatagramChannel(loop, port, backend, true));
+	wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wake_fd == -1) {
+		throw std::runtime_error(std::string("Error creating eventfd:\n") + strerror(errno));
+	}
+	loop.watch(wake_fd, EPOLLIN, [this](uint32_t) {
+		handle_inbox();
+	});
+}
+
+ShardedListener::Shard::~Shard() {
+	channel.reset();
+	loop.unwatch(wake_fd);
+	close(wake_fd);
+}
+
+void ShardedListener::Shard::post(std::function< void() > const &f) {
+	{
+		std::lock_guard< std::mutex > lock(inbox_mutex);
+		inbox.emplace_back(f);
+	}
+	uint64_t one = 1;
+	ssize_t ret = write(wake_fd, &one, sizeof(one));
+	(void)ret; //<-- (only fails if the counter is already huge -- i.e., the shard will wake anyway)
+}
+
+void ShardedListener::Shard::handle_inbox() {
+	uint64_t count;
+	while (read(wake_fd, &count, sizeof(count)) > 0) { }
+	std::vector< std::function< void() > > todo;
+	{
+		std::lock_guard< std::mutex > lock(inbox_mutex);
+		todo.swap(inbox);
+	}
+	for (auto const &f : todo) f();
+}
+
+ShardedListener::ShardedListener(uint16_t port_, uint32_t count, DatagramChannel::Backend backend) : port(port_) {
+	if (count == 0) count = std::max(1U, std::thread::hardware_concurrency());
+	//(shards join the port's reuseport group in order, which is how the steering program numbers them)
+	for (uint32_t i = 0; i < count; ++i) {
+		shards.emplace_back(new Shard(i, port, backend));
+		if (port == 0) {
+			struct sockaddr_storage local = shards[0]->channel->local_address();
+			port = ntohs(reinterpret_cast< struct sockaddr_in const & >(local).sin_port);
+		}
+	}
+	attach_steering();
+}
+
+ShardedListener::~ShardedListener() {
+	stop();
+}
+
+uint32_t ShardedListener::shard_for(struct sockaddr_storage const &peer) const {
+	if (peer.ss_family != AF_INET) return 0; //<-- (channels are ipv4 only)
+	struct sockaddr_in const &in = reinterpret_cast< struct sockaddr_in const & >(peer);
+	return steering_hash(ntohl(in.sin_addr.s_addr), ntohs(in.sin_port), uint32_t(shards.size()));
+}
+
+void ShardedListener::attach_steering() {
+	if (shards.size() < 2) return;
+	//Runs on each datagram for the port, with the packet's data starting *after* its UDP header (so the headers are
+	// read relative to the network header); returns the shard index:
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, uint32_t(SKF_NET_OFF + 12)), //A = source address (from the ipv4 header)
+		BPF_STMT(BPF_ST, 0), //M[0] = A
+		BPF_STMT(BPF_LDX | BPF_B | BPF_MSH, uint32_t(SKF_NET_OFF)), //X = ipv4 header length
+		BPF_STMT(BPF_LD | BPF_H | BPF_IND, uint32_t(SKF_NET_OFF)), //A = source port (first in the UDP header)
+		BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0), //X = M[0]
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+		BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, SteeringMultiplier),
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, uint32_t(shards.size())),
+		BPF_STMT(BPF_RET | BPF_A, 0),
+	};
+	struct sock_fprog program;
+	program.len = sizeof(code) / sizeof(code[0]);
+	program.filter = code;
+	//(attaching to any socket in the group sets the program for all of them)
+	steered = (setsockopt(shards[0]->channel->sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &program, sizeof(program)) == 0);
+}
+
+void ShardedListener::start(std::function< void(Shard &) > const &setup) {
+	if (!shards.empty() && shards[0]->thread.joinable()) {
+		throw std::runtime_error("ShardedListener: already started.");
+	}
+	uint32_t cores = std::max(1U, std::thread::hardware_concurrency());
+	for (auto &shard_ : shards) {
+		Shard *shard = shard_.get();
+		bool pin_ = pin;
+		shard->thread = std::thread([shard, setup, pin_, cores]() {
+			if (pin_) { //pin to core (best-effort):
+				cpu_set_t cpus;
+				CPU_ZERO(&cpus);
+				CPU_SET(shard->index % cores, &cpus);
+				pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+			}
+			if (setup) setup(*shard);
+			shard->loop.run();
+		});
+	}
+}
+
+void ShardedListener::stop() {
+	for (auto &shard_ : shards) {
+		if (!shard_->thread.joinable()) continue;
+		Shard *shard = shard_.get();
+		shard->post([shard]() {
+			shard->loop.stop();
+		});
+	}
+	for (auto &shard : shards) {
+		if (shard->thread.joinable()) shard->thread.join();
+	}
+}
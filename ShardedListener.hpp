@@ -0,0 +1,88 @@
+#pragma once
+
+/*
+ * ShardedListener spreads one UDP port over several cores: one
+ * SO_REUSEPORT DatagramChannel per shard, each with its own EventLoop run by
+ * its own thread (pinned to a core, best-effort), so receive work scales with
+ * shards instead of funneling through one socket.
+ *
+ * Peers are steered to shards by their address + port (the rest of the
+ * 4-tuple is the same for everything sent to the listener): a classic BPF
+ * program attached to the port's reuseport group picks the shard, using the
+ * same hash as shard_for(). So a peer always lands on the same shard, and
+ * per-peer state can live on that shard's thread without locks. To talk to a
+ * peer first, post() the send to shard_for(peer): replies then come back to
+ * the shard that sent.
+ * (If the kernel refuses the program, 'steered' stays false; the kernel's own
+ * reuseport hash still keeps each peer on one shard -- as long as the set of
+ * sockets doesn't change -- but shard_for() can't predict which.)
+ *
+ * Usage:
+ *   ShardedListener listener(15221); //one shard per core
+ *   listener.start([](ShardedListener::Shard &shard){
+ *     //(on the shard's thread)
+ *     shard.channel->on_receive = [&shard](auto const &from, uint8_t const *data, size_t size){ ... };
+ *   });
+ *   ...
+ *   listener.stop();
+ *
+ * Everything of a shard (its loop, channel, and callbacks) belongs to its
+ * thread once started; other threads only post().
+ */
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+
+#include <sys/socket.h>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct ShardedListener {
+	struct Shard {
+		Shard(uint32_t index, uint16_t port, DatagramChannel::Backend backend);
+		~Shard();
+		Shard(Shard const &) = delete;
+		Shard &operator=(Shard const &) = delete;
+
+		uint32_t const index;
+		EventLoop loop;
+		std::unique_ptr< DatagramChannel > channel;
+
+		//run 'f' on this shard's thread, soon (callable from any thread):
+		void post(std::function< void() > const &f);
+
+		//------ internals ------
+		int wake_fd = -1; //eventfd; written by post()
+		std::mutex inbox_mutex;
+		std::vector< std::function< void() > > inbox;
+		std::thread thread;
+		void handle_inbox();
+	};
+
+	//bind 'shards' sockets (0 = one per core) to 'port' (0 = any free port, shared by all shards); throws on error:
+	ShardedListener(uint16_t port, uint32_t shards = 0, DatagramChannel::Backend backend = DatagramChannel::SyscallBackend);
+	~ShardedListener(); //<-- stops
+	ShardedListener(ShardedListener const &) = delete;
+	ShardedListener &operator=(ShardedListener const &) = delete;
+
+	uint16_t port = 0;
+	std::vector< std::unique_ptr< Shard > > shards;
+	bool steered = false; //steering program attached (shard_for() matches the kernel's choice)
+	bool pin = true; //pin shard i's thread to core i % cores (set before start())
+
+	//shard that datagrams from 'peer' go to:
+	uint32_t shard_for(struct sockaddr_storage const &peer) const;
+
+	//start one thread per shard; each calls setup(shard) (if given) and then runs the shard's loop until stop():
+	void start(std::function< void(Shard &) > const &setup = nullptr);
+	//stop all shards' loops and wait for their threads (no-op if not started):
+	void stop();
+
+	//------ internals ------
+	void attach_steering();
+};
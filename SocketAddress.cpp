@@ -0,0 +1,81 @@
+#include "SocketAddress.hpp"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <cstring>
+#include <cstdlib>
+
+bool same_address(struct sockaddr_storage const &a, struct sockaddr_storage const &b) {
+	if (a.ss_family != b.ss_family) return false;
+	if (a.ss_family == AF_INET) {
+		struct sockaddr_in const &a4 = reinterpret_cast< struct sockaddr_in const & >(a);
+		struct sockaddr_in const &b4 = reinterpret_cast< struct sockaddr_in const & >(b);
+		return a4.sin_port == b4.sin_port && a4.sin_addr.s_addr == b4.sin_addr.s_addr;
+	} else if (a.ss_family == AF_INET6) {
+		struct sockaddr_in6 const &a6 = reinterpret_cast< struct sockaddr_in6 const & >(a);
+		struct sockaddr_in6 const &b6 = reinterpret_cast< struct sockaddr_in6 const & >(b);
+		return a6.sin6_port == b6.sin6_port && memcmp(&a6.sin6_addr, &b6.sin6_addr, sizeof(a6.sin6_addr)) == 0;
+	}
+	return false;
+}
+
+size_t AddressHash::operator()(struct sockaddr_storage const &address) const {
+	uint64_t h = address.ss_family;
+	auto mix = [&h](uint64_t v) {
+		h = (h ^ v) * 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+	};
+	if (address.ss_family == AF_INET) {
+		struct sockaddr_in const &in = reinterpret_cast< struct sockaddr_in const & >(address);
+		mix((uint64_t(in.sin_port) << 32) | in.sin_addr.s_addr);
+	} else if (address.ss_family == AF_INET6) {
+		struct sockaddr_in6 const &in6 = reinterpret_cast< struct sockaddr_in6 const & >(address);
+		uint64_t parts[2];
+		memcpy(parts, &in6.sin6_addr, sizeof(parts));
+		mix(parts[0]);
+		mix(parts[1]);
+		mix(in6.sin6_port);
+	}
+	return size_t(h);
+}
+
+socklen_t address_length(struct sockaddr_storage const &address) {
+	return (address.ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in));
+}
+
+std::string address_to_string(struct sockaddr_storage const &address) {
+	char str[INET6_ADDRSTRLEN];
+	if (address.ss_family == AF_INET) {
+		struct sockaddr_in const &in = reinterpret_cast< struct sockaddr_in const & >(address);
+		inet_ntop(AF_INET, &in.sin_addr, str, sizeof(str));
+		return std::string(str) + ":" + std::to_string(ntohs(in.sin_port));
+	} else if (address.ss_family == AF_INET6) {
+		struct sockaddr_in6 const &in6 = reinterpret_cast< struct sockaddr_in6 const & >(address);
+		inet_ntop(AF_INET6, &in6.sin6_addr, str, sizeof(str));
+		return "[" + std::string(str) + "]:" + std::to_string(ntohs(in6.sin6_port));
+	}
+	return "?";
+}
+
+bool address_from_string(std::string const &str, struct sockaddr_storage *address) {
+	size_t colon = str.rfind(':');
+	if (colon == std::string::npos || colon + 1 >= str.size()) return false;
+	std::string host = str.substr(0, colon);
+	char *end = nullptr;
+	unsigned long port = std::strtoul(str.c_str() + colon + 1, &end, 10);
+	if (*end != '\0' || port > 65535) return false;
+
+	memset(address, '\0', sizeof(*address));
+	if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+		struct sockaddr_in6 &in6 = reinterpret_cast< struct sockaddr_in6 & >(*address);
+		in6.sin6_family = AF_INET6;
+		in6.sin6_port = htons(uint16_t(port));
+		return inet_pton(AF_INET6, host.substr(1, host.size() - 2).c_str(), &in6.sin6_addr) == 1;
+	} else {
+		struct sockaddr_in &in = reinterpret_cast< struct sockaddr_in & >(*address);
+		in.sin_family = AF_INET;
+		in.sin_port = htons(uint16_t(port));
+		return inet_pton(AF_INET, host.c_str(), &in.sin_addr) == 1;
+	}
+}
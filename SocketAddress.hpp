@@ -0,0 +1,30 @@
+#pragma once
+
+/*
+ * Small helpers for ipv4 / ipv6 socket addresses held in sockaddr_storage.
+ */
+
+#include <sys/socket.h>
+
+#include <cstddef>
+#include <string>
+
+//do two socket addresses name the same host + port?
+bool same_address(struct sockaddr_storage const &a, struct sockaddr_storage const &b);
+
+//length to pass along with the address to sendto(), bind(), etc:
+socklen_t address_length(struct sockaddr_storage const &address);
+
+//"1.2.3.4:5" or "[::1]:5" (or "?" for other families):
+std::string address_to_string(struct sockaddr_storage const &address);
+
+//parse a numeric address in address_to_string()'s format; returns false if it isn't one:
+bool address_from_string(std::string const &str, struct sockaddr_storage *address);
+
+//for keying unordered containers by address (hash and equality agree with same_address()):
+struct AddressHash {
+	size_t operator()(struct sockaddr_storage const &address) const;
+};
+struct AddressEqual {
+	bool operator()(struct sockaddr_storage const &a, struct sockaddr_storage const &b) const { return same_address(a, b); }
+};
@@ -0,0 +1,136 @@
+#include "TimerWheel.hpp"
+
+#include <algorithm>
+#include <cassert>
+
+TimerWheel::TimerWheel(uint64_t now_ms, uint32_t tick_ms_, uint32_t slot_count) : tick_ms(tick_ms_) {
+	assert(tick_ms > 0);
+	assert(slot_count > 0 && slot_count % 64 == 0);
+	current_tick = now_ms / tick_ms;
+	slots.assign(slot_count, Nil);
+	occupied.assign(slot_count / 64, 0);
+}
+
+TimerWheel::TimerID TimerWheel::add(uint64_t deadline_ms, std::function< void() > const &fn) {
+	uint32_t index;
+	if (free_list != Nil) {
+		index = free_list;
+		free_list = entries[index].next;
+	} else {
+		index = uint32_t(entries.size());
+		entries.emplace_back();
+	}
+	Entry &entry = entries[index];
+	entry.tick = std::max(current_tick, (deadline_ms + tick_ms - 1) / tick_ms);
+	entry.fn = fn;
+
+	uint32_t slot = uint32_t(entry.tick % slots.size());
+	entry.prev = Nil;
+	entry.next = slots[slot];
+	if (entry.next != Nil) entries[entry.next].prev = index;
+	slots[slot] = index;
+	occupied[slot / 64] |= (uint64_t(1) << (slot % 64));
+
+	count += 1;
+	return (uint64_t(entry.generation) << 32) | index;
+}
+
+void TimerWheel::unlink(uint32_t index) {
+	Entry &entry = entries[index];
+	uint32_t slot = uint32_t(entry.tick % slots.size());
+	if (entry.prev != Nil) entries[entry.prev].next = entry.next;
+	else slots[slot] = entry.next;
+	if (entry.next != Nil) entries[entry.next].prev = entry.prev;
+	if (slots[slot] == Nil) occupied[slot / 64] &= ~(uint64_t(1) << (slot % 64));
+	entry.prev = entry.next = index; //<-- marks "not in any slot"
+}
+
+void TimerWheel::release(uint32_t index) {
+	Entry &entry = entries[index];
+	entry.fn = nullptr;
+	entry.generation += 1;
+	if (entry.generation == 0) entry.generation = 1;
+	entry.prev = Nil;
+	entry.next = free_list;
+	free_list = index;
+	count -= 1;
+}
+
+bool TimerWheel::cancel(TimerID id) {
+	uint32_t index = uint32_t(id);
+	uint32_t generation = uint32_t(id >> 32);
+	if (index >= entries.size()) return false;
+	Entry &entry = entries[index];
+	if (entry.generation != generation || !entry.fn) return false;
+	if (!(entry.prev == index && entry.next == index)) unlink(index);
+	release(index);
+	return true;
+}
+
+int32_t TimerWheel::next_timeout(uint64_t now_ms) const {
+	if (count == 0) return -1;
+
+	//walk slots in wheel order; first entry that is due within this rotation wins:
+	uint64_t best = ~uint64_t(0);
+	uint64_t const S = slots.size();
+	for (uint64_t k = 0; k < S; ++k) {
+		uint64_t slot = (current_tick + k) % S;
+		if (occupied[slot / 64] == 0) {
+			k += 63 - (slot % 64); //skip rest of empty word
+			continue;
+		}
+		if (!(occupied[slot / 64] & (uint64_t(1) << (slot % 64)))) continue;
+		for (uint32_t i = slots[slot]; i != Nil; i = entries[i].next) {
+			best = std::min(best, entries[i].tick);
+		}
+		if (best <= current_tick + k) break;
+	}
+	if (best == ~uint64_t(0)) return -1; //everything pending is mid-fire
+
+	uint64_t deadline_ms = best * tick_ms;
+	if (deadline_ms <= now_ms) return 0;
+	return int32_t(std::min< uint64_t >(deadline_ms - now_ms, 0x7fffffff));
+}
+
+void TimerWheel::advance(uint64_t now_ms) {
+	uint64_t now_tick = now_ms / tick_ms;
+	if (now_tick < current_tick) return;
+
+	std::vector< TimerID > firing;
+	firing.swap(due);
+	firing.clear();
+
+	if (count != 0) {
+		uint64_t steps = std::min< uint64_t >(now_tick - current_tick + 1, slots.size());
+		for (uint64_t t = 0; t < steps; ++t) {
+			uint32_t slot = uint32_t((current_tick + t) % slots.size());
+			if (!(occupied[slot / 64] & (uint64_t(1) << (slot % 64)))) continue;
+			uint32_t i = slots[slot];
+			while (i != Nil) {
+				uint32_t next = entries[i].next;
+				if (entries[i].tick <= now_tick) {
+					unlink(i);
+					firing.emplace_back((uint64_t(entries[i].generation) << 32) | i);
+				}
+				i = next;
+			}
+		}
+	}
+	current_tick = now_tick + 1;
+
+	std::stable_sort(firing.begin(), firing.end(), [this](TimerID a, TimerID b) {
+		return entries[uint32_t(a)].tick < entries[uint32_t(b)].tick;
+	});
+
+	for (TimerID id : firing) {
+		uint32_t index = uint32_t(id);
+		Entry &entry = entries[index];
+		if (entry.generation != uint32_t(id >> 32)) continue; //cancelled by an earlier callback
+		std::function< void() > fn = std::move(entry.fn);
+		release(index);
+		fn();
+	}
+
+	firing.clear();
+	due.swap(firing);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+/*
+ * TimerWheel is a hashed timing wheel: timers are dropped into one of 'slots'
+ * buckets by deadline (rounded up to 'tick_ms'), so adding and cancelling
+ * are O(1), and firing only ever looks at the buckets that came due.
+ *
+ * Deadlines more than one rotation away just sit in their bucket until the
+ * wheel comes around to the right tick.
+ *
+ * Not thread-safe; meant to be owned by an EventLoop.
+ */
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+struct TimerWheel {
+	TimerWheel(uint64_t now_ms, uint32_t tick_ms = 4, uint32_t slots = 512);
+
+	typedef uint64_t TimerID; //(generation << 32) | index; 0 is never a valid id
+
+	//call 'fn' once, at or shortly after 'deadline_ms':
+	TimerID add(uint64_t deadline_ms, std::function< void() > const &fn);
+
+	//returns false if timer has already fired or been cancelled:
+	bool cancel(TimerID id);
+
+	//ms from 'now_ms' until the next timer is due, or -1 if no timers are pending:
+	int32_t next_timeout(uint64_t now_ms) const;
+
+	//fire all timers due at or before 'now_ms':
+	void advance(uint64_t now_ms);
+
+	size_t pending() const { return count; }
+
+	//------ internals ------
+	struct Entry {
+		uint64_t tick = 0; //deadline, in ticks
+		uint32_t generation = 1;
+		uint32_t prev = Nil, next = Nil; //slot list (or free list, via next)
+		std::function< void() > fn;
+	};
+	static constexpr uint32_t Nil = 0xffffffff;
+
+	uint32_t tick_ms;
+	uint64_t current_tick; //next tick to process
+	std::vector< uint32_t > slots; //head of list for each slot
+	std::vector< uint64_t > occupied; //bitmap of non-empty slots
+	std::vector< Entry > entries;
+	uint32_t free_list = Nil;
+	size_t count = 0;
+	std::vector< TimerID > due; //scratch space for advance()
+
+	void unlink(uint32_t index);
+	void release(uint32_t index);
+};
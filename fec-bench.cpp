@@ -0,0 +1,238 @@
+/*
+ * Forward error correction benchmark (see FECCoder.hpp, ReedSolomon.hpp).
+ *
+ * Codec phase: GF(2^8) multiply-add throughput for each kernel the CPU has
+ * (checked against each other first), then Reed-Solomon encode (parity for
+ * a block) and decode (rebuilding as many lost datagrams as there is
+ * parity), in MB of data per second, for a few block shapes.
+ *
+ * Loss phase: a stream of small state updates (200 bytes every 8 ms)
+ * between two simulated hosts (NetworkSim: 20 ms +0-1 ms each way, the
+ * given loss on each host's link, so about twice that end to end), for
+ * 60 simulated seconds each: without FEC, with fixed redundancy, and with
+ * redundancy adapting to the loss the receiver reports. Reports how many
+ * updates arrived, how many of those FEC rebuilt, parity overhead, and
+ * one-way latency percentiles of what arrived (rebuilt updates arrive
+ * late, but a resend would have taken a round trip and more).
+ *
+ * usage: fec-bench [iterations [seed]]
+ */
+
+#include <sys/socket.h>
+
+#include <chrono>
+#include <cstring>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "FECCoder.hpp"
+#include "Histogram.hpp"
+#include "NetworkSim.hpp"
+#include "ReedSolomon.hpp"
+#include "STUN.hpp"
+
+//Time 'iterations' calls of 'fn', each covering 'bytes' bytes of data, and report MB/s:
+static void run(std::string const &name, uint32_t iterations, size_t bytes, std::function< uint32_t() > const &fn) {
+	uint32_t check = 0;
+	auto before = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < iterations; ++i) {
+		check += fn();
+	}
+	auto after = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration< double >(after - before).count();
+	std::cout << name << ": " << uint64_t(double(iterations) * double(bytes) / seconds / 1e6) << " MB/s"
+	          << " (" << (seconds * 1e9 / iterations) << " ns each, check " << check << ")" << std::endl;
+}
+
+static bool codec_phase(uint32_t iterations) {
+	std::mt19937 mt(1);
+
+	//kernels:
+	typedef void (*Kernel)(uint8_t *, uint8_t const *, uint8_t, size_t);
+	std::vector< std::pair< std::string, Kernel > > kernels{{"portable", gf256_mul_add_portable}};
+	if (gf256_has_ssse3()) kernels.emplace_back("ssse3", gf256_mul_add_ssse3);
+	if (gf256_has_avx2()) kernels.emplace_back("avx2", gf256_mul_add_avx2);
+	for (uint32_t trial = 0; trial < 1000; ++trial) {
+		size_t size = mt() % 1500;
+		uint8_t c = uint8_t(mt());
+		std::vector< uint8_t > src(size), dst(size);
+		for (auto &b : src) b = uint8_t(mt());
+		for (auto &b : dst) b = uint8_t(mt());
+		std::vector< uint8_t > expected = dst;
+		for (size_t i = 0; i < size; ++i) expected[i] ^= gf256_mul(c, src[i]);
+		for (auto const &kernel : kernels) {
+			std::vector< uint8_t > out = dst;
+			kernel.second(out.data(), src.data(), c, size);
+			if (out != expected) {
+				std::cerr << "GF(2^8) kernel '" << kernel.first << "' is wrong!" << std::endl;
+				return false;
+			}
+		}
+	}
+	std::cout << "GF(2^8) multiply-add, 1200 bytes, " << iterations << " iterations; gf256_mul_add() uses '" << gf256_implementation() << "'." << std::endl;
+	std::vector< uint8_t > src(1200), dst(1200);
+	for (auto &b : src) b = uint8_t(mt());
+	for (auto const &kernel : kernels) {
+		uint8_t c = 2;
+		run("mul_add " + kernel.first, iterations, src.size(), [&]() -> uint32_t {
+			c = uint8_t(c * 5 + 1) | 2; //<-- (never 0 or 1, which skip the multiply)
+			kernel.second(dst.data(), src.data(), c, src.size());
+			return dst[0];
+		});
+	}
+	run("xor (c = 1)", iterations, src.size(), [&]() -> uint32_t {
+		gf256_mul_add(dst.data(), src.data(), 1, src.size());
+		return dst[0];
+	});
+
+	//whole blocks (count data symbols + parities of 1200 bytes):
+	struct Shape { uint32_t count, parities; };
+	for (Shape shape : {Shape{8, 1}, Shape{8, 2}, Shape{8, 4}, Shape{32, 4}, Shape{32, 8}}) {
+		size_t const size = 1200;
+		std::vector< std::vector< uint8_t > > data(shape.count, std::vector< uint8_t >(size));
+		std::vector< std::vector< uint8_t > > parity(shape.parities, std::vector< uint8_t >(size));
+		for (auto &d : data) for (auto &b : d) b = uint8_t(mt());
+		auto encode = [&]() {
+			for (uint32_t j = 0; j < shape.parities; ++j) {
+				memset(parity[j].data(), 0, size);
+				for (uint32_t i = 0; i < shape.count; ++i) rs_encode_add(parity[j].data(), j, i, data[i].data(), size);
+			}
+		};
+		encode();
+
+		//lose the first 'parities' data symbols, rebuild them from all the parity, and check:
+		std::vector< std::vector< uint8_t > > received = data;
+		std::vector< uint8_t * > pointers;
+		bool present[RSMaxData];
+		for (uint32_t i = 0; i < shape.count; ++i) {
+			pointers.emplace_back(received[i].data());
+			present[i] = (i >= shape.parities);
+		}
+		std::vector< uint8_t const * > parity_pointers;
+		std::vector< uint32_t > parity_index;
+		for (uint32_t j = 0; j < shape.parities; ++j) {
+			parity_pointers.emplace_back(parity[j].data());
+			parity_index.emplace_back(j);
+		}
+		auto decode = [&]() {
+			return rs_decode(shape.count, pointers.data(), present, shape.parities, parity_pointers.data(), parity_index.data(), size);
+		};
+		for (uint32_t i = 0; i < shape.parities; ++i) memset(received[i].data(), 0, size);
+		if (!decode() || received != data) {
+			std::cerr << "Reed-Solomon (" << shape.count << " + " << shape.parities << ") fails to rebuild!" << std::endl;
+			return false;
+		}
+
+		std::string suffix = " (" + std::to_string(shape.count) + " + " + std::to_string(shape.parities) + " x 1200 bytes)";
+		uint32_t block_iterations = std::max< uint32_t >(1, iterations / shape.count);
+		run("rs encode" + suffix, block_iterations, shape.count * size, [&]() -> uint32_t {
+			data[0][0] += 1;
+			encode();
+			return parity[0][0];
+		});
+		run("rs decode, " + std::to_string(shape.parities) + " lost" + suffix, block_iterations, shape.count * size, [&]() -> uint32_t {
+			return decode() ? received[0][0] : 0;
+		});
+	}
+	return true;
+}
+
+enum FECMode { NoFEC, FixedFEC, AdaptiveFEC };
+
+static void loss_phase(uint64_t seed, double loss, FECMode mode) {
+	NetworkSim sim(seed);
+	NetworkSim::Link link;
+	link.latency_us = 20000;
+	link.jitter_us = 1000;
+	link.loss = loss;
+	std::unique_ptr< DatagramChannel > a = sim.add_host(nullptr, link);
+	std::unique_ptr< DatagramChannel > b = sim.add_host(nullptr, link);
+	struct sockaddr_storage to = b->local_address();
+
+	uint32_t const interval_ms = 8; //<-- (a multiple of the timer wheel's tick)
+	uint32_t const seconds = 60;
+	uint32_t const updates = seconds * 1000 / interval_ms;
+	size_t const size = 200;
+
+	if (mode != NoFEC) {
+		for (DatagramChannel *channel : {a.get(), b.get()}) {
+			channel->enable_fec(8, 20); //<-- (blocks close every 20 ms, so a rebuilt update is at most that late)
+			channel->fec->adapt = (mode == AdaptiveFEC);
+		}
+	}
+
+	std::vector< bool > arrived(updates, false);
+	uint64_t received = 0;
+	Histogram latency_us;
+	b->on_receive = [&](struct sockaddr_storage const &, uint8_t const *data, size_t length) {
+		if (length < 12) return;
+		uint32_t seq = stun_read_u32(data);
+		uint64_t sent_us = (uint64_t(stun_read_u32(data + 4)) << 32) | stun_read_u32(data + 8);
+		if (seq >= updates || arrived[seq]) return;
+		arrived[seq] = true;
+		received += 1;
+		latency_us.record(EventLoop::now_us() - sent_us);
+	};
+
+	std::vector< uint8_t > update(size, 0x5a);
+	uint32_t seq = 0;
+	std::function< void() > tick = [&]() {
+		if (seq >= updates) return;
+		uint64_t now_us = EventLoop::now_us();
+		stun_write_u32(update.data(), seq);
+		stun_write_u32(update.data() + 4, uint32_t(now_us >> 32));
+		stun_write_u32(update.data() + 8, uint32_t(now_us));
+		seq += 1;
+		if (a->fec) a->fec->send(to, update.data(), update.size());
+		else a->send_to(to, update.data(), update.size());
+		sim.loop().after(interval_ms, tick);
+	};
+	tick();
+	sim.run_for(seconds * 1000 + 1000);
+
+	static char const *mode_name[] = {"no FEC", "fixed 1/4", "adaptive"};
+	std::cout << std::setw(6) << loss * 100.0 << "%  " << std::setw(10) << mode_name[mode]
+		<< std::fixed << std::setprecision(3)
+		<< "  " << std::setw(7) << 100.0 * double(seq - received) / double(seq) << "%";
+	if (a->fec) {
+		std::cout << "  " << std::setw(9) << b->fec->recovered
+			<< "  " << std::setw(7) << 100.0 * double(a->fec->parity_sent) / double(a->fec->data_sent) << "%"
+			<< "  " << std::setw(8) << a->fec->loss(to) * 100.0 << "%";
+	} else {
+		std::cout << "  " << std::setw(9) << "-" << "  " << std::setw(8) << "-" << "  " << std::setw(9) << "-";
+	}
+	std::cout << std::defaultfloat << std::setprecision(6)
+		<< "  " << std::setw(6) << latency_us.percentile(0.5) / 1000.0
+		<< "  " << std::setw(6) << latency_us.percentile(0.99) / 1000.0
+		<< "  " << std::setw(6) << latency_us.percentile(0.999) / 1000.0 << "\n";
+	a.reset();
+	b.reset(); //<-- (channels go before the sim)
+}
+
+int main(int argc, char **argv) {
+	uint32_t iterations = 200000;
+	uint64_t seed = 1;
+	try {
+		if (argc > 1) iterations = uint32_t(std::stoul(argv[1]));
+		if (argc > 2) seed = std::stoull(argv[2]);
+	} catch (std::exception &e) {
+		std::cerr << "usage: fec-bench [iterations [seed]]" << std::endl;
+		return 1;
+	}
+
+	if (!codec_phase(iterations)) return 1;
+
+	std::cout << "\nState updates, 200 bytes every 8 ms for 60 s; 20ms +0-1ms each way; blocks of 8, closed after 20 ms; seed " << seed << "\n";
+	std::cout << "  loss        mode     lost  recovered   parity  reported  p50_ms  p99_ms  p99.9_ms\n";
+	for (double loss : {0.0, 0.01, 0.02, 0.05, 0.1, 0.2}) {
+		for (FECMode mode : {NoFEC, FixedFEC, AdaptiveFEC}) loss_phase(seed, loss, mode);
+	}
+	return 0;
+}
@@ -0,0 +1,411 @@
+/*
+ * NetworkSim benchmark: connection setup through every combination of NAT
+ * types, plus ReliableStream throughput over a lossy link -- all in simulated
+ * time, so thousands of peers take seconds of wall clock, and the same seed
+ * gives the same numbers every time.
+ *
+ * Setup phase: 'pairs' pairs of peers, each peer on its own (public or NATed)
+ * host, cycling through all 25 combinations of {public, full cone,
+ * restricted, port-restricted, symmetric}. Every peer gathers candidates
+ * (host + server-reflexive, from one simulated STUN server), descriptions
+ * are swapped, and ICEAgent connects each pair. Reports, per combination,
+ * how many pairs connected, and median time to the mapped address
+ * (gathering) and to a nominated pair (connect).
+ *
+ * Lifetime phase: peers behind NATs with binding timeouts from 20 s to 180 s
+ * each measure theirs with KeepaliveScheduler::probe_binding_lifetime() (from
+ * a second simulated socket on the peer's host); the measured range must
+ * contain the real timeout.
+ *
+ * Stream phase: one ReliableStream between two public hosts over a link with
+ * loss, delay, and a rate cap; reports goodput and resends.
+ *
+ * Each phase runs twice with the same seed, and the runs' digests (of every
+ * result and counter) must match. A last check connects restricted-cone
+ * peers over lossless links, which must take only a few round trips (a
+ * first check lost to the peer's NAT is resent as soon as the peer's own
+ * check arrives, not after a retransmit timeout). Another floods a
+ * MessagePacker with stray fragments from many sources, which must stay
+ * within its cap on receive-only peers (dropping the idlest) while a real
+ * fragmented message still gets through. Exits non-zero if anything doesn't
+ * hold.
+ *
+ * usage: sim-bench [pairs [seed [loss_percent]]]
+ *   defaults: 1000 pairs (2000 peers), seed 1, 1% loss on the stream's link
+ */
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "ICEAgent.hpp"
+#include "Keepalive.hpp"
+#include "MessagePacker.hpp"
+#include "NetworkSim.hpp"
+#include "ReliableStream.hpp"
+#include "SocketAddress.hpp"
+
+static uint64_t wall_ms() {
+	return std::chrono::duration_cast< std::chrono::milliseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//FNV-1a, to compare runs:
+struct Digest {
+	uint64_t value = 0xcbf29ce484222325ULL;
+	void add(uint64_t x) {
+		for (uint32_t i = 0; i < 8; ++i) {
+			value = (value ^ ((x >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+		}
+	}
+	void add(struct sockaddr_storage const &address) {
+		add(std::hash< std::string >()(address_to_string(address)));
+	}
+};
+
+//what a peer sits behind (past Public, in NetworkSim::NAT::Type order):
+enum Kind : uint32_t { Public, FullCone, Restricted, PortRestricted, Symmetric, Kinds };
+static char const *kind_name[Kinds] = { "public", "full-cone", "restricted", "port-restr", "symmetric" };
+static NetworkSim::NAT::Type nat_type(uint32_t kind) { return NetworkSim::NAT::Type(kind - FullCone); }
+
+static uint64_t median(std::vector< uint64_t > values) {
+	if (values.empty()) return 0;
+	std::sort(values.begin(), values.end());
+	return values[values.size() / 2];
+}
+
+struct Peer {
+	uint32_t kind;
+	std::unique_ptr< DatagramChannel > channel;
+	std::unique_ptr< ICEAgent > ice;
+	bool gathered = false;
+	uint64_t gather_ms = 0;
+	bool finished = false;
+	bool ok = false;
+	uint64_t connect_ms = 0;
+};
+
+//returns the run's digest:
+static uint64_t setup_phase(uint32_t pairs, uint64_t seed, bool report) {
+	uint64_t start = wall_ms();
+	NetworkSim sim(seed);
+
+	NetworkSim::Link access;
+	access.latency_us = 10000;
+	access.jitter_us = 2000;
+	access.loss = 0.01;
+	std::string server = sim.add_stun_server();
+
+	std::vector< Peer > peers(pairs * 2);
+	for (uint32_t i = 0; i < peers.size(); ++i) {
+		Peer &peer = peers[i];
+		uint32_t combination = (i / 2) % (Kinds * Kinds);
+		peer.kind = (i % 2 == 0 ? combination / Kinds : combination % Kinds);
+		NetworkSim::NAT *nat = nullptr;
+		if (peer.kind != Public) nat = sim.add_nat(nat_type(peer.kind));
+		peer.channel = sim.add_host(nat, access);
+		peer.channel->stun_servers.emplace_back(server);
+		peer.ice.reset(new ICEAgent(*peer.channel));
+	}
+
+	uint64_t begin = EventLoop::now();
+	uint32_t gathered = 0;
+	for (auto &peer : peers) {
+		Peer *p = &peer;
+		peer.ice->gather([&, p]() {
+			p->gathered = true;
+			p->gather_ms = EventLoop::now() - begin;
+			gathered += 1;
+		});
+	}
+	sim.run_until([&]() { return gathered == peers.size(); }, 60000);
+
+	begin = EventLoop::now();
+	uint32_t finished = 0;
+	for (uint32_t i = 0; i < peers.size(); ++i) {
+		Peer *p = &peers[i];
+		std::string remote = peers[i ^ 1].ice->description();
+		char const *error = p->ice->connect(remote, [&, p](ICEAgent::Result const &result) {
+			p->finished = true;
+			p->ok = result.ok;
+			p->connect_ms = EventLoop::now() - begin;
+			finished += 1;
+		});
+		if (error) {
+			std::cerr << "connect() refused a description: " << error << std::endl;
+			return 0;
+		}
+	}
+	sim.run_until([&]() { return finished == peers.size(); }, 60000);
+
+	Digest digest;
+	for (auto const &peer : peers) {
+		digest.add(peer.gather_ms);
+		digest.add(peer.ok);
+		digest.add(peer.connect_ms);
+		if (peer.ok) digest.add(peer.ice->result.remote);
+	}
+	digest.add(sim.delivered);
+	digest.add(sim.lost);
+	digest.add(sim.unroutable);
+	digest.add(sim.now_us);
+
+	if (report) {
+		std::cout << pairs << " pairs (" << peers.size() << " peers), 10ms +0-2ms each way, 1% loss; seed " << seed << "\n";
+		std::cout << std::setw(11) << "A" << " " << std::setw(11) << "B" << "  connected  gather_ms  connect_ms  (medians)\n";
+		for (uint32_t c = 0; c < Kinds * Kinds; ++c) {
+			uint32_t total = 0, connected = 0;
+			std::vector< uint64_t > gather, connect;
+			for (uint32_t i = 0; i < peers.size(); i += 2) {
+				if ((i / 2) % (Kinds * Kinds) != c) continue;
+				total += 1;
+				gather.emplace_back(peers[i].gather_ms);
+				gather.emplace_back(peers[i + 1].gather_ms);
+				if (peers[i].ok && peers[i + 1].ok) {
+					connected += 1;
+					connect.emplace_back(std::max(peers[i].connect_ms, peers[i + 1].connect_ms));
+				}
+			}
+			if (!total) continue;
+			std::cout << std::setw(11) << kind_name[c / Kinds] << " " << std::setw(11) << kind_name[c % Kinds]
+				<< "  " << std::setw(4) << connected << "/" << std::setw(4) << total
+				<< "  " << std::setw(9) << median(gather)
+				<< "  " << std::setw(10) << (connect.empty() ? std::string("-") : std::to_string(median(connect))) << "\n";
+		}
+		std::cout << "simulated " << (sim.now_us - 1000000) / 1000 << " ms in " << (wall_ms() - start) << " ms wall; "
+			<< sim.delivered << " delivered, " << sim.lost << " lost, " << sim.unroutable << " unroutable/filtered\n";
+	}
+	peers.clear(); //<-- (channels go before the sim)
+	return digest.value;
+}
+
+//Restricted-cone NATs on both ends: each side's first check is dropped by the other's NAT, and only the peer's
+// triggered check -- or the retransmit it prompts -- gets through. Returns true if every pair connects within
+// a few round trips (lossless links, so no retransmit timeout should ever be needed):
+static bool restricted_check(uint64_t seed) {
+	NetworkSim sim(seed);
+	NetworkSim::Link access;
+	access.latency_us = 10000;
+	std::string server = sim.add_stun_server();
+
+	uint32_t const pairs = 16;
+	uint64_t const rtt_ms = 40; //<-- (two access links each way)
+	uint64_t const limit_ms = 4 * rtt_ms;
+	std::vector< Peer > peers(pairs * 2);
+	for (auto &peer : peers) {
+		peer.kind = Restricted;
+		peer.channel = sim.add_host(sim.add_nat(nat_type(peer.kind)), access);
+		peer.channel->stun_servers.emplace_back(server);
+		peer.ice.reset(new ICEAgent(*peer.channel));
+	}
+	uint32_t gathered = 0;
+	for (auto &peer : peers) peer.ice->gather([&]() { gathered += 1; });
+	sim.run_until([&]() { return gathered == peers.size(); }, 10000);
+
+	uint64_t begin = EventLoop::now();
+	uint32_t finished = 0;
+	for (uint32_t i = 0; i < peers.size(); ++i) {
+		Peer *p = &peers[i];
+		p->ice->connect(peers[i ^ 1].ice->description(), [&, p](ICEAgent::Result const &result) {
+			p->ok = result.ok;
+			p->connect_ms = EventLoop::now() - begin;
+			finished += 1;
+		});
+	}
+	sim.run_until([&]() { return finished == peers.size(); }, 10000);
+
+	uint64_t slowest = 0;
+	bool ok = true;
+	for (auto const &peer : peers) {
+		if (!peer.ok) ok = false;
+		slowest = std::max(slowest, peer.connect_ms);
+	}
+	if (slowest > limit_ms) ok = false;
+	std::cout << "restricted x restricted, lossless: slowest of " << pairs << " connects " << slowest << " ms (limit " << limit_ms << " ms): " << (ok ? "ok" : "FAILED") << "\n";
+	peers.clear(); //<-- (channels go before the sim)
+	return ok;
+}
+
+//Stray fragments (first of two, never completed) from more sources than MessagePacker keeps receive-only peers
+// for: the count must stay at the cap, the idlest sources must be the ones forgotten, and a real fragmented
+// message sent meanwhile must still arrive. Returns true if all of that holds:
+static bool packer_peer_check(uint64_t seed) {
+	NetworkSim sim(seed);
+	std::unique_ptr< DatagramChannel > sender = sim.add_host();
+	std::unique_ptr< DatagramChannel > receiver = sim.add_host();
+	sender->enable_packing();
+	receiver->enable_packing();
+	uint32_t const cap = 16;
+	uint32_t const strays = 4 * cap;
+	receiver->packer->max_receive_peers = cap;
+	std::vector< uint8_t > received;
+	receiver->on_receive = [&](struct sockaddr_storage const &, uint8_t const *data, size_t size) {
+		received.assign(data, data + size);
+	};
+
+	std::vector< std::unique_ptr< DatagramChannel > > sources;
+	for (uint32_t i = 0; i < strays; ++i) {
+		sources.emplace_back(sim.add_socket(*sender));
+		uint8_t fragment[MessagePacker::FragmentHeader + 4] = {0xE5, uint8_t(i >> 8), uint8_t(i), 0, 2, 1, 2, 3, 4};
+		sources.back()->send_to(receiver->local_address(), fragment, sizeof(fragment));
+		sim.run_for(1); //<-- (so each is idle a different length of time)
+	}
+	std::vector< uint8_t > message(3 * MessagePacker::MaxMessage / MessagePacker::MaxFragments, 0x5a);
+	sender->packer->send(receiver->local_address(), message.data(), message.size());
+	sim.run_for(100);
+
+	//(the sender is a receive-only peer too, until its message is whole -- so it pushes out one more stray)
+	uint32_t const kept = cap - 1;
+	MessagePacker const &packer = *receiver->packer;
+	bool ok = (received == message);
+	if (packer.receive_only_peers != kept || packer.peers.size() != kept) ok = false;
+	if (packer.fragments_dropped != strays - kept) ok = false;
+	for (uint32_t i = 0; i < strays; ++i) {
+		bool found = (packer.peers.count(sources[i]->local_address()) != 0);
+		if (found != (i >= strays - kept)) ok = false; //<-- (the newest are kept)
+	}
+	std::cout << "packer, " << strays << " stray fragment sources (cap " << cap << "): " << packer.peers.size() << " kept, " << packer.fragments_dropped << " fragments dropped, message " << (received == message ? "arrived" : "LOST") << ": " << (ok ? "ok" : "FAILED") << "\n";
+	sources.clear();
+	sender.reset();
+	receiver.reset(); //<-- (channels go before the sim)
+	return ok;
+}
+
+//Binding lifetime: a peer behind each of a few NATs with known binding timeouts probes it (KeepaliveScheduler::
+// probe_binding_lifetime(), from a second simulated socket on the peer's host); returns the run's digest:
+static uint64_t lifetime_phase(uint64_t seed, bool report, bool *ok) {
+	NetworkSim sim(seed);
+	std::string server = sim.add_stun_server();
+	static uint32_t const timeouts_ms[] = {20000, 45000, 90000, 180000};
+	std::vector< std::unique_ptr< DatagramChannel > > channels;
+	uint32_t finished = 0;
+	for (uint32_t timeout_ms : timeouts_ms) {
+		channels.emplace_back(sim.add_host(sim.add_nat(NetworkSim::NAT::PortRestricted, timeout_ms)));
+		DatagramChannel &channel = *channels.back();
+		channel.enable_keepalive();
+		channel.keepalive->on_probe = [&](BindingLifetimeProbe const &probe) {
+			if (probe.state == BindingLifetimeProbe::Done || probe.state == BindingLifetimeProbe::Failed) finished += 1;
+		};
+		channel.keepalive->probe_binding_lifetime({server});
+	}
+	sim.run_until([&]() { return finished == channels.size(); }, 3600000);
+
+	Digest digest;
+	for (uint32_t i = 0; i < channels.size(); ++i) {
+		KeepaliveScheduler const &keepalive = *channels[i]->keepalive;
+		BindingLifetimeProbe const &probe = *keepalive.probe;
+		//the search must bracket the real timeout (or, if nothing died before the search's cap, the timeout must be past it):
+		bool bracketed = (probe.state == BindingLifetimeProbe::Done && probe.search.lo_ms <= timeouts_ms[i]
+			&& (probe.search.hi_ms == 0 || timeouts_ms[i] <= probe.search.hi_ms));
+		if (!bracketed) *ok = false;
+		digest.add(probe.search.lo_ms);
+		digest.add(probe.search.hi_ms);
+		digest.add(keepalive.interval_ms);
+		if (report) {
+			std::cout << "binding lifetime " << timeouts_ms[i] << " ms: measured " << probe.search.lo_ms << "-"
+				<< (probe.search.hi_ms ? std::to_string(probe.search.hi_ms) : std::string("")) << " ms, keepalive interval " << keepalive.interval_ms << " ms" << (bracketed ? "" : " (WRONG)") << "\n";
+		}
+	}
+	digest.add(sim.delivered);
+	digest.add(sim.now_us);
+	channels.clear(); //<-- (channels go before the sim)
+	return digest.value;
+}
+
+static uint64_t stream_phase(uint64_t seed, double loss, bool report) {
+	uint64_t start = wall_ms();
+	NetworkSim sim(seed);
+
+	NetworkSim::Link link;
+	link.latency_us = 20000;
+	link.jitter_us = 1000;
+	link.loss = loss;
+	link.reorder = 0.01;
+	link.rate_bytes_per_s = 2500000; //20 Mbit/s
+	std::unique_ptr< DatagramChannel > a = sim.add_host(nullptr, link);
+	std::unique_ptr< DatagramChannel > b = sim.add_host(nullptr, link);
+
+	ReliableStream sender(*a, b->local_address());
+	ReliableStream receiver(*b, a->local_address());
+
+	uint64_t received = 0;
+	Digest digest;
+	receiver.on_message = [&](uint8_t const *data, size_t size) {
+		received += size;
+		digest.add(uint64_t(data[0]) | (uint64_t(size) << 8));
+	};
+	std::vector< uint8_t > message(ReliableStream::MaxMessage);
+	uint32_t counter = 0;
+	auto fill = [&]() {
+		while (true) {
+			message[0] = uint8_t(counter);
+			if (!sender.send(message.data(), message.size())) break;
+			counter += 1;
+		}
+	};
+	sender.on_writable = fill;
+	fill();
+
+	uint32_t const seconds = 10;
+	sim.run_for(seconds * 1000);
+
+	digest.add(received);
+	digest.add(sender.retransmits);
+	digest.add(sim.delivered);
+	digest.add(sim.lost);
+	digest.add(sim.queue_drops);
+
+	if (report) {
+		std::cout << "stream: 20 Mbit/s, 20ms +0-1ms each way, " << loss * 100.0 << "% loss, 1% reordered; "
+			<< std::fixed << std::setprecision(2) << (received * 8.0 / seconds / 1e6) << " Mbit/s goodput, "
+			<< sender.retransmits << " resends, " << sim.queue_drops << " queue drops; "
+			<< seconds << " s simulated in " << (wall_ms() - start) << " ms wall\n";
+		std::cout.unsetf(std::ios::fixed);
+	}
+	return digest.value;
+}
+
+int main(int argc, char **argv) {
+	uint32_t pairs = 1000;
+	uint64_t seed = 1;
+	double loss = 0.01;
+	try {
+		if (argc > 1) pairs = uint32_t(std::stoul(argv[1]));
+		if (argc > 2) seed = std::stoull(argv[2]);
+		if (argc > 3) loss = std::stod(argv[3]) / 100.0;
+	} catch (std::exception &e) {
+		std::cerr << "usage: sim-bench [pairs [seed [loss_percent]]]" << std::endl;
+		return 1;
+	}
+	if (pairs == 0 || pairs > 2048) {
+		std::cerr << "pairs must be 1-2048 (each peer gets its own NAT)." << std::endl;
+		return 1;
+	}
+
+	uint64_t first = setup_phase(pairs, seed, true);
+	uint64_t second = setup_phase(pairs, seed, false);
+	std::cout << "setup replay: " << (first == second ? "identical" : "DIFFERENT") << " (digest " << std::hex << first << std::dec << ")\n";
+	bool ok = (first == second);
+	if (!restricted_check(seed)) ok = false;
+	if (!packer_peer_check(seed)) ok = false;
+
+	first = lifetime_phase(seed, true, &ok);
+	second = lifetime_phase(seed, false, &ok);
+	std::cout << "lifetime replay: " << (first == second ? "identical" : "DIFFERENT") << " (digest " << std::hex << first << std::dec << ")\n";
+	if (first != second) ok = false;
+
+	first = stream_phase(seed, loss, true);
+	second = stream_phase(seed, loss, false);
+	std::cout << "stream replay: " << (first == second ? "identical" : "DIFFERENT") << " (digest " << std::hex << first << std::dec << ")\n";
+	if (first != second) ok = false;
+	return (ok ? 0 : 1);
+}
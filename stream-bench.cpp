@@ -0,0 +1,226 @@
+/*
+ * ReliableStream benchmark under simulated loss: throughput and message
+ * latency over a lossy, delayed, rate-limited link, per congestion controller.
+ *
+ * Sender and receiver channels talk through an in-process relay (two more
+ * channels, on loopback) that emulates the link in each direction: random
+ * loss, a bottleneck of the given rate with a drop-tail queue, and one-way
+ * propagation delay. For each controller, two phases:
+ *  - bulk: the sender keeps the stream full; reports goodput, smoothed RTT
+ *    (which shows how much queue the controller builds), and resends;
+ *  - paced: the sender offers half of what bulk achieved; reports
+ *    send()-to-delivery message latency percentiles.
+ * Unreliable datagrams are sent alongside the whole time, to show they share
+ * the socket (and the link) with the stream.
+ *
+ * usage: stream-bench [loss_percent [delay_ms [rate_mbit [seconds]]]]
+ *   defaults: 1% loss, 10ms each way, 50 Mbit/s, 3 seconds per phase
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <iomanip>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "CongestionControl.hpp"
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "Histogram.hpp"
+#include "ReliableStream.hpp"
+
+static uint64_t now_us() {
+	return std::chrono::duration_cast< std::chrono::microseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static struct sockaddr_storage loopback(DatagramChannel &channel) {
+	struct sockaddr_storage address = channel.local_address();
+	reinterpret_cast< struct sockaddr_in & >(address).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	return address;
+}
+
+//One direction of the emulated link:
+struct Link {
+	double loss = 0.0;
+	uint64_t delay_us = 0;
+	double bytes_per_us = 0.0;
+	uint64_t queue_us = 50000; //drop-tail once this much is waiting for the bottleneck
+
+	DatagramChannel *out = nullptr;
+	struct sockaddr_storage to;
+	std::mt19937 mt{0x5eed};
+
+	struct Packet {
+		uint64_t deliver_us;
+		std::vector< uint8_t > data;
+	};
+	std::deque< Packet > in_flight;
+	uint64_t free_us = 0; //when the bottleneck finishes what it's sending
+	uint64_t dropped = 0;
+
+	void arrive(uint8_t const *data, size_t size) {
+		uint64_t now = now_us();
+		if (std::uniform_real_distribution< double >(0.0, 1.0)(mt) < loss) {
+			dropped += 1;
+			return;
+		}
+		uint64_t start = std::max(now, free_us);
+		if (start - now > queue_us) {
+			dropped += 1;
+			return;
+		}
+		free_us = start + uint64_t(double(size + 28) / bytes_per_us); //<-- (+ IP / UDP headers)
+		in_flight.emplace_back(Packet{free_us + delay_us, std::vector< uint8_t >(data, data + size)});
+	}
+
+	void deliver(uint64_t now) {
+		while (!in_flight.empty() && in_flight.front().deliver_us <= now) {
+			out->send_to(to, in_flight.front().data.data(), in_flight.front().data.size());
+			in_flight.pop_front();
+		}
+	}
+};
+
+struct Message {
+	uint64_t index;
+	uint64_t sent_us;
+};
+
+static void run(std::string const &name, std::function< CongestionControl *() > const &make_controller, double loss, uint32_t delay_ms, double rate_mbit, double seconds) {
+	EventLoop loop;
+	DatagramChannel sender(loop, 0), receiver(loop, 0), relay_a(loop, 0), relay_b(loop, 0);
+	for (DatagramChannel *c : {&sender, &receiver, &relay_a, &relay_b}) c->enable_batching();
+
+	//sender <-> relay_a ... relay_b <-> receiver:
+	Link forward, backward;
+	for (Link *link : {&forward, &backward}) {
+		link->loss = loss;
+		link->delay_us = uint64_t(delay_ms) * 1000;
+		link->bytes_per_us = rate_mbit / 8.0;
+	}
+	forward.out = &relay_b;
+	forward.to = loopback(receiver);
+	backward.out = &relay_a;
+	backward.to = loopback(sender);
+	relay_a.on_receive = [&](struct sockaddr_storage const &, uint8_t const *data, size_t size) { forward.arrive(data, size); };
+	relay_b.on_receive = [&](struct sockaddr_storage const &, uint8_t const *data, size_t size) { backward.arrive(data, size); };
+
+	ReliableStream out(sender, loopback(relay_a));
+	ReliableStream in(receiver, loopback(relay_b));
+	out.congestion.reset(make_controller());
+
+	uint64_t delivered = 0, delivered_bytes = 0, out_of_order = 0, unreliable = 0;
+	Histogram latency_us;
+	in.on_message = [&](uint8_t const *data, size_t size) {
+		Message m;
+		memcpy(&m, data, sizeof(m));
+		if (m.index != delivered) out_of_order += 1;
+		delivered += 1;
+		delivered_bytes += size;
+		latency_us.record(now_us() - m.sent_us);
+	};
+	receiver.on_receive = [&](struct sockaddr_storage const &, uint8_t const *, size_t) {
+		unreliable += 1;
+	};
+
+	std::vector< uint8_t > payload(1000, 0xab);
+	uint64_t queued = 0;
+	auto send_one = [&]() {
+		Message m{queued, now_us()};
+		memcpy(payload.data(), &m, sizeof(m));
+		if (!out.send(payload.data(), payload.size())) return false;
+		queued += 1;
+		return true;
+	};
+
+	double bulk_bytes_per_us = 0.0;
+	for (int phase = 0; phase < 2; ++phase) {
+		bool paced = (phase == 1);
+		uint64_t start = now_us();
+		uint64_t end = start + uint64_t(seconds * 1e6);
+		uint64_t delivered_before = delivered, bytes_before = delivered_bytes, resent_before = out.retransmits, timeouts_before = out.timeouts;
+		latency_us.clear();
+		double paced_per_us = bulk_bytes_per_us * 0.5 / double(payload.size());
+		uint64_t paced_sent = 0;
+		uint64_t next_unreliable = start;
+		uint64_t srtt_sum = 0, srtt_samples = 0;
+
+		uint64_t now;
+		while ((now = now_us()) < end) {
+			if (paced) {
+				uint64_t due = uint64_t(double(now - start) * paced_per_us);
+				while (paced_sent < due && send_one()) paced_sent += 1;
+			} else {
+				while (send_one()) { }
+			}
+			if (now >= next_unreliable) {
+				uint8_t ping[8] = {'u', 'n', 'r', 'e', 'l', 'i', 'a', 'b'};
+				sender.queue_to(loopback(relay_a), ping, sizeof(ping));
+				next_unreliable = now + 10000;
+			}
+			forward.deliver(now);
+			backward.deliver(now);
+			sender.flush();
+			relay_a.flush();
+			relay_b.flush();
+			loop.run_once(0);
+			if (out.srtt_us) {
+				srtt_sum += out.srtt_us;
+				srtt_samples += 1;
+			}
+		}
+		double elapsed = double(now - start) * 1e-6;
+		std::cout << std::left << std::setw(8) << name << std::setw(7) << (paced ? "paced" : "bulk") << std::right << std::fixed;
+		if (!paced) {
+			std::cout << std::setprecision(2) << std::setw(8) << double(delivered_bytes - bytes_before) / elapsed / 1e6 << " MB/s"
+				<< "  srtt " << std::setprecision(1) << std::setw(6) << (srtt_samples ? double(srtt_sum) / srtt_samples / 1000.0 : 0.0) << " ms";
+		} else {
+			std::cout << std::setprecision(2) << std::setw(8) << double(delivered - delivered_before) / elapsed << " msg/s"
+				<< "  latency p50 " << std::setprecision(1) << std::setw(6) << latency_us.percentile(0.5) / 1000.0 << " ms"
+				<< "  p99 " << std::setw(6) << latency_us.percentile(0.99) / 1000.0 << " ms";
+		}
+		if (!paced) bulk_bytes_per_us = double(delivered_bytes - bytes_before) / double(now - start);
+		std::cout << "  resent " << (out.retransmits - resent_before) << "  timeouts " << (out.timeouts - timeouts_before) << std::endl;
+
+		//let the pipe drain between phases (so paced messages don't queue behind bulk ones):
+		uint64_t drain_end = now_us() + 20000000;
+		while (out.unacked() && (now = now_us()) < drain_end) {
+			forward.deliver(now);
+			backward.deliver(now);
+			sender.flush();
+			relay_a.flush();
+			relay_b.flush();
+			loop.run_once(0);
+		}
+	}
+	if (out_of_order) std::cout << "  ERROR: " << out_of_order << " messages delivered out of order!" << std::endl;
+	std::cout << "  (link dropped " << forward.dropped << " forward / " << backward.dropped << " backward; "
+		<< unreliable << " unreliable datagrams got through alongside)" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	double loss_percent = (argc > 1 ? std::stod(argv[1]) : 1.0);
+	uint32_t delay_ms = (argc > 2 ? std::stoul(argv[2]) : 10);
+	double rate_mbit = (argc > 3 ? std::stod(argv[3]) : 50.0);
+	double seconds = (argc > 4 ? std::stod(argv[4]) : 3.0);
+	if (argc > 5 || rate_mbit <= 0.0 || seconds <= 0.0) {
+		std::cerr << "Usage:\n\t" << argv[0] << " [loss_percent [delay_ms [rate_mbit [seconds]]]]" << std::endl;
+		return 1;
+	}
+
+	std::cout << "Link: " << loss_percent << "% loss, " << delay_ms << " ms each way, " << rate_mbit << " Mbit/s ("
+		<< std::fixed << std::setprecision(2) << rate_mbit / 8.0 << " MB/s), 50 ms of queue." << std::endl;
+	run("NewReno", []() { return new NewReno(ReliableStream::MaxPacket); }, loss_percent / 100.0, delay_ms, rate_mbit, seconds);
+	run("LEDBAT", []() { return new LEDBAT(ReliableStream::MaxPacket); }, loss_percent / 100.0, delay_ms, rate_mbit, seconds);
+}
@@ -0,0 +1,448 @@
+/*
+ * STUN microbenchmarks. Prints messages per second for each case.
+ *
+ * Checks first (exiting non-zero if one fails): the parsers agree, the CRC-32
+ * and HMAC-SHA1 kernels agree, the RFC 5769 sample request verifies and
+ * is rebuilt byte for byte by STUNMessageBuilder, and an ICE connectivity
+ * check (PRIORITY, USE-CANDIDATE) gets a success response, not a 420.
+ *
+ * usage: stun-bench [iterations]
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <functional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "CRC32.hpp"
+#include "SHA1.hpp"
+#include "STUN.hpp"
+
+//The original istringstream-based parser, kept here as the "before" baseline:
+static struct sockaddr_in legacy_get_mapped_address(std::string const &message, uint32_t (&id_)[3]) {
+	std::istringstream ss(message);
+
+	{ //-------- header: type ------
+		uint16_t type;
+		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
+			throw std::runtime_error("Error: ran out of bytes reading type.");
+		}
+		type = ntohs(type);
+		if (type != 0x0101) {
+			throw std::runtime_error("Error: wrong message type.");
+		}
+	}
+
+	{ //-------- header: length ------
+		uint16_t length;
+		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
+			throw std::runtime_error("Error: ran out of bytes reading length.");
+		}
+		length = ntohs(length);
+		if (length + 20U != message.size()) {
+			throw std::runtime_error("Error: length doesn't match message length.");
+		}
+	}
+
+	{ //-------- header: cookie ------
+		uint32_t cookie;
+		if (!ss.read(reinterpret_cast< char * >(&cookie), 4)) {
+			throw std::runtime_error("Error: ran out of bytes reading cookie.");
+		}
+		cookie = ntohl(cookie);
+		if (cookie != 0x2112A442) {
+			throw std::runtime_error("Error: wrong cookie.");
+		}
+	}
+
+	{ //-------- header: ID ------
+		uint32_t id[3];
+		if (!ss.read(reinterpret_cast< char * >(id), sizeof(id))) {
+			throw std::runtime_error("Error: ran out of bytes reading transaction id.");
+		}
+		if (id[0] != id_[0] || id[1] != id_[1] || id[2] != id_[2]) {
+			throw std::runtime_error("Error: transaction id mis-match.");
+		}
+	}
+
+	//------ attributes ------
+	while (ss.peek() != std::istringstream::traits_type::eof()) {
+		uint16_t type;
+		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
+			throw std::runtime_error("Error: ran out of bytes reading attribute type.");
+		}
+		type = ntohs(type);
+
+		uint16_t length;
+		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
+			throw std::runtime_error("Error: ran out of bytes reading attribute length.");
+		}
+		length = ntohs(length);
+
+		std::string value;
+		for (uint32_t i = 0; i < length; ++i) {
+			char c;
+			if (!ss.read(&c, 1)) {
+				throw std::runtime_error("Error: ran out of bytes reading attribute value.");
+			}
+			value += c;
+		}
+
+		std::string padding;
+		for (uint32_t i = length; i % 4; ++i) {
+			char c;
+			if (!ss.read(&c, 1)) {
+				throw std::runtime_error("Error: ran out of bytes reading attribute padding.");
+			}
+			padding += c;
+		}
+
+		if (type == 0x0020) {
+			if (value.size() == 8) {
+				uint16_t port = (uint16_t(uint8_t(value[2])) << 8) | uint16_t(uint8_t(value[3]));
+				port = port ^ (0x2112A442 >> 16);
+				uint32_t addr = (uint32_t(uint8_t(value[4])) << 24) | (uint32_t(uint8_t(value[5])) << 16) | (uint32_t(uint8_t(value[6])) << 8) | uint32_t(uint8_t(value[7]));
+				addr = addr ^ 0x2112A442;
+
+				struct sockaddr_in ret;
+				memset(&ret, '\0', sizeof(ret));
+				ret.sin_family = AF_INET;
+				ret.sin_port = htons(port);
+				ret.sin_addr.s_addr = htonl(addr);
+				return ret;
+			} else {
+				throw std::runtime_error("Error: XOR-MAPPED-ADDRESS of unexpected length.");
+			}
+		}
+	}
+	throw std::runtime_error("Error: no XOR-MAPPED-ADDRESS attribute.");
+}
+
+//The original one-byte-at-a-time CRC-32, kept as the "before" baseline for FINGERPRINT:
+static uint32_t legacy_crc32(uint8_t const *data, size_t size) {
+	static uint32_t table[256];
+	static bool init = []() {
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (uint32_t k = 0; k < 8; ++k) {
+				c = (c & 1) ? (0xedb88320 ^ (c >> 1)) : (c >> 1);
+			}
+			table[i] = c;
+		}
+		return true;
+	}();
+	(void)init;
+
+	uint32_t crc = 0xffffffff;
+	for (size_t i = 0; i < size; ++i) {
+		crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	}
+	return crc ^ 0xffffffff;
+}
+
+//Append a type-length-value attribute (+ padding) to a message under construction:
+static void append_attribute(std::vector< uint8_t > &message, uint16_t type, uint8_t const *value, uint16_t length) {
+	message.emplace_back(uint8_t(type >> 8));
+	message.emplace_back(uint8_t(type));
+	message.emplace_back(uint8_t(length >> 8));
+	message.emplace_back(uint8_t(length));
+	message.insert(message.end(), value, value + length);
+	while (message.size() % 4) message.emplace_back(0);
+}
+
+//Build a typical binding response (SOFTWARE, XOR-MAPPED-ADDRESS, FINGERPRINT):
+static std::vector< uint8_t > example_response(uint32_t const (&id)[3]) {
+	std::vector< uint8_t > message(STUN_HEADER_SIZE, 0);
+
+	std::string software = "Example STUN Server 1.0";
+	append_attribute(message, STUN_ATTR_SOFTWARE, reinterpret_cast< uint8_t const * >(software.data()), software.size());
+
+	uint16_t port = 15221 ^ uint16_t(STUN_COOKIE >> 16);
+	uint32_t addr = 0xc0a80102 ^ STUN_COOKIE; //192.168.1.2
+	uint8_t xma[8] = {
+		0x00, 0x01,
+		uint8_t(port >> 8), uint8_t(port),
+		uint8_t(addr >> 24), uint8_t(addr >> 16), uint8_t(addr >> 8), uint8_t(addr)
+	};
+	append_attribute(message, STUN_ATTR_XOR_MAPPED_ADDRESS, xma, sizeof(xma));
+
+	uint8_t fingerprint[4] = {0xde, 0xad, 0xbe, 0xef}; //<-- not checked by either parser
+	append_attribute(message, STUN_ATTR_FINGERPRINT, fingerprint, sizeof(fingerprint));
+
+	uint16_t length = message.size() - STUN_HEADER_SIZE;
+	message[0] = uint8_t(STUN_BINDING_RESPONSE >> 8);
+	message[1] = uint8_t(STUN_BINDING_RESPONSE);
+	message[2] = uint8_t(length >> 8);
+	message[3] = uint8_t(length);
+	message[4] = uint8_t(STUN_COOKIE >> 24);
+	message[5] = uint8_t(STUN_COOKIE >> 16);
+	message[6] = uint8_t(STUN_COOKIE >> 8);
+	message[7] = uint8_t(STUN_COOKIE);
+	std::memcpy(&message[8], id, sizeof(id));
+	return message;
+}
+
+//RFC 5769 section 2.1: sample request (short-term credentials, password "VOkJxbRl1RmTxUk/WvJxBt"):
+static const uint8_t rfc5769_request[] = {
+	0x00, 0x01, 0x00, 0x58, 0x21, 0x12, 0xa4, 0x42, 0xb7, 0xe7, 0xa7, 0x01, 0xbc, 0x34, 0xd6, 0x86,
+	0xfa, 0x87, 0xdf, 0xae, 0x80, 0x22, 0x00, 0x10, 0x53, 0x54, 0x55, 0x4e, 0x20, 0x74, 0x65, 0x73,
+	0x74, 0x20, 0x63, 0x6c, 0x69, 0x65, 0x6e, 0x74, 0x00, 0x24, 0x00, 0x04, 0x6e, 0x00, 0x01, 0xff,
+	0x80, 0x29, 0x00, 0x08, 0x93, 0x2f, 0xf9, 0xb1, 0x51, 0x26, 0x3b, 0x36, 0x00, 0x06, 0x00, 0x09,
+	0x65, 0x76, 0x74, 0x6a, 0x3a, 0x68, 0x36, 0x76, 0x59, 0x20, 0x20, 0x20, 0x00, 0x08, 0x00, 0x14,
+	0x9a, 0xea, 0xa7, 0x0c, 0xbf, 0xd8, 0xcb, 0x56, 0x78, 0x1e, 0xf2, 0xb5, 0xb2, 0xd3, 0xf2, 0x49,
+	0xc1, 0xb5, 0x71, 0xa2, 0x80, 0x28, 0x00, 0x04, 0xe5, 0x7a, 0x3b, 0xcf,
+};
+
+//Check the sample verifies, and that the builder reproduces it byte for byte; returns nullptr or what went wrong:
+static char const *check_rfc5769(HMACSHA1 const &key) {
+	STUNMessageView sample(rfc5769_request, sizeof(rfc5769_request));
+	if (sample.error) return "sample request doesn't parse.";
+	if (char const *err = sample.verify_fingerprint()) return err;
+	if (char const *err = sample.verify_message_integrity(key)) return err;
+
+	uint8_t message[sizeof(rfc5769_request)];
+	STUNMessageBuilder builder(message, sizeof(message), STUN_BINDING_REQUEST, rfc5769_request + 8);
+	builder.add_attribute(STUN_ATTR_SOFTWARE, "STUN test client", 16);
+	builder.add_attribute(STUN_ATTR_PRIORITY, rfc5769_request + 44, 4);
+	builder.add_attribute(0x8029, rfc5769_request + 52, 8); //ICE-CONTROLLED
+	uint8_t *username = builder.add_attribute(STUN_ATTR_USERNAME, "evtj:h6vY", 9);
+	std::memset(username + 9, ' ', 3); //<-- (the sample pads with spaces, and MESSAGE-INTEGRITY covers padding)
+	builder.add_message_integrity(key);
+	builder.add_fingerprint();
+	if (builder.finish() != sizeof(rfc5769_request) || std::memcmp(message, rfc5769_request, sizeof(message)) != 0) {
+		return "builder doesn't reproduce the sample request.";
+	}
+	return nullptr;
+}
+
+//Check that the responder answers an ICE connectivity check -- with a nominating USE-CANDIDATE, as ICEAgent
+// sends -- with success, but still answers an unknown comprehension-required attribute with 420:
+static char const *check_ice_response(HMACSHA1 const &key) {
+	struct sockaddr_storage from;
+	std::memset(&from, '\0', sizeof(from));
+	reinterpret_cast< struct sockaddr_in & >(from).sin_family = AF_INET;
+	reinterpret_cast< struct sockaddr_in & >(from).sin_port = htons(15221);
+	reinterpret_cast< struct sockaddr_in & >(from).sin_addr.s_addr = htonl(0xc0a80102);
+
+	for (uint16_t extra : {uint16_t(0), uint16_t(0x0030)}) {
+		uint8_t message[256];
+		STUNMessageBuilder builder(message, sizeof(message), STUN_BINDING_REQUEST, rfc5769_request + 8);
+		builder.add_attribute(STUN_ATTR_USERNAME, "evtj:h6vY", 9);
+		builder.add_attribute(STUN_ATTR_PRIORITY, rfc5769_request + 44, 4);
+		builder.add_attribute(0x802a, rfc5769_request + 52, 8); //ICE-CONTROLLING
+		builder.add_attribute(STUN_ATTR_USE_CANDIDATE, nullptr, 0);
+		if (extra) builder.add_attribute(extra, nullptr, 0);
+		builder.add_message_integrity(key);
+		builder.add_fingerprint();
+		size_t size = stun_binding_response_in_place(message, builder.finish(), sizeof(message), from);
+		if (!size) return "responder dropped the connectivity check.";
+		STUNMessageView response(message, size);
+		if (response.error) return "response doesn't parse.";
+		if (!extra && response.type() != STUN_BINDING_RESPONSE) return "connectivity check got an error response.";
+		if (extra && response.type() != STUN_BINDING_ERROR_RESPONSE) return "unknown attribute didn't get an error response.";
+	}
+	return nullptr;
+}
+
+//Time 'iterations' calls of 'fn' and report messages per second:
+static void run(std::string const &name, uint32_t iterations, std::function< uint32_t() > const &fn) {
+	uint32_t check = 0;
+	auto before = std::chrono::steady_clock::now();
+	for (uint32_t i = 0; i < iterations; ++i) {
+		check += fn();
+	}
+	auto after = std::chrono::steady_clock::now();
+	double seconds = std::chrono::duration< double >(after - before).count();
+	std::cout << name << ": " << uint64_t(iterations / seconds) << " msgs/sec"
+	          << " (" << (seconds * 1e9 / iterations) << " ns/msg, check " << check << ")" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	uint32_t iterations = 1000000;
+	if (argc >= 2) iterations = std::stoul(argv[1]);
+
+	uint32_t id[3] = {0x01234567, 0x89abcdef, 0xfedcba98};
+	std::vector< uint8_t > response = example_response(id);
+
+	//sanity check: both parsers agree:
+	{
+		struct sockaddr_in a = legacy_get_mapped_address(std::string(response.begin(), response.end()), id);
+		struct sockaddr_in b = get_mapped_address(response.data(), response.size(), id);
+		if (a.sin_port != b.sin_port || a.sin_addr.s_addr != b.sin_addr.s_addr) {
+			std::cerr << "Parsers disagree!" << std::endl;
+			return 1;
+		}
+	}
+
+	std::cout << "Parsing " << response.size() << "-byte binding response, " << iterations << " iterations." << std::endl;
+
+	//"before": copy into std::string + istringstream, as the receive loop used to do:
+	run("get_mapped_address (istringstream)", iterations, [&]() -> uint32_t {
+		struct sockaddr_in addr = legacy_get_mapped_address(std::string(response.begin(), response.end()), id);
+		return addr.sin_port;
+	});
+
+	//"after": parse in place:
+	run("get_mapped_address (STUNMessageView)", iterations, [&]() -> uint32_t {
+		struct sockaddr_in addr = get_mapped_address(response.data(), response.size(), id);
+		return addr.sin_port;
+	});
+
+	//just the view + attribute walk, no exception-capable wrapper:
+	run("STUNMessageView + find", iterations, [&]() -> uint32_t {
+		STUNMessageView msg(response.data(), response.size());
+		STUNAttribute attr;
+		if (msg.error || !msg.find(STUN_ATTR_XOR_MAPPED_ADDRESS, &attr)) return 0;
+		struct sockaddr_storage addr;
+		if (decode_xor_mapped_address(attr, msg.transaction_id(), &addr)) return 0;
+		return reinterpret_cast< struct sockaddr_in const & >(addr).sin_port;
+	});
+
+	std::cout << "Building binding request, " << iterations << " iterations." << std::endl;
+
+	//"before": std::string += body, then header prepended, as the request path used to do:
+	run("binding request (std::string concat)", iterations, [&]() -> uint32_t {
+		std::string message;
+		{
+			std::string value = "TCHOW STUN Test";
+			uint16_t type = htons(0x8022);
+			uint16_t length = htons(value.size());
+			message += std::string(reinterpret_cast< const char * >(&type), 2);
+			message += std::string(reinterpret_cast< const char * >(&length), 2);
+			message += value;
+			while (message.size() % 4) message += '\0';
+		}
+		struct STUNHeader {
+			uint16_t type;
+			uint16_t length;
+			uint32_t cookie;
+			uint32_t id[3];
+		} __attribute__((packed));
+		STUNHeader header;
+		header.type = htons(0x0001);
+		header.length = htons(message.size());
+		header.cookie = htonl(0x2112A442);
+		header.id[0] = id[0];
+		header.id[1] = id[1];
+		header.id[2] = id[2];
+		message = std::string(reinterpret_cast< const char * >(&header), sizeof(header)) + message;
+		return uint8_t(message[message.size() - 1]) + message.size();
+	});
+
+	//"after": stamp transaction id into pre-built template:
+	static const STUNBindingRequestTemplate request_template("TCHOW STUN Test");
+	static const STUNBindingRequestTemplate fingerprint_template("TCHOW STUN Test", true);
+	uint8_t request[STUNBindingRequestTemplate::Capacity];
+	run("binding request (template stamp)", iterations, [&]() -> uint32_t {
+		size_t size = request_template.stamp(request, id);
+		return request[size - 1] + size;
+	});
+	run("binding request (template stamp + FINGERPRINT)", iterations, [&]() -> uint32_t {
+		size_t size = fingerprint_template.stamp(request, id);
+		return request[size - 1] + size;
+	});
+
+	//------ FINGERPRINT / MESSAGE-INTEGRITY ------
+	//(typical STUN messages are 20-100 bytes, so per-call overhead matters as much as bytes/cycle)
+	std::vector< uint8_t > bytes(128);
+	for (size_t i = 0; i < bytes.size(); ++i) bytes[i] = uint8_t(i * 37 + 11);
+	static const size_t sizes[] = {20, 28, 48, 64, 100};
+
+	std::cout << "CRC-32 (FINGERPRINT), " << iterations << " iterations; crc32() uses '" << crc32_implementation() << "'." << std::endl;
+	for (size_t size : sizes) {
+		if (crc32_slice8(bytes.data(), size) != legacy_crc32(bytes.data(), size) || crc32(bytes.data(), size) != legacy_crc32(bytes.data(), size)) {
+			std::cerr << "CRC-32 kernels disagree!" << std::endl;
+			return 1;
+		}
+		std::string suffix = " (" + std::to_string(size) + " bytes)";
+		run("crc32 bytewise" + suffix, iterations, [&]() -> uint32_t {
+			bytes[0] += 1;
+			return legacy_crc32(bytes.data(), size);
+		});
+		run("crc32 slice8" + suffix, iterations, [&]() -> uint32_t {
+			bytes[0] += 1;
+			return crc32_slice8(bytes.data(), size);
+		});
+		if (crc32_has_pclmul()) {
+			run("crc32 pclmul" + suffix, iterations, [&]() -> uint32_t {
+				bytes[0] += 1;
+				return crc32_pclmul(bytes.data(), size);
+			});
+		}
+	}
+
+	std::cout << "HMAC-SHA1 (MESSAGE-INTEGRITY), " << iterations << " iterations; default is '" << sha1_implementation() << "'." << std::endl;
+	std::string password = "VOkJxbRl1RmTxUk/WvJxBt";
+	uint8_t const *password_bytes = reinterpret_cast< uint8_t const * >(password.data());
+	HMACSHA1 portable_key(password_bytes, password.size(), sha1_blocks_portable);
+	HMACSHA1 sha_ni_key(password_bytes, password.size(), sha1_has_sha_ni() ? sha1_blocks_sha_ni : sha1_blocks_portable);
+	for (HMACSHA1 const *k : {&portable_key, &sha_ni_key}) {
+		if (char const *err = check_rfc5769(*k)) {
+			std::cerr << "RFC 5769 sample request: " << err << std::endl;
+			return 1;
+		}
+	}
+	if (char const *err = check_ice_response(portable_key)) {
+		std::cerr << "ICE connectivity check: " << err << std::endl;
+		return 1;
+	}
+	for (size_t size : sizes) {
+		uint8_t mac[SHA1::DigestSize];
+		{
+			uint8_t expected[SHA1::DigestSize];
+			portable_key.compute(bytes.data(), size, expected);
+			sha_ni_key.compute(bytes.data(), size, mac);
+			if (std::memcmp(mac, expected, sizeof(mac)) != 0) {
+				std::cerr << "HMAC-SHA1 kernels disagree!" << std::endl;
+				return 1;
+			}
+		}
+		std::string suffix = " (" + std::to_string(size) + " bytes)";
+		run("hmac-sha1 portable" + suffix, iterations, [&]() -> uint32_t {
+			bytes[0] += 1;
+			portable_key.compute(bytes.data(), size, mac);
+			return mac[0];
+		});
+		if (sha1_has_sha_ni()) {
+			run("hmac-sha1 sha-ni" + suffix, iterations, [&]() -> uint32_t {
+				bytes[0] += 1;
+				sha_ni_key.compute(bytes.data(), size, mac);
+				return mac[0];
+			});
+		}
+	}
+
+	//whole messages, as an ICE connectivity check would use them:
+	HMACSHA1 key(password_bytes, password.size());
+	std::string username = "evtj:h6vY";
+	uint8_t check[256];
+	size_t check_size = 0;
+	std::cout << "Binding request with USERNAME + MESSAGE-INTEGRITY + FINGERPRINT, " << iterations << " iterations." << std::endl;
+	run("build (USERNAME + MESSAGE-INTEGRITY + FINGERPRINT)", iterations, [&]() -> uint32_t {
+		id[2] += 1;
+		STUNMessageBuilder builder(check, sizeof(check), STUN_BINDING_REQUEST, reinterpret_cast< uint8_t const * >(id));
+		builder.add_attribute(STUN_ATTR_USERNAME, username.data(), uint16_t(username.size()));
+		builder.add_message_integrity(key);
+		builder.add_fingerprint();
+		check_size = builder.finish();
+		return check[check_size - 1];
+	});
+	run("verify (FINGERPRINT + MESSAGE-INTEGRITY)", iterations, [&]() -> uint32_t {
+		STUNMessageView msg(check, check_size);
+		if (msg.verify_fingerprint() || msg.verify_message_integrity(key)) return 0;
+		return 1;
+	});
+
+	return 0;
+}
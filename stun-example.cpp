@@ -1,7 +1,18 @@
-
-
 /*
  * Simple UDP / STUN test code. Figures out own info and prints it out.
+ *
+ * usage: stun-example [--stun host[:port]]... [--stats file] [--cache file] [--dns-cache file] [--keepalive] [--verbose] [--metrics file] [--key secret] [host port [message ...] | --ice [message ...]]
+ *  --stun  STUN server to ask (may be repeated; all are raced)
+ *  --stats where to keep per-server latency stats (default ~/.stun-example-stats)
+ *  --cache where to remember the mapped address between runs (default ~/.stun-example-address);
+ *          with a cached address, messages go out right away and STUN just double-checks it
+ *  --dns-cache where to remember looked-up server addresses between runs (default ~/.stun-example-dns)
+ *  --keepalive keep the binding to host:port open while idle, measuring this NAT's binding lifetime to pick the interval
+ *  --verbose print every message received (otherwise, just a count, at most once a second)
+ *  --metrics file to keep the channel's metrics in (rewritten every second; Prometheus text format)
+ *  --key   encrypt messages (and require them encrypted) with keys from this shared secret; the other side needs the same one
+ *  --ice   instead of sending to host:port, swap candidate lines with another stun-example --ice (copy + paste)
+ *          and send to whichever address ICE connectivity checks find first
  */
 
 
@@ -11,549 +22,298 @@
 #include <arpa/inet.h>
 #include <unistd.h>
 #include <netdb.h>
+#include <sys/epoll.h>
 
 #include <iostream>
 #include <cstring>
 #include <cassert>
-#include <random>
-#include <sstream>
-
-constexpr size_t MAX_DATA_SIZE = 65508; //<-- probably should set lower in general
+#include <cstdlib>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "DNSResolver.hpp"
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "ICEAgent.hpp"
+#include "Keepalive.hpp"
+#include "MappedAddressCache.hpp"
+#include "Metrics.hpp"
+#include "PacketCrypto.hpp"
+#include "PeerDemux.hpp"
+#include "STUNClient.hpp"
+#include "STUNServerRace.hpp"
+#include "SocketAddress.hpp"
 
-template< typename T >
-std::string binary(T val, uint32_t bits) {
-	std::string ret;
-	ret.reserve(bits);
-	assert(bits >= 8*sizeof(val) || (val >> bits) == 0);
-	while (bits != 0) {
-		bits -= 1;
-		if (val & (1 << bits)) ret += '1';
-		else ret += '0';
-	}
-	return ret;
-}
 
-template< typename T >
-std::string hex(T val, uint32_t digits) {
-	std::string ret;
-	ret.reserve(digits);
-	assert(digits >= 2*sizeof(val) || (val >> (4*digits)) == 0);
-	while (digits != 0) {
-		digits -= 1;
-		ret += "0123456789abcdef"[(val >> (4*digits)) & 0xf];
-	}
-	return ret;
-}
-
-void dump_stun_message(std::string const &message) {
-	if (message.size() < 20) {
-		std::cout << "(INVALID message: header is too small.)" << std::endl;
-		return;
+int main(int argc, char **argv) {
+	//options come first; remaining arguments are [host port [message ...]]:
+	std::vector< std::string > servers;
+	std::string stats_file;
+	std::string cache_file;
+	std::string dns_cache_file;
+	if (char const *home = getenv("HOME")) {
+		stats_file = std::string(home) + "/.stun-example-stats";
+		cache_file = std::string(home) + "/.stun-example-address";
+		dns_cache_file = std::string(home) + "/.stun-example-dns";
 	}
-	std::istringstream ss(message);
 
-	{ //-------- header: type ------
-		uint16_t type;
-		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
-			std::cout << "Error: ran out of bytes reading type." << std::endl;
-			return;
+	bool keepalive = false;
+	bool ice_mode = false;
+	bool verbose = false;
+	std::string metrics_file;
+	std::string key;
+	std::vector< std::string > args;
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (arg == "--stun" && a + 1 < argc) {
+			servers.emplace_back(argv[a+1]);
+			a += 1;
+		} else if (arg == "--stats" && a + 1 < argc) {
+			stats_file = argv[a+1];
+			a += 1;
+		} else if (arg == "--cache" && a + 1 < argc) {
+			cache_file = argv[a+1];
+			a += 1;
+		} else if (arg == "--dns-cache" && a + 1 < argc) {
+			dns_cache_file = argv[a+1];
+			a += 1;
+		} else if (arg == "--keepalive") {
+			keepalive = true;
+		} else if (arg == "--ice") {
+			ice_mode = true;
+		} else if (arg == "--verbose") {
+			verbose = true;
+		} else if (arg == "--metrics" && a + 1 < argc) {
+			metrics_file = argv[a+1];
+			a += 1;
+		} else if (arg == "--key" && a + 1 < argc) {
+			key = argv[a+1];
+			a += 1;
+		} else if (arg.substr(0,2) == "--") {
+			std::cerr << "Usage:\n\t" << argv[0] << " [--stun host[:port]]... [--stats file] [--cache file] [--dns-cache file] [--keepalive] [--verbose] [--metrics file] [--key secret] [host port [message ...] | --ice [message ...]]" << std::endl;
+			return 1;
+		} else {
+			args.emplace_back(arg);
 		}
-		type = ntohs(type);
-		std::cout << "Should be 00: 0b" << ((type >> 15) & 0x1) << ((type >> 14) & 0x1) << std::endl;
-		// 8 gets shifted right by 7
-		// 4 gets shifted right by 4
-		uint8_t cls = ((type & 0x0100) >> 7) | ((type & 0x0010) >> 4);
-		// 13-9 get shifted right by 2 -->0x3e00
-		// 7-5 get shifted right by 1 --> 0x00e0
-		// 3-0 aren't shifted --> 0x000f
-		uint8_t method = ((type & 0x3e00) >> 2) | ((type & 0x00e0) >> 1) | (type & 0x000f);
-	
-		std::cout << "Class: 0b" << binary(cls, 2) << "\n";
-		std::cout << "Method: 0b" << binary(method, 12) << "\n";
 	}
-
-	{ //-------- header: length ------
-		uint16_t length;
-		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
-			std::cout << "Error: ran out of bytes reading length." << std::endl;
-			return;
-		}
-		length = ntohs(length);
-		std::cout << "Length: " << length;
-
-		if (length + 20U != message.size()) std::cout << " (INVALID! Length should be " << int32_t(message.size()) - 20 << ")";
-		std::cout << "\n";
+	if (servers.empty()) {
+		servers = {
+			"stun.stunprotocol.org:3478",
+			"stun.l.google.com:19302",
+			"stun.cloudflare.com:3478",
+		};
 	}
 
-	{ //-------- header: cookie ------
-		uint32_t cookie;
-		if (!ss.read(reinterpret_cast< char * >(&cookie), 4)) {
-			std::cout << "Error: ran out of bytes reading cookie." << std::endl;
-			return;
-		}
-		cookie = ntohl(cookie);
-		std::cout << "Cookie: 0x" << hex(cookie, 8);
-		if (cookie != 0x2112A442) std::cout << " (INVALID! must be 0x2112A442)";
-		std::cout << "\n";
-	}
+	EventLoop loop;
 
-	{ //-------- header: ID ------
-		uint32_t id[3];
-		static_assert(sizeof(id) == 3*4, "sizeof static array gives size of array in bytes, right?");
-		if (!ss.read(reinterpret_cast< char * >(id), sizeof(id))) {
-			std::cout << "Error: ran out of bytes reading id." << std::endl;
-			return;
-		}
-		std::cout << "Transaction ID: 0x" << hex(id[0], 8) << " " << hex(id[1], 8) << " " << hex(id[2], 8) << "\n";
+	//NOTE: binding not explicitly needed but will bind as a matter of style
+	//  (and to make local firewall settings clearer)
+	std::unique_ptr< DatagramChannel > channel;
+	try {
+		channel.reset(new DatagramChannel(loop, 15221)); //TODO: don't actually care about port (will discover from server)
+	} catch (std::exception &e) {
+		std::cerr << e.what() << "\n (will continue anyway, with what I can only assume will be an different port number.)" << std::endl;
+		channel.reset(new DatagramChannel(loop, 0));
+	}
+	channel->enable_batching();
+	Metrics metrics;
+	channel->enable_metrics(metrics, "stun-example");
+	if (!key.empty()) {
+		//everything but STUN is sealed from here on:
+		channel->enable_encryption();
+		channel->crypto->set_secret(reinterpret_cast< uint8_t const * >(key.data()), key.size());
+		std::cout << "Encrypting with " << aead_cipher_name(channel->crypto->cipher) << "." << std::endl;
 	}
 
-	//------ attributes ------
-	while (ss.peek() != std::istringstream::traits_type::eof()) {
-		//read attribute:
-		uint16_t type;
-		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
-			std::cout << "Error: ran out of bytes reading type." << std::endl;
-			return;
-		}
-		type = ntohs(type);
-		std::cout << "Type: 0x" << hex(type, 4);
-		if      (type == 0x0000) std::cout << " (Reserved)";
-		else if (type == 0x0001) std::cout << " MAPPED_ADDRESS";
-		else if (type == 0x0002) std::cout << " (Reserved; was RESPONSE-ADDRESS)";
-		else if (type == 0x0003) std::cout << " (Reserved; was CHANGE-ADDRESS)";
-		else if (type == 0x0004) std::cout << " (Reserved; was SOURCE-ADDRESS)";
-		else if (type == 0x0005) std::cout << " (Reserved; was CHANGED-ADDRESS)";
-		else if (type == 0x0006) std::cout << " USERNAME";
-		else if (type == 0x0007) std::cout << " (Reserved; was PASSWORD)";
-		else if (type == 0x0008) std::cout << " MESSAGE-INTEGRITY";
-		else if (type == 0x0009) std::cout << " ERROR-CODE";
-		else if (type == 0x000a) std::cout << " UNKNOWN-ATTRIBUTES";
-		else if (type == 0x000b) std::cout << " (Reserved; was REFLECTED-FROM)";
-		else if (type == 0x0014) std::cout << " REALM";
-		else if (type == 0x0015) std::cout << " NONCE";
-		else if (type == 0x0020) std::cout << " XOR-MAPPED-ADDRESS";
-		else if (type == 0x8022) std::cout << " SOFTWARE";
-		else if (type == 0x8023) std::cout << " ALTERNATE-SERVER";
-		else if (type == 0x8028) std::cout << " FINGERPRINT";
-		else if (type <= 0x7FFF) std::cout << " (Unknown; Comprehension-required)";
-		else std::cout << " (Unknown; Comprehension-optional)";
-		std::cout << "\n";
-
-		uint16_t length;
-		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
-			std::cout << "Error: ran out of bytes reading length." << std::endl;
-			return;
+	//use STUN protocol to figure out public host/port.
+	//race all of the servers; stats from previous runs decide who goes first:
+	STUNServerStats stats;
+	if (!stats_file.empty()) stats.load(stats_file);
+	MappedAddressCache cache;
+	if (!cache_file.empty()) cache.load(cache_file);
+	//server names are looked up without blocking, and remembered (by their TTLs) across runs:
+	DNSResolver dns(loop);
+	if (!dns_cache_file.empty()) dns.load(dns_cache_file);
+	channel->resolver = &dns;
+
+	channel->stun_servers = servers;
+	channel->stun_stats = &stats;
+	channel->address_cache = &cache;
+	channel->address_cache_file = cache_file;
+
+	bool checked = false;
+	channel->address_listeners.emplace_back([&](STUNServerRace::Result const &result, bool changed) {
+		checked = true;
+		if (!result.ok) {
+			std::cout << "STUN failed: " << result.error << std::endl;
+		} else {
+			std::cout << "Got response from " << result.server << " (" << result.rtt_ms << " ms)." << std::endl;
+			if (changed) std::cout << "Local Address: " << address_to_string(result.mapped) << std::endl;
 		}
-		length = ntohs(length);
-		std::cout << "Length: " << length << "\n";
-
-		std::string value;
-		for (uint32_t i = 0; i < length; ++i) {
-			char c;
-			if (!ss.read(&c, 1)) {
-				std::cout << "Error: ran out of bytes reading value." << std::endl;
-				return;
+		if (!stats_file.empty()) {
+			try {
+				stats.save(stats_file);
+			} catch (std::exception &e) {
+				std::cerr << e.what() << std::endl;
 			}
-			value += c;
 		}
-		std::cout << "Value: '" << value << "'\n";
-
-		std::string padding;
-		for (uint32_t i = length; i % 4; ++i) {
-			char c;
-			if (!ss.read(&c, 1)) {
-				std::cout << "Error: ran out of bytes reading padding." << std::endl;
-				return;
+		if (!dns_cache_file.empty()) {
+			try {
+				dns.save(dns_cache_file);
+			} catch (std::exception &e) {
+				std::cerr << e.what() << std::endl;
 			}
-			padding += c;
 		}
-		std::cout << "Padding: '" << padding << "' (" << padding.size() << " bytes)";
-		if (padding.size() >= 4) std::cout << " (INVALID: padding should be 0-3 bytes)";
-		if ((padding.size() + value.size()) % 4) std::cout << " (INVALID: padding + value should be multiple of four)";
-		std::cout << "\n";
-
+	});
 
-		if (type == 0x0020) {
-			assert(value.size() == length);
-			if (value.size() == 8) {
-				//ipv4 version
-				std::cout << "XOR-MAPPED-ADDRESS (ipv4):\n";
-				uint8_t zeros = value[0];
-				std::cout << " zero padding: 0x" << hex(zeros, 2) << "\n";
-				uint8_t family = value[1];
-				std::cout << " family: 0x" << hex(family, 2);
-				if (family != 0x01) std::cout << " (INVALID: expecting 0x01 for ipv4)";
-				std::cout << "\n";
-
-				uint16_t port = (uint16_t(value[2]) << 8) | uint16_t(value[3]);
-				//de-xor port:
-				port = port ^ (0x2112A442 >> 16);
-				std::cout << " port: " << port << "\n";
-
-				uint32_t addr = (uint32_t(uint8_t(value[4])) << 24) | (uint32_t(uint8_t(value[5])) << 16) | (uint32_t(uint8_t(value[6])) << 8) | uint32_t(uint8_t(value[7]));
-				//de-xor addr:
-				addr = addr ^ 0x2112A442;
-
-				struct in_addr ia;
-				ia.s_addr = htonl(addr);
-				std::cout << " addr: 0x" << hex(addr, 8) << " == " <<  inet_ntoa(ia) << "\n";
-
-			} else if (value.size() == 20) {
-				//ipv6 version
-
-				//.... I guess not?
-			} else {
-				std::cout << "XOR-MAPPED-ADDRESS of invalid length!\n";
-			}
-		}
-	}
-	std::cout.flush();
-}
-
-
-//Parse a STUN server response to find mapped host+port:
-// fills in ipv4 address info + returns
-// throws on error / invalid message / wrong transaction
-struct sockaddr_in get_mapped_address(std::string const &message, uint32_t (&id_)[3]) {
-	std::istringstream ss(message);
-
-	{ //-------- header: type ------
-		uint16_t type;
-		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
-			throw std::runtime_error("Error: ran out of bytes reading type.");
-		}
-		type = ntohs(type);
-		if (type != 0x0101) {
-			throw std::runtime_error("Error: message type was " + hex(type, 4) = ", expecting 0x0101.");
-		}
-	}
-
-	{ //-------- header: length ------
-		uint16_t length;
-		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
-			throw std::runtime_error("Error: ran out of bytes reading length.");
-		}
-		length = ntohs(length);
-		if (length + 20U != message.size()) {
-			throw std::runtime_error("Error: length doesn't match message length.");
-		}
-	}
-
-	{ //-------- header: cookie ------
-		uint32_t cookie;
-		if (!ss.read(reinterpret_cast< char * >(&cookie), 4)) {
-			throw std::runtime_error("Error: ran out of bytes reading cookie."); //<-- shouldn't happen because of length check above(!)
-		}
-		cookie = ntohl(cookie);
-		if (cookie != 0x2112A442) {
-			throw std::runtime_error("Error: expected cookie of 0x2112A442, got 0x" + hex(cookie, 8) + ".");
-		}
-	}
-
-	{ //-------- header: ID ------
-		uint32_t id[3];
-		static_assert(sizeof(id) == 3*4, "sizeof static array gives size of array in bytes, right?");
-		if (!ss.read(reinterpret_cast< char * >(id), sizeof(id))) {
-			throw std::runtime_error("Error: ran out of bytes reading transaction id."); //<-- shouldn't happen because of length check above(!)
+	std::string self_addr = channel->what_is_my_address();
+	if (!self_addr.empty()) {
+		std::cout << "Local Address: " << self_addr << " (cached; checking in the background)" << std::endl;
+	} else {
+		std::cout << "Waiting for response..." << std::endl;
+		while (!checked) {
+			loop.run_once();
 		}
-		if (id[0] != id_[0] || id[1] != id_[1] || id[2] != id_[2]) {
-			throw std::runtime_error("Error: transaction id mis-match.");
+		if (!channel->have_mapped_address) {
+			std::cout << "Error: Was unable to determine local address." << std::endl;
+			return 1;
 		}
 	}
 
-	//------ attributes ------
-	while (ss.peek() != std::istringstream::traits_type::eof()) {
-		//read attribute:
-		uint16_t type;
-		if (!ss.read(reinterpret_cast< char * >(&type), 2)) {
-			throw std::runtime_error("Error: ran out of bytes reading attribute type.");
-		}
-		type = ntohs(type);
+	//(Should now be able to sendto and recvfrom on the socket.)
 
-		uint16_t length;
-		if (!ss.read(reinterpret_cast< char * >(&length), 2)) {
-			throw std::runtime_error("Error: ran out of bytes reading attribute length.");
-		}
-		length = ntohs(length);
+	//send message(s) to 'dest' (and keep it alive, if asked):
+	auto send_messages = [&](struct sockaddr_storage const &dest, size_t first) {
+		std::cout << "Sending some messages to " << address_to_string(dest) << " :" << std::endl;
 
-		std::string value;
-		for (uint32_t i = 0; i < length; ++i) {
-			char c;
-			if (!ss.read(&c, 1)) {
-				throw std::runtime_error("Error: ran out of bytes reading attribute value.");
+		//all messages go out in one sendmmsg():
+		for (size_t a = first; a < args.size(); ++a) {
+			std::string const &buf = args[a];
+			if (!channel->queue_to(dest, reinterpret_cast< const uint8_t * >(buf.data()), buf.size())) {
+				std::cout << "Error sending message '" << buf << "':\n" << strerror(errno) << std::endl;
+				//NOTE: continue trying to send *other* messages
 			}
-			value += c;
 		}
-
-		std::string padding;
-		for (uint32_t i = length; i % 4; ++i) {
-			char c;
-			if (!ss.read(&c, 1)) {
-				throw std::runtime_error("Error: ran out of bytes reading attribute padding.");
-			}
-			padding += c;
+		if (!channel->flush()) {
+			std::cout << "Error sending (some) messages:\n" << strerror(errno) << std::endl;
+		} else {
+			std::cout << "Sent " << (args.size() - first) << " message(s)." << std::endl;
 		}
-		assert(padding.size() < 4);
-		assert((padding.size() + value.size()) % 4 == 0);
 
-
-		if (type == 0x0020) {
-			assert(value.size() == length);
-			if (value.size() == 8) {
-				//ipv4 version
-				uint8_t zeros = value[0];
-				if (zeros != 0) {
-					throw std::runtime_error("Error: XOR-MAPPED-ADDRESS has 0x" + hex(zeros,2) + " instead of zeros.");
-				}
-				uint8_t family = value[1];
-				if (family != 0x01) {
-					throw std::runtime_error("Error: XOR-MAPPED-ADDRESS has family 0x" + hex(family,2) + " instead of 0x01 (ipv4).");
+		if (keepalive) {
+			channel->enable_keepalive();
+			channel->keepalive->add(dest);
+			channel->keepalive->on_probe = [&](BindingLifetimeProbe const &probe) {
+				if (probe.state == BindingLifetimeProbe::Failed) {
+					std::cout << "Binding lifetime probe stopped: " << probe.error << std::endl;
+				} else {
+					std::cout << "Binding lifetime (" << address_to_string(probe.mapped) << "): at least " << probe.search.lo_ms << " ms";
+					if (probe.search.hi_ms) std::cout << ", under " << probe.search.hi_ms << " ms";
+					std::cout << (probe.state == BindingLifetimeProbe::Done ? " (done)" : "") << "." << std::endl;
 				}
-
-				uint16_t port = (uint16_t(value[2]) << 8) | uint16_t(value[3]);
-				port = port ^ (0x2112A442 >> 16);
-
-				uint32_t addr = (uint32_t(uint8_t(value[4])) << 24) | (uint32_t(uint8_t(value[5])) << 16) | (uint32_t(uint8_t(value[6])) << 8) | uint32_t(uint8_t(value[7]));
-				//de-xor addr:
-				addr = addr ^ 0x2112A442;
-
-				struct sockaddr_in ret;
-				memset(&ret, '\0', sizeof(ret));
-				ret.sin_family = AF_INET;
-				ret.sin_port = htons(port);
-				ret.sin_addr.s_addr = htonl(addr);
-
-				return ret;
-			} else if (value.size() == 20) {
-				//ipv6 version
-				throw std::runtime_error("Error: XOR-MAPPED-ADDRESS for ipv6 (wanted ipv4).");
-			} else {
-				throw std::runtime_error("Error: XOR-MAPPED-ADDRESS of invalid length.");
-			}
+				std::cout << "Keepalive interval: " << channel->keepalive->interval_ms << " ms." << std::endl;
+			};
+			channel->keepalive->probe_binding_lifetime(servers);
+			std::cout << "Keeping " << address_to_string(dest) << " alive every " << channel->keepalive->interval_ms << " ms (measuring binding lifetime)." << std::endl;
 		}
-	}
-	throw std::runtime_error("Error: no XOR-MAPPED-ADDRESS attribute.");
-}
-
-
-int main(int argc, char **argv) {
-	//create socket, make it datagram-flavored:
-	int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
-
-	if (sockfd == -1) {
-		std::cerr << "Error creating socket:\n" << strerror(errno) << std::endl;
-		return 1;
-	}
-
-	//NOTE: binding not explicitly needed but will bind as a matter of style
-	//  (and to make local firewall settings clearer)
-
-	{ //bind socket to local address:
-		struct sockaddr_in addr;
-		memset(&addr, '\0', sizeof(addr));
-		addr.sin_family = AF_INET;
-		addr.sin_port = htons(15221); //TODO: don't actually care about port (will discover from server)
-		addr.sin_addr.s_addr = INADDR_ANY;
-
-		int ret = bind(sockfd, reinterpret_cast< const sockaddr * >(&addr), sizeof(addr));
-		if (ret != 0) {
-			std::cerr << "Error binding socket:\n" << strerror(errno) << "\n (will continue anyway, with what I can only assume will be an different port number.)" << std::endl;
+	};
+
+	std::unique_ptr< ICEAgent > ice;
+	if (ice_mode) {
+		//gather candidates, swap descriptions with the peer (by copy + paste), then let the checks find a path:
+		ice.reset(new ICEAgent(*channel));
+		bool gathered = false;
+		ice->gather([&]() { gathered = true; });
+		while (!gathered) {
+			loop.run_once();
 		}
-	}
-
-	bool have_self_addr = false;
-	struct sockaddr_in self_addr;
-
-	{ //use STUN protocol to figure out public host/port.
-		std::string node = "stun.stunprotocol.org"; //<-- should be configurable
-		struct addrinfo *res = nullptr;
-
-		struct addrinfo hints;
-		memset(&hints, '\0', sizeof(hints));
-
-		hints.ai_family = AF_INET;
-		hints.ai_socktype = SOCK_DGRAM;
-		hints.ai_protocol = IPPROTO_UDP; //or '0' for "don't care"
-
-		int ret = getaddrinfo(node.c_str(), "3478", &hints, &res);
-
-		if (ret != 0) {
-			std::cerr << "Error from getaddrinfo:\n" << gai_strerror(ret) << std::endl;
-			return 1;
-		}
-
-
-		//loop through all of the returned options:
-		for (struct addrinfo *option = res; option; option = option->ai_next) {
-			assert(option->ai_family == AF_INET);
-			assert(option->ai_socktype == SOCK_DGRAM);
-			assert(option->ai_protocol == IPPROTO_UDP);
-			assert(option->ai_addrlen == sizeof(struct sockaddr_in));
-			const struct sockaddr_in &stun_addr = *reinterpret_cast< const struct sockaddr_in * >(option->ai_addr);
-			std::cout << "Server option " << inet_ntoa(stun_addr.sin_addr) << ":" << ntohs(stun_addr.sin_port) << std::endl;
-
-			//Create a (random) transaction ID:
-			uint32_t id[3];
-			static std::random_device rd; //NOTE: watch out for determinism here? (e.g., could xor microseconds from clock)
-			id[0] = rd();
-			id[1] = rd();
-			id[2] = rd();
-
-
-			//Build STUN message:
-
-			std::string message;
-
-			{ //add 'SOFTWARE' attribute to body:
-				std::string value = "TCHOW STUN Test";
-				uint16_t type = htons(0x8022);
-				uint16_t length = htons(value.size());
-				message += std::string(reinterpret_cast< const char * >(&type), 2);
-				message += std::string(reinterpret_cast< const char * >(&length), 2);
-				message += value;
-				while (message.size() % 4) message += '\0';
-			}
-
-			//add header to message:
-			struct STUNHeader {
-				uint16_t type;
-				uint16_t length;
-				uint32_t cookie;
-				uint32_t id[3];
-			} __attribute__((packed));
-			STUNHeader header;
-			static_assert( sizeof(header) == 20, "header is packed.");
-
-			header.type = htons(0x0001); //class 'request' (b00) method 'Binding' (b00..01)
-			header.length = htons(message.size());
-			header.cookie = htonl(0x2112A442);
-			header.id[0] = id[0];
-			header.id[1] = id[1];
-			header.id[2] = id[2];
-
-			message = std::string(reinterpret_cast< const char * >(&header), sizeof(header)) + message;
-
-			//STUN request message is.... ready?
-
-			ssize_t sent = sendto(sockfd, message.data(), message.size(), 0, reinterpret_cast< const sockaddr * >(&stun_addr), sizeof(stun_addr));
-
-			if (sent < 0) {
-				assert(sent == -1);
-				std::cout << "Error sending message '" << message << "':\n" << strerror(errno) << std::endl;
-				//NOTE: continue trying to send *other* messages
-			} else { assert((size_t)sent == message.size());
-				std::cout << "Sent message:\n";
-				dump_stun_message(message);
+		std::cout << "Give this line to the other side:\n" << ice->description() << "\nThen paste theirs here:" << std::endl;
+
+		std::string line;
+		loop.watch(STDIN_FILENO, EPOLLIN, [&](uint32_t) {
+			char buf[4096];
+			ssize_t got = read(STDIN_FILENO, buf, sizeof(buf));
+			if (got <= 0) {
+				loop.unwatch(STDIN_FILENO);
+				return;
 			}
-
-			//wait for response:
-			while (true) { //<-- should be finite number of retries
-				//TODO: use select() so can wait with timeout
-				struct sockaddr_in src_addr;
-				memset(&src_addr, '\0', sizeof(src_addr)); //<-- not really needed, I'd expect
-				socklen_t addrlen = sizeof(src_addr);
-
-				static uint8_t buf[MAX_DATA_SIZE];
-
-				std::cout << "Waiting for message..." << std::endl;
-				ssize_t got = recvfrom(sockfd, &buf, sizeof(buf), 0, reinterpret_cast< sockaddr * >(&src_addr), &addrlen);
-
-				if (got < 0) {
-					assert(got == -1); //other negative results not specified behavior
-					//message... not received?
-					std::cerr << "Error recvfrom'ing:\n" << strerror(errno) << std::endl;
-					sleep(1);
-				} else { assert(got >= 0); //only remaining option
-					//message received!
-					if ((size_t)got > sizeof(buf)) {
-						got = sizeof(buf);
-						std::cout << "NOTE: some bytes discarded." << std::endl;
-					}
-					std::cout << "Got message from " << inet_ntoa(src_addr.sin_addr) << ":" << ntohs(src_addr.sin_port) << ":\n";
-					dump_stun_message(std::string(buf, buf + got));
-
-					try {
-						self_addr = get_mapped_address(std::string(buf, buf + got), id);
-						have_self_addr = true;
-						break;
-					} catch (std::exception &e) {
-						std::cout << "Error parsing message: " << e.what() << std::endl;
-						//TODO: retry? next server?
-					}
+			line.append(buf, buf + got);
+			size_t newline = line.find('\n');
+			if (newline == std::string::npos) return;
+			loop.unwatch(STDIN_FILENO);
+			uint64_t started = EventLoop::now();
+			char const *err = ice->connect(line.substr(0, newline), [&, started](ICEAgent::Result const &result) {
+				if (!result.ok) {
+					std::cout << "ICE failed: " << result.error << std::endl;
+					return;
 				}
-			}
-
-			if (have_self_addr) break; //no need to keep asking
-		}
-
-		freeaddrinfo(res);
-
-	}
-	if (have_self_addr) {
-		std::cout << "Local Address: " << inet_ntoa(self_addr.sin_addr) << ":" << ntohs(self_addr.sin_port) << std::endl;
-	} else {
-		std::cout << "Error: Was unable to determine local address." << std::endl;
-		return 1;
-	}
-
-	//(Should now be able to sendto and recvfrom on the socket.)
-
-	if (argc >= 3) {
+				static char const *types[] = {"host", "server-reflexive", "peer-reflexive"};
+				std::cout << "Connected to " << address_to_string(result.remote) << " (" << types[result.remote_type] << ", "
+					<< (ice->controlling ? "controlling" : "controlled") << ") after " << (EventLoop::now() - started) << " ms." << std::endl;
+				send_messages(result.remote, 0);
+			});
+			if (err) std::cout << "Bad ICE description: " << err << std::endl;
+		});
+	} else if (args.size() >= 2) {
 		//send message(s) to specified place before waiting for messages
 
-		//TODO: consider getaddrinfo(!)
-		struct sockaddr_in dest_addr;
-		memset(&dest_addr, '\0', sizeof(dest_addr));
-		dest_addr.sin_family = AF_INET;
-		dest_addr.sin_port = htons(atoi(argv[2]));
-		dest_addr.sin_addr.s_addr = inet_addr(argv[1]);
-
-		if (dest_addr.sin_addr.s_addr == INADDR_NONE) {
-			std::cout << "Invalid ip address: '" << argv[1] << "'" << std::endl;
+		int port = atoi(args[1].c_str());
+		if (port <= 0 || port > 65535) {
+			std::cout << "Invalid port: '" << args[1] << "'" << std::endl;
 			return 1;
 		}
-
-		std::cout << "Sending some messages to " << inet_ntoa(dest_addr.sin_addr) << ":" << ntohs(dest_addr.sin_port) << " :" << std::endl;
-
-		for (int a = 3; a < argc; ++a) {
-			std::string buf = argv[a];
-			ssize_t sent = sendto(sockfd, buf.data(), buf.size(), 0, reinterpret_cast< const sockaddr * >(&dest_addr), sizeof(dest_addr));
-
-			if (sent < 0) {
-				assert(sent == -1);
-				std::cout << "Error sending message '" << buf << "':\n" << strerror(errno) << std::endl;
-				//NOTE: continue trying to send *other* messages
-			} else { assert((size_t)sent == buf.size());
-				std::cout << "Sent message '" << buf << "'." << std::endl;
+		dns.resolve(args[0], AF_INET, [&, port](DNSResolver::Result const &result) {
+			if (!result.ok) {
+				std::cout << "Couldn't look up '" << args[0] << "': " << result.error << std::endl;
+				return;
 			}
-		}
-
+			struct sockaddr_storage dest = result.addresses[0];
+			reinterpret_cast< struct sockaddr_in & >(dest).sin_port = htons(uint16_t(port));
+			send_messages(dest, 2);
+		});
 	}
 
 	std::cout << "Socket bound and stuff." << std::endl;
-	while (true) {
-		struct sockaddr_in src_addr;
-		memset(&src_addr, '\0', sizeof(src_addr)); //<-- not really needed, I'd expect
-		socklen_t addrlen = sizeof(src_addr);
-
-		static uint8_t buf[MAX_DATA_SIZE];
-
-		std::cout << "Waiting for message..." << std::endl;
-		ssize_t got = recvfrom(sockfd, &buf, sizeof(buf), 0, reinterpret_cast< sockaddr * >(&src_addr), &addrlen);
-
-		if (got < 0) {
-			assert(got == -1); //other negative results not specified behavior
-			//message... not received?
-			std::cerr << "Error recvfrom'ing:\n" << strerror(errno) << std::endl;
-			sleep(1);
-		} else { assert(got >= 0); //only remaining option
-			//message received!
-			if ((size_t)got > sizeof(buf)) {
-				got = sizeof(buf);
-				std::cout << "NOTE: some bytes discarded." << std::endl;
+	uint64_t received = 0;
+	//one PeerChannel per sender, all sharing this socket (and its mapped address):
+	constexpr size_t MaxPeers = 4096;
+	std::vector< std::unique_ptr< PeerChannel > > peers;
+	channel->enable_demux();
+	channel->demux->on_new_peer = [&](struct sockaddr_storage const &from, uint32_t connection_id, uint8_t const *, size_t) {
+		if (peers.size() >= MaxPeers) return; //<-- (dropped)
+		peers.emplace_back(new PeerChannel(*channel->demux, from, connection_id));
+		PeerChannel *peer = peers.back().get();
+		peer->on_receive = [&, peer](uint8_t const *data, size_t size) {
+			received += 1;
+			//(no flush per message; stdout is flushed once per loop turn, below)
+			if (verbose) std::cout << "Got message from " << address_to_string(peer->address) << ":\n" << std::string(data, data + size) << '\n';
+		};
+		if (verbose) std::cout << "New peer: " << address_to_string(from) << '\n';
+	};
+
+	//once a second: report (quietly) + export metrics:
+	uint64_t reported = 0;
+	std::function< void() > tick = [&]() {
+		if (!verbose && received != reported) {
+			std::cout << "Received " << (received - reported) << " message(s) (" << received << " total, from " << peers.size() << " peer(s))." << std::endl;
+		}
+		reported = received;
+		if (!metrics_file.empty()) {
+			try {
+				metrics.export_to(metrics_file);
+			} catch (std::exception &e) {
+				std::cerr << e.what() << std::endl;
 			}
-			std::cout << "Got message from " << inet_ntoa(src_addr.sin_addr) << ":" << ntohs(src_addr.sin_port) << ":\n" << std::string(buf, buf + got) << std::endl;
 		}
+		loop.after(1000, tick);
+	};
+	tick();
+
+	while (!loop.stopped) {
+		loop.run_once();
+		if (verbose) std::cout.flush();
 	}
 
 }
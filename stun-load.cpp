@@ -0,0 +1,292 @@
+/*
+ * STUN load generator / latency benchmark.
+ *
+ * Opens N sockets (N simulated clients) and fires Binding requests at a
+ * target server at a fixed total rate, round-robin across the sockets.
+ * Responses are matched back to requests by transaction id; each request
+ * is sent once (no retransmits) so loss shows up as timeouts.
+ *
+ * Prints one JSON object on stdout (request counts, achieved rate, and the
+ * RTT distribution) so results can be tracked across commits; a short
+ * human-readable summary goes to stderr.
+ *
+ * usage: stun-load [options] host[:port]
+ *   --clients N     number of sockets (default 64)
+ *   --rate R        total requests per second; 0 = as fast as the window allows (default 10000)
+ *   --window W      max requests outstanding (default 65536)
+ *   --duration S    seconds of sending (default 10)
+ *   --timeout MS    how long to wait for each response (default 1000)
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <netdb.h>
+
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "Histogram.hpp"
+#include "STUN.hpp"
+
+static uint64_t now_ns() {
+	return std::chrono::duration_cast< std::chrono::nanoseconds >(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//Requests are tracked in a ring indexed by sequence number, which is also stamped into the transaction id:
+struct Outstanding {
+	uint64_t seq = ~uint64_t(0);
+	uint64_t sent_ns = 0;
+	bool pending = false;
+};
+
+int main(int argc, char **argv) {
+	uint32_t clients = 64;
+	uint64_t rate = 10000;
+	uint64_t window = 65536;
+	double duration = 10.0;
+	uint32_t timeout_ms = 1000;
+	std::string target;
+
+	for (int a = 1; a < argc; ++a) {
+		std::string arg = argv[a];
+		if (arg == "--clients" && a + 1 < argc) clients = std::stoul(argv[++a]);
+		else if (arg == "--rate" && a + 1 < argc) rate = std::stoull(argv[++a]);
+		else if (arg == "--window" && a + 1 < argc) window = std::stoull(argv[++a]);
+		else if (arg == "--duration" && a + 1 < argc) duration = std::stod(argv[++a]);
+		else if (arg == "--timeout" && a + 1 < argc) timeout_ms = std::stoul(argv[++a]);
+		else if (arg.substr(0,2) != "--" && target.empty()) target = arg;
+		else {
+			target.clear();
+			break;
+		}
+	}
+	if (target.empty() || clients == 0 || window == 0) {
+		std::cerr << "Usage:\n\t" << argv[0] << " [--clients N] [--rate R] [--window W] [--duration S] [--timeout MS] host[:port]" << std::endl;
+		return 1;
+	}
+
+	//------ resolve target ------
+	struct sockaddr_storage server;
+	socklen_t server_len = 0;
+	{
+		std::string host = target, port = "3478";
+		size_t colon = target.rfind(':');
+		if (colon != std::string::npos && target.find(':') == colon) {
+			host = target.substr(0, colon);
+			port = target.substr(colon + 1);
+		}
+		struct addrinfo hints;
+		memset(&hints, '\0', sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_DGRAM;
+		hints.ai_protocol = IPPROTO_UDP;
+		struct addrinfo *res = nullptr;
+		int ret = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+		if (ret != 0) {
+			std::cerr << "Error from getaddrinfo:\n" << gai_strerror(ret) << std::endl;
+			return 1;
+		}
+		memset(&server, '\0', sizeof(server));
+		memcpy(&server, res->ai_addr, res->ai_addrlen);
+		server_len = res->ai_addrlen;
+		freeaddrinfo(res);
+	}
+
+	//------ sockets ------
+	int epoll_fd = epoll_create1(0);
+	std::vector< int > sockets;
+	for (uint32_t c = 0; c < clients; ++c) {
+		int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
+		if (sockfd == -1) {
+			std::cerr << "Error creating socket:\n" << strerror(errno) << std::endl;
+			return 1;
+		}
+		//connect() so the kernel filters out anything not from the server:
+		if (connect(sockfd, reinterpret_cast< const sockaddr * >(&server), server_len) != 0) {
+			std::cerr << "Error connecting socket:\n" << strerror(errno) << std::endl;
+			return 1;
+		}
+		struct epoll_event ev;
+		memset(&ev, '\0', sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = c;
+		epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sockfd, &ev);
+		sockets.emplace_back(sockfd);
+	}
+
+	//------ state ------
+	uint64_t ring_size = 1;
+	while (ring_size < 4 * window) ring_size *= 2; //<-- slack, since slots free up in order but responses don't arrive in order
+	std::vector< Outstanding > ring(ring_size);
+	uint64_t const ring_mask = ring_size - 1;
+
+	uint32_t salt = std::random_device()(); //<-- first word of every transaction id, to reject strays
+
+	uint64_t sent = 0, send_errors = 0, received = 0, timeouts = 0, late = 0, malformed = 0;
+	uint64_t next_seq = 0; //next request to send
+	uint64_t expire_seq = 0; //oldest request that might still be pending
+	uint64_t outstanding = 0;
+	Histogram rtt_us;
+
+	STUNBindingRequestTemplate request_template("stun-load");
+	uint64_t const timeout_ns = uint64_t(timeout_ms) * 1000000ULL;
+
+	//expire requests that have waited too long ('force' expires the single oldest request, regardless):
+	auto expire = [&](uint64_t now, bool force) {
+		while (expire_seq < next_seq) {
+			Outstanding &o = ring[expire_seq & ring_mask];
+			if (o.pending) {
+				if (!force && now - o.sent_ns < timeout_ns) break;
+				o.pending = false;
+				timeouts += 1;
+				outstanding -= 1;
+			}
+			expire_seq += 1;
+			if (force) break;
+		}
+	};
+
+	constexpr uint32_t Batch = 32;
+	uint8_t buffers[Batch][512];
+	struct iovec iovs[Batch];
+	struct mmsghdr msgs[Batch];
+
+	auto receive = [&](int sockfd, uint64_t now) {
+		while (true) {
+			for (uint32_t i = 0; i < Batch; ++i) {
+				iovs[i].iov_base = buffers[i];
+				iovs[i].iov_len = sizeof(buffers[i]);
+				memset(&msgs[i].msg_hdr, '\0', sizeof(msgs[i].msg_hdr));
+				msgs[i].msg_hdr.msg_iov = &iovs[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+			int got = recvmmsg(sockfd, msgs, Batch, MSG_DONTWAIT, nullptr);
+			if (got <= 0) return;
+			for (int i = 0; i < got; ++i) {
+				STUNMessageView msg(buffers[i], msgs[i].msg_len);
+				STUNAttribute attr;
+				if (msg.error || msg.type() != STUN_BINDING_RESPONSE || !msg.find(STUN_ATTR_XOR_MAPPED_ADDRESS, &attr) || stun_read_u32(msg.transaction_id()) != salt) {
+					malformed += 1;
+					continue;
+				}
+				uint64_t seq = (uint64_t(stun_read_u32(msg.transaction_id() + 4)) << 32) | stun_read_u32(msg.transaction_id() + 8);
+				Outstanding &o = ring[seq & ring_mask];
+				if (o.seq != seq || !o.pending) {
+					late += 1; //duplicate, or arrived after its timeout
+					continue;
+				}
+				o.pending = false;
+				outstanding -= 1;
+				received += 1;
+				rtt_us.record((now - o.sent_ns) / 1000);
+			}
+			if (got < int(Batch)) return;
+		}
+	};
+
+	uint64_t start = now_ns();
+	uint64_t const send_until = start + uint64_t(duration * 1e9);
+	uint8_t request[STUNBindingRequestTemplate::Capacity];
+
+	while (true) {
+		uint64_t now = now_ns();
+
+		//------ send (paced) ------
+		if (now < send_until) {
+			uint64_t target_sent = (rate ? uint64_t(double(now - start) * 1e-9 * double(rate)) + 1 : ~uint64_t(0));
+			for (uint32_t burst = 0; sent + send_errors < target_sent && burst < 1024; ++burst) {
+				if (outstanding >= window) break; //<-- wait for responses (shows up as a shortfall in achieved rate)
+				if (next_seq - expire_seq >= ring_size) break; //<-- ring slot still held by an old (unexpired) request
+				uint64_t seq = next_seq++;
+				uint32_t id[3];
+				stun_write_u32(reinterpret_cast< uint8_t * >(&id[0]), salt);
+				stun_write_u32(reinterpret_cast< uint8_t * >(&id[1]), uint32_t(seq >> 32));
+				stun_write_u32(reinterpret_cast< uint8_t * >(&id[2]), uint32_t(seq));
+				size_t size = request_template.stamp(request, id);
+
+				Outstanding &o = ring[seq & ring_mask];
+				o.seq = seq;
+				o.sent_ns = now;
+				ssize_t ret = send(sockets[seq % clients], request, size, 0);
+				if (ret < 0) {
+					send_errors += 1;
+					o.pending = false;
+				} else {
+					sent += 1;
+					o.pending = true;
+					outstanding += 1;
+				}
+			}
+		} else if (outstanding == 0 || now > send_until + timeout_ns) {
+			break;
+		}
+
+		//------ receive ------
+		struct epoll_event events[64];
+		int wait_ms = 1;
+		if (now < send_until && outstanding < window) {
+			//wake up in time for the next paced send:
+			uint64_t next_due = (rate ? start + uint64_t(double(sent + send_errors) * 1e9 / double(rate)) : now);
+			if (next_due <= now_ns()) wait_ms = 0;
+		}
+		int got = epoll_wait(epoll_fd, events, 64, wait_ms);
+		now = now_ns();
+		for (int i = 0; i < got; ++i) {
+			receive(sockets[events[i].data.u32], now);
+		}
+
+		expire(now, false);
+	}
+	//anything still outstanding has timed out:
+	while (outstanding) expire(0, true);
+
+	double elapsed = double(std::min(now_ns(), send_until) - start) * 1e-9;
+
+	//------ report ------
+	std::cout << "{\"target\":\"" << target << "\""
+	          << ",\"clients\":" << clients
+	          << ",\"duration_s\":" << elapsed
+	          << ",\"rate_requested\":" << rate
+	          << ",\"rate_achieved\":" << uint64_t(double(sent) / elapsed)
+	          << ",\"sent\":" << sent
+	          << ",\"send_errors\":" << send_errors
+	          << ",\"received\":" << received
+	          << ",\"timeouts\":" << timeouts
+	          << ",\"late\":" << late
+	          << ",\"malformed\":" << malformed
+	          << ",\"rtt_us\":{"
+	          << "\"min\":" << (rtt_us.total ? rtt_us.min : 0)
+	          << ",\"mean\":" << rtt_us.mean()
+	          << ",\"p50\":" << rtt_us.percentile(0.50)
+	          << ",\"p90\":" << rtt_us.percentile(0.90)
+	          << ",\"p99\":" << rtt_us.percentile(0.99)
+	          << ",\"p999\":" << rtt_us.percentile(0.999)
+	          << ",\"max\":" << rtt_us.max
+	          << "},\"rtt_histogram_us\":[";
+	bool first = true;
+	for (uint32_t b = 0; b < Histogram::Buckets; ++b) {
+		if (rtt_us.counts[b] == 0) continue;
+		if (!first) std::cout << ",";
+		first = false;
+		std::cout << "[" << Histogram::bucket_low(b) << "," << Histogram::bucket_high(b) << "," << rtt_us.counts[b] << "]";
+	}
+	std::cout << "]}" << std::endl;
+
+	std::cerr << "sent " << sent << " (" << uint64_t(double(sent) / elapsed) << "/sec), received " << received
+	          << ", timeouts " << timeouts << ", late " << late << ", malformed " << malformed
+	          << "; rtt p50 " << rtt_us.percentile(0.50) << "us p99 " << rtt_us.percentile(0.99) << "us p999 " << rtt_us.percentile(0.999) << "us" << std::endl;
+
+	for (int sockfd : sockets) close(sockfd);
+	close(epoll_fd);
+	return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * STUN binding responder. Answers Binding requests with XOR-MAPPED-ADDRESS
+ * (ipv4 or ipv6) + FINGERPRINT. Meant for self-hosting and for load testing
+ * without a network.
+ *
+ * One SO_REUSEPORT socket (and one thread, pinned to a core) per worker.
+ * Each worker receives a batch of requests with recvmmsg(), rewrites every
+ * request into its response in the same buffer, and sends the whole batch
+ * back with sendmmsg(). Throughput is reported once per second.
+ *
+ * usage: stun-server [port [threads]]
+ *   port defaults to 3478, threads to the number of cores.
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <iostream>
+#include <cstring>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "STUN.hpp"
+
+constexpr uint32_t BATCH_SIZE = 64; //datagrams per recvmmsg / sendmmsg
+constexpr size_t BUFFER_SIZE = 2048; //<-- binding requests are small; anything bigger gets truncated + dropped
+
+static std::atomic< bool > running(true);
+
+static void handle_signal(int) {
+	running = false;
+}
+
+struct alignas(64) WorkerStats {
+	std::atomic< uint64_t > requests{0};
+	std::atomic< uint64_t > responses{0};
+	std::atomic< uint64_t > dropped{0};
+};
+
+//Make a (dual-stack if possible) SO_REUSEPORT socket bound to 'port':
+static int make_socket(uint16_t port) {
+	int sockfd = socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+	bool ipv6 = (sockfd != -1);
+	if (!ipv6) sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sockfd == -1) {
+		std::cerr << "Error creating socket:\n" << strerror(errno) << std::endl;
+		return -1;
+	}
+
+	int one = 1;
+	int zero = 0;
+	if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) != 0) {
+		std::cerr << "Error setting SO_REUSEPORT:\n" << strerror(errno) << std::endl;
+		close(sockfd);
+		return -1;
+	}
+	if (ipv6) setsockopt(sockfd, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)); //<-- also accept ipv4
+
+	//wake up periodically to notice shutdown:
+	struct timeval timeout;
+	timeout.tv_sec = 0;
+	timeout.tv_usec = 200000;
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+	int ret;
+	if (ipv6) {
+		struct sockaddr_in6 addr;
+		memset(&addr, '\0', sizeof(addr));
+		addr.sin6_family = AF_INET6;
+		addr.sin6_port = htons(port);
+		addr.sin6_addr = in6addr_any;
+		ret = bind(sockfd, reinterpret_cast< const sockaddr * >(&addr), sizeof(addr));
+	} else {
+		struct sockaddr_in addr;
+		memset(&addr, '\0', sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = INADDR_ANY;
+		ret = bind(sockfd, reinterpret_cast< const sockaddr * >(&addr), sizeof(addr));
+	}
+	if (ret != 0) {
+		std::cerr << "Error binding socket:\n" << strerror(errno) << std::endl;
+		close(sockfd);
+		return -1;
+	}
+	return sockfd;
+}
+
+//ipv4 clients of a dual-stack socket show up as ::ffff:a.b.c.d; report them as plain ipv4:
+static void unmap_v4(struct sockaddr_storage &addr) {
+	if (addr.ss_family != AF_INET6) return;
+	struct sockaddr_in6 in6 = reinterpret_cast< struct sockaddr_in6 & >(addr);
+	if (!IN6_IS_ADDR_V4MAPPED(&in6.sin6_addr)) return;
+	struct sockaddr_in &in = reinterpret_cast< struct sockaddr_in & >(addr);
+	memset(&in, '\0', sizeof(in));
+	in.sin_family = AF_INET;
+	in.sin_port = in6.sin6_port;
+	memcpy(&in.sin_addr, &in6.sin6_addr.s6_addr[12], 4);
+}
+
+static void worker(int sockfd, uint32_t core, WorkerStats *stats) {
+	{ //pin to core (best-effort):
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(core, &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	static thread_local uint8_t buffers[BATCH_SIZE][BUFFER_SIZE];
+	struct sockaddr_storage addrs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	struct mmsghdr msgs[BATCH_SIZE];
+	struct mmsghdr replies[BATCH_SIZE];
+	struct iovec reply_iovs[BATCH_SIZE];
+
+	while (running) {
+		for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+			iovs[i].iov_base = buffers[i];
+			iovs[i].iov_len = BUFFER_SIZE;
+			memset(&msgs[i].msg_hdr, '\0', sizeof(msgs[i].msg_hdr));
+			msgs[i].msg_hdr.msg_name = &addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		//block for the first datagram, then take whatever else is already queued:
+		int got = recvmmsg(sockfd, msgs, BATCH_SIZE, MSG_WAITFORONE, nullptr);
+		if (got <= 0) continue; //timeout (check 'running') or transient error
+
+		uint32_t count = 0;
+		for (int i = 0; i < got; ++i) {
+			if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+			struct sockaddr_storage from = addrs[i];
+			unmap_v4(from);
+			size_t size = stun_binding_response_in_place(buffers[i], msgs[i].msg_len, BUFFER_SIZE, from);
+			if (size == 0) continue;
+
+			reply_iovs[count].iov_base = buffers[i];
+			reply_iovs[count].iov_len = size;
+			memset(&replies[count].msg_hdr, '\0', sizeof(replies[count].msg_hdr));
+			replies[count].msg_hdr.msg_name = &addrs[i]; //<-- original (possibly v4-mapped) address, right for this socket
+			replies[count].msg_hdr.msg_namelen = msgs[i].msg_hdr.msg_namelen;
+			replies[count].msg_hdr.msg_iov = &reply_iovs[count];
+			replies[count].msg_hdr.msg_iovlen = 1;
+			count += 1;
+		}
+
+		uint32_t sent = 0;
+		while (sent < count) {
+			int ret = sendmmsg(sockfd, replies + sent, count - sent, 0);
+			if (ret <= 0) break; //NOTE: drop rest of batch rather than spin
+			sent += ret;
+		}
+
+		stats->requests.fetch_add(got, std::memory_order_relaxed);
+		stats->responses.fetch_add(sent, std::memory_order_relaxed);
+		stats->dropped.fetch_add(got - sent, std::memory_order_relaxed);
+	}
+}
+
+//parse a whole decimal argument in [min, max] into *out; false if it isn't one:
+static bool parse_argument(char const *arg, unsigned long min, unsigned long max, unsigned long *out) {
+	char *end = nullptr;
+	errno = 0;
+	unsigned long value = std::strtoul(arg, &end, 10);
+	if (end == arg || *end != '\0' || errno == ERANGE || arg[0] == '-' || value < min || value > max) return false;
+	*out = value;
+	return true;
+}
+
+constexpr unsigned long MAX_THREADS = 1024; //(one socket + pinned thread each; far past any core count)
+
+int main(int argc, char **argv) {
+	unsigned long port = 3478;
+	unsigned long threads = std::max(1U, std::thread::hardware_concurrency());
+	if (argc > 3
+	 || (argc >= 2 && !parse_argument(argv[1], 1, 65535, &port))
+	 || (argc >= 3 && !parse_argument(argv[2], 1, MAX_THREADS, &threads))) {
+		std::cerr << "usage: stun-server [port [threads]]\n  port: 1-65535 (default 3478); threads: 1-" << MAX_THREADS << " (default: the number of cores)" << std::endl;
+		return 1;
+	}
+
+	signal(SIGINT, handle_signal);
+	signal(SIGTERM, handle_signal);
+
+	std::vector< WorkerStats > stats(threads);
+	std::vector< int > sockets;
+	for (uint32_t t = 0; t < threads; ++t) {
+		int sockfd = make_socket(uint16_t(port));
+		if (sockfd == -1) return 1;
+		sockets.emplace_back(sockfd);
+	}
+
+	std::vector< std::thread > workers;
+	uint32_t cores = std::max(1U, std::thread::hardware_concurrency());
+	for (uint32_t t = 0; t < threads; ++t) {
+		workers.emplace_back(worker, sockets[t], t % cores, &stats[t]);
+	}
+
+	std::cout << "Answering STUN binding requests on port " << port << " with " << threads << " thread(s)." << std::endl;
+
+	uint64_t last_responses = 0;
+	auto last = std::chrono::steady_clock::now();
+	while (running) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		uint64_t requests = 0, responses = 0, dropped = 0;
+		for (auto const &s : stats) {
+			requests += s.requests.load(std::memory_order_relaxed);
+			responses += s.responses.load(std::memory_order_relaxed);
+			dropped += s.dropped.load(std::memory_order_relaxed);
+		}
+		auto now = std::chrono::steady_clock::now();
+		double seconds = std::chrono::duration< double >(now - last).count();
+		if (responses != last_responses) {
+			std::cout << uint64_t((responses - last_responses) / seconds) << " responses/sec"
+			          << " (total: " << requests << " requests, " << responses << " responses, " << dropped << " dropped)" << std::endl;
+		}
+		last_responses = responses;
+		last = now;
+	}
+
+	for (auto &w : workers) w.join();
+	for (int sockfd : sockets) close(sockfd);
+
+	return 0;
+}
@@ -0,0 +1,400 @@
+/*
+ * UDP data path benchmark: DatagramChannel's default one-syscall-per-datagram
+ * path (sendto / recvfrom) vs. its batched path (sendmmsg / recvmmsg), the
+ * batched path with UDP GSO / GRO offload (if the kernel has it), the
+ * io_uring backend, the batched path with small messages packed into
+ * MTU-sized datagrams (MessagePacker), and the batched path receiving into a
+ * PacketPool and handing each datagram to a worker thread through an
+ * SPSCRing (the worker reads it, then releases the buffer), and the batched
+ * path with every datagram sealed / opened (PacketCrypto: AES-128-GCM, if
+ * the CPU has AES-NI, then ChaCha20-Poly1305).
+ *
+ * Two channels on one EventLoop bounce bursts of datagrams over loopback;
+ * reports packets (messages, when packed) per second, CPU time (user +
+ * system) per packet, where each packet is counted once but costs a send *and*
+ * a receive, and payload bytes per CPU-second (i.e., per core).
+ *
+ * Then a ShardedListener (one SO_REUSEPORT socket + thread per core) taking
+ * the same load from many peers, reporting how peers were spread over shards
+ * (and whether each landed where shard_for() said it would).
+ *
+ * Then one socket serving many peers through a PeerDemux: each peer (its
+ * own socket) gets its own PeerChannel on the receiver -- half routed by
+ * source address, half by connection ID -- reporting the same rates, and
+ * whether any datagram reached the wrong PeerChannel.
+ *
+ * Then, per backend, latency: one datagram at a time bounced back and forth
+ * (each hop through the EventLoop), reporting round-trip percentiles.
+ *
+ * usage: udp-bench [packets [size [batch]]]
+ *   defaults: 1000000 packets of 64 bytes, batches of 32
+ *   (offload shows best with bulk-sized packets: e.g., udp-bench 1000000 1400 64)
+ */
+
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <time.h>
+
+#include <iostream>
+#include <atomic>
+#include <cstring>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "DatagramChannel.hpp"
+#include "EventLoop.hpp"
+#include "Histogram.hpp"
+#include "MessagePacker.hpp"
+#include "PacketCrypto.hpp"
+#include "PacketPool.hpp"
+#include "PeerDemux.hpp"
+#include "SPSCRing.hpp"
+#include "ShardedListener.hpp"
+
+static double cpu_seconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return double(ts.tv_sec) + double(ts.tv_nsec) * 1e-9;
+}
+
+enum Mode { Plain, Batched, Offload, Ring, Packed, Pooled, Sealed, SealedChaCha };
+
+static void run(std::string const &name, Mode mode, uint64_t packets, size_t size, uint32_t batch) {
+	EventLoop loop;
+	DatagramChannel::Backend backend = (mode == Ring ? DatagramChannel::IOUringBackend : DatagramChannel::SyscallBackend);
+	DatagramChannel sender(loop, 0, backend);
+	DatagramChannel receiver(loop, 0, backend);
+	bool batched = (mode != Plain && mode != Ring);
+	bool packed = (mode == Packed);
+	bool sealed = (mode == Sealed || mode == SealedChaCha);
+	if (batched) {
+		size_t max_datagram = (packed ? 2048 : size + (sealed ? PacketCrypto::Overhead : 0));
+		sender.enable_batching(batch, max_datagram);
+		receiver.enable_batching(batch, max_datagram);
+	}
+	if (mode == Offload) {
+		sender.enable_offload();
+		receiver.enable_offload();
+		if (!sender.gso && !receiver.gro) {
+			std::cout << name << ": not supported by this kernel." << std::endl;
+			return;
+		}
+	}
+	if (packed) {
+		sender.enable_packing();
+		receiver.enable_packing();
+	}
+	if (sealed) {
+		std::string secret = "udp-bench";
+		for (DatagramChannel *channel : {&sender, &receiver}) {
+			channel->enable_encryption();
+			if (mode == SealedChaCha) channel->crypto->cipher = ChaCha20Poly1305;
+			channel->crypto->set_secret(reinterpret_cast< uint8_t const * >(secret.data()), secret.size());
+		}
+	}
+
+	struct sockaddr_storage to = receiver.local_address();
+	reinterpret_cast< struct sockaddr_in & >(to).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	uint64_t received = 0;
+	receiver.on_receive = [&](struct sockaddr_storage const &, uint8_t const *, size_t) {
+		received += 1;
+	};
+
+	//pooled: buffers go to a worker, which touches every byte (so the handoff isn't free) and releases them:
+	std::unique_ptr< PacketPool > pool;
+	std::unique_ptr< SPSCRing< PacketBuffer * > > handoff;
+	std::atomic< bool > working(true);
+	std::atomic< uint64_t > worked(0), checksum(0);
+	uint64_t handoff_drops = 0;
+	std::thread worker;
+	if (mode == Pooled) {
+		pool.reset(new PacketPool(4096, uint32_t(size)));
+		handoff.reset(new SPSCRing< PacketBuffer * >(2048));
+		receiver.enable_packet_pool(*pool);
+		receiver.on_packet = [&](PacketBuffer *packet) {
+			received += 1;
+			if (!handoff->push(packet)) {
+				handoff_drops += 1;
+				packet->release();
+			}
+		};
+		worker = std::thread([&]() {
+			PacketBuffer *packet;
+			uint64_t sum = 0;
+			while (true) {
+				if (!handoff->pop(&packet)) {
+					if (!working.load()) break;
+					std::this_thread::yield();
+					continue;
+				}
+				for (uint32_t i = 0; i < packet->size; ++i) sum += packet->data()[i];
+				packet->release();
+				worked.fetch_add(1, std::memory_order_relaxed);
+			}
+			checksum = sum;
+		});
+	}
+
+	std::vector< uint8_t > payload(size, 0xab);
+	uint64_t sent = 0, send_errors = 0;
+
+	double cpu_before = cpu_seconds();
+	auto before = std::chrono::steady_clock::now();
+
+	while (sent + send_errors < packets) {
+		//one burst out...
+		uint32_t burst = uint32_t(std::min< uint64_t >(batch, packets - sent - send_errors));
+		for (uint32_t i = 0; i < burst; ++i) {
+			payload[0] = uint8_t(sent + i); //<-- (so the payload isn't entirely constant)
+			bool ok;
+			if (packed) ok = sender.packer->send(to, payload.data(), size);
+			else if (batched || mode == Ring) ok = sender.queue_to(to, payload.data(), size);
+			else ok = sender.send_to(to, payload.data(), size);
+			if (ok) sent += 1;
+			else send_errors += 1;
+		}
+		if (packed) sender.packer->flush();
+		if ((batched || mode == Ring) && !sender.flush()) send_errors += 1;
+		//...and drained back in:
+		loop.run_once(0);
+	}
+	//pick up stragglers:
+	for (uint32_t idle = 0; received < sent && idle < 10; ++idle) {
+		uint64_t was = received;
+		loop.run_once(1);
+		if (received != was) idle = 0;
+	}
+
+	if (worker.joinable()) {
+		working = false;
+		worker.join();
+	}
+	auto after = std::chrono::steady_clock::now();
+	double cpu = cpu_seconds() - cpu_before;
+	double seconds = std::chrono::duration< double >(after - before).count();
+
+	std::cout << name << ": " << uint64_t(received / seconds) << " pkts/sec, "
+	          << (cpu * 1e9 / double(received ? received : 1)) << " ns CPU/pkt, "
+	          << uint64_t(double(received * size) / (cpu > 0.0 ? cpu : 1.0) / 1e6) << " MB/CPU-sec"
+	          << " (sent " << sent << ", received " << received << ", send errors " << send_errors;
+	if (packed) std::cout << "; " << sender.packer->datagrams_sent << " datagrams, path MTU " << sender.packer->mtu(to);
+	if (mode == Offload) std::cout << "; GSO " << (sender.gso ? "on" : "off") << ", GRO " << (receiver.gro ? "on" : "off") << ", fallbacks " << sender.gso_fallbacks;
+	if (mode == Pooled) std::cout << "; worker got " << worked.load() << ", handoff drops " << handoff_drops << ", pool drops " << receiver.pool_drops;
+	if (sealed) std::cout << "; " << aead_cipher_name(sender.crypto->cipher) << ", opened " << receiver.crypto->opened << ", forged " << receiver.crypto->forged << ", replayed " << receiver.crypto->replayed;
+	if (mode == Ring) std::cout << "; direct sends " << sender.ring_direct_sends << ", ring send errors " << sender.ring_send_errors;
+	std::cout << ")" << std::endl;
+}
+
+static void sharded(std::string const &name, uint64_t packets, size_t size, uint32_t batch) {
+	ShardedListener listener(0);
+	uint32_t shards = uint32_t(listener.shards.size());
+	std::vector< std::atomic< uint64_t > > received(shards);
+	std::atomic< uint64_t > misdirected(0);
+	listener.start([&](ShardedListener::Shard &shard) {
+		shard.channel->enable_batching(batch, size);
+		shard.channel->on_receive = [&](struct sockaddr_storage const &from, uint8_t const *, size_t) {
+			received[shard.index].fetch_add(1, std::memory_order_relaxed);
+			if (listener.steered && listener.shard_for(from) != shard.index) misdirected.fetch_add(1, std::memory_order_relaxed);
+		};
+	});
+
+	//peers, each its own socket (so its own source port):
+	EventLoop loop;
+	std::vector< std::unique_ptr< DatagramChannel > > peers;
+	for (uint32_t i = 0; i < 16 * shards; ++i) {
+		peers.emplace_back(new DatagramChannel(loop));
+		peers.back()->enable_batching(batch, size);
+	}
+	struct sockaddr_storage to;
+	memset(&to, '\0', sizeof(to));
+	reinterpret_cast< struct sockaddr_in & >(to).sin_family = AF_INET;
+	reinterpret_cast< struct sockaddr_in & >(to).sin_port = htons(listener.port);
+	reinterpret_cast< struct sockaddr_in & >(to).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	auto total = [&]() {
+		uint64_t sum = 0;
+		for (auto const &r : received) sum += r.load(std::memory_order_relaxed);
+		return sum;
+	};
+
+	std::vector< uint8_t > payload(size, 0xab);
+	uint64_t sent = 0;
+	double cpu_before = cpu_seconds();
+	auto before = std::chrono::steady_clock::now();
+	for (uint32_t p = 0; sent < packets; p = (p + 1) % peers.size()) {
+		uint32_t burst = uint32_t(std::min< uint64_t >(batch, packets - sent));
+		for (uint32_t i = 0; i < burst; ++i) peers[p]->queue_to(to, payload.data(), size);
+		peers[p]->flush();
+		sent += burst;
+		//don't just overflow the shards' sockets (but don't wait forever on lost datagrams, either):
+		auto waiting = std::chrono::steady_clock::now();
+		while (sent - total() > 4 * uint64_t(batch) * shards && std::chrono::steady_clock::now() - waiting < std::chrono::milliseconds(10)) {
+			std::this_thread::yield();
+		}
+	}
+	//pick up stragglers:
+	for (uint32_t idle = 0; total() < sent && idle < 10; ++idle) {
+		uint64_t was = total();
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		if (total() != was) idle = 0;
+	}
+	auto after = std::chrono::steady_clock::now();
+	double cpu = cpu_seconds() - cpu_before;
+	double seconds = std::chrono::duration< double >(after - before).count();
+	listener.stop();
+
+	uint64_t got = total();
+	std::cout << name << " (" << shards << " shard" << (shards == 1 ? "" : "s") << ", " << peers.size() << " peers): "
+	          << uint64_t(got / seconds) << " pkts/sec, " << (cpu * 1e9 / double(got ? got : 1)) << " ns CPU/pkt"
+	          << " (sent " << sent << ", received " << got << "; per shard";
+	for (auto const &r : received) std::cout << " " << r.load();
+	if (listener.steered) std::cout << "; misdirected " << misdirected.load();
+	else if (shards > 1) std::cout << "; not steered";
+	std::cout << ")" << std::endl;
+}
+
+static void demuxed(std::string const &name, uint32_t peer_count, uint64_t packets, size_t size, uint32_t batch) {
+	EventLoop loop;
+	size_t max_datagram = size + PeerDemux::FrameHeader;
+	DatagramChannel receiver(loop);
+	receiver.enable_batching(batch, max_datagram);
+	receiver.enable_demux();
+	struct sockaddr_storage to = receiver.local_address();
+	reinterpret_cast< struct sockaddr_in & >(to).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	//payloads carry their sender's index, so each PeerChannel can check it only ever hears from one:
+	uint64_t received = 0, misrouted = 0;
+	std::vector< std::unique_ptr< PeerChannel > > accepted;
+	receiver.demux->on_new_peer = [&](struct sockaddr_storage const &from, uint32_t connection_id, uint8_t const *data, size_t got) {
+		if (got < 5) return;
+		uint32_t owner;
+		memcpy(&owner, data + 1, sizeof(owner));
+		accepted.emplace_back(new PeerChannel(*receiver.demux, from, connection_id));
+		accepted.back()->on_receive = [&, owner](uint8_t const *payload, size_t) {
+			received += 1;
+			if (memcmp(payload + 1, &owner, sizeof(owner)) != 0) misrouted += 1;
+		};
+	};
+
+	struct Peer {
+		std::unique_ptr< DatagramChannel > channel;
+		std::unique_ptr< PeerChannel > peer; //<-- (declared after 'channel', so destroyed before it)
+	};
+	std::vector< Peer > peers(peer_count);
+	for (uint32_t i = 0; i < peer_count; ++i) {
+		peers[i].channel.reset(new DatagramChannel(loop));
+		peers[i].channel->enable_batching(batch, max_datagram);
+		peers[i].channel->enable_demux();
+		uint32_t connection_id = (i % 2 ? peers[i].channel->demux->new_connection_id() : 0);
+		peers[i].peer.reset(new PeerChannel(*peers[i].channel->demux, to, connection_id));
+	}
+
+	std::vector< uint8_t > payload(size < 5 ? 5 : size, 0xab);
+	payload[0] = 0xf0; //<-- (unassigned by RFC 7983)
+	uint64_t sent = 0;
+	double cpu_before = cpu_seconds();
+	auto before = std::chrono::steady_clock::now();
+	for (uint32_t p = 0; sent < packets; p = (p + 1) % peer_count) {
+		memcpy(payload.data() + 1, &p, sizeof(p));
+		uint32_t burst = uint32_t(std::min< uint64_t >(batch, packets - sent));
+		for (uint32_t i = 0; i < burst; ++i) peers[p].peer->queue(payload.data(), payload.size());
+		peers[p].channel->flush();
+		sent += burst;
+		loop.run_once(0);
+	}
+	//pick up stragglers:
+	for (uint32_t idle = 0; received < sent && idle < 10; ++idle) {
+		uint64_t was = received;
+		loop.run_once(1);
+		if (received != was) idle = 0;
+	}
+	auto after = std::chrono::steady_clock::now();
+	double cpu = cpu_seconds() - cpu_before;
+	double seconds = std::chrono::duration< double >(after - before).count();
+
+	std::cout << name << " (" << peer_count << " peers, one socket): " << uint64_t(received / seconds) << " pkts/sec, "
+	          << (cpu * 1e9 / double(received ? received : 1)) << " ns CPU/pkt"
+	          << " (sent " << sent << ", received " << received << "; " << accepted.size() << " PeerChannels, "
+	          << receiver.demux->migrations << " migrations, misrouted " << misrouted << ")" << std::endl;
+	accepted.clear();
+}
+
+static void ping_pong(std::string const &name, DatagramChannel::Backend backend, uint64_t round_trips, size_t size) {
+	EventLoop loop;
+	DatagramChannel a(loop, 0, backend);
+	DatagramChannel b(loop, 0, backend);
+	struct sockaddr_storage to_a = a.local_address(), to_b = b.local_address();
+	reinterpret_cast< struct sockaddr_in & >(to_a).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	reinterpret_cast< struct sockaddr_in & >(to_b).sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	std::vector< uint8_t > payload(size, 0xab);
+	Histogram rtt_ns;
+	uint64_t done = 0;
+	auto sent_at = std::chrono::steady_clock::now();
+	b.on_receive = [&](struct sockaddr_storage const &, uint8_t const *data, size_t got) {
+		b.send_to(to_a, data, got);
+	};
+	a.on_receive = [&](struct sockaddr_storage const &, uint8_t const *, size_t) {
+		auto now = std::chrono::steady_clock::now();
+		rtt_ns.record(uint64_t(std::chrono::duration_cast< std::chrono::nanoseconds >(now - sent_at).count()));
+		done += 1;
+		if (done < round_trips) {
+			sent_at = std::chrono::steady_clock::now();
+			a.send_to(to_b, payload.data(), payload.size());
+		}
+	};
+
+	double cpu_before = cpu_seconds();
+	a.send_to(to_b, payload.data(), payload.size());
+	while (done < round_trips) {
+		loop.run_once(100);
+		if (std::chrono::steady_clock::now() - sent_at > std::chrono::milliseconds(100)) { //<-- (lost one? send another)
+			sent_at = std::chrono::steady_clock::now();
+			a.send_to(to_b, payload.data(), payload.size());
+		}
+	}
+	double cpu = cpu_seconds() - cpu_before;
+	std::cout << name << ": round trip p50 " << rtt_ns.percentile(0.5) / 1000.0 << " us, p99 " << rtt_ns.percentile(0.99) / 1000.0
+	          << " us, " << (cpu * 1e9 / double(round_trips)) << " ns CPU/round trip" << std::endl;
+}
+
+int main(int argc, char **argv) {
+	uint64_t packets = 1000000;
+	size_t size = 64;
+	uint32_t batch = 32;
+	if (argc >= 2) packets = std::stoull(argv[1]);
+	if (argc >= 3) size = std::stoul(argv[2]);
+	if (argc >= 4) batch = std::stoul(argv[3]);
+	if (packets == 0 || size == 0 || batch == 0) {
+		std::cerr << "Usage:\n\t" << argv[0] << " [packets [size [batch]]]" << std::endl;
+		return 1;
+	}
+
+	std::cout << packets << " packets of " << size << " bytes over loopback, bursts of " << batch << "." << std::endl;
+	try {
+		run("sendto / recvfrom", Plain, packets, size, batch);
+		run("sendmmsg / recvmmsg", Batched, packets, size, batch);
+		run("sendmmsg / recvmmsg + GSO / GRO", Offload, packets, size, batch);
+		run("io_uring", Ring, packets, size, batch);
+		run("packed + sendmmsg / recvmmsg", Packed, packets, size, batch);
+		run("sendmmsg / recvmmsg into pool -> worker", Pooled, packets, size, batch);
+		if (aead_has_aes_ni()) run("sealed + sendmmsg / recvmmsg", Sealed, packets, size, batch);
+		run("sealed (chacha20-poly1305) + sendmmsg / recvmmsg", SealedChaCha, packets, size, batch);
+		sharded("sharded listener", packets, size, batch);
+		demuxed("demuxed PeerChannels", 256, packets, size, batch);
+		uint64_t round_trips = std::min< uint64_t >(packets / 10 + 1, 100000);
+		std::cout << round_trips << " round trips, one datagram at a time:" << std::endl;
+		ping_pong("syscalls", DatagramChannel::SyscallBackend, round_trips, std::min< size_t >(size, DatagramChannel::RingDatagram));
+		ping_pong("io_uring", DatagramChannel::IOUringBackend, round_trips, std::min< size_t >(size, DatagramChannel::RingDatagram));
+	} catch (std::exception &e) {
+		std::cerr << e.what() << std::endl;
+		return 1;
+	}
+	return 0;
+}
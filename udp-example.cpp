@@ -2,6 +2,9 @@
 
 /*
  * Simple UDP test code. Maybe a chat program? Seems fine.
+ *
+ * usage: udp-example [--verbose] [ip [message ...]]
+ *  --verbose print every message received (otherwise, just a count, at most once a second)
  */
 
 
@@ -9,15 +12,27 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
 #include <iostream>
 #include <cstring>
+#include <string>
 #include <cassert>
+#include <chrono>
 
 constexpr size_t MAX_DATA_SIZE = 65508; //<-- probably should set lower in general
+constexpr uint32_t BATCH_SIZE = 16; //datagrams per recvmmsg / sendmmsg
 
 int main(int argc, char **argv) {
+	//printing (and flushing) every message would cost more than receiving it, so that's opt-in:
+	bool verbose = false;
+	if (argc >= 2 && std::string(argv[1]) == "--verbose") {
+		verbose = true;
+		argv += 1;
+		argc -= 1;
+	}
+
 	//create socket, make it datagram-flavored:
 	int sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
 
@@ -60,44 +75,88 @@ int main(int argc, char **argv) {
 			return 1;
 		}
 
-		for (int a = 2; a < argc; ++a) {
-			std::string buf = argv[a];
-			ssize_t sent = sendto(sockfd, buf.data(), buf.size(), 0, reinterpret_cast< const sockaddr * >(&dest_addr), sizeof(dest_addr));
+		//send all the messages with one sendmmsg() call (well, one per BATCH_SIZE):
+		for (int first = 2; first < argc; first += BATCH_SIZE) {
+			struct iovec iovs[BATCH_SIZE];
+			struct mmsghdr msgs[BATCH_SIZE];
+			uint32_t count = 0;
+			for (int a = first; a < argc && count < BATCH_SIZE; ++a, ++count) {
+				iovs[count].iov_base = argv[a];
+				iovs[count].iov_len = strlen(argv[a]);
+				memset(&msgs[count], '\0', sizeof(msgs[count]));
+				msgs[count].msg_hdr.msg_name = &dest_addr;
+				msgs[count].msg_hdr.msg_namelen = sizeof(dest_addr);
+				msgs[count].msg_hdr.msg_iov = &iovs[count];
+				msgs[count].msg_hdr.msg_iovlen = 1;
+			}
 
-			if (sent < 0) {
-				assert(sent == -1);
-				std::cout << "Error sending message '" << buf << "':\n" << strerror(errno) << std::endl;
-				//NOTE: continue trying to send *other* messages
-			} else { assert((size_t)sent == buf.size());
-				std::cout << "Sent message '" << buf << "'." << std::endl;
+			uint32_t done = 0;
+			while (done < count) {
+				int sent = sendmmsg(sockfd, msgs + done, count - done, 0);
+				if (sent < 0) {
+					assert(sent == -1);
+					std::cout << "Error sending message '" << argv[first + done] << "':\n" << strerror(errno) << std::endl;
+					//NOTE: continue trying to send *other* messages
+					done += 1;
+				} else {
+					for (int i = 0; i < sent; ++i) {
+						std::cout << "Sent message '" << argv[first + done + i] << "'." << std::endl;
+					}
+					done += sent;
+				}
 			}
 		}
 
 	}
 
 	std::cout << "Socket bound and stuff." << std::endl;
-	while (true) {
-		struct sockaddr_in src_addr;
-		memset(&src_addr, '\0', sizeof(src_addr)); //<-- not really needed, I'd expect
-		socklen_t addrlen = sizeof(src_addr);
+	if (verbose) std::cout << "Waiting for messages..." << std::endl;
+	uint64_t received = 0, reported = 0;
+	auto last_report = std::chrono::steady_clock::now();
+	//buffers for a batch of messages, so one recvmmsg() can pick up everything that's queued:
+	static uint8_t bufs[BATCH_SIZE][MAX_DATA_SIZE];
+	struct sockaddr_in src_addrs[BATCH_SIZE];
+	struct iovec iovs[BATCH_SIZE];
+	struct mmsghdr msgs[BATCH_SIZE];
 
-		static uint8_t buf[MAX_DATA_SIZE];
+	while (true) {
+		for (uint32_t i = 0; i < BATCH_SIZE; ++i) {
+			iovs[i].iov_base = bufs[i];
+			iovs[i].iov_len = sizeof(bufs[i]);
+			memset(&msgs[i], '\0', sizeof(msgs[i]));
+			msgs[i].msg_hdr.msg_name = &src_addrs[i];
+			msgs[i].msg_hdr.msg_namelen = sizeof(src_addrs[i]);
+			msgs[i].msg_hdr.msg_iov = &iovs[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
 
-		std::cout << "Waiting for message..." << std::endl;
-		ssize_t got = recvfrom(sockfd, &buf, sizeof(buf), 0, reinterpret_cast< sockaddr * >(&src_addr), &addrlen);
+		//(block for the first message, then take any others that are already waiting)
+		int got = recvmmsg(sockfd, msgs, BATCH_SIZE, MSG_WAITFORONE, nullptr);
 
 		if (got < 0) {
 			assert(got == -1); //other negative results not specified behavior
 			//message... not received?
-			std::cerr << "Error recvfrom'ing:\n" << strerror(errno) << std::endl;
+			std::cerr << "Error recvmmsg'ing:\n" << strerror(errno) << std::endl;
 			sleep(1);
-		} else { assert(got >= 0); //only remaining option
-			//message received!
-			if ((size_t)got > sizeof(buf)) {
-				got = sizeof(buf);
-				std::cout << "NOTE: some bytes discarded." << std::endl;
+		} else {
+			received += got;
+			if (verbose) {
+				for (int i = 0; i < got; ++i) {
+					//message received!
+					if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+						std::cout << "NOTE: some bytes discarded.\n";
+					}
+					std::cout << "Got message from " << inet_ntoa(src_addrs[i].sin_addr) << ":" << ntohs(src_addrs[i].sin_port) << ":\n" << std::string(bufs[i], bufs[i] + msgs[i].msg_len) << '\n';
+				}
+				std::cout.flush(); //<-- (once per batch)
+			} else {
+				auto now = std::chrono::steady_clock::now();
+				if (now - last_report >= std::chrono::seconds(1)) {
+					std::cout << "Received " << (received - reported) << " message(s) (" << received << " total)." << std::endl;
+					reported = received;
+					last_report = now;
+				}
 			}
-			std::cout << "Got message from " << inet_ntoa(src_addr.sin_addr) << ":" << ntohs(src_addr.sin_port) << ":\n" << std::string(buf, buf + got) << std::endl;
 		}
 	}
 